@@ -0,0 +1,284 @@
+//
+//  archive_cache.c
+//  barc
+//
+
+#include "archive_cache.h"
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <uv.h>
+#include "curler.h"
+
+static char cache_dir[PATH_MAX];
+static int64_t budget;
+// eviction and hits must not interleave across batch workers
+static uv_once_t lock_once = UV_ONCE_INIT;
+static uv_mutex_t lock;
+
+struct cached_zip_s {
+  char name[NAME_MAX + 1];
+  time_t last_used;
+  int64_t size;
+};
+
+// zips handed out by archive_cache_fetch and not yet released
+struct held_zip_s {
+  char name[NAME_MAX + 1];
+  int refs;
+  struct held_zip_s* next;
+};
+static struct held_zip_s* held_zips;
+
+// downloads in progress, counted at their full size
+struct pending_download_s {
+  char name[NAME_MAX + 1];
+  int64_t size;
+  struct pending_download_s* next;
+};
+static struct pending_download_s* pending_downloads;
+
+static void init_lock() {
+  uv_mutex_init(&lock);
+}
+
+int archive_cache_configure(const char* dir, int64_t budget_bytes) {
+  uv_once(&lock_once, init_lock);
+  cache_dir[0] = '\0';
+  if (!dir) {
+    return 0;
+  }
+  if (mkdir(dir, 0755) && EEXIST != errno) {
+    perror(dir);
+    return -1;
+  }
+  snprintf(cache_dir, sizeof(cache_dir), "%s", dir);
+  budget = budget_bytes;
+  return 0;
+}
+
+char archive_cache_enabled() {
+  return '\0' != cache_dir[0];
+}
+
+// FNV-1a, 64 bit
+static uint64_t hash_bytes(uint64_t hash, const char* data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+void archive_cache_key(const char* url, const char* etag, int64_t size,
+                       char key_out[17])
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  char suffix[64];
+  if (etag[0]) {
+    // presigned urls differ only in their query string
+    hash = hash_bytes(hash, url, strcspn(url, "?"));
+    hash = hash_bytes(hash, "\n", 1);
+    hash = hash_bytes(hash, etag, strlen(etag));
+  } else {
+    snprintf(suffix, sizeof(suffix), "\n%lld", (long long)size);
+    hash = hash_bytes(hash, url, strlen(url));
+    hash = hash_bytes(hash, suffix, strlen(suffix));
+  }
+  snprintf(key_out, 17, "%016llx", (unsigned long long)hash);
+}
+
+static int compare_last_used(const void* a, const void* b) {
+  const struct cached_zip_s* zip_a = (const struct cached_zip_s*)a;
+  const struct cached_zip_s* zip_b = (const struct cached_zip_s*)b;
+  return (zip_a->last_used > zip_b->last_used) -
+  (zip_a->last_used < zip_b->last_used);
+}
+
+// call locked
+static struct held_zip_s** find_held(const char* name) {
+  struct held_zip_s** link = &held_zips;
+  while (*link && strcmp((*link)->name, name)) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+// call locked
+static void hold(const char* name) {
+  struct held_zip_s** link = find_held(name);
+  if (!*link) {
+    *link = (struct held_zip_s*) calloc(1, sizeof(struct held_zip_s));
+    snprintf((*link)->name, sizeof((*link)->name), "%s", name);
+  }
+  (*link)->refs++;
+}
+
+void archive_cache_release(const char* path) {
+  const char* name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+  uv_mutex_lock(&lock);
+  struct held_zip_s** link = find_held(name);
+  struct held_zip_s* zip = *link;
+  if (zip && !--zip->refs) {
+    *link = zip->next;
+    free(zip);
+  }
+  uv_mutex_unlock(&lock);
+}
+
+// call locked
+static char is_pending(const char* name) {
+  for (struct pending_download_s* download = pending_downloads; download;
+       download = download->next)
+  {
+    if (!strcmp(download->name, name)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// call locked. make room for incoming bytes, oldest hits first.
+static void evict(int64_t incoming) {
+  DIR* dir = opendir(cache_dir);
+  if (!dir) {
+    perror(cache_dir);
+    return;
+  }
+  struct cached_zip_s* zips = NULL;
+  size_t count = 0;
+  int64_t used = 0;
+  struct dirent* entry;
+  char path[PATH_MAX];
+  struct stat file_stat;
+  for (struct pending_download_s* download = pending_downloads; download;
+       download = download->next)
+  {
+    used += download->size;
+  }
+  while ((entry = readdir(dir))) {
+    size_t len = strlen(entry->d_name);
+    snprintf(path, sizeof(path), "%s/%s", cache_dir, entry->d_name);
+    if (stat(path, &file_stat) || !S_ISREG(file_stat.st_mode)) {
+      continue;
+    }
+    // partial downloads: ours are counted above, at their full size. others
+    // (another process, or one that crashed) take up what they take up.
+    if (strstr(entry->d_name, ".zip.")) {
+      if (!is_pending(entry->d_name)) {
+        used += file_stat.st_size;
+      }
+      continue;
+    }
+    if (len < 4 || strcmp(entry->d_name + len - 4, ".zip")) {
+      continue;
+    }
+    zips = (struct cached_zip_s*)
+    realloc(zips, (count + 1) * sizeof(struct cached_zip_s));
+    snprintf(zips[count].name, sizeof(zips[count].name), "%s",
+             entry->d_name);
+    zips[count].last_used = file_stat.st_mtime;
+    zips[count].size = file_stat.st_size;
+    used += file_stat.st_size;
+    count++;
+  }
+  closedir(dir);
+  qsort(zips, count, sizeof(struct cached_zip_s), compare_last_used);
+  for (size_t i = 0; i < count && used + incoming > budget; i++) {
+    if (*find_held(zips[i].name)) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", cache_dir, zips[i].name);
+    if (!unlink(path)) {
+      printf("archive cache: evicted %s (%lld bytes)\n", zips[i].name,
+             (long long)zips[i].size);
+      used -= zips[i].size;
+    }
+  }
+  free(zips);
+}
+
+char* archive_cache_fetch(const char* url) {
+  char etag[256];
+  int64_t size;
+  if (curler_probe(url, etag, sizeof(etag), &size)) {
+    return NULL;
+  }
+  char key[17];
+  archive_cache_key(url, etag, size, key);
+  char name[NAME_MAX + 1];
+  snprintf(name, sizeof(name), "%s.zip", key);
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", cache_dir, name);
+
+  // downloaded beside the entry and renamed into place once complete, so a
+  // concurrent fetch of the same archive never sees half a zip
+  char temp_path[PATH_MAX];
+  snprintf(temp_path, sizeof(temp_path), "%s.XXXXXX", path);
+  struct pending_download_s pending;
+  struct stat file_stat;
+  uv_mutex_lock(&lock);
+  char hit = !stat(path, &file_stat) &&
+  (size < 0 || file_stat.st_size == size);
+  int fd = -1;
+  if (hit) {
+    // held before the lock is let go, so no other job can evict it first
+    utimes(path, NULL);
+    hold(name);
+  } else {
+    evict(size > 0 ? size : 0);
+    fd = mkstemp(temp_path);
+    if (fd >= 0) {
+      snprintf(pending.name, sizeof(pending.name), "%s",
+               strrchr(temp_path, '/') + 1);
+      pending.size = size > 0 ? size : 0;
+      pending.next = pending_downloads;
+      pending_downloads = &pending;
+    }
+  }
+  uv_mutex_unlock(&lock);
+  if (hit) {
+    printf("archive cache: %s is %s\n", url, path);
+    return strdup(path);
+  }
+  if (fd < 0) {
+    perror(temp_path);
+    return NULL;
+  }
+  close(fd);
+
+  struct download_s* download;
+  int ret = download_start(&download, url, temp_path,
+                           CURLER_DEFAULT_CONNECTIONS);
+  if (!ret) {
+    ret = download_wait(download);
+    download_free(download);
+  }
+  uv_mutex_lock(&lock);
+  struct pending_download_s** link = &pending_downloads;
+  while (*link != &pending) {
+    link = &(*link)->next;
+  }
+  *link = pending.next;
+  if (!ret && rename(temp_path, path)) {
+    perror(path);
+    ret = -1;
+  }
+  if (!ret) {
+    hold(name);
+  }
+  uv_mutex_unlock(&lock);
+  if (ret) {
+    unlink(temp_path);
+    return NULL;
+  }
+  printf("archive cache: stored %s as %s\n", url, path);
+  return strdup(path);
+}
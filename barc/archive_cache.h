@@ -0,0 +1,45 @@
+//
+//  archive_cache.h
+//  barc
+//
+
+#ifndef archive_cache_h
+#define archive_cache_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Process wide cache of downloaded archive zips, so rendering the same
+ * archive again (another css preset, another size) skips the download.
+ * Zips are stored as <dir>/<key>.zip, where the key hashes the url and the
+ * ETag the server sends for it. With an ETag, the query string is left out
+ * of the key, so presigned urls for the same object share an entry. Without
+ * one, the whole url and the file size are used.
+ *
+ * Every hit refreshes the modification time of its zip. Before a download,
+ * the least recently used zips are removed until it fits in the budget,
+ * counting downloads still in progress. Zips held by a render in this
+ * process are never removed, so the budget can be overrun while they are.
+ * Media is read straight out of the cached zip (see zip_io.h), so there is
+ * nothing extracted to keep.
+ */
+
+/** Set the cache directory (created if missing). NULL turns caching off. */
+int archive_cache_configure(const char* dir, int64_t budget_bytes);
+char archive_cache_enabled();
+
+/**
+ * @return path of a local copy of url (free with free()), downloaded on a
+ * miss, or NULL. The copy belongs to the cache: don't remove it. It stays
+ * put until archive_cache_release is called with the path.
+ */
+char* archive_cache_fetch(const char* url);
+/** Let eviction have a zip returned by archive_cache_fetch again. */
+void archive_cache_release(const char* path);
+
+/** Cache key for url as served with etag (may be empty), as 16 hex digits. */
+void archive_cache_key(const char* url, const char* etag, int64_t size,
+                       char key_out[17]);
+
+#endif /* archive_cache_h */
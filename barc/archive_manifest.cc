@@ -224,6 +224,8 @@ int parse_event(struct layout_event_s* event, json_t* json) {
   return ret;
 }
 
+static int parse_manifest(struct archive_manifest_s* pthis, json_t* json);
+
 int archive_manifest_parse(struct archive_manifest_s* pthis,
                            const char* path)
 {
@@ -236,6 +238,24 @@ int archive_manifest_parse(struct archive_manifest_s* pthis,
            error.line, error.text);
     return 1;
   }
+  return parse_manifest(pthis, json);
+}
+
+int archive_manifest_parse_buffer(struct archive_manifest_s* pthis,
+                                  const char* data, size_t size)
+{
+  json_error_t error;
+  json_t* json = json_loadb(data, size, 0, &error);
+  if (!json) {
+    printf("Unable to parse json manifest: line %d: %s\n",
+           error.line, error.text);
+    return 1;
+  }
+  return parse_manifest(pthis, json);
+}
+
+// the manifest keeps pointers into json, so it is never released
+static int parse_manifest(struct archive_manifest_s* pthis, json_t* json) {
   json_t* files = json_object_get(json, "files");
 
   if (!json_is_array(files)) {
@@ -64,6 +64,9 @@ void archive_manifest_alloc(struct archive_manifest_s** manifest_out);
 void archive_manifest_free(struct archive_manifest_s* manifest);
 int archive_manifest_parse(struct archive_manifest_s* manifest,
                            const char* path);
+/** Same as archive_manifest_parse, for a manifest already in memory. */
+int archive_manifest_parse_buffer(struct archive_manifest_s* manifest,
+                                  const char* data, size_t size);
 /**
  * @return the number of files walked.
  */
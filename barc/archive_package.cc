@@ -10,6 +10,11 @@ extern "C" {
 #include <glob.h>
 #include <jansson.h>
 #include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <uv.h>
+#include <sys/stat.h>
 
 #include "archive_package.h"
 #include "archive_manifest.h"
@@ -17,27 +22,82 @@ extern "C" {
 #include "webm_source.h"
 #include "image_source.h"
 #include "barc.h"
+#include "segment_plan.h"
+#include "segment_stitcher.h"
+#include "checkpoint.h"
+#include "log.h"
+#include "perf_stats.h"
+#include "file_writer.h"
+#include "timeline.h"
+#include "zip_io.h"
 }
 
+#include <string>
 #include <vector>
+#include <algorithm>
 
 #include "Geometry.h"
 
 struct archive_s {
   struct barc_s* barc;
   std::vector<struct source_s*> sources;
-  std::vector<const struct layout_event_s*> events;
+  // sources enter and leave on [start, stop) of archive time
+  struct timeline_s* source_timeline;
+  // layout events, applied once archive time passes them
+  struct timeline_s* event_timeline;
+  // for --trim_gaps: webm sources to move when archive time jumps ahead,
+  // and the stretches to jump over
+  std::vector<struct archive_webm_s> webm_sources;
+  struct timeline_gap_s* gaps;
+  size_t gap_count;
+  size_t gap_index;
   const char* source_path;
+  // set when source_path is a zip. media is read from it in place.
+  struct zip_io_s* zip;
+  // media files named by the manifest, joined onto source_path. sources keep
+  // pointers into these, so they live as long as the archive.
+  std::vector<char*> source_files;
+  // relative outputs resolved against source_path (see archive_resolve_path)
+  char output_path[PATH_MAX];
+  struct barc_rendition_s renditions[FILE_WRITER_MAX_AUDIO_FOLLOWERS];
+  char rendition_paths[FILE_WRITER_MAX_AUDIO_FOLLOWERS][PATH_MAX];
   double begin_offset;
   double end_offset;
   struct archive_manifest_s* manifest;
+  // kept around so parallel renders can derive a config for each segment
+  struct archive_config_s config;
+  // when set, progress is reported here instead of stdout
+  double* progress_out;
+  double* total_out;
 };
 
+/** A webm source and where it starts in archive time. */
+struct archive_webm_s {
+  struct webm_source_s* source;
+  double start_offset;
+};
+
+// shorter stretches without sources are reconnects. leave them alone.
+static const double min_trimmed_gap = 1;
+
+// segment boundaries must be a common multiple of the output frame
+// durations, otherwise the joined tracks drift apart. these match the
+// encoder settings in file_writer.c.
+static const double segment_video_fps = 30;
+static const int segment_audio_frame_size = 1024;
+static const int segment_audio_sample_rate = 48000;
+
 static int archive_open(struct archive_s* archive);
+static int archive_open_manifest(struct archive_s* archive);
+static int archive_main_parallel(struct archive_s* archive);
+static int archive_main_segment(struct archive_s* archive);
+static int archive_main_checkpointed(struct archive_s* archive);
 static double archive_get_finish_clock_time(struct archive_s* archive);
 static int setup_streams_for_tick(struct archive_s* archive, double clock_time);
 static void process_layout_events(struct archive_s* pthis,
                                   double clock_time);
+static void skip_gap(struct archive_s* archive, double clock_time,
+                     double* end_time);
 
 void archive_alloc(struct archive_s** archive_out) {
   struct archive_s* archive = (struct archive_s*)
@@ -45,7 +105,10 @@ void archive_alloc(struct archive_s** archive_out) {
   barc_alloc(&archive->barc);
   archive_manifest_alloc(&archive->manifest);
   archive->sources = std::vector<struct source_s*>();
-  archive->events = std::vector<const struct layout_event_s*>();
+  timeline_alloc(&archive->source_timeline, 1);
+  timeline_alloc(&archive->event_timeline, 0);
+  archive->source_files = std::vector<char*>();
+  archive->webm_sources = std::vector<struct archive_webm_s>();
   *archive_out = archive;
 }
 
@@ -53,20 +116,89 @@ void archive_free(struct archive_s* archive) {
   for (struct source_s* source : archive->sources) {
     source_free(source);
   }
+  for (char* path : archive->source_files) {
+    free(path);
+  }
+  // sources read through the zip, so it goes after them
+  if (archive->zip) {
+    zip_io_close(archive->zip);
+  }
+  timeline_free(archive->source_timeline);
+  timeline_free(archive->event_timeline);
+  free(archive->gaps);
   barc_free(archive->barc);
   archive_manifest_free(archive->manifest);
   free(archive);
 }
 
+// urls are always zips; an archive directory can only be read locally
+static char is_zip_path(const char* path) {
+  struct stat file_stat;
+  return path && (zip_io_is_remote(path) ||
+                  (!stat(path, &file_stat) && S_ISREG(file_stat.st_mode)));
+}
+
+/* The working directory is shared by every archive in the process, so paths
+ * are never resolved through it. Relative outputs are placed inside the
+ * archive directory, same as they always have been. Zips are read in place,
+ * so outputs of a zip stay where they were given.
+ */
+static const char* archive_resolve_path(const char* source_path,
+                                        const char* path,
+                                        char* buffer, size_t buffer_size)
+{
+  if (!path || !source_path || '/' == path[0] ||
+      file_writer_is_stream_output(path) || is_zip_path(source_path))
+  {
+    return path;
+  }
+  snprintf(buffer, buffer_size, "%s/%s", source_path, path);
+  return buffer;
+}
+
+void archive_set_progress_out(struct archive_s* archive, double* progress,
+                              double* total)
+{
+  archive->progress_out = progress;
+  archive->total_out = total;
+}
+
 int archive_load_configuration(struct archive_s* archive,
                                struct archive_config_s* config) {
-  struct barc_config_s barc_config;
+  struct barc_config_s barc_config = { 0 };
+  if (config->rendition_count > FILE_WRITER_MAX_AUDIO_FOLLOWERS) {
+    printf("at most %d renditions are supported\n",
+           FILE_WRITER_MAX_AUDIO_FOLLOWERS);
+    return -1;
+  }
+  archive->config = *config;
+  archive->config.output_path =
+  archive_resolve_path(config->source_path, config->output_path,
+                       archive->output_path, sizeof(archive->output_path));
+  for (size_t i = 0; i < config->rendition_count; i++) {
+    archive->renditions[i] = config->renditions[i];
+    archive->renditions[i].output_path =
+    archive_resolve_path(config->source_path, config->renditions[i].output_path,
+                         archive->rendition_paths[i], PATH_MAX);
+  }
+  if (config->rendition_count) {
+    archive->config.renditions = archive->renditions;
+  }
+  config = &archive->config;
   barc_config.out_width = config->width;
   barc_config.out_height = config->height;
   barc_config.css_custom = config->css_custom;
   barc_config.css_preset = config->css_preset;
   barc_config.output_path = config->output_path;
   barc_config.video_framerate = 30; // TODO want this in a config file maybe?
+  barc_config.audio_preroll_frames = config->audio_preroll_frames;
+  barc_config.output_format = config->output_format;
+  barc_config.segment_duration = config->segment_duration;
+  barc_config.sink = config->sink;
+  barc_config.renditions = config->renditions;
+  barc_config.rendition_count = config->rendition_count;
+  barc_config.variable_frame_rate = config->variable_frame_rate;
+  barc_config.pipeline = config->pipeline;
   archive->source_path = config->source_path;
   archive->begin_offset = config->begin_offset;
   archive->end_offset = config->end_offset;
@@ -75,44 +207,73 @@ int archive_load_configuration(struct archive_s* archive,
 }
 
 int archive_main(struct archive_s* archive) {
+  if (archive->config.segment_count > 0) {
+    return archive_main_segment(archive);
+  }
+  if (archive->config.checkpoint_interval > 0) {
+    return archive_main_checkpointed(archive);
+  }
+  if (archive->config.parallel_segments > 1) {
+    return archive_main_parallel(archive);
+  }
   int ret = archive_open(archive);
   if (ret) {
     printf("failed to open archive %s", archive->source_path);
     return ret;
   }
-  barc_open_outfile(archive->barc);
+  ret = barc_open_outfile(archive->barc);
   if (ret) {
-    printf("failed to open archive outfile");
+    printf("failed to open archive outfile\n");
+    // renditions opened before the failure still have threads to stop
+    barc_close_outfile(archive->barc);
     return ret;
   }
 
-  double end_time = archive_get_finish_clock_time(archive);
+  // output clock starts at zero, regardless of begin offset
+  double end_time =
+  archive_get_finish_clock_time(archive) - archive->begin_offset;
   if (archive->end_offset > 0) {
     double duration = archive->end_offset - archive->begin_offset;
     end_time = fmin(end_time, duration);
   }
+  if (archive->config.trim_gaps) {
+    archive->gap_count = timeline_find_gaps(archive->source_timeline,
+                                            archive->begin_offset,
+                                            min_trimmed_gap, &archive->gaps);
+  }
 
-  double global_clock = 0;
+  if (archive->total_out) {
+    __atomic_store(archive->total_out, &end_time, __ATOMIC_RELAXED);
+  }
+
+  // may be negative if barc is pre-rolling audio
+  double global_clock = barc_get_current_clock(archive->barc);
 
   while (!ret && end_time > global_clock) {
+    skip_gap(archive, global_clock, &end_time);
     process_layout_events(archive, global_clock);
     setup_streams_for_tick(archive, global_clock);
     ret = barc_tick(archive->barc);
     global_clock = barc_get_current_clock(archive->barc);
-    printf("{\"progress\": {\"complete\": %f, \"total\": %f }}\n",
-           global_clock * 1000, end_time * 1000);
+    if (archive->progress_out) {
+      __atomic_store(archive->progress_out, &global_clock, __ATOMIC_RELAXED);
+    } else {
+      log_progress(global_clock, end_time);
+    }
   }
 
+  perf_stats_add_media_time(global_clock > 0 ? global_clock : 0);
   if (ret) {
-    printf("problem in barc main loop. closing outfile and aborting. ret=%d",
+    printf("problem in barc main loop. closing outfile and aborting. ret=%d\n",
            ret);
     // don't let this condition stop us from closing the file.
   }
   int fret = barc_close_outfile(archive->barc);
   if (fret) {
-    printf("failed to finalize container (ret %d", fret);
+    printf("failed to finalize container (ret %d)\n", fret);
   }
-  return ret & fret;
+  // the first failure wins; a clean close doesn't make up for a bad tick
+  return ret ? ret : fret;
 }
 
 /* globerr --- print error message for glob() */
@@ -139,22 +300,39 @@ static void open_manifest_item(const struct archive_manifest_s* manifest,
   struct archive_s* pthis = (struct archive_s*)p;
   struct source_s* source = NULL;
   int ret = 0;
+  const char* path = file->filename;
+  if (!pthis->zip) {
+    size_t path_len = strlen(pthis->source_path) + strlen(file->filename) + 2;
+    char* joined_path = (char*)malloc(path_len);
+    snprintf(joined_path, path_len, "%s/%s",
+             pthis->source_path, file->filename);
+    pthis->source_files.push_back(joined_path);
+    path = joined_path;
+  }
   if (ends_with(file->filename, ".webm")) {
     struct webm_source_s* file_source;
-    ret = webm_source_open(&file_source, file->filename,
+    ret = webm_source_open(&file_source, pthis->zip, path,
                                      file->start_time_offset,
                                      file->stop_time_offset,
                                      file->stream_id,
                                      file->stream_class);
     source = webm_source_get_container(file_source);
-    if (pthis->begin_offset > 0) {
-      webm_source_seek(file_source, pthis->begin_offset);
+    // a source that failed to open has nothing to seek in
+    if (!ret) {
+      webm_source_set_prefetch(file_source,
+                               pthis->config.pipeline.decode_frames,
+                               pthis->config.pipeline.decode_bytes);
+      if (pthis->begin_offset > 0) {
+        webm_source_seek(file_source, pthis->begin_offset);
+      }
+      struct archive_webm_s webm = { file_source, file->start_time_offset };
+      pthis->webm_sources.push_back(webm);
     }
   } else {
     printf("%s does not look like a webm. attempting to open as an image\n",
            file->filename);
     struct image_source_s* image_source;
-    ret = image_source_create(&image_source, file->filename,
+    ret = image_source_create(&image_source, pthis->zip, path,
                               file->start_time_offset,
                               file->stop_time_offset,
                               file->stream_id,
@@ -168,6 +346,8 @@ static void open_manifest_item(const struct archive_manifest_s* manifest,
 
   if (source) {
     pthis->sources.push_back(source);
+    timeline_add_span(pthis->source_timeline, file->start_time_offset,
+                      file->stop_time_offset, source);
   }
   printf("opened archive stream source %s\n", file->filename);
 }
@@ -177,42 +357,122 @@ static void register_layout_event(const struct archive_manifest_s* manifest,
                                   void* p)
 {
   struct archive_s* pthis = (struct archive_s*)p;
-  double event_offset =
-  (event->created_at - archive_manifest_get_created_at(manifest)) / 1000;
-  if (event_offset > pthis->begin_offset) {
-    pthis->events.push_back(event);
-  }
+  // events before the begin offset still shape the layout at the begin
+  // offset. process_layout_events applies those on the first tick.
+  double event_offset = (event->created_at -
+                         archive_manifest_get_created_at(manifest)) / 1000;
+  timeline_add_point(pthis->event_timeline, event_offset, (void*)event);
 }
 
 static int archive_open(struct archive_s* archive)
 {
-  int ret;
-  glob_t globbuf;
-  ret = chdir(archive->source_path);
+  int ret = archive_open_manifest(archive);
   if (ret) {
-    printf("unknown path %s\n", archive->source_path);
+    return ret;
+  }
+  archive_manifest_files_walk(archive->manifest, open_manifest_item, archive);
+  archive_manifest_events_walk(archive->manifest, register_layout_event,
+                               archive);
+  return 0;
+}
+
+// the manifest is the first json entry at the top of the zip
+static int archive_open_zip_manifest(struct archive_s* archive)
+{
+  if (!archive->zip &&
+      zip_io_open_remote(&archive->zip, archive->source_path,
+                         archive->config.remote_size))
+  {
     return -1;
   }
-  glob("*.json", 0, globerr, &globbuf);
+  const char* manifest_name = zip_io_find(archive->zip, ".json");
+  void* data;
+  size_t size;
+  if (!manifest_name) {
+    printf("no json manifest found in %s\n", archive->source_path);
+    return -1;
+  }
+  int ret = zip_io_read_entry(archive->zip, manifest_name, &data, &size);
+  if (ret) {
+    return ret;
+  }
+  ret = archive_manifest_parse_buffer(archive->manifest, (const char*)data,
+                                      size);
+  free(data);
+  if (ret) {
+    printf("CRITICAL: failed to parse archive manifest.");
+  }
+  return ret;
+}
+
+static int archive_open_manifest(struct archive_s* archive)
+{
+  int ret;
+  glob_t globbuf;
+  if (is_zip_path(archive->source_path)) {
+    return archive_open_zip_manifest(archive);
+  }
+  char pattern[PATH_MAX];
+  snprintf(pattern, sizeof(pattern), "%s/*.json", archive->source_path);
+  ret = glob(pattern, 0, globerr, &globbuf);
 
-  if (!globbuf.gl_pathc) {
+  if (ret || !globbuf.gl_pathc) {
     printf("no json manifest found at %s\n", archive->source_path);
+    if (!ret) {
+      globfree(&globbuf);
+    }
+    return -1;
   }
   // use the first json file we find inside the archive zip (hopefully only)
   const char* manifest_path = globbuf.gl_pathv[0];
 
   ret = archive_manifest_parse(archive->manifest, manifest_path);
+  globfree(&globbuf);
   if (ret) {
     printf("CRITICAL: failed to parse archive manifest.");
     return ret;
   }
-  archive_manifest_files_walk(archive->manifest, open_manifest_item, archive);
-  archive_manifest_events_walk(archive->manifest, register_layout_event,
-                               archive);
   return 0;
 }
 
 #pragma mark - Internal utilities
+
+/* With --trim_gaps, a tick that lands in a stretch without sources moves the
+ * archive clock to the end of that stretch. The output clock keeps going, so
+ * everything after the gap comes out earlier by the length of the gap.
+ */
+static void skip_gap(struct archive_s* archive, double clock_time,
+                     double* end_time)
+{
+  double archive_time = clock_time + archive->begin_offset;
+  while (archive->gap_index < archive->gap_count &&
+         archive->gaps[archive->gap_index].end <= archive_time)
+  {
+    archive->gap_index++;
+  }
+  if (archive->gap_index >= archive->gap_count ||
+      archive->gaps[archive->gap_index].begin > archive_time)
+  {
+    return;
+  }
+  const struct timeline_gap_s* gap = &archive->gaps[archive->gap_index++];
+  double skipped = gap->end - archive_time;
+  printf("trimming %f seconds without sources at %f\n",
+         skipped, archive_time);
+  archive->begin_offset += skipped;
+  *end_time -= skipped;
+  if (archive->total_out) {
+    __atomic_store(archive->total_out, end_time, __ATOMIC_RELAXED);
+  }
+  // nothing is active in a gap, so only sources still to come hear about it.
+  // they have not started decoding, which makes this cheap.
+  for (struct archive_webm_s& webm : archive->webm_sources) {
+    if (webm.start_offset >= gap->end) {
+      webm_source_seek(webm.source, archive->begin_offset);
+    }
+  }
+}
+
 static double archive_get_finish_clock_time(struct archive_s* archive)
 {
     double finish_time = 0;
@@ -225,19 +485,24 @@ static double archive_get_finish_clock_time(struct archive_s* archive)
     return finish_time;
 }
 
-static int setup_streams_for_tick(struct archive_s* archive, double clock_time)
+static void handle_source_edge(void* p, void* item, enum timeline_edge edge)
 {
-  // find any streams that should present content on this tick
-  for (struct source_s* stream : archive->sources) {
-    struct barc_source_s barc_source;
-    barc_source.media_stream = source_get_media_stream(stream);
-    if (source_is_active_at_time(stream, clock_time + archive->begin_offset))
-    {
-      barc_add_source(archive->barc, &barc_source);
-    } else {
-      barc_remove_source(archive->barc, &barc_source);
-    }
+  struct archive_s* archive = (struct archive_s*)p;
+  struct barc_source_s barc_source;
+  barc_source.media_stream = source_get_media_stream((struct source_s*)item);
+  if (timeline_enter == edge) {
+    barc_add_source(archive->barc, &barc_source);
+  } else {
+    barc_remove_source(archive->barc, &barc_source);
   }
+}
+
+static int setup_streams_for_tick(struct archive_s* archive, double clock_time)
+{
+  // only sources that started or stopped since the last tick are touched
+  timeline_advance(archive->source_timeline,
+                   clock_time + archive->begin_offset,
+                   handle_source_edge, archive);
   return 0;
 }
 
@@ -258,19 +523,367 @@ static void handle_layout_event(struct archive_s* pthis,
   }
 }
 
+static void handle_event_edge(void* p, void* item, enum timeline_edge edge)
+{
+  handle_layout_event((struct archive_s*)p,
+                      (const struct layout_event_s*)item);
+}
+
 static void process_layout_events(struct archive_s* pthis,
                                   double clock_time)
 {
-  double event_offset;
-  for (const struct layout_event_s* event : pthis->events) {
-    event_offset = (event->created_at -
-    archive_manifest_get_created_at(pthis->manifest)) / 1000;
-    // compensate for begin offset
-    event_offset -= pthis->begin_offset;
-    if (event_offset < clock_time) {
-      handle_layout_event(pthis, event);
-      auto index = std::find(pthis->events.begin(), pthis->events.end(), event);
-      pthis->events.erase(index);
+  // event times are in archive time; compensate for begin offset
+  timeline_advance(pthis->event_timeline, clock_time + pthis->begin_offset,
+                   handle_event_edge, pthis);
+}
+
+#pragma mark - Parallel segments
+
+struct segment_job_s {
+  struct archive_config_s config;
+  char output_path[PATH_MAX];
+  double progress;
+  int finished;
+  int ret;
+  uv_thread_t thread;
+};
+
+static void find_stop_offset(const struct archive_manifest_s* manifest,
+                             const struct manifest_file_s* file, void* p)
+{
+  double* stop_offset = (double*)p;
+  if (*stop_offset < file->stop_time_offset) {
+    *stop_offset = file->stop_time_offset;
+  }
+}
+
+static void render_segment(void* p) {
+  struct segment_job_s* job = (struct segment_job_s*)p;
+  struct archive_s* archive;
+  archive_alloc(&archive);
+  archive->progress_out = &job->progress;
+  job->ret = archive_load_configuration(archive, &job->config);
+  if (!job->ret) {
+    job->ret = archive_main(archive);
+  }
+  archive_free(archive);
+  __atomic_store_n(&job->finished, 1, __ATOMIC_RELEASE);
+}
+
+// every segment opens the archive on its own. hand them all the same
+// absolute path so their logs agree on what they opened. with a
+// segment_length, the timeline is cut into as many pieces as it takes to keep
+// each one about that long.
+static int plan_segments(struct archive_s* archive, char* source_path,
+                         int max_segments, double segment_length,
+                         std::vector<struct segment_s>& segments,
+                         double* end_time_out)
+{
+  if (zip_io_is_remote(archive->source_path)) {
+    snprintf(source_path, PATH_MAX, "%s", archive->source_path);
+  } else if (!realpath(archive->source_path, source_path)) {
+    printf("unknown path %s\n", archive->source_path);
+    return -1;
+  }
+  archive->source_path = source_path;
+  int ret = archive_open_manifest(archive);
+  if (ret) {
+    return ret;
+  }
+
+  double finish_time = 0;
+  archive_manifest_files_walk(archive->manifest, find_stop_offset,
+                              &finish_time);
+  double end_time = finish_time - archive->begin_offset;
+  if (archive->end_offset > 0) {
+    end_time = fmin(end_time, archive->end_offset - archive->begin_offset);
+  }
+
+  if (segment_length > 0 && end_time > 0) {
+    max_segments = (int) ceil(end_time / segment_length);
+  }
+  segments.resize(std::max(max_segments, 1));
+  double grid = segment_plan_grid(segment_video_fps,
+                                  segment_audio_frame_size,
+                                  segment_audio_sample_rate);
+  int segment_count = segment_plan_split(end_time, max_segments, grid,
+                                         segments.data());
+  segments.resize(segment_count);
+  *end_time_out = end_time;
+  if (!segment_count) {
+    printf("nothing to render between %f and %f\n",
+           archive->begin_offset, archive->begin_offset + end_time);
+    return -1;
+  }
+  return 0;
+}
+
+static void configure_segment_job(struct archive_s* archive,
+                                  struct segment_job_s* job,
+                                  const char* source_path,
+                                  const struct segment_s* segment,
+                                  int index)
+{
+  job->config = archive->config;
+  job->config.parallel_segments = 0;
+  job->config.segment_count = 0;
+  job->config.checkpoint_interval = 0;
+  job->config.resume = 0;
+  job->config.source_path = source_path;
+  job->config.begin_offset = archive->begin_offset + segment->begin;
+  job->config.end_offset = archive->begin_offset + segment->end;
+  // prime the audio encoder with media from the previous segment, so its
+  // first packet is not a cold start. the stitcher drops these packets.
+  job->config.audio_preroll_frames = index > 0 ? 1 : 0;
+  // the stitcher needs progressive pieces
+  job->config.output_format = NULL;
+  job->config.renditions = NULL;
+  job->config.rendition_count = 0;
+  // pieces are cut on the untrimmed timeline
+  job->config.trim_gaps = 0;
+  job->progress = 0;
+  job->finished = 0;
+}
+
+static int archive_main_segment(struct archive_s* archive) {
+  char source_path[PATH_MAX];
+  std::vector<struct segment_s> segments;
+  double end_time;
+  int index = archive->config.segment_index;
+  int ret = plan_segments(archive, source_path, archive->config.segment_count,
+                          0, segments, &end_time);
+  if (ret) {
+    return ret;
+  }
+
+  struct segment_sidecar_s sidecar = { 0 };
+  sidecar.index = index;
+  sidecar.count = (int) segments.size();
+  if (index >= segments.size()) {
+    // short timelines collapse into fewer segments. still leave a sidecar
+    // so whoever stitches can tell this apart from a failed render.
+    printf("segment %d is empty. timeline only has %d segments\n",
+           index, sidecar.count);
+    sidecar.begin = end_time;
+    sidecar.end = end_time;
+    sidecar.empty = 1;
+    return segment_sidecar_write(archive->config.output_path, &sidecar);
+  }
+
+  struct segment_job_s job;
+  configure_segment_job(archive, &job, source_path, &segments[index], index);
+  job.config.output_path = archive->config.output_path;
+  printf("segment %d/%d: [%f, %f)\n", index, sidecar.count,
+         segments[index].begin, segments[index].end);
+
+  struct archive_s* segment_archive;
+  archive_alloc(&segment_archive);
+  ret = archive_load_configuration(segment_archive, &job.config);
+  if (!ret) {
+    ret = archive_main(segment_archive);
+  }
+  archive_free(segment_archive);
+  if (ret) {
+    return ret;
+  }
+
+  sidecar.begin = segments[index].begin;
+  sidecar.end = segments[index].end;
+  sidecar.audio_preroll_frames = job.config.audio_preroll_frames;
+  sidecar.audio_preroll = (double)sidecar.audio_preroll_frames *
+  segment_audio_frame_size / segment_audio_sample_rate;
+  return segment_sidecar_write(archive->config.output_path, &sidecar);
+}
+
+static int archive_main_parallel(struct archive_s* archive) {
+  char source_path[PATH_MAX];
+  std::vector<struct segment_s> segments;
+  double end_time;
+  int ret = plan_segments(archive, source_path,
+                          archive->config.parallel_segments, 0,
+                          segments, &end_time);
+  if (ret) {
+    return ret;
+  }
+  int segment_count = (int) segments.size();
+
+  std::vector<struct segment_job_s> jobs(segment_count);
+  for (int i = 0; i < segment_count; i++) {
+    struct segment_job_s* job = &jobs[i];
+    configure_segment_job(archive, job, source_path, &segments[i], i);
+    snprintf(job->output_path, sizeof(job->output_path), "%s.seg%d.mp4",
+             archive->config.output_path, i);
+    job->config.output_path = job->output_path;
+    printf("segment %d: [%f, %f)\n", i, segments[i].begin, segments[i].end);
+    uv_thread_create(&job->thread, render_segment, job);
+  }
+
+  int finished_count = 0;
+  while (finished_count < segment_count) {
+    double complete = 0;
+    finished_count = 0;
+    for (int i = 0; i < segment_count; i++) {
+      double progress;
+      __atomic_load(&jobs[i].progress, &progress, __ATOMIC_RELAXED);
+      complete += fmax(0, progress);
+      finished_count += __atomic_load_n(&jobs[i].finished, __ATOMIC_ACQUIRE);
+    }
+    log_progress(complete, end_time);
+    if (finished_count < segment_count) {
+      usleep(500000);
+    }
+  }
+
+  std::vector<struct stitch_segment_s> stitch(segment_count);
+  for (int i = 0; i < segment_count; i++) {
+    uv_thread_join(&jobs[i].thread);
+    if (jobs[i].ret) {
+      printf("segment %d failed (ret %d)\n", i, jobs[i].ret);
+      ret = jobs[i].ret;
+    }
+    stitch[i].path = jobs[i].output_path;
+    stitch[i].begin = segments[i].begin;
+    stitch[i].end = segments[i].end;
+    stitch[i].drop_leading_audio = jobs[i].config.audio_preroll_frames > 0;
+  }
+
+  if (!ret) {
+    ret = segment_stitcher_run(archive->config.output_path,
+                               stitch.data(), segment_count);
+  }
+  for (int i = 0; i < segment_count; i++) {
+    unlink(jobs[i].output_path);
+  }
+  return ret;
+}
+
+#pragma mark - Checkpointed renders
+
+// what the chunks of a checkpointed render depend on besides the plan
+// itself. chunks rendered with anything else different can't be reused.
+static void fingerprint_render(struct archive_s* archive,
+                               const char* source_path,
+                               char fingerprint[CHECKPOINT_FINGERPRINT_SIZE])
+{
+  const struct archive_config_s* config = &archive->config;
+  char numbers[256];
+  snprintf(numbers, sizeof(numbers),
+           "size %zux%zu\nrange %f %f\ninterval %f\nvfr %d\n",
+           config->width, config->height, config->begin_offset,
+           config->end_offset, config->checkpoint_interval,
+           config->variable_frame_rate);
+  std::string description = std::string("input ") + source_path + "\n";
+  description += numbers;
+  description += std::string("css ") +
+  (config->css_preset ? config->css_preset : "") + "\n";
+  description += std::string("format ") +
+  (config->output_format ? config->output_format : "") + "\n";
+  // custom css can be any length
+  description += std::string("css_custom ") +
+  (config->css_custom ? config->css_custom : "");
+  checkpoint_fingerprint(description.c_str(), fingerprint);
+}
+
+static void report_progress(struct archive_s* archive, double complete,
+                            double total)
+{
+  if (archive->progress_out) {
+    __atomic_store(archive->progress_out, &complete, __ATOMIC_RELAXED);
+  } else {
+    log_progress(complete, total);
+  }
+}
+
+/* Render the timeline chunk by chunk, recording every finished chunk in a
+ * checkpoint. Each chunk is an ordinary segment render: sources are seeked to
+ * its beginning, layout events before it are applied on its first tick, and
+ * its audio is primed with one frame from the previous chunk. An interrupted
+ * render therefore resumes at the first unfinished chunk, losing at most one
+ * chunk of work.
+ */
+static int archive_main_checkpointed(struct archive_s* archive) {
+  char source_path[PATH_MAX];
+  std::vector<struct segment_s> segments;
+  double end_time;
+  int ret = plan_segments(archive, source_path, 0,
+                          archive->config.checkpoint_interval,
+                          segments, &end_time);
+  if (ret) {
+    return ret;
+  }
+  int chunk_count = (int) segments.size();
+  const char* output_path = archive->config.output_path;
+  if (archive->total_out) {
+    __atomic_store(archive->total_out, &end_time, __ATOMIC_RELAXED);
+  }
+
+  struct checkpoint_s checkpoint = { 0 };
+  checkpoint.end_time = end_time;
+  checkpoint.chunk_count = chunk_count;
+  fingerprint_render(archive, source_path, checkpoint.fingerprint);
+  if (archive->config.resume) {
+    checkpoint.completed = checkpoint_find_resume(output_path, &checkpoint);
+  }
+  if (checkpoint.completed > 0) {
+    printf("resuming %s at chunk %d/%d (%f seconds)\n", output_path,
+           checkpoint.completed, chunk_count,
+           segments[checkpoint.completed - 1].end);
+  }
+
+  std::vector<struct segment_job_s> jobs(chunk_count);
+  for (int i = 0; i < chunk_count; i++) {
+    configure_segment_job(archive, &jobs[i], source_path, &segments[i], i);
+    checkpoint_chunk_path(output_path, i, jobs[i].output_path,
+                          sizeof(jobs[i].output_path));
+    jobs[i].config.output_path = jobs[i].output_path;
+  }
+
+  checkpoint.resume_time = checkpoint.completed < chunk_count ?
+  segments[checkpoint.completed].begin : end_time;
+  ret = checkpoint_write(output_path, &checkpoint);
+  for (int i = checkpoint.completed; !ret && i < chunk_count; i++) {
+    struct segment_job_s* job = &jobs[i];
+    printf("chunk %d/%d: [%f, %f)\n", i, chunk_count,
+           segments[i].begin, segments[i].end);
+    uv_thread_create(&job->thread, render_segment, job);
+    while (!__atomic_load_n(&job->finished, __ATOMIC_ACQUIRE)) {
+      double progress;
+      __atomic_load(&job->progress, &progress, __ATOMIC_RELAXED);
+      report_progress(archive, segments[i].begin + fmax(0, progress),
+                      end_time);
+      usleep(500000);
     }
+    uv_thread_join(&job->thread);
+    ret = job->ret;
+    if (ret) {
+      printf("chunk %d failed (ret %d). rerun with --resume to continue\n",
+             i, ret);
+      break;
+    }
+    checkpoint.completed = i + 1;
+    checkpoint.resume_time = segments[i].end;
+    ret = checkpoint_write(output_path, &checkpoint);
+  }
+  if (ret) {
+    return ret;
+  }
+  report_progress(archive, end_time, end_time);
+
+  std::vector<struct stitch_segment_s> stitch(chunk_count);
+  for (int i = 0; i < chunk_count; i++) {
+    stitch[i].path = jobs[i].output_path;
+    stitch[i].begin = segments[i].begin;
+    stitch[i].end = segments[i].end;
+    stitch[i].drop_leading_audio = jobs[i].config.audio_preroll_frames > 0;
   }
+  ret = segment_stitcher_run(output_path, stitch.data(), chunk_count);
+  if (ret) {
+    // keep the chunks and the checkpoint. a resume only has to stitch again.
+    return ret;
+  }
+  for (int i = 0; i < chunk_count; i++) {
+    unlink(jobs[i].output_path);
+  }
+  checkpoint_remove(output_path);
+  return 0;
 }
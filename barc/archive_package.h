@@ -10,11 +10,15 @@
 
 #include <stdio.h>
 #include <libavutil/rational.h>
+#include "barc.h"
 
 struct archive_s;
 
 struct archive_config_s {
   const char* source_path;
+  // size of a remote source_path the caller already probed, so it isn't
+  // probed again (see http_source_probe). 0 if unknown.
+  int64_t remote_size;
   const char* output_path;
   size_t width;
   size_t height;
@@ -22,6 +26,32 @@ struct archive_config_s {
   double end_offset;
   const char* css_preset;
   const char* css_custom;
+  // see barc_config_s
+  const char* output_format;
+  double segment_duration;
+  const char* sink;
+  // extra output sizes, see barc_config_s
+  const struct barc_rendition_s* renditions;
+  size_t rendition_count;
+  // see barc_config_s
+  char variable_frame_rate;
+  struct barc_pipeline_config_s pipeline;
+  // cut stretches with no sources out of the output, instead of filling them
+  // with black and silence. only for serial renders.
+  char trim_gaps;
+  // split the timeline and render this many pieces concurrently
+  int parallel_segments;
+  // render only piece segment_index of segment_count, and describe it in a
+  // sidecar so the pieces can be stitched later (see segment_stitcher.h)
+  int segment_index;
+  int segment_count;
+  // see barc_config_s. used when rendering a segment that is not first.
+  int audio_preroll_frames;
+  // render in chunks of about this many seconds, and record each finished
+  // chunk in a checkpoint next to the output (see checkpoint.h)
+  double checkpoint_interval;
+  // pick up from the checkpoint left by an interrupted render
+  char resume;
 };
 
 /**
@@ -31,6 +61,11 @@ void archive_alloc(struct archive_s** archive_out);
 int archive_load_configuration(struct archive_s* archive,
                                struct archive_config_s* config);
 int archive_main(struct archive_s* archive);
+/* Publish the output clock and the expected output length (seconds) here
+ * instead of printing progress lines. Written from the rendering thread; read
+ * them with __atomic_load. total may be NULL. */
+void archive_set_progress_out(struct archive_s* archive, double* progress,
+                              double* total);
 void archive_free(struct archive_s* archive);
 
 #endif /* archive_package_h */
@@ -7,6 +7,7 @@
 
 #include "audio_mixer.h"
 #include "archive_package.h"
+#include "log.h"
 #include <libavutil/opt.h>
 #include <assert.h>
 
@@ -19,8 +20,8 @@ int audio_mixer_get_samples_for_streams
  double clock_time, AVFrame* output_frame)
 {
   int ret = 0;
-    printf("Will mix %zu audio streams for ts %f\n",
-           active_stream_count, clock_time);
+    log_debug(log_module_mixer, "Will mix %zu audio streams for ts %f",
+              active_stream_count, clock_time);
 
     if (active_stream_count <= 0) {
         return -1;
@@ -33,6 +34,7 @@ int audio_mixer_get_samples_for_streams
     }
     assert(output_frame->format == AV_SAMPLE_FMT_FLTP);
     float** dest_samples = (float**)output_frame->data;
+    int clipped = 0;
 
     // third loop for each active stream
     for (int i = 0; i < active_stream_count; i++) {
@@ -56,7 +58,7 @@ int audio_mixer_get_samples_for_streams
                 (((float)source_samples[j][k]) / INT16_MAX);
                 if (fabs(dest_samples[j][k]) > 1.0) {
                     // turn down for what
-                    printf("audio clip detected\n");
+                    clipped++;
                     dest_samples[j][k] = fmin(1.0, dest_samples[j][k]);
                     dest_samples[j][k] = fmax(-1.0, dest_samples[j][k]);
                 }
@@ -64,6 +66,13 @@ int audio_mixer_get_samples_for_streams
         }
     }
 
+    // once per frame, not per sample: loud mixes clip thousands of them
+    if (clipped) {
+        log_warn_limited(log_module_mixer,
+                         "audio clip detected at ts %f (%d samples)",
+                         clock_time, clipped);
+    }
+
     for (int i = 0; i < output_frame->channels; i++) {
         free(source_samples[i]);
     }
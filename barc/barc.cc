@@ -7,11 +7,14 @@
 
 extern "C" {
 #include <MagickWand/MagickWand.h>
+#include <libavutil/samplefmt.h>
 #include "barc.h"
 #include "file_writer.h"
+#include "log.h"
 #include "media_stream.h"
 #include "video_mixer.h"
 #include "audio_mixer.h"
+#include "trace.h"
 }
 #include <algorithm>
 #include <vector>
@@ -24,6 +27,14 @@ av_make_error_string((char*)__builtin_alloca(AV_ERROR_MAX_STRING_SIZE), \
 AV_ERROR_MAX_STRING_SIZE, errnum)
 #endif
 
+struct rendition_output_s {
+  size_t out_width;
+  size_t out_height;
+  const char* output_path;
+  struct video_mixer_s* video_mixer;
+  struct file_writer_t* file_writer;
+};
+
 struct barc_s {
   std::vector<struct media_stream_s*> streams;
   size_t out_width;
@@ -31,16 +42,30 @@ struct barc_s {
   struct file_writer_t* file_writer;
   struct video_mixer_s* video_mixer;
   const char* output_path;
+  int audio_preroll_frames;
+  const char* output_format;
+  double segment_duration;
+  enum file_writer_sink sink;
+  // outputs beyond the main one. these share the main writer's audio.
+  std::vector<struct rendition_output_s> renditions;
+  struct barc_pipeline_config_s pipeline;
 
   char need_track[2];
   double global_clock;
   double next_clock_times[2];
   double audio_tick_time;
   double video_tick_time;
+  // a frame of silence, handed to the encoder while there are no sources
+  AVFrame* silent_audio_frame;
 };
 
 static int tick_audio(struct barc_s* barc);
+static int tick_video(struct barc_s* barc, struct video_mixer_s* video_mixer,
+                      struct file_writer_t* file_writer);
 static void compute_audio_times(struct barc_s* barc);
+static void schedule_next_tick(struct barc_s* barc);
+static int open_writer(struct barc_s* barc, struct file_writer_t** writer_out,
+                       enum file_writer_format format);
 
 void barc_bootstrap() {
   av_register_all();
@@ -54,6 +79,7 @@ void barc_bootstrap() {
 void barc_alloc(struct barc_s** barc_out) {
   struct barc_s* barc = (struct barc_s*)calloc(1, sizeof(struct barc_s));
   barc->streams = std::vector<struct media_stream_s*>();
+  barc->renditions = std::vector<struct rendition_output_s>();
   video_mixer_alloc(&barc->video_mixer);
   *barc_out = barc;
 }
@@ -63,6 +89,12 @@ void barc_free(struct barc_s* barc) {
   barc->streams.clear();
   video_mixer_free(barc->video_mixer);
   file_writer_free(barc->file_writer);
+  for (struct rendition_output_s& rendition : barc->renditions) {
+    video_mixer_free(rendition.video_mixer);
+    file_writer_free(rendition.file_writer);
+  }
+  barc->renditions.clear();
+  av_frame_free(&barc->silent_audio_frame);
   free(barc);
 }
 
@@ -72,30 +104,109 @@ int barc_read_configuration(struct barc_s* barc, struct barc_config_s* config)
   barc->output_path = config->output_path;
   barc->out_width = config->out_width;
   barc->out_height = config->out_height;
+  barc->audio_preroll_frames = config->audio_preroll_frames;
+  barc->output_format = config->output_format;
+  barc->segment_duration = config->segment_duration;
+  if (file_writer_parse_sink(config->sink, &barc->sink)) {
+    printf("unknown sink %s\n", config->sink);
+    return -1;
+  }
+  barc->pipeline = config->pipeline;
+  video_mixer_set_max_compose_jobs(barc->video_mixer,
+                                   config->pipeline.compose_jobs);
   video_mixer_set_width(barc->video_mixer, barc->out_width);
   video_mixer_set_height(barc->video_mixer, barc->out_height);
   video_mixer_set_css_preset(barc->video_mixer, config->css_preset);
   video_mixer_set_css_custom(barc->video_mixer, config->css_custom);
+  // a static picture still gets a frame at least once a second
+  int max_omitted = (int) config->video_framerate;
+  video_mixer_set_variable_frame_rate(barc->video_mixer,
+                                      config->variable_frame_rate,
+                                      max_omitted);
+  for (size_t i = 0; i < config->rendition_count; i++) {
+    struct rendition_output_s rendition = { 0 };
+    rendition.out_width = config->renditions[i].out_width;
+    rendition.out_height = config->renditions[i].out_height;
+    rendition.output_path = config->renditions[i].output_path;
+    // each rendition lays out at its own size
+    video_mixer_alloc(&rendition.video_mixer);
+    video_mixer_set_max_compose_jobs(rendition.video_mixer,
+                                     config->pipeline.compose_jobs);
+    video_mixer_set_width(rendition.video_mixer, rendition.out_width);
+    video_mixer_set_height(rendition.video_mixer, rendition.out_height);
+    video_mixer_set_css_preset(rendition.video_mixer, config->css_preset);
+    video_mixer_set_css_custom(rendition.video_mixer, config->css_custom);
+    video_mixer_set_variable_frame_rate(rendition.video_mixer,
+                                        config->variable_frame_rate,
+                                        max_omitted);
+    barc->renditions.push_back(rendition);
+  }
   return 0;
 }
 
 int barc_open_outfile(struct barc_s* barc) {
-  file_writer_alloc(&barc->file_writer);
-  int ret = file_writer_open(barc->file_writer,
-                             barc->output_path,
-                             (int) barc->out_width,
-                             (int) barc->out_height);
+  enum file_writer_format format;
+  if (file_writer_parse_format(barc->output_format, &format)) {
+    printf("unknown output format %s\n", barc->output_format);
+    return -1;
+  }
+  int ret = open_writer(barc, &barc->file_writer, format);
+  if (ret) {
+    return ret;
+  }
+  for (struct rendition_output_s& rendition : barc->renditions) {
+    ret = open_writer(barc, &rendition.file_writer, format);
+    if (ret) {
+      return ret;
+    }
+    ret = file_writer_follow_audio(barc->file_writer, rendition.file_writer);
+    if (ret) {
+      printf("too many renditions. at most %d are supported\n",
+             FILE_WRITER_MAX_AUDIO_FOLLOWERS);
+      return ret;
+    }
+    // followers must be ready to mux before the main writer makes audio
+    ret = file_writer_open(rendition.file_writer,
+                           rendition.output_path,
+                           (int) rendition.out_width,
+                           (int) rendition.out_height);
+    if (ret) {
+      printf("unable to open rendition %s\n", rendition.output_path);
+      return ret;
+    }
+  }
+  ret = file_writer_open(barc->file_writer,
+                         barc->output_path,
+                         (int) barc->out_width,
+                         (int) barc->out_height);
   compute_audio_times(barc);
+  if (barc->audio_preroll_frames > 0) {
+    // start the clock early, but only for audio. video still begins at zero.
+    barc->global_clock = -barc->audio_preroll_frames * barc->audio_tick_time;
+    barc->need_track[0] = 1;
+    barc->need_track[1] = 0;
+    barc->next_clock_times[1] = 0;
+  }
   return ret;
 }
 
 int barc_close_outfile(struct barc_s* barc) {
   printf("Waiting for video mixer to finish...");
   video_mixer_flush(barc->video_mixer);
+  for (struct rendition_output_s& rendition : barc->renditions) {
+    video_mixer_flush(rendition.video_mixer);
+  }
   printf("..done!\n");
 
   printf("Close file writer..");
+  // the main writer feeds audio to the renditions, so it goes first
   int ret = file_writer_close(barc->file_writer);
+  for (struct rendition_output_s& rendition : barc->renditions) {
+    int rret = file_writer_close(rendition.file_writer);
+    if (!ret) {
+      ret = rret;
+    }
+  }
   printf("..done!\n");
 
   return ret;
@@ -121,9 +232,16 @@ int barc_remove_source(struct barc_s* barc, struct barc_source_s* source) {
   return 0;
 }
 
+/* Drives the pipeline one step along the output clock. Each call hands at
+ * most one audio frame and one video frame to the stages behind it; those
+ * stages run on their own threads and block this call when they fall
+ * behind (see barc_pipeline_config_s). */
 int barc_tick(struct barc_s* barc) {
-  printf("barc.tick: global_clock:%f need_audio:%d need_video:%d\n",
-         barc->global_clock, barc->need_track[0], barc->need_track[1]);
+  log_debug(log_module_barc, "tick: global_clock:%f need_audio:%d "
+            "need_video:%d", barc->global_clock, barc->need_track[0],
+            barc->need_track[1]);
+  uint64_t trace_start = trace_begin();
+  double tick_clock = barc->global_clock;
   int aret = 0;
   int vret = 0;
   // process audio and video tracks, as needed
@@ -134,19 +252,21 @@ int barc_tick(struct barc_s* barc) {
   }
 
   if (barc->need_track[1]) {
-    video_mixer_clear_streams(barc->video_mixer);
-    for (struct media_stream_s* stream : barc->streams) {
-      video_mixer_add_stream(barc->video_mixer, stream);
+    vret = tick_video(barc, barc->video_mixer, barc->file_writer);
+    // sources were decoded for the main output; renditions reuse them
+    for (struct rendition_output_s& rendition : barc->renditions) {
+      tick_video(barc, rendition.video_mixer, rendition.file_writer);
     }
-    //TODO: get the millisecond time base from encoder format context
-    vret = video_mixer_async_push_frame(barc->video_mixer,
-                                        barc->file_writer,
-                                        barc->global_clock,
-                                        barc->global_clock * 1000
-                                        );
     barc->next_clock_times[1] = barc->global_clock + barc->video_tick_time;
   }
 
+  schedule_next_tick(barc);
+  trace_end("tick", trace_start, "clock_ms",
+            (int64_t)(tick_clock * 1000));
+  return aret & vret;
+}
+
+static void schedule_next_tick(struct barc_s* barc) {
   // calculate exactly when we need to wake up again.
   // first, assume audio is next.
   double next_clock = barc->next_clock_times[0];
@@ -168,8 +288,6 @@ int barc_tick(struct barc_s* barc) {
   }
 
   barc->global_clock = next_clock;
-
-  return aret & vret;
 }
 
 #pragma mark - Getters & Setters
@@ -180,18 +298,77 @@ double barc_get_current_clock(struct barc_s* barc) {
 
 void barc_set_css_preset(struct barc_s* barc, const char* css_preset) {
   video_mixer_set_css_preset(barc->video_mixer, css_preset);
+  for (struct rendition_output_s& rendition : barc->renditions) {
+    video_mixer_set_css_preset(rendition.video_mixer, css_preset);
+  }
 }
 
 void barc_set_custom_css(struct barc_s* barc, const char* custom_css) {
   video_mixer_set_css_custom(barc->video_mixer, custom_css);
+  for (struct rendition_output_s& rendition : barc->renditions) {
+    video_mixer_set_css_custom(rendition.video_mixer, custom_css);
+  }
 }
 
 #pragma mark - Internal Utilities
 
+static int tick_video(struct barc_s* barc, struct video_mixer_s* video_mixer,
+                      struct file_writer_t* file_writer)
+{
+  if (barc->streams.empty()) {
+    // nothing to lay out or compose
+    return video_mixer_push_blank_frame(video_mixer, file_writer,
+                                        barc->global_clock * 1000);
+  }
+  video_mixer_clear_streams(video_mixer);
+  for (struct media_stream_s* stream : barc->streams) {
+    video_mixer_add_stream(video_mixer, stream);
+  }
+  //TODO: get the millisecond time base from encoder format context
+  return video_mixer_async_push_frame(video_mixer,
+                                      file_writer,
+                                      barc->global_clock,
+                                      barc->global_clock * 1000
+                                      );
+}
+
+static int tick_silent_audio(struct barc_s* barc)
+{
+  if (!barc->silent_audio_frame) {
+    AVCodecContext* audio_ctx = barc->file_writer->audio_ctx_out;
+    AVFrame* frame = av_frame_alloc();
+    frame->format = audio_ctx->sample_fmt;
+    frame->channel_layout = audio_ctx->channel_layout;
+    frame->nb_samples = audio_ctx->frame_size;
+    frame->sample_rate = audio_ctx->sample_rate;
+    int ret = av_frame_get_buffer(frame, 1);
+    if (ret) {
+      printf("No output AVFrame buffer to write audio. Error: %s\n",
+             av_err2str(ret));
+      av_frame_free(&frame);
+      return ret;
+    }
+    av_samples_set_silence(frame->extended_data, 0, frame->nb_samples,
+                           frame->channels,
+                           (enum AVSampleFormat)frame->format);
+    barc->silent_audio_frame = frame;
+  }
+  AVFrame* output_frame = av_frame_clone(barc->silent_audio_frame);
+  output_frame->pts = llround(barc->global_clock *
+  barc->file_writer->audio_ctx_out->time_base.den);
+  file_writer_push_audio_frame(barc->file_writer, output_frame);
+  av_frame_free(&output_frame);
+  return 0;
+}
+
 static int tick_audio(struct barc_s* barc)
 {
   int ret;
 
+  if (barc->streams.empty()) {
+    return tick_silent_audio(barc);
+  }
+
   // configure next audio frame to be encoded
   AVFrame* output_frame = av_frame_alloc();
   output_frame->format = barc->file_writer->audio_ctx_out->sample_fmt;
@@ -200,8 +377,8 @@ static int tick_audio(struct barc_s* barc)
   output_frame->nb_samples =
   barc->file_writer->audio_ctx_out->frame_size;
   // output pts is offset back to zero for late starts (see -b option)
-  output_frame->pts = barc->global_clock *
-  barc->file_writer->audio_ctx_out->time_base.den;
+  output_frame->pts = llround(barc->global_clock *
+  barc->file_writer->audio_ctx_out->time_base.den);
   output_frame->sample_rate = barc->file_writer->audio_ctx_out->sample_rate;
 
   ret = av_frame_get_buffer(output_frame, 1);
@@ -231,8 +408,26 @@ static int tick_audio(struct barc_s* barc)
   (active_streams, stream_count, barc->global_clock, output_frame);
   free(active_streams);
 
-  // send it to the audio filter graph
+  // send it to the audio encoder. file writer keeps its own reference.
   file_writer_push_audio_frame(barc->file_writer, output_frame);
+  av_frame_free(&output_frame);
+  return ret;
+}
+
+static int open_writer(struct barc_s* barc, struct file_writer_t** writer_out,
+                       enum file_writer_format format)
+{
+  struct file_writer_queue_limits_s limits;
+  limits.video_frames = barc->pipeline.encode_video_frames;
+  limits.video_bytes = barc->pipeline.encode_video_bytes;
+  limits.audio_frames = barc->pipeline.encode_audio_frames;
+  file_writer_alloc(writer_out);
+  file_writer_set_output_format(*writer_out, format, barc->segment_duration);
+  file_writer_set_sink(*writer_out, barc->sink);
+  int ret = file_writer_set_queue_limits(*writer_out, &limits);
+  if (ret) {
+    printf("unable to size encoder queues\n");
+  }
   return ret;
 }
 
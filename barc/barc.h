@@ -12,6 +12,33 @@
 
 struct barc_s;
 
+/** An additional output size, rendered alongside the main output. */
+struct barc_rendition_s {
+  size_t out_width;
+  size_t out_height;
+  const char* output_path;
+};
+
+/**
+ * Per-stage limits for the render pipeline:
+ * decode (a thread per source) -> layout and mix (the barc_tick caller) ->
+ * compose (libuv pool) -> encode (a thread per track) -> mux (one thread).
+ * Every queue between stages is bounded, and a full queue blocks the stage
+ * feeding it, so a slow stage slows everything upstream instead of growing
+ * memory. Zero fields keep the defaults.
+ */
+struct barc_pipeline_config_s {
+  // decoded video frames (and bytes) buffered ahead of the mixer, per source
+  size_t decode_frames;
+  size_t decode_bytes;
+  // output frames being composed at once
+  int compose_jobs;
+  // raw frames waiting for the encoders
+  size_t encode_video_frames;
+  size_t encode_video_bytes;
+  size_t encode_audio_frames;
+};
+
 struct barc_config_s {
   double video_framerate;
   size_t out_width;
@@ -19,6 +46,22 @@ struct barc_config_s {
   const char* css_preset;
   const char* css_custom;
   const char* output_path;
+  // encode this many audio frames ahead of t=0 so the audio encoder is
+  // primed with real media when the output is joined onto another segment.
+  int audio_preroll_frames;
+  // container layout: mp4 (default), fmp4, hls or dash. see file_writer.h
+  const char* output_format;
+  // fragment/segment length in seconds for the non-progressive formats
+  double segment_duration;
+  // encode (default), null or hash. see file_writer_sink
+  const char* sink;
+  // extra outputs rendered from the same decode and audio mix. each gets its
+  // own layout pass and video encode; audio is encoded once and shared.
+  const struct barc_rendition_s* renditions;
+  size_t rendition_count;
+  // skip frames whose inputs did not change instead of repeating them
+  char variable_frame_rate;
+  struct barc_pipeline_config_s pipeline;
 };
 
 struct barc_source_s {
@@ -0,0 +1,372 @@
+//
+//  batch_runner.c
+//  barc
+//
+
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <jansson.h>
+#include <uv.h>
+
+#include "batch_runner.h"
+#include "archive_cache.h"
+#include "archive_package.h"
+#include "curler.h"
+#include "file_writer.h"
+#include "http_source.h"
+#include "perf_stats.h"
+#include "zip_io.h"
+
+struct batch_runner_s {
+  const struct batch_config_s* config;
+  // limits the number of jobs rendering at once
+  uv_sem_t slots;
+  // serializes status lines and the failure count
+  uv_mutex_t lock;
+  struct batch_job_s* jobs;
+  int failed;
+};
+
+// web API spellings accepted for job keys
+static const char* job_key_aliases[][2] = {
+  { "archiveURL", "input" },
+  { "cssPreset", "css_preset" },
+  { "customCSS", "custom_css" },
+  { "beginOffset", "begin_offset" },
+  { "endOffset", "end_offset" },
+};
+
+struct batch_job_s {
+  // owns every string the job points to
+  json_t* json;
+  const char* id;
+  const char* input;
+  struct archive_config_s config;
+  char output_path[PATH_MAX];
+  // directory or zip the archive is rendered from
+  char* source_path;
+  // fetched for this job, removed once it is rendered
+  char* download_path;
+  // source_path is held in the archive cache until the job is rendered
+  char cached;
+  double progress;
+  double duration;
+  int ret;
+  int finished;
+  time_t start_time;
+  uv_thread_t thread;
+  struct batch_runner_s* runner;
+  struct batch_job_s* next;
+};
+
+#pragma mark - Job descriptors
+
+int batch_job_parse(const char* line, const struct archive_config_s* defaults,
+                    struct batch_job_s** job_out)
+{
+  json_error_t error;
+  json_t* json = json_loads(line, 0, &error);
+  if (!json) {
+    printf("batch: malformed job line %d: %s\n", error.line, error.text);
+    return -1;
+  }
+  if (!json_is_object(json)) {
+    printf("batch: job line %d is not an object\n", error.line);
+    json_decref(json);
+    return -1;
+  }
+  for (size_t i = 0; i < sizeof(job_key_aliases) / sizeof(*job_key_aliases);
+       i++)
+  {
+    json_t* value = json_object_get(json, job_key_aliases[i][0]);
+    if (value && !json_object_get(json, job_key_aliases[i][1])) {
+      json_object_set(json, job_key_aliases[i][1], value);
+    }
+  }
+  struct batch_job_s* job = (struct batch_job_s*)
+  calloc(1, sizeof(struct batch_job_s));
+  job->json = json;
+  job->config = *defaults;
+  // one output per job. a shared rendition path or a pipe would have every
+  // job writing over the others.
+  job->config.renditions = NULL;
+  job->config.rendition_count = 0;
+  job->config.segment_index = 0;
+  job->config.segment_count = 0;
+
+  int width = (int)job->config.width;
+  int height = (int)job->config.height;
+  int vfr = job->config.variable_frame_rate;
+  int trim_gaps = job->config.trim_gaps;
+  int ret = json_unpack_ex(json, &error, 0,
+                           "{s?s, s:s, s:s, s?i, s?i, s?s, s?s, s?F, s?F, "
+                           "s?s, s?F, s?b, s?b}",
+                           "id", &job->id,
+                           "input", &job->input,
+                           "output", &job->config.output_path,
+                           "width", &width,
+                           "height", &height,
+                           "css_preset", &job->config.css_preset,
+                           "custom_css", &job->config.css_custom,
+                           "begin_offset", &job->config.begin_offset,
+                           "end_offset", &job->config.end_offset,
+                           "format", &job->config.output_format,
+                           "segment_duration",
+                           &job->config.segment_duration,
+                           "vfr", &vfr,
+                           "trim_gaps", &trim_gaps);
+  if (ret) {
+    printf("batch: invalid job: %s\n", error.text);
+    batch_job_free(job);
+    return -1;
+  }
+  if (file_writer_is_stream_output(job->config.output_path)) {
+    printf("batch: job output must be a file. got %s\n",
+           job->config.output_path);
+    batch_job_free(job);
+    return -1;
+  }
+  if (width <= 0 || height <= 0) {
+    printf("batch: invalid output size %dx%d\n", width, height);
+    batch_job_free(job);
+    return -1;
+  }
+  job->config.width = width;
+  job->config.height = height;
+  job->config.variable_frame_rate = vfr;
+  job->config.trim_gaps = trim_gaps;
+  if (!job->id) {
+    job->id = job->input;
+  }
+  *job_out = job;
+  return 0;
+}
+
+void batch_job_free(struct batch_job_s* job) {
+  free(job->source_path);
+  free(job->download_path);
+  json_decref(job->json);
+  free(job);
+}
+
+const char* batch_job_get_id(const struct batch_job_s* job) {
+  return job->id;
+}
+
+const char* batch_job_get_input(const struct batch_job_s* job) {
+  return job->input;
+}
+
+const struct archive_config_s*
+batch_job_get_config(const struct batch_job_s* job)
+{
+  return &job->config;
+}
+
+void batch_job_get_progress(const struct batch_job_s* job,
+                            double* complete, double* total)
+{
+  __atomic_load(&job->progress, complete, __ATOMIC_RELAXED);
+  __atomic_load(&job->duration, total, __ATOMIC_RELAXED);
+}
+
+int batch_job_get_result(const struct batch_job_s* job) {
+  return job->ret;
+}
+
+time_t batch_job_get_start_time(const struct batch_job_s* job) {
+  return job->start_time;
+}
+
+int batch_job_check_output(const struct batch_job_s* job) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s", job->config.output_path);
+  // dirname may modify its argument
+  const char* dir = dirname(path);
+  if (access(dir, W_OK | X_OK)) {
+    printf("batch: can't write to %s: %s\n", dir, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+#pragma mark - Job execution
+
+static void print_status(struct batch_job_s* job, const char* status) {
+  struct batch_runner_s* runner = job->runner;
+  // batch_job_execute starts the clock, so "started" goes out at 0 seconds
+  time_t seconds = job->start_time ? time(NULL) - job->start_time : 0;
+  json_t* json = json_pack("{s:{s:s, s:s, s:i, s:I}}", "batch",
+                           "id", job->id,
+                           "status", status,
+                           "ret", job->ret,
+                           "seconds", (json_int_t)seconds);
+  char* line = json ? json_dumps(json, JSON_COMPACT) : NULL;
+  uv_mutex_lock(&runner->lock);
+  if (line) {
+    printf("%s\n", line);
+    fflush(stdout);
+  }
+  uv_mutex_unlock(&runner->lock);
+  free(line);
+  json_decref(json);
+}
+
+// directories and zips (local, remote or downloaded) are rendered in place.
+// urls are only downloaded when the server can't answer range requests, or
+// into the archive cache when there is one.
+static int prepare_input(struct batch_job_s* job) {
+  const char* input = job->input;
+  if (archive_cache_enabled() && zip_io_is_remote(input)) {
+    job->source_path = archive_cache_fetch(input);
+    job->cached = NULL != job->source_path;
+    return job->source_path ? 0 : -1;
+  }
+  if (zip_io_is_remote(input) &&
+      !http_source_probe(input, &job->config.remote_size))
+  {
+    job->source_path = strdup(input);
+    return 0;
+  }
+  if (!strncmp(input, "http", 4)) {
+    job->download_path = get_http(input);
+    input = job->download_path;
+  }
+
+  struct stat file_stat;
+  if (!input || stat(input, &file_stat)) {
+    printf("batch: %s: %s\n", input ? input : job->input, strerror(errno));
+  } else if (S_ISDIR(file_stat.st_mode) || S_ISREG(file_stat.st_mode)) {
+    job->source_path = realpath(input, NULL);
+  } else {
+    printf("batch: unknown file type %s\n", input);
+  }
+  return job->source_path ? 0 : -1;
+}
+
+int batch_job_execute(struct batch_job_s* job) {
+  char cwd[PATH_MAX];
+  job->start_time = time(NULL);
+  int ret = prepare_input(job);
+  // relative outputs are relative to where barc was started, not to the
+  // archive directory. nothing in barc changes the working directory.
+  if (!ret && '/' != job->config.output_path[0]) {
+    if (getcwd(cwd, sizeof(cwd))) {
+      snprintf(job->output_path, sizeof(job->output_path), "%s/%s",
+               cwd, job->config.output_path);
+      job->config.output_path = job->output_path;
+    } else {
+      perror("getcwd");
+      ret = -1;
+    }
+  }
+  if (!ret) {
+    job->config.source_path = job->source_path;
+    struct archive_s* archive;
+    archive_alloc(&archive);
+    archive_set_progress_out(archive, &job->progress, &job->duration);
+    ret = archive_load_configuration(archive, &job->config);
+    if (!ret) {
+      ret = archive_main(archive);
+    }
+    archive_free(archive);
+  }
+  if (job->download_path) {
+    unlink(job->download_path);
+  }
+  if (job->cached) {
+    archive_cache_release(job->source_path);
+    job->cached = 0;
+  }
+  job->ret = ret;
+  return ret;
+}
+
+static void run_job(void* p) {
+  struct batch_job_s* job = (struct batch_job_s*)p;
+  struct batch_runner_s* runner = job->runner;
+  print_status(job, "started");
+  int ret = batch_job_execute(job);
+  print_status(job, ret ? "failed" : "done");
+  if (ret) {
+    uv_mutex_lock(&runner->lock);
+    runner->failed++;
+    uv_mutex_unlock(&runner->lock);
+  }
+  __atomic_store_n(&job->finished, 1, __ATOMIC_RELEASE);
+  uv_sem_post(&runner->slots);
+}
+
+static void reap_jobs(struct batch_runner_s* runner, char wait) {
+  struct batch_job_s** link = &runner->jobs;
+  while (*link) {
+    struct batch_job_s* job = *link;
+    if (wait || __atomic_load_n(&job->finished, __ATOMIC_ACQUIRE)) {
+      uv_thread_join(&job->thread);
+      *link = job->next;
+      batch_job_free(job);
+    } else {
+      link = &job->next;
+    }
+  }
+}
+
+static char is_blank_line(const char* line) {
+  while (' ' == *line || '\t' == *line || '\r' == *line || '\n' == *line) {
+    line++;
+  }
+  return !*line || '#' == *line;
+}
+
+int batch_run(FILE* jobs, const struct batch_config_s* config) {
+  struct batch_config_s batch_config = *config;
+  if (batch_config.max_jobs < 1) {
+    batch_config.max_jobs = 1;
+  }
+
+  struct batch_runner_s runner = { 0 };
+  runner.config = &batch_config;
+  uv_sem_init(&runner.slots, batch_config.max_jobs);
+  uv_mutex_init(&runner.lock);
+
+  char* line = NULL;
+  size_t line_size = 0;
+  int line_number = 0;
+  while (getline(&line, &line_size, jobs) > 0) {
+    line_number++;
+    if (is_blank_line(line)) {
+      continue;
+    }
+    struct batch_job_s* job = NULL;
+    if (batch_job_parse(line, &batch_config.defaults, &job)) {
+      printf("{\"batch\": {\"line\": %d, \"status\": \"invalid\"}}\n",
+             line_number);
+      uv_mutex_lock(&runner.lock);
+      runner.failed++;
+      uv_mutex_unlock(&runner.lock);
+      continue;
+    }
+    uv_sem_wait(&runner.slots);
+    reap_jobs(&runner, 0);
+    // nothing else is decoding, so the per-source breakdown starts over
+    if (!runner.jobs) {
+      perf_stats_reset_sources();
+    }
+    job->runner = &runner;
+    job->next = runner.jobs;
+    runner.jobs = job;
+    uv_thread_create(&job->thread, run_job, job);
+  }
+  free(line);
+  reap_jobs(&runner, 1);
+
+  uv_mutex_destroy(&runner.lock);
+  uv_sem_destroy(&runner.slots);
+  return runner.failed;
+}
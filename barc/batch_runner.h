@@ -0,0 +1,70 @@
+//
+//  batch_runner.h
+//  barc
+//
+
+#ifndef batch_runner_h
+#define batch_runner_h
+
+#include <stdio.h>
+#include <time.h>
+#include "archive_package.h"
+
+/**
+ * Render many archives from one process. Jobs are read one JSON object per
+ * line, e.g.
+ *   {"id": "abc", "input": "/data/abc.zip", "output": "/out/abc.mp4",
+ *    "width": 1280, "height": 720, "css_preset": "bestFit"}
+ * Only input and output are required. Other keys (custom_css, begin_offset,
+ * end_offset, format, segment_duration, vfr, trim_gaps) override the
+ * defaults for that job. The web API names (archiveURL, cssPreset,
+ * customCSS, beginOffset, endOffset) are accepted too. Every job unpacks
+ * into its own directory and the working directory of the process is never
+ * changed, so jobs can run side by side. They share the libuv thread pool
+ * that composes frames.
+ */
+struct batch_job_s;
+
+struct batch_config_s {
+  // options applied to every job unless the job line overrides them
+  struct archive_config_s defaults;
+  // jobs rendering at once (default 1)
+  int max_jobs;
+};
+
+int batch_job_parse(const char* line, const struct archive_config_s* defaults,
+                    struct batch_job_s** job_out);
+void batch_job_free(struct batch_job_s* job);
+const char* batch_job_get_id(const struct batch_job_s* job);
+const char* batch_job_get_input(const struct batch_job_s* job);
+const struct archive_config_s*
+batch_job_get_config(const struct batch_job_s* job);
+// output clock and expected output length, in seconds. safe to call while
+// the job is rendering.
+void batch_job_get_progress(const struct batch_job_s* job,
+                            double* complete, double* total);
+int batch_job_get_result(const struct batch_job_s* job);
+time_t batch_job_get_start_time(const struct batch_job_s* job);
+/**
+ * Check that the directory the job renders into exists and is writable, so
+ * a bad path is turned away before the job waits in a queue.
+ * @return 0 if it is
+ */
+int batch_job_check_output(const struct batch_job_s* job);
+
+/**
+ * Fetch and render one job on the calling thread, then remove anything it
+ * downloaded. Zips are read in place.
+ * @return 0 on success
+ */
+int batch_job_execute(struct batch_job_s* job);
+
+/**
+ * Run every job read from jobs until end of file. A status line is printed
+ * when each job starts and finishes:
+ *   {"batch": {"id": "abc", "status": "done", "ret": 0, "seconds": 42}}
+ * @return number of jobs that could not be parsed or failed to render
+ */
+int batch_run(FILE* jobs, const struct batch_config_s* config);
+
+#endif /* batch_runner_h */
@@ -0,0 +1,146 @@
+//
+//  checkpoint.c
+//  barc
+//
+
+#include "checkpoint.h"
+#include <jansson.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char* checkpoint_extension = ".checkpoint";
+static const int checkpoint_version = 2;
+
+static char* checkpoint_path(const char* output_path, const char* suffix) {
+  size_t len = strlen(output_path) + strlen(checkpoint_extension) +
+  strlen(suffix) + 1;
+  char* path = (char*) malloc(len);
+  snprintf(path, len, "%s%s%s", output_path, checkpoint_extension, suffix);
+  return path;
+}
+
+int checkpoint_write(const char* output_path,
+                     const struct checkpoint_s* checkpoint)
+{
+  json_t* json = json_pack("{s:i, s:f, s:i, s:s, s:i, s:f}",
+                           "version", checkpoint_version,
+                           "end_time", checkpoint->end_time,
+                           "chunk_count", checkpoint->chunk_count,
+                           "fingerprint", checkpoint->fingerprint,
+                           "completed", checkpoint->completed,
+                           "resume_time", checkpoint->resume_time);
+  if (!json) {
+    printf("unable to build checkpoint\n");
+    return -1;
+  }
+  // a preempted write must leave the previous checkpoint intact
+  char* path = checkpoint_path(output_path, "");
+  char* tmp_path = checkpoint_path(output_path, ".tmp");
+  int ret = json_dump_file(json, tmp_path, JSON_INDENT(2));
+  if (!ret) {
+    ret = rename(tmp_path, path);
+  }
+  if (ret) {
+    printf("unable to write checkpoint %s\n", path);
+    unlink(tmp_path);
+  }
+  free(tmp_path);
+  free(path);
+  json_decref(json);
+  return ret;
+}
+
+int checkpoint_read(const char* output_path,
+                    struct checkpoint_s* checkpoint_out)
+{
+  json_error_t error;
+  char* path = checkpoint_path(output_path, "");
+  json_t* json = json_load_file(path, 0, &error);
+  if (!json) {
+    printf("unable to read checkpoint %s: %s\n", path, error.text);
+    free(path);
+    return -1;
+  }
+  int version = 0;
+  const char* fingerprint = "";
+  memset(checkpoint_out, 0, sizeof(struct checkpoint_s));
+  int ret = json_unpack(json, "{s:i, s:F, s:i, s?s, s:i, s?F}",
+                        "version", &version,
+                        "end_time", &checkpoint_out->end_time,
+                        "chunk_count", &checkpoint_out->chunk_count,
+                        "fingerprint", &fingerprint,
+                        "completed", &checkpoint_out->completed,
+                        "resume_time", &checkpoint_out->resume_time);
+  snprintf(checkpoint_out->fingerprint, CHECKPOINT_FINGERPRINT_SIZE, "%s",
+           fingerprint);
+  if (ret || checkpoint_version != version ||
+      checkpoint_out->completed < 0 ||
+      checkpoint_out->completed > checkpoint_out->chunk_count)
+  {
+    printf("malformed checkpoint %s\n", path);
+    ret = -1;
+  }
+  free(path);
+  json_decref(json);
+  return ret;
+}
+
+void checkpoint_remove(const char* output_path) {
+  char* path = checkpoint_path(output_path, "");
+  unlink(path);
+  free(path);
+}
+
+void checkpoint_chunk_path(const char* output_path, int index,
+                           char* buffer, size_t buffer_size)
+{
+  snprintf(buffer, buffer_size, "%s.chunk%d.mp4", output_path, index);
+}
+
+void checkpoint_fingerprint(const char* description,
+                            char fingerprint_out[CHECKPOINT_FINGERPRINT_SIZE])
+{
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const char* c = description; *c; c++) {
+    hash = (hash ^ (unsigned char)*c) * 0x100000001b3ULL;
+  }
+  snprintf(fingerprint_out, CHECKPOINT_FINGERPRINT_SIZE, "%016llx",
+           (unsigned long long)hash);
+}
+
+int checkpoint_find_resume(const char* output_path,
+                           const struct checkpoint_s* plan)
+{
+  struct checkpoint_s checkpoint;
+  if (checkpoint_read(output_path, &checkpoint)) {
+    printf("no usable checkpoint for %s. starting from the beginning\n",
+           output_path);
+    return 0;
+  }
+  if (checkpoint.chunk_count != plan->chunk_count ||
+      fabs(checkpoint.end_time - plan->end_time) > 0.001 ||
+      strcmp(checkpoint.fingerprint, plan->fingerprint))
+  {
+    printf("checkpoint for %s was made for a different render "
+           "(%d chunks, %f seconds, settings %s). "
+           "starting from the beginning\n",
+           output_path, checkpoint.chunk_count, checkpoint.end_time,
+           checkpoint.fingerprint);
+    return 0;
+  }
+  char chunk_path[PATH_MAX];
+  for (int i = 0; i < checkpoint.completed; i++) {
+    checkpoint_chunk_path(output_path, i, chunk_path, sizeof(chunk_path));
+    if (access(chunk_path, R_OK)) {
+      printf("chunk %s is missing. resuming from there\n", chunk_path);
+      return i;
+    }
+  }
+  return checkpoint.completed;
+}
@@ -0,0 +1,62 @@
+//
+//  checkpoint.h
+//  barc
+//
+
+#ifndef checkpoint_h
+#define checkpoint_h
+
+#include <stddef.h>
+
+/**
+ * Progress of a checkpointed render (--checkpoint). The output timeline is
+ * cut into grid-aligned chunks that are rendered one after another into
+ * <output>.chunk<i>.mp4, and stitched when the last one is done. Everything a
+ * chunk needs (source positions, layout, audio pre-roll) is derived from
+ * where it begins, so the chunks already on disk are all there is to resume.
+ * Written next to the output as <output>.checkpoint (JSON).
+ */
+#define CHECKPOINT_FINGERPRINT_SIZE 17
+
+struct checkpoint_s {
+  // the plan this checkpoint belongs to. a resume with a different plan
+  // starts over.
+  double end_time;
+  int chunk_count;
+  // everything else the chunks depend on: input, size, layout, range...
+  // (see checkpoint_fingerprint)
+  char fingerprint[CHECKPOINT_FINGERPRINT_SIZE];
+  // chunks [0, completed) are finished
+  int completed;
+  // output time where the next chunk begins
+  double resume_time;
+};
+
+/** Replace the checkpoint for output_path. The file is swapped in whole. */
+int checkpoint_write(const char* output_path,
+                     const struct checkpoint_s* checkpoint);
+int checkpoint_read(const char* output_path,
+                    struct checkpoint_s* checkpoint_out);
+void checkpoint_remove(const char* output_path);
+
+/**
+ * Hash a description of the render settings into 16 hex digits. Two
+ * descriptions that differ at all give different fingerprints.
+ */
+void checkpoint_fingerprint(const char* description,
+                            char fingerprint_out[CHECKPOINT_FINGERPRINT_SIZE]);
+
+/**
+ * How many chunks of plan (end_time, chunk_count and fingerprint) an earlier
+ * run of output_path left behind: the checkpoint's completed count, cut
+ * short at the first chunk that is missing on disk. 0 when there is no
+ * readable checkpoint or it was made for a different plan.
+ */
+int checkpoint_find_resume(const char* output_path,
+                           const struct checkpoint_s* plan);
+
+/** Path of chunk index of output_path. */
+void checkpoint_chunk_path(const char* output_path, int index,
+                           char* buffer, size_t buffer_size);
+
+#endif /* checkpoint_h */
@@ -6,57 +6,402 @@
 //  Copyright © 2017 TokBox, Inc. All rights reserved.
 //
 
+#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <curl/curl.h>
+#include <uv.h>
 #include "curler.h"
 
-static size_t write_data(void *ptr, size_t size, size_t nmemb, void *stream)
-{
-  size_t written = fwrite(ptr, size, nmemb, (FILE *)stream);
-  return written;
-}
+// small enough that a retry costs little, big enough to keep requests few
+static const int64_t chunk_size = 4 * 1024 * 1024;
+static const int max_attempts = 5;
+// a connection slower than this for low_speed_time seconds is retried
+static const long low_speed_limit = 1024;
+static const long low_speed_time = 30;
 
-#define OUT_PATH_TEMPLATE "/tmp/barc-XXXXXX"
-char* get_http(const char* url)
-{
-  char* out_path = (char*)calloc(strlen(OUT_PATH_TEMPLATE) + 1, sizeof(char));
-  strcpy(out_path, OUT_PATH_TEMPLATE);
-  int out_fd = mkstemp(out_path);
-  FILE* out_file = fdopen(out_fd, "wb");
-  CURL* curl_handle;
+/** One range of the file, or the whole file when the server has no ranges. */
+struct chunk_s {
+  struct download_s* download;
+  CURL* curl;
+  int64_t begin;
+  // -1 for the probe, which doesn't know how much is coming
+  int64_t length;
+  int64_t received;
+  int attempts;
+};
+
+struct download_s {
+  char* url;
+  int fd;
+  int connections;
+  int64_t size;
+  char ranged;
+  struct chunk_s* chunks;
+  int chunk_count;
+  int retries;
+  int ret;
+  uv_thread_t thread;
+};
+
+static uv_once_t global_init_once = UV_ONCE_INIT;
 
+static void global_init() {
   curl_global_init(CURL_GLOBAL_ALL);
+}
+
+void curler_global_init() {
+  uv_once(&global_init_once, global_init);
+}
+
+
+#pragma mark - Transfers
+
+static size_t write_chunk(void* ptr, size_t size, size_t nmemb, void* p) {
+  struct chunk_s* chunk = (struct chunk_s*)p;
+  struct download_s* download = chunk->download;
+  size_t bytes = size * nmemb;
+  if (chunk->length >= 0 && chunk->received + (int64_t)bytes > chunk->length)
+  {
+    // the server sent more than the range asked for
+    return 0;
+  }
+  ssize_t written = pwrite(download->fd, ptr, bytes,
+                           chunk->begin + chunk->received);
+  if (written != (ssize_t)bytes) {
+    perror("download: pwrite");
+    return 0;
+  }
+  chunk->received += bytes;
+  return bytes;
+}
+
+int64_t parse_content_range_total(const char* header, size_t size) {
+  char line[256];
+  if (size >= sizeof(line)) {
+    return -1;
+  }
+  memcpy(line, header, size);
+  line[size] = '\0';
+  const char* slash = strchr(line, '/');
+  long long total;
+  if (strncasecmp(line, "content-range:", 14) || !slash ||
+      1 != sscanf(slash, "/%lld", &total) || total < 0)
+  {
+    return -1;
+  }
+  return total;
+}
+
+static size_t read_header(char* buffer, size_t size, size_t nitems, void* p) {
+  struct chunk_s* chunk = (struct chunk_s*)p;
+  size_t bytes = size * nitems;
+  int64_t total = parse_content_range_total(buffer, bytes);
+  if (total >= 0) {
+    chunk->download->size = total;
+  }
+  return bytes;
+}
+
+// picks up where the last attempt of chunk stopped
+static CURL* chunk_handle(struct chunk_s* chunk) {
+  struct download_s* download = chunk->download;
+  CURL* curl = curl_easy_init();
+  char range[64];
+  if (chunk->length < 0) {
+    snprintf(range, sizeof(range), "0-0");
+    chunk->received = 0;
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, read_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, chunk);
+  } else {
+    snprintf(range, sizeof(range), "%lld-%lld",
+             (long long)(chunk->begin + chunk->received),
+             (long long)(chunk->begin + chunk->length - 1));
+  }
+  curl_easy_setopt(curl, CURLOPT_URL, download->url);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_RANGE, range);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_chunk);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, chunk);
+  curl_easy_setopt(curl, CURLOPT_PRIVATE, chunk);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, low_speed_limit);
+  curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, low_speed_time);
+  chunk->curl = curl;
+  return curl;
+}
+
+/* Ask for the first byte. A server with ranges answers 206 with the size of
+ * the file; one without answers 200 and sends all of it, which then is the
+ * download.
+ */
+static int probe(struct download_s* download) {
+  struct chunk_s chunk = { download, NULL, 0, -1, 0, 0 };
+  for (int attempt = 0; attempt < max_attempts; attempt++) {
+    CURL* curl = chunk_handle(&chunk);
+    CURLcode result = curl_easy_perform(curl);
+    long status = 0;
+    curl_off_t content_length = -1;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                      &content_length);
+    curl_easy_cleanup(curl);
+    if (CURLE_OK == result && 206 == status && download->size > 0) {
+      download->ranged = 1;
+      return 0;
+    }
+    if (CURLE_OK == result && 200 == status) {
+      if (content_length >= 0 && content_length != chunk.received) {
+        printf("download: %s sent %lld of %lld bytes\n", download->url,
+               (long long)chunk.received, (long long)content_length);
+      } else {
+        download->size = chunk.received;
+        return 0;
+      }
+    } else {
+      printf("download: %s failed: %s (status %ld)\n", download->url,
+             curl_easy_strerror(result), status);
+      if (status > 0 && status < 500) {
+        return -1;
+      }
+    }
+    download->retries++;
+  }
+  return -1;
+}
+
+static int fetch_chunks(struct download_s* download) {
+  download->chunk_count = (int)((download->size + chunk_size - 1) / chunk_size);
+  download->chunks = (struct chunk_s*)
+  calloc(download->chunk_count, sizeof(struct chunk_s));
+  for (int i = 0; i < download->chunk_count; i++) {
+    struct chunk_s* chunk = &download->chunks[i];
+    chunk->download = download;
+    chunk->begin = i * chunk_size;
+    chunk->length = download->size - chunk->begin < chunk_size ?
+    download->size - chunk->begin : chunk_size;
+  }
+
+  CURLM* multi = curl_multi_init();
+  int next = 0;
+  int active = 0;
+  int ret = 0;
+  while (!ret && (next < download->chunk_count || active)) {
+    while (active < download->connections && next < download->chunk_count) {
+      curl_multi_add_handle(multi, chunk_handle(&download->chunks[next++]));
+      active++;
+    }
+    int running;
+    curl_multi_perform(multi, &running);
+    CURLMsg* message;
+    int queued;
+    while (!ret && (message = curl_multi_info_read(multi, &queued))) {
+      if (CURLMSG_DONE != message->msg) {
+        continue;
+      }
+      struct chunk_s* chunk;
+      long status = 0;
+      CURLcode result = message->data.result;
+      curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &chunk);
+      curl_easy_getinfo(message->easy_handle, CURLINFO_RESPONSE_CODE,
+                        &status);
+      curl_multi_remove_handle(multi, chunk->curl);
+      curl_easy_cleanup(chunk->curl);
+      chunk->curl = NULL;
+      active--;
+      if (CURLE_OK == result && 206 == status &&
+          chunk->received == chunk->length)
+      {
+        continue;
+      }
+      if (++chunk->attempts < max_attempts &&
+          (!status || 206 == status || status >= 500))
+      {
+        printf("download: retrying bytes %lld-%lld of %s: %s (status %ld)\n",
+               (long long)(chunk->begin + chunk->received),
+               (long long)(chunk->begin + chunk->length - 1), download->url,
+               curl_easy_strerror(result), status);
+        download->retries++;
+        curl_multi_add_handle(multi, chunk_handle(chunk));
+        active++;
+      } else {
+        printf("download: giving up on bytes %lld-%lld of %s: %s "
+               "(status %ld)\n", (long long)chunk->begin,
+               (long long)(chunk->begin + chunk->length - 1), download->url,
+               curl_easy_strerror(result), status);
+        ret = -1;
+      }
+    }
+    if (!ret && active) {
+      curl_multi_wait(multi, NULL, 0, 1000, NULL);
+    }
+  }
+  for (int i = 0; i < download->chunk_count; i++) {
+    if (download->chunks[i].curl) {
+      curl_multi_remove_handle(multi, download->chunks[i].curl);
+      curl_easy_cleanup(download->chunks[i].curl);
+    }
+  }
+  curl_multi_cleanup(multi);
+  return ret;
+}
 
-  /* init the curl session */
-  curl_handle = curl_easy_init();
+static void run_download(void* p) {
+  struct download_s* download = (struct download_s*)p;
+  uint64_t start = uv_hrtime();
+  int ret = probe(download);
+  if (!ret && download->ranged) {
+    ret = fetch_chunks(download);
+  }
+  struct stat file_stat;
+  if (!ret && (fstat(download->fd, &file_stat) ||
+               file_stat.st_size != download->size))
+  {
+    printf("download: %s is %lld bytes, expected %lld\n", download->url,
+           (long long)file_stat.st_size, (long long)download->size);
+    ret = -1;
+  }
+  if (!ret) {
+    double seconds = (uv_hrtime() - start) / 1e9;
+    printf("downloaded %lld bytes in %.1fs (%.1f MB/s, %d connections, "
+           "%d retries)\n", (long long)download->size, seconds,
+           download->size / 1e6 / (seconds > 0 ? seconds : 1e-9),
+           download->ranged ? download->connections : 1, download->retries);
+  }
+  download->ret = ret;
+}
 
-  /* example.com is redirected, so we tell libcurl to follow redirection */
-  curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1L);
+#pragma mark - Probes
 
-  /* set URL to get here */
-  curl_easy_setopt(curl_handle, CURLOPT_URL, url);
+struct probe_s {
+  char* etag;
+  size_t etag_size;
+  int64_t size;
+};
 
-  /* Switch on full protocol/debug output while testing */
-  curl_easy_setopt(curl_handle, CURLOPT_VERBOSE, 1L);
+static size_t discard_body(void* ptr, size_t size, size_t nmemb, void* p) {
+  // stop a server that ignored the range from sending the whole file
+  return 0;
+}
 
-  /* disable progress meter, set to 0L to enable and disable debug output */
-  curl_easy_setopt(curl_handle, CURLOPT_NOPROGRESS, 1L);
+static size_t read_probe_header(char* buffer, size_t size, size_t nitems,
+                                void* p)
+{
+  struct probe_s* probe = (struct probe_s*)p;
+  size_t bytes = size * nitems;
+  int64_t total = parse_content_range_total(buffer, bytes);
+  char line[256];
+  if (total >= 0) {
+    probe->size = total;
+  } else if (bytes < sizeof(line)) {
+    memcpy(line, buffer, bytes);
+    line[bytes] = '\0';
+    line[strcspn(line, "\r\n")] = '\0';
+    if (!strncasecmp(line, "etag:", 5)) {
+      const char* value = line + 5 + strspn(line + 5, " \t");
+      snprintf(probe->etag, probe->etag_size, "%s", value);
+    } else if (probe->size < 0 && !strncasecmp(line, "content-length:", 15))
+    {
+      // only a 200 means it's the length of the whole file; a 206 sends
+      // Content-Range too, which replaces it
+      probe->size = strtoll(line + 15, NULL, 10);
+    }
+  }
+  return bytes;
+}
 
-  /* send all data to this function  */
-  curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_data);
+int curler_probe(const char* url, char* etag_out, size_t etag_size,
+                 int64_t* size_out)
+{
+  curler_global_init();
+  struct probe_s probe = { etag_out, etag_size, -1 };
+  etag_out[0] = '\0';
+  CURL* curl = curl_easy_init();
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_RANGE, "0-0");
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_body);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, read_probe_header);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, &probe);
+  CURLcode result = curl_easy_perform(curl);
+  long status = 0;
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+  curl_easy_cleanup(curl);
+  // the body is always refused, so a write error is expected
+  if ((CURLE_OK != result && CURLE_WRITE_ERROR != result) ||
+      (200 != status && 206 != status))
+  {
+    printf("probe of %s failed: %s (status %ld)\n", url,
+           curl_easy_strerror(result), status);
+    return -1;
+  }
+  *size_out = probe.size;
+  return 0;
+}
 
-  /* write the page body to this file handle */
-  curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, out_file);
+#pragma mark - Downloads
 
-  /* get it! */
-  curl_easy_perform(curl_handle);
+int download_start(struct download_s** download_out, const char* url,
+                   const char* path, int connections)
+{
+  curler_global_init();
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+  struct download_s* download = (struct download_s*)
+  calloc(1, sizeof(struct download_s));
+  download->url = strdup(url);
+  download->fd = fd;
+  download->size = -1;
+  download->connections = connections < 1 ? 1 :
+  connections > CURLER_MAX_CONNECTIONS ? CURLER_MAX_CONNECTIONS : connections;
+  uv_thread_create(&download->thread, run_download, download);
+  *download_out = download;
+  return 0;
+}
 
-  /* close the header file */
-  fclose(out_file);
+int download_wait(struct download_s* download) {
+  uv_thread_join(&download->thread);
+  return download->ret;
+}
 
-  /* cleanup curl stuff */
-  curl_easy_cleanup(curl_handle);
+void download_free(struct download_s* download) {
+  close(download->fd);
+  free(download->chunks);
+  free(download->url);
+  free(download);
+}
 
+#define OUT_PATH_TEMPLATE "/tmp/barc-XXXXXX"
+char* get_http(const char* url)
+{
+  char* out_path = strdup(OUT_PATH_TEMPLATE);
+  int out_fd = mkstemp(out_path);
+  if (out_fd < 0) {
+    perror("mkstemp");
+    free(out_path);
+    return NULL;
+  }
+  close(out_fd);
+  struct download_s* download;
+  int ret = download_start(&download, url, out_path, CURLER_DEFAULT_CONNECTIONS);
+  if (!ret) {
+    ret = download_wait(download);
+    download_free(download);
+  }
+  if (ret) {
+    unlink(out_path);
+    free(out_path);
+    return NULL;
+  }
   return out_path;
 }
@@ -9,8 +9,51 @@
 #ifndef curler_h
 #define curler_h
 
-/** @return fd of downloaded file
+#include <stddef.h>
+#include <stdint.h>
+
+#define CURLER_DEFAULT_CONNECTIONS 4
+#define CURLER_MAX_CONNECTIONS 16
+
+/**
+ * Download url to a new temporary file, over several connections when the
+ * server takes range requests.
+ * @return path of the downloaded file (free with free()), or NULL
  */
 char* get_http(const char* url);
 
+/**
+ * A download running on its own thread. The file is cut into fixed size
+ * chunks, fetched in order by up to connections concurrent range requests
+ * and written in place with pwrite. A chunk that fails resumes from its last
+ * byte received, a few times over. Servers without ranges get a single
+ * request.
+ */
+struct download_s;
+
+int download_start(struct download_s** download_out, const char* url,
+                   const char* path, int connections);
+/** @return 0 once the whole file is written and has the expected size. */
+int download_wait(struct download_s* download);
+/** Call after download_wait. */
+void download_free(struct download_s* download);
+
+/**
+ * Ask for the first byte of url to learn its size and ETag, without taking
+ * the body. etag_out is left empty when the server sends none.
+ * @return 0 if the server answered 200 or 206
+ */
+int curler_probe(const char* url, char* etag_out, size_t etag_size,
+                 int64_t* size_out);
+
+/**
+ * For header callbacks: size bytes of one header line, not terminated.
+ * @return the file size from a Content-Range line ("bytes 0-0/1234"), or -1
+ * for any other line, or when the size is given as unknown (an asterisk)
+ */
+int64_t parse_content_range_total(const char* header, size_t size);
+
+/** curl_global_init, once per process. Safe to call from any thread. */
+void curler_global_init();
+
 #endif /* curler_h */
@@ -13,6 +13,10 @@ extern "C" {
 #include <libavutil/audio_fifo.h>
 
 #include "file_audio_source.h"
+#include "log.h"
+#include "perf_stats.h"
+#include "trace.h"
+#include "zip_io.h"
 }
 
 #include <deque>
@@ -39,6 +43,7 @@ struct file_audio_source_s {
   double sample_head_time;
 
   const char* file_path;
+  struct zip_io_s* zip;
 };
 
 void file_audio_source_alloc(struct file_audio_source_s** source_out) {
@@ -60,7 +65,7 @@ void file_audio_source_free(struct file_audio_source_s* pthis) {
   av_audio_fifo_free(pthis->audio_sample_fifo);
 
   avcodec_close(pthis->codec_context);
-  avformat_close_input(&pthis->format_context);
+  zip_io_close_input(&pthis->format_context);
   free(pthis);
 }
 
@@ -68,6 +73,7 @@ int file_audio_source_load_config(struct file_audio_source_s* pthis,
                                   struct file_audio_config_s* config)
 {
   pthis->file_path = config->file_path;
+  pthis->zip = config->zip;
   open_file_stream(pthis);
   return 0;
 }
@@ -90,7 +96,12 @@ int file_audio_source_seek(struct file_audio_source_s* pthis, double to_time)
   // every packet from the file!
   while (!ret && pthis->sample_head_time < to_time) {
     ret = av_read_frame(pthis->format_context, &pkt);
-    pthis->sample_head_time = (double)pkt.pts / format_time_base.den;
+    // this packet is discarded, so the next sample comes from its end
+    if (!ret && pkt.stream_index == pthis->stream_index) {
+      pthis->sample_head_time =
+      (double)(pkt.pts + pkt.duration) * format_time_base.num /
+      format_time_base.den;
+    }
     av_packet_unref(&pkt);
   }
   return ret;
@@ -124,8 +135,8 @@ double file_audio_source_get_sample_rate(struct file_audio_source_s* pthis) {
 static int open_file_stream(struct file_audio_source_s* pthis)
 {
   int ret;
-  ret = avformat_open_input(&pthis->format_context, pthis->file_path,
-                            NULL, NULL);
+  ret = zip_io_open_input(pthis->zip, pthis->file_path,
+                          &pthis->format_context);
   if (ret < 0)
   {
     av_log(NULL, AV_LOG_ERROR, "Cannot open input file\n");
@@ -202,7 +213,9 @@ static int read_audio_frame(struct file_audio_source_s* pthis)
 
   /* pump packet reader until fifo is populated, or file ends */
   while (pthis->audio_frame_fifo.empty()) {
+    uint64_t start = perf_stats_start();
     ret = av_read_frame(pthis->format_context, &packet);
+    perf_stats_end(perf_demux, start);
     if (ret < 0) {
       return ret;
     }
@@ -210,8 +223,12 @@ static int read_audio_frame(struct file_audio_source_s* pthis)
     AVFrame* frame = av_frame_alloc();
     got_frame = 0;
     if (packet.stream_index == pthis->stream_index) {
+      start = perf_stats_start();
+      uint64_t trace_start = trace_begin();
       ret = avcodec_decode_audio4(pthis->codec_context, frame,
                                   &got_frame, &packet);
+      perf_stats_end(perf_decode, start);
+      trace_end("decode audio", trace_start, "pts", packet.pts);
       if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR, "Error decoding audio: %s\n",
                av_err2str(ret));
@@ -281,14 +298,16 @@ static void check_frame_sync(struct file_audio_source_s* pthis,
   if (desync_time > FRAME_SYNC_THRESHOLD) {
     double silence_needed = current_frame_time - (pthis->sample_head_time +
                                           sample_fifo_duration);
-    printf("lipsync: inject silence for %.02f\n", silence_needed);
+    log_debug(log_module_source, "lipsync: inject silence for %.02f",
+              silence_needed);
     AVFrame* silence = generate_silence(pthis, silence_needed);
     av_audio_fifo_write(pthis->audio_sample_fifo,
                         (void**)silence->data, silence->nb_samples);
     av_frame_unref(silence);
   } else if (fabs(desync_time) > FRAME_SYNC_THRESHOLD) {
     // audio frames are growing away from sample_head_time. readjust.
-    printf("lipsync: frame time is off by %.02f\n", desync_time);
+    log_debug(log_module_source, "lipsync: frame time is off by %.02f",
+              desync_time);
     pthis->sample_head_time = current_frame_time - sample_fifo_duration;
   }
 }
@@ -10,8 +10,12 @@
 
 struct file_audio_source_s;
 
+struct zip_io_s;
+
 struct file_audio_config_s {
   const char* file_path;
+  // when set, file_path names an entry of this zip (see zip_io.h)
+  struct zip_io_s* zip;
 };
 
 void file_audio_source_alloc(struct file_audio_source_s** source_out);
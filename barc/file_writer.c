@@ -7,46 +7,189 @@
 
 #include "file_writer.h"
 #include <stdlib.h>
+#include <string.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavfilter/avfiltergraph.h>
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
 #include <libavutil/opt.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/audio_fifo.h>
 #include <libswresample/swresample.h>
 #include <assert.h>
+#include "log.h"
+#include "perf_stats.h"
+#include "spsc_queue.h"
+#include "trace.h"
+#include "smart_avframe.h"
 
 const int out_pix_format = AV_PIX_FMT_YUV420P;
 const int out_audio_format = AV_SAMPLE_FMT_FLTP;
 const int src_audio_format = AV_SAMPLE_FMT_S16;
 const int out_audio_num_channels = 1;
 
+/* Filter graphs are only built once a frame arrives that the encoder can't
+ * take as-is. The audio graph only converts; a video graph that does more
+ * than "null" (scaling, overlays) is always used. */
 const char *video_filter_descr = "null";
-const char *audio_filter_descr = "aresample=48000,aformat=sample_fmts=s16:channel_layouts=mono";
+const char *audio_filter_descr = "aresample=48000";
 
 const AVRational global_time_base = { 1, 1000 };
 const int64_t out_video_fps = 30;
 const int64_t out_sample_rate = 48000;
 
+// raw frames waiting on an encoder. video frames are big, so keep that
+// queue short; it only needs to absorb jitter between compose and encode.
+const size_t video_frame_queue_size = 8;
+const size_t video_frame_queue_bytes = 32 * 1024 * 1024;
+const size_t audio_frame_queue_size = 64;
+const size_t packet_queue_size = 128;
+
+// fragments and segments are cut on keyframes, so this also sets the GOP
+const double default_segment_duration = 4;
+
+// write buffer for callback sinks
+const int output_callback_buffer_size = 64 * 1024;
+
+// 64-bit FNV-1a, for the hash sink
+static const uint64_t fnv_offset_basis = 14695981039346656037ULL;
+static const uint64_t fnv_prime = 1099511628211ULL;
+
 static int init_audio_filters(struct file_writer_t* file_writer,
-                              const char *filters_descr);
+                              const char *filters_descr,
+                              const AVFrame* frame);
 static int init_video_filters(struct file_writer_t* file_writer,
                               const char *filters_descr,
-                              int out_width, int out_height);
+                              const AVFrame* frame);
 static int open_output_file(struct file_writer_t* file_writer,
                             const char* filename);
+static void free_output(struct file_writer_t* file_writer);
+static void start_workers(struct file_writer_t* file_writer);
 
 int file_writer_alloc(struct file_writer_t** writer) {
     struct file_writer_t* result =
     (struct file_writer_t*) calloc(1, sizeof(struct file_writer_t));
-    uv_mutex_init(&result->write_lock);
+    spsc_queue_alloc(&result->video_frame_queue, video_frame_queue_size);
+    spsc_queue_set_max_bytes(result->video_frame_queue,
+                             video_frame_queue_bytes);
+    spsc_queue_alloc(&result->audio_frame_queue, audio_frame_queue_size);
+    spsc_queue_alloc(&result->video_packet_queue, packet_queue_size);
+    spsc_queue_alloc(&result->audio_packet_queue, packet_queue_size);
+    uv_sem_init(&result->mux_wakeup, 0);
+    result->segment_duration = default_segment_duration;
     *writer = result;
     return 0;
 }
 
+void file_writer_set_output_format(struct file_writer_t* writer,
+                                   enum file_writer_format format,
+                                   double segment_duration)
+{
+    writer->output_format = format;
+    writer->segment_duration = segment_duration > 0 ?
+    segment_duration : default_segment_duration;
+}
+
+int file_writer_follow_audio(struct file_writer_t* leader,
+                             struct file_writer_t* follower)
+{
+    if (leader->audio_follower_count >= FILE_WRITER_MAX_AUDIO_FOLLOWERS ||
+        follower->audio_leader || leader->audio_leader)
+    {
+        return -1;
+    }
+    leader->audio_followers[leader->audio_follower_count++] = follower;
+    follower->audio_leader = leader;
+    return 0;
+}
+
+int file_writer_parse_format(const char* name,
+                             enum file_writer_format* format_out)
+{
+    if (!name || !strcmp(name, "mp4")) {
+        *format_out = file_writer_format_auto;
+    } else if (!strcmp(name, "fmp4")) {
+        *format_out = file_writer_format_fmp4;
+    } else if (!strcmp(name, "hls")) {
+        *format_out = file_writer_format_hls;
+    } else if (!strcmp(name, "dash")) {
+        *format_out = file_writer_format_dash;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+void file_writer_set_sink(struct file_writer_t* writer,
+                          enum file_writer_sink sink)
+{
+    writer->sink = sink;
+    writer->video_hash = fnv_offset_basis;
+    writer->audio_hash = fnv_offset_basis;
+}
+
+int file_writer_parse_sink(const char* name, enum file_writer_sink* sink_out)
+{
+    if (!name || !strcmp(name, "encode")) {
+        *sink_out = file_writer_sink_encode;
+    } else if (!strcmp(name, "null")) {
+        *sink_out = file_writer_sink_null;
+    } else if (!strcmp(name, "hash")) {
+        *sink_out = file_writer_sink_hash;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int file_writer_set_queue_limits(struct file_writer_t* writer,
+                                 const struct file_writer_queue_limits_s* limits)
+{
+    struct spsc_queue_s* video_queue = NULL;
+    struct spsc_queue_s* audio_queue = NULL;
+    size_t video_frames = limits->video_frames ?
+    limits->video_frames : video_frame_queue_size;
+    size_t video_bytes = limits->video_bytes ?
+    limits->video_bytes : video_frame_queue_bytes;
+    size_t audio_frames = limits->audio_frames ?
+    limits->audio_frames : audio_frame_queue_size;
+    if (spsc_queue_alloc(&video_queue, video_frames)) {
+        return -1;
+    }
+    if (spsc_queue_alloc(&audio_queue, audio_frames)) {
+        spsc_queue_free(video_queue);
+        return -1;
+    }
+    spsc_queue_set_max_bytes(video_queue, video_bytes);
+    spsc_queue_free(writer->video_frame_queue);
+    spsc_queue_free(writer->audio_frame_queue);
+    writer->video_frame_queue = video_queue;
+    writer->audio_frame_queue = audio_queue;
+    return 0;
+}
+
+void file_writer_set_output_callback(struct file_writer_t* writer,
+                                     file_writer_output_cb_t callback,
+                                     void* opaque)
+{
+    writer->output_cb = callback;
+    writer->output_opaque = opaque;
+}
+
+int file_writer_is_stream_output(const char* filename)
+{
+    return filename &&
+    (!strcmp(filename, "-") || !strncmp(filename, "pipe:", 5));
+}
+
 void file_writer_free(struct file_writer_t* writer) {
-    uv_mutex_destroy(&writer->write_lock);
+    spsc_queue_free(writer->video_frame_queue);
+    spsc_queue_free(writer->audio_frame_queue);
+    spsc_queue_free(writer->video_packet_queue);
+    spsc_queue_free(writer->audio_packet_queue);
+    uv_sem_destroy(&writer->mux_wakeup);
     free(writer);
 }
 
@@ -58,28 +201,22 @@ int file_writer_open(struct file_writer_t* file_writer,
     file_writer->out_height = out_height;
     file_writer->out_width = out_width;
 
-    open_output_file(file_writer, filename);
-
-    ret = init_audio_filters(file_writer, audio_filter_descr);
-    if (ret < 0)
-    {
-        printf("Error: init audio filters\n");
+    ret = open_output_file(file_writer, filename);
+    if (ret < 0) {
         return ret;
     }
 
-    ret = init_video_filters(file_writer, video_filter_descr,
-                             out_width, out_height);
-    if (ret < 0)
-    {
-        printf("Error: init video filters\n");
-    }
+    // filter graphs are set up by the encode threads, if at all
+    start_workers(file_writer);
+    file_writer->workers_started = 1;
 
     return ret;
 }
 
 
 static int init_audio_filters(struct file_writer_t* file_writer,
-                              const char *filters_descr)
+                              const char *filters_descr,
+                              const AVFrame* frame)
 {
     char args[512];
     int ret = 0;
@@ -101,17 +238,17 @@ static int init_audio_filters(struct file_writer_t* file_writer,
         goto end;
     }
 
-    /* buffer audio source: the decoded frames from the decoder will be inserted here. */
-    if (!file_writer->audio_ctx_out->channel_layout) {
-        file_writer->audio_ctx_out->channel_layout =
-        av_get_default_channel_layout(file_writer->audio_ctx_out->channels);
+    /* buffer audio source: described by the first frame that needed it. */
+    uint64_t in_channel_layout = frame->channel_layout;
+    if (!in_channel_layout) {
+        in_channel_layout = av_get_default_channel_layout(frame->channels);
     }
     snprintf(args, sizeof(args),
              "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=0x%"PRIx64,
              time_base.num, time_base.den,
-             file_writer->audio_ctx_out->sample_rate,
-             av_get_sample_fmt_name(file_writer->audio_ctx_out->sample_fmt),
-             file_writer->audio_ctx_out->channel_layout);
+             frame->sample_rate,
+             av_get_sample_fmt_name(frame->format),
+             in_channel_layout);
     ret = avfilter_graph_create_filter(&file_writer->audio_buffersrc_ctx,
                                        abuffersrc, "in",
                                        args, NULL,
@@ -191,6 +328,14 @@ static int init_audio_filters(struct file_writer_t* file_writer,
                                      NULL)) < 0)
         goto end;
 
+    // hand the encoder exactly the frame size it asked for
+    if (!(file_writer->audio_codec_out->capabilities &
+          AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
+    {
+        av_buffersink_set_frame_size(file_writer->audio_buffersink_ctx,
+                                     file_writer->audio_ctx_out->frame_size);
+    }
+
     /* Print summary of the sink buffer
      * Note: args buffer is reused to store channel layout string */
     outlink = file_writer->audio_buffersink_ctx->inputs[0];
@@ -211,7 +356,7 @@ end:
 
 static int init_video_filters(struct file_writer_t* file_writer,
                               const char *filters_descr,
-                              int out_width, int out_height)
+                              const AVFrame* frame)
 {
     char args[512];
     int ret = 0;
@@ -221,7 +366,6 @@ static int init_video_filters(struct file_writer_t* file_writer,
     AVFilterInOut *inputs  = avfilter_inout_alloc();
     //AVRational time_base = dec_ctx->time_base;
     enum AVPixelFormat pix_fmts[] = { AV_PIX_FMT_YUV420P, AV_PIX_FMT_NONE };
-    AVRational out_aspect_ratio = { out_width , out_height };
 
     file_writer->video_filter_graph = avfilter_graph_alloc();
     if (!outputs || !inputs || !file_writer->video_filter_graph) {
@@ -229,15 +373,13 @@ static int init_video_filters(struct file_writer_t* file_writer,
         goto end;
     }
 
-    /* buffer video source */
+    /* buffer video source: described by the first frame that needed it. */
     snprintf(args, sizeof(args),
-             "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
-             out_width,
-             out_height,
-             out_pix_format,
-             global_time_base.num, global_time_base.den,
-             out_aspect_ratio.num,
-             out_aspect_ratio.den);
+             "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=1/1",
+             frame->width,
+             frame->height,
+             frame->format,
+             global_time_base.num, global_time_base.den);
 
     ret = avfilter_graph_create_filter(&file_writer->video_buffersrc_ctx,
                                        buffersrc, "in",
@@ -365,10 +507,67 @@ static int open_output_file(struct file_writer_t* file_writer,
 {
     AVDictionary *opt = NULL;
     int ret;
+    const char* format_name = NULL;
+    char segment_option[32];
+
+    if (file_writer_sink_encode != file_writer->sink) {
+        // frames never reach a muxer, so there is nothing to lay out
+        printf("%s sink: %s will not be written\n",
+               file_writer_sink_null == file_writer->sink ? "null" : "hash",
+               filename ? filename : "output callback");
+        format_name = "null";
+        file_writer->output_format = file_writer_format_auto;
+    } else if (file_writer->output_cb ||
+               file_writer_is_stream_output(filename))
+    {
+        if (!filename) {
+            filename = "output callback";
+        } else if (!strcmp(filename, "-")) {
+            filename = "pipe:1";
+        }
+        // nothing can be patched up after it's sent, so no moov at the end
+        if (file_writer_format_auto == file_writer->output_format) {
+            printf("streaming %s as fragmented mp4\n", filename);
+            file_writer->output_format = file_writer_format_fmp4;
+        } else if (file_writer_format_fmp4 != file_writer->output_format) {
+            printf("%s can't carry a playlist and segments. "
+                   "use mp4 or fmp4\n", filename);
+            return -1;
+        }
+    }
+
+    switch (file_writer->output_format) {
+        case file_writer_format_fmp4:
+            format_name = "mp4";
+            // an empty moov up front, then self-contained fragments: every
+            // completed fragment is playable without the trailer.
+            av_dict_set(&opt, "movflags",
+                        "frag_keyframe+empty_moov+default_base_moof", 0);
+            break;
+        case file_writer_format_hls:
+            format_name = "hls";
+            snprintf(segment_option, sizeof(segment_option), "%f",
+                     file_writer->segment_duration);
+            av_dict_set(&opt, "hls_time", segment_option, 0);
+            // keep every segment in the playlist, and let players follow
+            // along as it grows
+            av_dict_set(&opt, "hls_list_size", "0", 0);
+            av_dict_set(&opt, "hls_playlist_type", "event", 0);
+            break;
+        case file_writer_format_dash:
+            format_name = "dash";
+            snprintf(segment_option, sizeof(segment_option), "%"PRId64,
+                     (int64_t)(file_writer->segment_duration * 1000000));
+            av_dict_set(&opt, "min_seg_duration", segment_option, 0);
+            av_dict_set(&opt, "window_size", "0", 0);
+            break;
+        default:
+            break;
+    }
 
     /* allocate the output media context */
     avformat_alloc_output_context2(&file_writer->format_ctx_out,
-                                   NULL, NULL, filename);
+                                   NULL, format_name, filename);
     if (!file_writer->format_ctx_out) {
         printf("Could not deduce output format from file extension.\n");
         avformat_alloc_output_context2(&file_writer->format_ctx_out,
@@ -376,36 +575,67 @@ static int open_output_file(struct file_writer_t* file_writer,
     }
     // fall back to mpeg
     if (!file_writer->format_ctx_out) {
-        printf("Could not allocate format output context");
-        exit(1);
+        printf("Could not allocate format output context\n");
+        ret = AVERROR(ENOMEM);
+        goto fail;
     }
 
     av_dump_format(file_writer->format_ctx_out, 0, filename, 1);
 
     AVOutputFormat* fmt = file_writer->format_ctx_out->oformat;
+    // the null muxer asks for raw codecs. open the ones an mp4 would get,
+    // so audio frame sizes and encoder setup match a real render.
+    AVOutputFormat* codec_fmt = fmt;
+    if (file_writer_sink_encode != file_writer->sink) {
+        codec_fmt = av_guess_format("mp4", NULL, NULL);
+    }
 
     /* open the output file, if needed */
-    if (!(fmt->flags & AVFMT_NOFILE)) {
+    if (file_writer->output_cb &&
+        file_writer_sink_encode == file_writer->sink)
+    {
+        unsigned char* buffer = av_malloc(output_callback_buffer_size);
+        AVIOContext* pb = avio_alloc_context(buffer,
+                                             output_callback_buffer_size,
+                                             1, file_writer->output_opaque,
+                                             NULL, file_writer->output_cb,
+                                             NULL);
+        if (!buffer || !pb) {
+            printf("Could not allocate output callback context\n");
+            if (pb) {
+                av_freep(&pb->buffer);
+                av_freep(&pb);
+            } else {
+                av_free(buffer);
+            }
+            ret = AVERROR(ENOMEM);
+            goto fail;
+        }
+        file_writer->format_ctx_out->pb = pb;
+        file_writer->format_ctx_out->flags |= AVFMT_FLAG_CUSTOM_IO;
+    } else if (!(fmt->flags & AVFMT_NOFILE)) {
         ret = avio_open(&file_writer->format_ctx_out->pb,
                         filename, AVIO_FLAG_WRITE);
         if (ret < 0) {
             fprintf(stderr, "Could not open '%s': %s\n", filename,
                     av_err2str(ret));
-            exit(1);
+            goto fail;
         }
     }
 
     /* find the video encoder */
-    file_writer->video_codec_out = avcodec_find_encoder(fmt->video_codec);
+    file_writer->video_codec_out = avcodec_find_encoder(codec_fmt->video_codec);
     if (!file_writer->video_codec_out) {
         printf("Video codec not found\n");
-        exit(1);
+        ret = AVERROR_ENCODER_NOT_FOUND;
+        goto fail;
     }
 
-    file_writer->audio_codec_out = avcodec_find_encoder(fmt->audio_codec);
+    file_writer->audio_codec_out = avcodec_find_encoder(codec_fmt->audio_codec);
     if (!file_writer->audio_codec_out) {
         printf("Audio codec not found\n");
-        exit(1);
+        ret = AVERROR_ENCODER_NOT_FOUND;
+        goto fail;
     }
 
     file_writer->video_stream =
@@ -418,12 +648,14 @@ static int open_output_file(struct file_writer_t* file_writer,
     file_writer->video_ctx_out = file_writer->video_stream->codec;
     if (!file_writer->video_ctx_out) {
         printf("Could not allocate video codec context\n");
-        exit(1);
+        ret = AVERROR(ENOMEM);
+        goto fail;
     }
     file_writer->audio_ctx_out = file_writer->audio_stream->codec;
     if (!file_writer->audio_ctx_out) {
         printf("Could not allocate audio codec context\n");
-        exit(1);
+        ret = AVERROR(ENOMEM);
+        goto fail;
     }
 
     file_writer->audio_stream->time_base.num = 1;
@@ -445,9 +677,25 @@ static int open_output_file(struct file_writer_t* file_writer,
     file_writer->video_ctx_out->time_base = global_time_base;
     //video_ctx_out->max_b_frames = 1;
 
-    if (fmt->video_codec == AV_CODEC_ID_H264) {
+    if (file_writer_format_auto != file_writer->output_format) {
+        // fragments and segments can only start on a keyframe. force one at
+        // every boundary so they come out the length we asked for.
+        int gop_size = (int)(file_writer->segment_duration * out_video_fps);
+        file_writer->video_ctx_out->gop_size = gop_size;
+        file_writer->video_ctx_out->keyint_min = gop_size;
+        file_writer->video_stream->avg_frame_rate =
+        (AVRational){ out_video_fps, 1 };
+        // hand finished fragments to the OS as soon as they are muxed
+        file_writer->format_ctx_out->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+    }
+
+    if (codec_fmt->video_codec == AV_CODEC_ID_H264) {
         av_opt_set(file_writer->video_ctx_out->priv_data,
                    "preset", "fast", 0);
+        // a forced keyframe is an IDR, so the first frame starts a closed
+        // GOP. the stitcher relies on that to join outputs without decoding.
+        av_opt_set(file_writer->video_ctx_out->priv_data,
+                   "forced-idr", "1", 0);
     }
 
     /* Some formats want stream headers to be separate. */
@@ -457,17 +705,19 @@ static int open_output_file(struct file_writer_t* file_writer,
     }
 
     /* open the context */
-    if (avcodec_open2(file_writer->video_ctx_out,
-                      file_writer->video_codec_out, NULL) < 0) {
+    ret = avcodec_open2(file_writer->video_ctx_out,
+                        file_writer->video_codec_out, NULL);
+    if (ret < 0) {
         printf("Could not open video codec\n");
-        exit(1);
+        goto fail;
     }
 
     /* open the context */
-    if (avcodec_open2(file_writer->audio_ctx_out,
-                      file_writer->audio_codec_out, NULL) < 0) {
+    ret = avcodec_open2(file_writer->audio_ctx_out,
+                        file_writer->audio_codec_out, NULL);
+    if (ret < 0) {
         printf("Could not open audio codec\n");
-        exit(1);
+        goto fail;
     }
 
     /* Write the stream header, if any. */
@@ -475,21 +725,31 @@ static int open_output_file(struct file_writer_t* file_writer,
     if (ret < 0) {
         fprintf(stderr, "Error occurred when opening output file: %s\n",
                 av_err2str(ret));
-        exit(1);
+        goto fail;
     }
+    av_dict_free(&opt);
 
     printf("Ready to encode video file %s\n", filename);
 
     return 0;
+
+    // the process may be rendering other jobs, so a bad output only fails
+    // this one
+fail:
+    av_dict_free(&opt);
+    free_output(file_writer);
+    return ret < 0 ? ret : -1;
 }
 
-static int safe_write_packet(struct file_writer_t* file_writer,
-                             AVPacket* packet)
+// hands an encoded packet off to the mux thread
+static void enqueue_packet(struct file_writer_t* file_writer,
+                           struct spsc_queue_s* queue,
+                           AVPacket* pkt)
 {
-    uv_mutex_lock(&file_writer->write_lock);
-    int ret = av_interleaved_write_frame(file_writer->format_ctx_out, packet);
-    uv_mutex_unlock(&file_writer->write_lock);
-    return ret;
+    AVPacket* packet = av_packet_alloc();
+    av_packet_move_ref(packet, pkt);
+    spsc_queue_push(queue, packet);
+    uv_sem_post(&file_writer->mux_wakeup);
 }
 
 static int write_audio_frame(struct file_writer_t* file_writer,
@@ -500,37 +760,41 @@ static int write_audio_frame(struct file_writer_t* file_writer,
     av_init_packet(&pkt);
 
     /* encode the frame */
+    uint64_t start = perf_stats_start();
+    uint64_t trace_start = trace_begin();
     ret = avcodec_encode_audio2(file_writer->audio_ctx_out,
                                 &pkt, frame, &got_packet);
+    perf_stats_end(perf_encode, start);
+    trace_end("encode audio", trace_start, "pts", frame ? frame->pts : -1);
     if (ret < 0) {
         fprintf(stderr, "Error encoding audio frame: %s\n", av_err2str(ret));
         return 1;
     }
 
     if (got_packet) {
+        // followers get their own reference before ours moves to the muxer
+        for (int i = 0; i < file_writer->audio_follower_count; i++) {
+            struct file_writer_t* follower = file_writer->audio_followers[i];
+            AVPacket copy = { 0 };
+            av_packet_ref(&copy, &pkt);
+            av_packet_rescale_ts(&copy, file_writer->audio_ctx_out->time_base,
+                                 follower->audio_stream->time_base);
+            copy.stream_index = follower->audio_stream->index;
+            enqueue_packet(follower, follower->audio_packet_queue, &copy);
+        }
         /* rescale output packet timestamp values from codec to stream timebase */
         av_packet_rescale_ts(&pkt, file_writer->audio_ctx_out->time_base,
                              file_writer->audio_stream->time_base);
         pkt.stream_index = file_writer->audio_stream->index;
-
-        /* Write the compressed frame to the media file. */
-        printf("Write audio frame %lld, size=%d pts=%lld duration=%lld\n",
-               file_writer->audio_frame_ct, pkt.size, pkt.pts, pkt.duration);
-        file_writer->audio_frame_ct++;
-        ret = safe_write_packet(file_writer, &pkt);
-        if (ret) {
-            printf("tilt");
-        }
-    } else {
-        ret = 0;
+        enqueue_packet(file_writer, file_writer->audio_packet_queue, &pkt);
     }
-    av_free_packet(&pkt);
-    return ret;
+    av_packet_unref(&pkt);
+    return got_packet ? 0 : AVERROR(EAGAIN);
 }
 
 // inserts audio frame into filtergraph
-int file_writer_push_audio_frame(struct file_writer_t* file_writer,
-                                 AVFrame* frame)
+static int filter_audio_frame(struct file_writer_t* file_writer,
+                              AVFrame* frame)
 {
     int ret;
     AVFrame *filt_frame = av_frame_alloc();
@@ -548,6 +812,9 @@ int file_writer_push_audio_frame(struct file_writer_t* file_writer,
             break;
         }
         ret = write_audio_frame(file_writer, filt_frame);
+        if (AVERROR(EAGAIN) == ret) {
+            ret = 0;
+        }
         av_frame_unref(filt_frame);
     }
     av_frame_free(&filt_frame);
@@ -562,11 +829,16 @@ static int write_video_frame(struct file_writer_t* file_writer,
     av_init_packet(&pkt);
 
     /* encode the image */
+    uint64_t start = perf_stats_start();
+    uint64_t trace_start = trace_begin();
     ret = avcodec_encode_video2(file_writer->video_ctx_out,
                                 &pkt, frame, &got_packet);
+    perf_stats_end(perf_encode, start);
+    trace_end("encode video", trace_start, "pts", frame ? frame->pts : -1);
     if (ret < 0) {
         fprintf(stderr, "Error encoding video frame: %s\n", av_err2str(ret));
-        exit(1);
+        av_packet_unref(&pkt);
+        return ret;
     }
 
     if (got_packet) {
@@ -576,48 +848,19 @@ static int write_video_frame(struct file_writer_t* file_writer,
         av_packet_rescale_ts(&pkt, global_time_base,
                              file_writer->video_stream->time_base);
         pkt.stream_index = file_writer->video_stream->index;
-
-        /* Write the compressed frame to the media file. */
-        printf("Write video frame %lld, size=%d pts=%lld\n",
-               file_writer->video_frame_ct, pkt.size, pkt.pts);
-        file_writer->video_frame_ct++;
-        ret = safe_write_packet(file_writer, &pkt);
-        if (ret) {
-            printf("tilt");
-        }
-
-    } else {
-        ret = 0;
+        enqueue_packet(file_writer, file_writer->video_packet_queue, &pkt);
     }
 
-    av_free_packet(&pkt);
-
-    return ret;
-}
+    av_packet_unref(&pkt);
 
-int file_writer_close(struct file_writer_t* file_writer)
-{
-    int ret = av_write_trailer(file_writer->format_ctx_out);
-    if (ret) {
-        printf("no trailer!\n");
-    }
-    avcodec_close(file_writer->video_ctx_out);
-    
-    if (!(file_writer->format_ctx_out->oformat->flags & AVFMT_NOFILE)) {
-        avio_closep(&file_writer->format_ctx_out->pb);
-    }
-    
-    avformat_free_context(file_writer->format_ctx_out);
-    
-    printf("File write done!\n");
-    return 0;
+    return got_packet ? 0 : AVERROR(EAGAIN);
 }
 
-int file_writer_push_video_frame(struct file_writer_t* file_writer,
-                                 AVFrame* frame)
+static int filter_video_frame(struct file_writer_t* file_writer,
+                              AVFrame* frame)
 {
     int ret = av_buffersrc_add_frame_flags(file_writer->video_buffersrc_ctx,
-                                           frame, AV_BUFFERSRC_FLAG_KEEP_REF);
+                                           frame, 0);
     AVFrame *filt_frame = av_frame_alloc();
 
     /* push the output frame into the filtergraph */
@@ -647,3 +890,378 @@ end:
 
     return ret;
 }
+
+// a frame that already matches the encoder can skip the graph entirely
+static char video_frame_needs_filter(struct file_writer_t* file_writer,
+                                     const AVFrame* frame)
+{
+    AVCodecContext* ctx = file_writer->video_ctx_out;
+    return strcmp(video_filter_descr, "null") ||
+    frame->width != ctx->width ||
+    frame->height != ctx->height ||
+    frame->format != ctx->pix_fmt;
+}
+
+static char audio_frame_needs_filter(struct file_writer_t* file_writer,
+                                     const AVFrame* frame)
+{
+    AVCodecContext* ctx = file_writer->audio_ctx_out;
+    char fixed_frame_size = !(file_writer->audio_codec_out->capabilities &
+                              AV_CODEC_CAP_VARIABLE_FRAME_SIZE);
+    return frame->format != ctx->sample_fmt ||
+    frame->sample_rate != ctx->sample_rate ||
+    av_frame_get_channels(frame) != ctx->channels ||
+    (fixed_frame_size && frame->nb_samples != ctx->frame_size);
+}
+
+#pragma mark - Null and hash sinks
+
+static uint64_t fnv1a(uint64_t hash, const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= fnv_prime;
+    }
+    return hash;
+}
+
+// only the visible part of each row counts; padding is left uninitialized
+static uint64_t hash_video_frame(uint64_t hash, const AVFrame* frame) {
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(frame->format);
+    int planes = av_pix_fmt_count_planes(frame->format);
+    for (int plane = 0; plane < planes; plane++) {
+        int row_bytes = av_image_get_linesize(frame->format, frame->width,
+                                              plane);
+        int rows = frame->height;
+        if (1 == plane || 2 == plane) {
+            rows = AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h);
+        }
+        for (int y = 0; y < rows; y++) {
+            hash = fnv1a(hash, frame->data[plane] + y * frame->linesize[plane],
+                         row_bytes);
+        }
+    }
+    return fnv1a(hash, (const uint8_t*)&frame->pts, sizeof(frame->pts));
+}
+
+static uint64_t hash_audio_frame(uint64_t hash, const AVFrame* frame) {
+    int planar = av_sample_fmt_is_planar(frame->format);
+    int planes = planar ? frame->channels : 1;
+    size_t plane_bytes = (size_t)frame->nb_samples *
+    av_get_bytes_per_sample(frame->format) * (planar ? 1 : frame->channels);
+    for (int plane = 0; plane < planes; plane++) {
+        hash = fnv1a(hash, frame->extended_data[plane], plane_bytes);
+    }
+    return fnv1a(hash, (const uint8_t*)&frame->pts, sizeof(frame->pts));
+}
+
+/* Stand-ins for the encoders. They run on the encode threads, so the mux
+ * thread only ever sees the end of stream markers and leaves the counters
+ * to us. */
+static int sink_video_frame(struct file_writer_t* file_writer,
+                            AVFrame* frame)
+{
+    if (!frame) {
+        return 0;
+    }
+    if (file_writer_sink_hash == file_writer->sink) {
+        file_writer->video_hash =
+        hash_video_frame(file_writer->video_hash, frame);
+    }
+    file_writer->video_frame_ct++;
+    return 0;
+}
+
+static int sink_audio_frame(struct file_writer_t* file_writer,
+                            AVFrame* frame)
+{
+    if (!frame) {
+        return 0;
+    }
+    if (file_writer_sink_hash == file_writer->sink) {
+        file_writer->audio_hash =
+        hash_audio_frame(file_writer->audio_hash, frame);
+    }
+    file_writer->audio_frame_ct++;
+    return 0;
+}
+
+#pragma mark - Encoding
+
+/* Send a frame (or NULL at the end of the stream) to the encoder, through
+ * the filter graph only if one is needed. Once a graph exists every later
+ * frame goes through it, so nothing it buffers gets reordered. */
+static int encode_video_frame(struct file_writer_t* file_writer,
+                              AVFrame* frame)
+{
+    int ret;
+    if (file_writer_sink_encode != file_writer->sink) {
+        return sink_video_frame(file_writer, frame);
+    }
+    if (!file_writer->video_filter_graph) {
+        if (!frame) {
+            return 0;
+        }
+        if (!video_frame_needs_filter(file_writer, frame)) {
+            ret = write_video_frame(file_writer, frame);
+            return AVERROR(EAGAIN) == ret ? 0 : ret;
+        }
+        ret = init_video_filters(file_writer, video_filter_descr, frame);
+        if (ret < 0) {
+            printf("Error: init video filters\n");
+            return ret;
+        }
+    }
+    return filter_video_frame(file_writer, frame);
+}
+
+static int encode_audio_frame(struct file_writer_t* file_writer,
+                              AVFrame* frame)
+{
+    int ret;
+    if (file_writer_sink_encode != file_writer->sink) {
+        return sink_audio_frame(file_writer, frame);
+    }
+    if (!file_writer->audio_filter_graph) {
+        if (!frame) {
+            return 0;
+        }
+        if (!audio_frame_needs_filter(file_writer, frame)) {
+            return write_audio_frame(file_writer, frame);
+        }
+        ret = init_audio_filters(file_writer, audio_filter_descr, frame);
+        if (ret < 0) {
+            printf("Error: init audio filters\n");
+            return ret;
+        }
+    }
+    return filter_audio_frame(file_writer, frame);
+}
+
+#pragma mark - Encode and mux threads
+
+// drain any frames the encoder is holding on to for lookahead
+static void flush_encoder(struct file_writer_t* file_writer,
+                          AVCodecContext* codec_context,
+                          int (*write_f)(struct file_writer_t*, AVFrame*))
+{
+    if (!(codec_context->codec->capabilities & AV_CODEC_CAP_DELAY) ||
+        file_writer_sink_encode != file_writer->sink)
+    {
+        return;
+    }
+    while (0 == write_f(file_writer, NULL));
+}
+
+static void video_encode_worker(void* p) {
+    struct file_writer_t* file_writer = (struct file_writer_t*)p;
+    AVFrame* frame;
+    char first_frame = 1;
+    trace_set_thread_name("video encode");
+    // a NULL frame marks the end of the stream
+    while ((frame = spsc_queue_pop(file_writer->video_frame_queue))) {
+        if (first_frame) {
+            frame->pict_type = AV_PICTURE_TYPE_I;
+            first_frame = 0;
+        }
+        int ret = encode_video_frame(file_writer, frame);
+        if (ret) {
+            __atomic_add_fetch(&file_writer->encode_errors, 1,
+                               __ATOMIC_RELAXED);
+            log_warn_limited(log_module_writer,
+                             "Unable to encode video frame %lld", frame->pts);
+        }
+        av_frame_free(&frame);
+    }
+    encode_video_frame(file_writer, NULL);
+    flush_encoder(file_writer, file_writer->video_ctx_out, write_video_frame);
+    spsc_queue_push(file_writer->video_packet_queue, NULL);
+    uv_sem_post(&file_writer->mux_wakeup);
+}
+
+static void audio_encode_worker(void* p) {
+    struct file_writer_t* file_writer = (struct file_writer_t*)p;
+    AVFrame* frame;
+    trace_set_thread_name("audio encode");
+    while ((frame = spsc_queue_pop(file_writer->audio_frame_queue))) {
+        int ret = encode_audio_frame(file_writer, frame);
+        if (ret && AVERROR(EAGAIN) != ret) {
+            __atomic_add_fetch(&file_writer->encode_errors, 1,
+                               __ATOMIC_RELAXED);
+            log_warn_limited(log_module_writer,
+                             "Unable to encode audio frame %lld", frame->pts);
+        }
+        av_frame_free(&frame);
+    }
+    encode_audio_frame(file_writer, NULL);
+    flush_encoder(file_writer, file_writer->audio_ctx_out, write_audio_frame);
+    spsc_queue_push(file_writer->audio_packet_queue, NULL);
+    uv_sem_post(&file_writer->mux_wakeup);
+    for (int i = 0; i < file_writer->audio_follower_count; i++) {
+        struct file_writer_t* follower = file_writer->audio_followers[i];
+        spsc_queue_push(follower->audio_packet_queue, NULL);
+        uv_sem_post(&follower->mux_wakeup);
+    }
+}
+
+static void mux_worker(void* p) {
+    struct file_writer_t* file_writer = (struct file_writer_t*)p;
+    char video_done = 0;
+    char audio_done = 0;
+    AVPacket* packet;
+    const char* trace_name;
+    int ret;
+    trace_set_thread_name("mux");
+    while (!video_done || !audio_done) {
+        // every post on the wakeup semaphore matches one queued packet
+        uv_sem_wait(&file_writer->mux_wakeup);
+        if (!spsc_queue_try_pop(file_writer->video_packet_queue,
+                                (void**)&packet))
+        {
+            if (!packet) {
+                video_done = 1;
+                continue;
+            }
+            log_debug(log_module_writer,
+                      "Write video frame %lld, size=%d pts=%lld",
+                      file_writer->video_frame_ct, packet->size, packet->pts);
+            file_writer->video_frame_ct++;
+            trace_name = "mux video";
+        } else if (!spsc_queue_try_pop(file_writer->audio_packet_queue,
+                                       (void**)&packet))
+        {
+            if (!packet) {
+                audio_done = 1;
+                continue;
+            }
+            log_debug(log_module_writer,
+                      "Write audio frame %lld, size=%d pts=%lld duration=%lld",
+                      file_writer->audio_frame_ct, packet->size, packet->pts,
+                      packet->duration);
+            file_writer->audio_frame_ct++;
+            trace_name = "mux audio";
+        } else {
+            continue;
+        }
+        uint64_t start = perf_stats_start();
+        uint64_t trace_start = trace_begin();
+        int64_t pts = packet->pts;
+        ret = av_interleaved_write_frame(file_writer->format_ctx_out, packet);
+        perf_stats_end(perf_mux, start);
+        trace_end(trace_name, trace_start, "pts", pts);
+        if (ret) {
+            log_warn_limited(log_module_writer,
+                             "unable to mux packet pts=%lld: %s",
+                             pts, av_err2str(ret));
+        }
+        av_packet_free(&packet);
+    }
+}
+
+static void start_workers(struct file_writer_t* file_writer) {
+    uv_thread_create(&file_writer->mux_thread, mux_worker, file_writer);
+    uv_thread_create(&file_writer->video_encode_thread,
+                     video_encode_worker, file_writer);
+    if (!file_writer->audio_leader) {
+        uv_thread_create(&file_writer->audio_encode_thread,
+                         audio_encode_worker, file_writer);
+    }
+}
+
+static void stop_workers(struct file_writer_t* file_writer) {
+    spsc_queue_push(file_writer->video_frame_queue, NULL);
+    uv_thread_join(&file_writer->video_encode_thread);
+    // a follower's audio ends when its leader's encoder drains
+    if (!file_writer->audio_leader) {
+        spsc_queue_push(file_writer->audio_frame_queue, NULL);
+        uv_thread_join(&file_writer->audio_encode_thread);
+    }
+    uv_thread_join(&file_writer->mux_thread);
+}
+
+int file_writer_close(struct file_writer_t* file_writer)
+{
+    // open failed (or never happened): no threads to join, nothing to finish
+    if (!file_writer->workers_started) {
+        return 0;
+    }
+    stop_workers(file_writer);
+    file_writer->workers_started = 0;
+
+    int ret = av_write_trailer(file_writer->format_ctx_out);
+    if (ret) {
+        printf("no trailer!\n");
+    }
+    // the workers are joined, so the count is final
+    if (file_writer->encode_errors) {
+        printf("%d frames could not be encoded\n", file_writer->encode_errors);
+        ret = -1;
+    }
+    free_output(file_writer);
+
+    if (file_writer_sink_hash == file_writer->sink) {
+        printf("video hash %016"PRIx64" (%"PRId64" frames)\n",
+               file_writer->video_hash, file_writer->video_frame_ct);
+        printf("audio hash %016"PRIx64" (%"PRId64" frames)\n",
+               file_writer->audio_hash, file_writer->audio_frame_ct);
+    } else if (file_writer_sink_null == file_writer->sink) {
+        printf("discarded %"PRId64" video and %"PRId64" audio frames\n",
+               file_writer->video_frame_ct, file_writer->audio_frame_ct);
+    }
+    printf("File write done!\n");
+    return ret;
+}
+
+// everything open_output_file set up, however far it got
+static void free_output(struct file_writer_t* file_writer) {
+    if (file_writer->video_ctx_out) {
+        avcodec_close(file_writer->video_ctx_out);
+    }
+    avfilter_graph_free(&file_writer->video_filter_graph);
+    avfilter_graph_free(&file_writer->audio_filter_graph);
+    if (!file_writer->format_ctx_out) {
+        return;
+    }
+
+    if (file_writer->format_ctx_out->flags & AVFMT_FLAG_CUSTOM_IO) {
+        AVIOContext* pb = file_writer->format_ctx_out->pb;
+        avio_flush(pb);
+        av_freep(&pb->buffer);
+        av_freep(&file_writer->format_ctx_out->pb);
+    } else if (!(file_writer->format_ctx_out->oformat->flags & AVFMT_NOFILE)) {
+        avio_closep(&file_writer->format_ctx_out->pb);
+    }
+
+    // the streams' codec contexts go with it
+    avformat_free_context(file_writer->format_ctx_out);
+    file_writer->format_ctx_out = NULL;
+    file_writer->video_ctx_out = NULL;
+    file_writer->audio_ctx_out = NULL;
+    file_writer->video_stream = NULL;
+    file_writer->audio_stream = NULL;
+}
+
+int file_writer_push_audio_frame(struct file_writer_t* file_writer,
+                                 AVFrame* frame)
+{
+    AVFrame* ref = av_frame_clone(frame);
+    if (!ref) {
+        return AVERROR(ENOMEM);
+    }
+    spsc_queue_push(file_writer->audio_frame_queue, ref);
+    return 0;
+}
+
+int file_writer_push_video_frame(struct file_writer_t* file_writer,
+                                 AVFrame* frame)
+{
+    AVFrame* ref = av_frame_clone(frame);
+    if (!ref) {
+        return AVERROR(ENOMEM);
+    }
+    // blocks while the encoder is behind
+    uint64_t trace_start = trace_begin();
+    spsc_queue_push_sized(file_writer->video_frame_queue, ref,
+                          frame_buffer_bytes(ref));
+    trace_end("push to encoder", trace_start, "pts", frame->pts);
+    return 0;
+}
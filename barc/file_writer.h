@@ -13,11 +13,66 @@
 #include <libavfilter/avfilter.h>
 #include <uv.h>
 
+struct spsc_queue_s;
+
+#define FILE_WRITER_MAX_AUDIO_FOLLOWERS 8
+
+/* Container layouts. Progressive MP4 is only playable after the trailer is
+ * written; the others are readable (and survive a crash) up to the last
+ * completed fragment or segment. */
+enum file_writer_format {
+    // let avformat guess from the file extension
+    file_writer_format_auto = 0,
+    // fragmented mp4, one fragment per keyframe interval
+    file_writer_format_fmp4,
+    // HLS playlist plus media segments, next to the playlist path
+    file_writer_format_hls,
+    // MPEG-DASH manifest plus media segments, next to the manifest path
+    file_writer_format_dash
+};
+
+/* Where encoder input ends up. The null and hash sinks take frames off the
+ * encoder queues as usual but never encode or write them, so decode and
+ * compose can be timed without the encoders in the way. */
+enum file_writer_sink {
+    file_writer_sink_encode = 0,
+    // drop every frame
+    file_writer_sink_null,
+    // drop every frame, after folding it into video_hash or audio_hash.
+    // identical renders give identical hashes.
+    file_writer_sink_hash
+};
+
+/* Receives muxed output when it shouldn't go to a path. Called on the mux
+ * thread. Return size, or a negative AVERROR to abort. */
+typedef int (*file_writer_output_cb_t)(void* opaque, uint8_t* buf, int size);
+
+/* Bounds on raw frames waiting for each encoder. Pushing blocks once either
+ * bound is reached, which in turn stalls compose and decode. Zero fields keep
+ * the defaults. */
+struct file_writer_queue_limits_s {
+    size_t video_frames;
+    size_t video_bytes;
+    size_t audio_frames;
+};
+
 struct file_writer_t {
     int out_width;
     int out_height;
+    enum file_writer_format output_format;
+    // target length of a fragment or segment, in seconds
+    double segment_duration;
+    // custom sink. when set, the filename passed to file_writer_open is
+    // only used for logging.
+    file_writer_output_cb_t output_cb;
+    void* output_opaque;
+    enum file_writer_sink sink;
+    // FNV-1a over the pixels, samples and pts of every frame. hash sink only.
+    uint64_t video_hash;
+    uint64_t audio_hash;
 
-    /* stream filtering */
+    /* stream filtering. graphs stay NULL while frames already match the
+     * encoders, which is the normal case. */
     AVFilterContext *audio_buffersink_ctx;
     AVFilterContext *audio_buffersrc_ctx;
     AVFilterContext *video_buffersink_ctx;
@@ -36,19 +91,81 @@ struct file_writer_t {
     int64_t video_frame_ct;
     int64_t audio_frame_ct;
 
-    uv_mutex_t write_lock;
+    /* encode and mux stages. each encoder thread owns its filter graph and
+     * codec context, and the mux thread is the only one that touches
+     * format_ctx_out after the header is written. */
+    struct spsc_queue_s* video_frame_queue;
+    struct spsc_queue_s* audio_frame_queue;
+    struct spsc_queue_s* video_packet_queue;
+    struct spsc_queue_s* audio_packet_queue;
+    uv_sem_t mux_wakeup;
+    uv_thread_t video_encode_thread;
+    uv_thread_t audio_encode_thread;
+    uv_thread_t mux_thread;
+    // set once file_writer_open got as far as starting the threads above
+    char workers_started;
+    // frames the encode threads failed on. file_writer_close fails if any.
+    int encode_errors;
+
+    /* audio is encoded once and muxed into every follower as well. a
+     * follower has no audio encoder thread of its own; audio_leader points
+     * back at the writer that feeds it. */
+    struct file_writer_t* audio_followers[FILE_WRITER_MAX_AUDIO_FOLLOWERS];
+    int audio_follower_count;
+    struct file_writer_t* audio_leader;
 };
 
 int file_writer_alloc(struct file_writer_t** writer);
 void file_writer_free(struct file_writer_t* writer);
 
+/* Choose the container layout. Must be called before file_writer_open.
+ * segment_duration <= 0 selects the default. */
+void file_writer_set_output_format(struct file_writer_t* writer,
+                                   enum file_writer_format format,
+                                   double segment_duration);
+/* @return 0 if name is one of mp4, fmp4, hls or dash. */
+int file_writer_parse_format(const char* name,
+                             enum file_writer_format* format_out);
+/* Discard or hash frames instead of encoding them. Must be called before
+ * file_writer_open. Codecs are still opened, so frame sizes match a real
+ * render, but nothing is written to the output path. */
+void file_writer_set_sink(struct file_writer_t* writer,
+                          enum file_writer_sink sink);
+/* @return 0 if name is one of encode, null or hash. */
+int file_writer_parse_sink(const char* name, enum file_writer_sink* sink_out);
+/* Resize the encoder input queues. Must be called before file_writer_open.
+ * @return 0 on success */
+int file_writer_set_queue_limits(struct file_writer_t* writer,
+                                 const struct file_writer_queue_limits_s* limits);
+/* Send output to callback instead of a file. Must be called before
+ * file_writer_open. */
+void file_writer_set_output_callback(struct file_writer_t* writer,
+                                     file_writer_output_cb_t callback,
+                                     void* opaque);
+/* @return 1 if filename names a stream that can't seek: "-" (stdout) or
+ * pipe:N. Streamed outputs (including callbacks) can't be rewritten once
+ * sent, so they are always written as fragmented mp4. */
+int file_writer_is_stream_output(const char* filename);
+
 int file_writer_open(struct file_writer_t* writer,
                      const char* filename,
                      int out_width, int out_height);
+/* Mux leader's encoded audio into follower instead of encoding it again.
+ * Both writers must use the same audio settings. Call before either writer
+ * is opened, and close the leader before its followers.
+ * @return 0 on success */
+int file_writer_follow_audio(struct file_writer_t* leader,
+                             struct file_writer_t* follower);
+/* Push functions take a new reference to frame and hand it off to the
+ * encoder thread. Callers keep ownership of the frame they passed in.
+ * These block only when the encoder falls far enough behind to fill its
+ * queue. */
 int file_writer_push_audio_frame(struct file_writer_t* file_writer,
                                  AVFrame* frame);
 int file_writer_push_video_frame(struct file_writer_t* file_writer,
                                  AVFrame* frame);
+/* Flushes encoders, waits for all queued media to be muxed, then writes the
+ * container trailer. */
 int file_writer_close(struct file_writer_t* writer);
 
 #endif /* file_writer_h */
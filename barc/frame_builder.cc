@@ -12,7 +12,11 @@ extern "C" {
 #include <unistd.h>
 
 #include "frame_builder.h"
+#include "log.h"
 #include "magic_frame.h"
+#include "memory_governor.h"
+#include "perf_stats.h"
+#include "trace.h"
 }
 
 #include <vector>
@@ -26,14 +30,22 @@ av_make_error_string((char*)__builtin_alloca(AV_ERROR_MAX_STRING_SIZE), \
 AV_ERROR_MAX_STRING_SIZE, errnum)
 #endif
 
-static int job_counter;
 static void crunch_frame(uv_work_t* work);
 static void after_crunch_frame(uv_work_t* work, int status);
 static void free_job(struct frame_job_t* job);
 static void frame_builder_worker(void* p);
+static void submit_jobs(uv_async_t* handle);
+
+// what happens to a job once it is scheduled
+enum frame_job_action {
+    frame_job_compose = 0,
+    frame_job_repeat,
+    frame_job_omit
+};
 
 struct frame_job_t {
     uv_work_t request;
+    enum frame_job_action action;
     int width;
     int height;
     enum AVPixelFormat format;
@@ -42,19 +54,46 @@ struct frame_job_t {
     AVFrame* output_frame;
     frame_builder_t* builder;
     int serial_number;
+    // charged to the memory governor while the job is in flight
+    size_t charged_bytes;
+    // when the frame was begun, for its latency (0 when not measured)
+    uint64_t start_time;
     void* p;
 };
 
 struct frame_builder_t {
     struct frame_job_t* current_job;
     uv_mutex_t job_queue_lock;
+    // jobs handed in but not yet called back. finish_frame blocks while
+    // this is at max_queue_size (less while the memory governor is under
+    // pressure); job_done is signalled as it drops.
     int max_queue_size;
+    int in_flight;
+    uv_cond_t job_done;
     std::map<int, struct frame_job_t*>pending_jobs;
     std::map<int, struct frame_job_t*>finished_jobs;
     char running;
     uv_loop_t *loop;
     uv_thread_t loop_thread;
+    // uv_queue_work is only safe on the loop thread, so new jobs are parked
+    // here and picked up by submit_async.
+    std::vector<struct frame_job_t*> submit_queue;
+    uv_async_t submit_async;
+    int job_counter;
     int finish_serial;
+
+    /* unchanged frame detection. previous_subframes holds references on its
+     * smart frames, so their addresses can't be recycled while we compare
+     * against them. previous_output is only touched on the loop thread. */
+    enum frame_builder_repeat_mode repeat_mode;
+    int max_omitted;
+    int omitted_count;
+    char has_previous;
+    int previous_width;
+    int previous_height;
+    enum AVPixelFormat previous_format;
+    std::vector<struct frame_builder_subframe_t> previous_subframes;
+    AVFrame* previous_output;
 };
 
 int frame_builder_alloc(struct frame_builder_t** frame_builder) {
@@ -62,6 +101,9 @@ int frame_builder_alloc(struct frame_builder_t** frame_builder) {
     calloc(1, sizeof(struct frame_builder_t));
     result->pending_jobs = std::map<int, struct frame_job_t*>();
     result->finished_jobs = std::map<int, struct frame_job_t*>();
+    result->previous_subframes = std::vector<struct frame_builder_subframe_t>();
+    result->submit_queue = std::vector<struct frame_job_t*>();
+    result->repeat_mode = frame_builder_repeat_reference;
     result->loop = (uv_loop_t*) malloc(sizeof(uv_loop_t));
     result->running = 1;
     result->finish_serial = 0;
@@ -76,7 +118,8 @@ int frame_builder_alloc(struct frame_builder_t** frame_builder) {
     // ...or, don't. your mileage may vary. see what works for you.
     setenv("UV_THREADPOOL_SIZE", str, 0);
     uv_loop_init(result->loop);
-    uv_thread_create(&result->loop_thread, frame_builder_worker, result);
+    uv_async_init(result->loop, &result->submit_async, submit_jobs);
+    result->submit_async.data = result;
 
     // configure job queue size. bigger queue uses more memory, but not
     // necessarily improves performance.
@@ -84,20 +127,27 @@ int frame_builder_alloc(struct frame_builder_t** frame_builder) {
     // all the available resources something to do.
     result->max_queue_size = 64;
     uv_mutex_init(&result->job_queue_lock);
+    uv_cond_init(&result->job_done);
+    uv_thread_create(&result->loop_thread, frame_builder_worker, result);
 
     *frame_builder = result;
     return 0;
 }
 
 void frame_builder_free(struct frame_builder_t* frame_builder) {
-    int ret;
+    frame_builder_wait(frame_builder, 0);
+    // the loop thread closes its handle and returns once it sees this
+    uv_mutex_lock(&frame_builder->job_queue_lock);
     frame_builder->running = 0;
-    uv_stop(frame_builder->loop);
-    do {
-        ret = uv_loop_close(frame_builder->loop);
-    } while (UV_EBUSY == ret);
+    uv_mutex_unlock(&frame_builder->job_queue_lock);
+    uv_async_send(&frame_builder->submit_async);
     uv_thread_join(&frame_builder->loop_thread);
+    uv_loop_close(frame_builder->loop);
+    free(frame_builder->loop);
+    uv_cond_destroy(&frame_builder->job_done);
     uv_mutex_destroy(&frame_builder->job_queue_lock);
+    frame_builder_forget_previous(frame_builder);
+    av_frame_free(&frame_builder->previous_output);
     free(frame_builder);
 }
 
@@ -108,11 +158,12 @@ int frame_builder_begin_frame(struct frame_builder_t* frame_builder,
     struct frame_job_t* job = (struct frame_job_t*)
     calloc(1, sizeof(struct frame_job_t));
     job->builder = frame_builder;
-    job->serial_number = job_counter++;
+    job->serial_number = frame_builder->job_counter++;
     job->width = width;
     job->height = height;
     job->format = format;
     job->p = p;
+    job->start_time = perf_stats_start();
     frame_builder->current_job = job;
     return 0;
 }
@@ -129,6 +180,79 @@ int frame_builder_add_subframe(struct frame_builder_t* frame_builder,
     return 0;
 }
 
+void frame_builder_set_max_jobs(struct frame_builder_t* frame_builder,
+                                int max_jobs)
+{
+    if (max_jobs > 0) {
+        frame_builder->max_queue_size = max_jobs;
+    }
+}
+
+void frame_builder_set_repeat_mode(struct frame_builder_t* frame_builder,
+                                   enum frame_builder_repeat_mode mode,
+                                   int max_omitted)
+{
+    frame_builder->repeat_mode = mode;
+    frame_builder->max_omitted = max_omitted;
+}
+
+static char subframes_equal(const struct frame_builder_subframe_t* a,
+                            const struct frame_builder_subframe_t* b)
+{
+    return a->smart_frame == b->smart_frame &&
+    a->x_offset == b->x_offset &&
+    a->y_offset == b->y_offset &&
+    a->render_width == b->render_width &&
+    a->render_height == b->render_height &&
+    a->object_fit == b->object_fit &&
+    a->border.width == b->border.width &&
+    a->border.radius == b->border.radius &&
+    a->border.red == b->border.red &&
+    a->border.green == b->border.green &&
+    a->border.blue == b->border.blue;
+}
+
+void frame_builder_forget_previous(struct frame_builder_t* frame_builder)
+{
+    for (struct frame_builder_subframe_t& subframe :
+         frame_builder->previous_subframes)
+    {
+        smart_frame_release(subframe.smart_frame);
+    }
+    frame_builder->previous_subframes.clear();
+    frame_builder->has_previous = 0;
+    frame_builder->omitted_count = 0;
+}
+
+// compare this job against the last one, then remember it for the next
+static char job_repeats_previous(struct frame_builder_t* frame_builder,
+                                 struct frame_job_t* job)
+{
+    char same = frame_builder->has_previous &&
+    job->width == frame_builder->previous_width &&
+    job->height == frame_builder->previous_height &&
+    job->format == frame_builder->previous_format &&
+    job->subframes.size() == frame_builder->previous_subframes.size();
+    for (size_t i = 0; same && i < job->subframes.size(); i++) {
+        same = subframes_equal(job->subframes[i],
+                               &frame_builder->previous_subframes[i]);
+    }
+    if (same) {
+        return 1;
+    }
+
+    frame_builder_forget_previous(frame_builder);
+    for (struct frame_builder_subframe_t* subframe : job->subframes) {
+        smart_frame_retain(subframe->smart_frame);
+        frame_builder->previous_subframes.push_back(*subframe);
+    }
+    frame_builder->previous_width = job->width;
+    frame_builder->previous_height = job->height;
+    frame_builder->previous_format = job->format;
+    frame_builder->has_previous = 1;
+    return 0;
+}
+
 int frame_builder_finish_frame(struct frame_builder_t* frame_builder,
                                frame_builder_cb_t callback) {
     struct frame_job_t* job = frame_builder->current_job;
@@ -136,19 +260,57 @@ int frame_builder_finish_frame(struct frame_builder_t* frame_builder,
     job->request.data = job;
     int ret = 0;
 
-    size_t current_queue_size = frame_builder->pending_jobs.size();
-    if (current_queue_size > frame_builder->max_queue_size) {
-        printf("Queue size exceeded. Drain half before proceeding.\n");
-        frame_builder_wait(frame_builder, (int)current_queue_size / 2);
+    job->action = frame_job_compose;
+    if (frame_builder_repeat_compose != frame_builder->repeat_mode &&
+        job_repeats_previous(frame_builder, job))
+    {
+        if (frame_builder_repeat_omit == frame_builder->repeat_mode &&
+            frame_builder->omitted_count < frame_builder->max_omitted)
+        {
+            job->action = frame_job_omit;
+            frame_builder->omitted_count++;
+        } else {
+            job->action = frame_job_repeat;
+            frame_builder->omitted_count = 0;
+        }
+    } else {
+        frame_builder->omitted_count = 0;
     }
 
+    // backpressure: wait for compose (and everything after it) to catch up
     uv_mutex_lock(&frame_builder->job_queue_lock);
+    uint64_t wait_start = 0;
+    uint64_t trace_wait_start = 0;
+    while ((size_t)frame_builder->in_flight >=
+           memory_governor_scale(frame_builder->max_queue_size, 1))
+    {
+        if (!wait_start && !trace_wait_start) {
+            wait_start = perf_stats_start();
+            trace_wait_start = trace_begin();
+        }
+        uv_cond_wait(&frame_builder->job_done, &frame_builder->job_queue_lock);
+    }
+    perf_stats_end(perf_queue_push_wait, wait_start);
+    trace_end("wait for compose", trace_wait_start, "in_flight",
+              frame_builder->in_flight);
+    if (perf_stats_enabled && frame_builder->max_queue_size) {
+        perf_stats_record(perf_queue_fill, 100 * frame_builder->in_flight /
+                          frame_builder->max_queue_size);
+    }
+    frame_builder->in_flight++;
+    // composition works on an RGBA canvas the size of the output
+    if (frame_job_compose == job->action) {
+        job->charged_bytes = (size_t)job->width * job->height * 4;
+        memory_governor_charge(job->charged_bytes);
+    }
+    size_t current_queue_size = frame_builder->pending_jobs.size();
     frame_builder->pending_jobs[job->serial_number] = job;
+    trace_counter("frame_builder in_flight", frame_builder->in_flight);
+    trace_counter("frame_builder pending", current_queue_size + 1);
     uv_mutex_unlock(&frame_builder->job_queue_lock);
     // release the lock before doing anything crazy
-    printf("Schedule job %d. Pending queue size: %lu\n",
-           job->serial_number,
-           current_queue_size);
+    log_debug(log_module_compose, "Schedule job %d. Pending queue size: %zu",
+              job->serial_number, current_queue_size);
 
     // This debug env var won't kill all threads, just the ones we create to
     // offload magic frame generation.
@@ -156,23 +318,40 @@ int frame_builder_finish_frame(struct frame_builder_t* frame_builder,
         crunch_frame(&job->request);
         after_crunch_frame(&job->request, 0);
     } else {
-        ret = uv_queue_work(frame_builder->loop,
-                            &(job->request),
-                            crunch_frame,
-                            after_crunch_frame);
+        uv_mutex_lock(&frame_builder->job_queue_lock);
+        frame_builder->submit_queue.push_back(job);
+        uv_mutex_unlock(&frame_builder->job_queue_lock);
+        ret = uv_async_send(&frame_builder->submit_async);
     }
     return ret;
 }
 
 int frame_builder_wait(struct frame_builder_t* frame_builder, int min) {
-    while (frame_builder->pending_jobs.size() > min ||
-           frame_builder->finished_jobs.size() > min)
-    {
-        usleep(1000);
+    uv_mutex_lock(&frame_builder->job_queue_lock);
+    while (frame_builder->in_flight > min) {
+        uv_cond_wait(&frame_builder->job_done, &frame_builder->job_queue_lock);
     }
+    uv_mutex_unlock(&frame_builder->job_queue_lock);
     return 0;
 }
 
+// runs on the loop thread
+static void submit_jobs(uv_async_t* handle) {
+    struct frame_builder_t* builder = (struct frame_builder_t*)handle->data;
+    std::vector<struct frame_job_t*> jobs;
+    uv_mutex_lock(&builder->job_queue_lock);
+    jobs.swap(builder->submit_queue);
+    char running = builder->running;
+    uv_mutex_unlock(&builder->job_queue_lock);
+    for (struct frame_job_t* job : jobs) {
+        uv_queue_work(builder->loop, &(job->request),
+                      crunch_frame, after_crunch_frame);
+    }
+    if (!running) {
+        uv_close((uv_handle_t*)handle, NULL);
+    }
+}
+
 static void free_job(struct frame_job_t* job) {
     for (struct frame_builder_subframe_t* subframe : job->subframes) {
         smart_frame_release(subframe->smart_frame);
@@ -189,22 +368,60 @@ static void after_crunch_frame(uv_work_t* work, int status) {
     uv_mutex_lock(&builder->job_queue_lock);
     builder->pending_jobs.erase(job->serial_number);
     builder->finished_jobs[job->serial_number] = job;
+    trace_counter("frame_builder pending", builder->pending_jobs.size());
+    trace_counter("frame_builder finished", builder->finished_jobs.size());
     uv_mutex_unlock(&builder->job_queue_lock);
 
     // invoke callbacks and flush all finished jobs in order they were received.
+    // only this thread touches finished_jobs after the insert above.
+    int completed = 0;
     auto iter = builder->finished_jobs.find(builder->finish_serial);
     while (iter != builder->finished_jobs.end()) {
+        struct frame_job_t* finished = iter->second;
+        // jobs finish in order here, so the previous output is the one
+        // immediately before this job
+        if (frame_job_compose == finished->action) {
+            av_frame_free(&builder->previous_output);
+            builder->previous_output = av_frame_clone(finished->output_frame);
+        } else if (frame_job_repeat == finished->action &&
+                   builder->previous_output)
+        {
+            finished->output_frame = av_frame_clone(builder->previous_output);
+        }
+        uint64_t trace_start = trace_begin();
         iter->second->callback(iter->second->output_frame, iter->second->p);
+        trace_end("deliver frame", trace_start, "serial",
+                  iter->second->serial_number);
+        perf_stats_end(perf_frame_latency, iter->second->start_time);
+        memory_governor_discharge(iter->second->charged_bytes);
         free_job(iter->second);
+        uv_mutex_lock(&builder->job_queue_lock);
         builder->finished_jobs.erase(iter);
+        uv_mutex_unlock(&builder->job_queue_lock);
         builder->finish_serial++;
+        completed++;
         iter = builder->finished_jobs.find(builder->finish_serial);
     }
+    if (completed) {
+        uv_mutex_lock(&builder->job_queue_lock);
+        builder->in_flight -= completed;
+        trace_counter("frame_builder in_flight", builder->in_flight);
+        trace_counter("frame_builder finished", builder->finished_jobs.size());
+        uv_cond_broadcast(&builder->job_done);
+        uv_mutex_unlock(&builder->job_queue_lock);
+    }
 }
 
 static void crunch_frame(uv_work_t* work) {
     struct frame_job_t* job = (struct frame_job_t*)work->data;
     int ret;
+    if (frame_job_compose != job->action) {
+        // output is filled in (or not) when callbacks run in order
+        return;
+    }
+    uint64_t start = perf_stats_start();
+    uint64_t trace_start = trace_begin();
+    trace_set_thread_name("compose");
     MagickWand* output_wand;
     magic_frame_start(&output_wand, job->width, job->height);
 
@@ -224,19 +441,23 @@ static void crunch_frame(uv_work_t* work) {
     }
     
     for (struct frame_builder_subframe_t* subframe : job->subframes) {
+        uint64_t subframe_start = perf_stats_start();
         magic_frame_add(output_wand,
-                        smart_frame_get(subframe->smart_frame),
+                        subframe->smart_frame,
                         subframe->x_offset,
                         subframe->y_offset,
                         subframe->border,
                         subframe->render_width,
                         subframe->render_height,
                         subframe->object_fit);
+        perf_stats_end(perf_compose_subframe, subframe_start);
     }
 
     ret = magic_frame_finish(output_wand, output_frame, job->serial_number);
 
     job->output_frame = output_frame;
+    perf_stats_end(perf_compose_frame, start);
+    trace_end("compose", trace_start, "serial", job->serial_number);
 
 //    printf("Crunched %lu frames for frame builder job number %d\n",
 //           job->subframes.size(), job->serial_number);
@@ -245,6 +466,7 @@ static void crunch_frame(uv_work_t* work) {
 static void frame_builder_worker(void* p) {
     struct frame_builder_t* builder = (struct frame_builder_t*)p;
     int ret = 0;
+    trace_set_thread_name("frame_builder loop");
     while (builder->running && 0 == ret) {
         ret = uv_run(builder->loop, UV_RUN_DEFAULT);
     }
@@ -26,6 +26,18 @@ struct frame_builder_subframe_t {
     enum object_fit object_fit;
 };
 
+/* What to do with a frame whose subframes (source frames and geometry) are
+ * identical to the frame before it. Either way, compose is skipped. */
+enum frame_builder_repeat_mode {
+    // hand the previous output to the callback again, by reference
+    frame_builder_repeat_reference = 0,
+    // call back with a NULL frame so the caller can leave a gap (VFR)
+    frame_builder_repeat_omit,
+    // compose every frame, even unchanged ones
+    frame_builder_repeat_compose
+};
+
+/* frame is NULL when the frame was omitted (see frame_builder_repeat_omit). */
 typedef void (*frame_builder_cb_t)(AVFrame* frame, void *p);
 
 int frame_builder_alloc(struct frame_builder_t** frame_builder);
@@ -38,6 +50,20 @@ int frame_builder_add_subframe(struct frame_builder_t* frame_builder,
                                struct frame_builder_subframe_t* subframe);
 int frame_builder_finish_frame(struct frame_builder_t* frame_builder,
                                frame_builder_cb_t callback);
+/* Block until at most min jobs are still waiting on their callback. */
 int frame_builder_wait(struct frame_builder_t* frame_builder, int min);
+/* Cap on jobs between finish_frame and their callback. finish_frame blocks
+ * at the cap until the oldest job is called back. */
+void frame_builder_set_max_jobs(struct frame_builder_t* frame_builder,
+                                int max_jobs);
+/* In omit mode, at most max_omitted frames in a row are dropped before the
+ * previous output is repeated anyway. */
+void frame_builder_set_repeat_mode(struct frame_builder_t* frame_builder,
+                                   enum frame_builder_repeat_mode mode,
+                                   int max_omitted);
+/* The caller output something else since the last frame (a blank frame), so
+ * the next one is composed even if it matches. Call from the thread that
+ * calls finish_frame. */
+void frame_builder_forget_previous(struct frame_builder_t* frame_builder);
 
 #endif /* frame_builder_h */
@@ -0,0 +1,365 @@
+//
+//  http_source.c
+//  barc
+//
+
+#include "http_source.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <curl/curl.h>
+#include <uv.h>
+#include "curler.h"
+
+// 16 MB of cache per remote archive, fetched at most 4 MB at a time
+#define HTTP_SOURCE_CACHE_BLOCKS 64
+#define HTTP_SOURCE_MAX_READAHEAD 16
+// connections kept open between requests
+#define HTTP_SOURCE_IDLE_HANDLES 8
+
+static const int64_t block_size = 256 * 1024;
+static const int max_attempts = 3;
+
+struct cache_block_s {
+  int64_t index;
+  char* data;
+  size_t length;
+  uint64_t last_used;
+  // a request for it is in flight. not evicted until it lands.
+  char loading;
+};
+
+struct http_source_s {
+  char* url;
+  int64_t size;
+  // guards the blocks and the idle handles, never a request
+  uv_mutex_t lock;
+  // a loading block finished, or failed
+  uv_cond_t loaded;
+  struct cache_block_s blocks[HTTP_SOURCE_CACHE_BLOCKS];
+  uint64_t use_counter;
+  CURL* idle[HTTP_SOURCE_IDLE_HANDLES];
+  int idle_count;
+  size_t requests;
+  int64_t bytes;
+};
+
+/** Body of one range request. Anything past capacity is refused. */
+struct range_response_s {
+  char* data;
+  size_t length;
+  size_t capacity;
+  // parsed from Content-Range
+  int64_t total_size;
+};
+
+static size_t write_range(void* ptr, size_t size, size_t nmemb, void* p) {
+  struct range_response_s* response = (struct range_response_s*)p;
+  size_t bytes = size * nmemb;
+  if (response->length + bytes > response->capacity) {
+    // the server ignored the range and is sending the whole file
+    return 0;
+  }
+  memcpy(response->data + response->length, ptr, bytes);
+  response->length += bytes;
+  return bytes;
+}
+
+static size_t read_header(char* buffer, size_t size, size_t nitems, void* p) {
+  struct range_response_s* response = (struct range_response_s*)p;
+  size_t bytes = size * nitems;
+  int64_t total = parse_content_range_total(buffer, bytes);
+  if (total >= 0) {
+    response->total_size = total;
+  }
+  return bytes;
+}
+
+static CURL* new_handle(const char* url) {
+  CURL* curl = curl_easy_init();
+  curl_easy_setopt(curl, CURLOPT_URL, url);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_range);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, read_header);
+  return curl;
+}
+
+// call with the lock held. a handle serves one request at a time.
+static CURL* take_handle(struct http_source_s* source) {
+  if (source->idle_count) {
+    return source->idle[--source->idle_count];
+  }
+  return new_handle(source->url);
+}
+
+// call with the lock held
+static void give_handle(struct http_source_s* source, CURL* curl) {
+  if (source->idle_count < HTTP_SOURCE_IDLE_HANDLES) {
+    source->idle[source->idle_count++] = curl;
+  } else {
+    curl_easy_cleanup(curl);
+  }
+}
+
+// fill response with bytes [begin, end] of the file. call without the lock.
+static int request_range(struct http_source_s* source, CURL* curl,
+                         int64_t begin, int64_t end,
+                         struct range_response_s* response)
+{
+  char range[64];
+  snprintf(range, sizeof(range), "%lld-%lld", (long long)begin,
+           (long long)end);
+  int ret = -1;
+  for (int attempt = 0; ret && attempt < max_attempts; attempt++) {
+    long status = 0;
+    response->length = 0;
+    curl_easy_setopt(curl, CURLOPT_RANGE, range);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, response);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, response);
+    CURLcode code = curl_easy_perform(curl);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    __atomic_add_fetch(&source->requests, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&source->bytes, (int64_t)response->length,
+                       __ATOMIC_RELAXED);
+    if (CURLE_OK == code && 206 == status &&
+        response->length == (size_t)(end - begin + 1))
+    {
+      ret = 0;
+    } else {
+      printf("http_source: range %s of %s failed: %s (status %ld)\n",
+             range, source->url, curl_easy_strerror(code), status);
+      // only dropped connections and server errors are worth another try
+      if (status > 0 && status < 500) {
+        break;
+      }
+    }
+  }
+  return ret;
+}
+
+static struct http_source_s* alloc_source(const char* url) {
+  curler_global_init();
+  struct http_source_s* source = (struct http_source_s*)
+  calloc(1, sizeof(struct http_source_s));
+  source->url = strdup(url);
+  for (int i = 0; i < HTTP_SOURCE_CACHE_BLOCKS; i++) {
+    source->blocks[i].index = -1;
+  }
+  uv_mutex_init(&source->lock);
+  uv_cond_init(&source->loaded);
+  return source;
+}
+
+int http_source_open(struct http_source_s** source_out, const char* url,
+                     int64_t size)
+{
+  struct http_source_s* source = alloc_source(url);
+  if (size > 0) {
+    source->size = size;
+    *source_out = source;
+    return 0;
+  }
+  // presigned urls are often only good for GET, so probe with a tiny range
+  // instead of a HEAD
+  char probe;
+  struct range_response_s response = { &probe, 0, 1, -1 };
+  CURL* curl = new_handle(url);
+  int ret = request_range(source, curl, 0, 0, &response);
+  give_handle(source, curl);
+  if (!ret && response.total_size <= 0) {
+    printf("http_source: %s did not report its size\n", url);
+    ret = -1;
+  }
+  if (ret) {
+    printf("http_source: %s does not support range requests\n", url);
+    http_source_free(source);
+    return -1;
+  }
+  source->size = response.total_size;
+  *source_out = source;
+  return 0;
+}
+
+void http_source_free(struct http_source_s* source) {
+  for (int i = 0; i < HTTP_SOURCE_CACHE_BLOCKS; i++) {
+    free(source->blocks[i].data);
+  }
+  for (int i = 0; i < source->idle_count; i++) {
+    curl_easy_cleanup(source->idle[i]);
+  }
+  uv_cond_destroy(&source->loaded);
+  uv_mutex_destroy(&source->lock);
+  free(source->url);
+  free(source);
+}
+
+int http_source_probe(const char* url, int64_t* size_out) {
+  struct http_source_s* source;
+  int ret = http_source_open(&source, url, 0);
+  if (!ret) {
+    *size_out = source->size;
+    http_source_free(source);
+  }
+  return ret;
+}
+
+int64_t http_source_get_size(const struct http_source_s* source) {
+  return source->size;
+}
+
+void http_source_get_stats(const struct http_source_s* source,
+                           size_t* requests_out, int64_t* bytes_out)
+{
+  *requests_out = __atomic_load_n(&source->requests, __ATOMIC_RELAXED);
+  *bytes_out = __atomic_load_n(&source->bytes, __ATOMIC_RELAXED);
+}
+
+#pragma mark - Block cache
+
+static struct cache_block_s* find_block(struct http_source_s* source,
+                                        int64_t index, char touch)
+{
+  for (int i = 0; i < HTTP_SOURCE_CACHE_BLOCKS; i++) {
+    if (source->blocks[i].index == index) {
+      if (touch) {
+        source->blocks[i].last_used = ++source->use_counter;
+      }
+      return &source->blocks[i];
+    }
+  }
+  return NULL;
+}
+
+// @return the least recently used block that isn't loading, or NULL
+static struct cache_block_s* evict_block(struct http_source_s* source) {
+  struct cache_block_s* oldest = NULL;
+  for (int i = 0; i < HTTP_SOURCE_CACHE_BLOCKS; i++) {
+    if (!source->blocks[i].loading &&
+        (!oldest || source->blocks[i].last_used < oldest->last_used))
+    {
+      oldest = &source->blocks[i];
+    }
+  }
+  if (!oldest) {
+    return NULL;
+  }
+  if (!oldest->data) {
+    oldest->data = (char*)malloc(block_size);
+  }
+  oldest->index = -1;
+  return oldest;
+}
+
+/* Fetch block index. Several demuxers read the archive at once, so rather
+ * than tracking one read position, a miss right after a run of cached blocks
+ * counts as sequential and fetches one more block than the run is long.
+ * Readahead doubles while a stream keeps reading forward.
+ *
+ * Call with the lock held. The blocks are claimed (loading) and the lock is
+ * dropped for the request, so readers of other blocks carry on and readers
+ * of these ones wait on loaded instead of asking for them again.
+ */
+static int fetch_blocks(struct http_source_s* source, int64_t index) {
+  int64_t block_count = (source->size + block_size - 1) / block_size;
+  int run = 0;
+  while (run < HTTP_SOURCE_MAX_READAHEAD - 1 && index - run > 0 &&
+         find_block(source, index - run - 1, 0))
+  {
+    run++;
+  }
+  int count = 1;
+  while (count <= run && index + count < block_count &&
+         !find_block(source, index + count, 0))
+  {
+    count++;
+  }
+
+  struct cache_block_s* claimed[HTTP_SOURCE_MAX_READAHEAD];
+  for (int i = 0; i < count; i++) {
+    claimed[i] = evict_block(source);
+    if (!claimed[i]) {
+      count = i;
+      break;
+    }
+    claimed[i]->index = index + i;
+    claimed[i]->loading = 1;
+  }
+  if (!count) {
+    // every block is on its way in. try again once one lands.
+    uv_cond_wait(&source->loaded, &source->lock);
+    return 0;
+  }
+
+  int64_t begin = index * block_size;
+  int64_t end = (index + count) * block_size;
+  if (end > source->size) {
+    end = source->size;
+  }
+  CURL* curl = take_handle(source);
+  uv_mutex_unlock(&source->lock);
+  struct range_response_s response = { 0 };
+  response.capacity = end - begin;
+  response.data = (char*)malloc(response.capacity);
+  int ret = request_range(source, curl, begin, end - 1, &response);
+  uv_mutex_lock(&source->lock);
+  give_handle(source, curl);
+  for (int i = 0; i < count; i++) {
+    struct cache_block_s* block = claimed[i];
+    int64_t offset = i * block_size;
+    if (ret) {
+      block->index = -1;
+    } else {
+      block->length = end - begin - offset < block_size ?
+      end - begin - offset : block_size;
+      memcpy(block->data, response.data + offset, block->length);
+    }
+    block->last_used = ++source->use_counter;
+    block->loading = 0;
+  }
+  uv_cond_broadcast(&source->loaded);
+  free(response.data);
+  return ret;
+}
+
+int64_t http_source_read(struct http_source_s* source, int64_t offset,
+                         void* buffer, size_t size)
+{
+  if (offset < 0) {
+    return -1;
+  }
+  if (offset >= source->size) {
+    return 0;
+  }
+  if (size > source->size - offset) {
+    size = source->size - offset;
+  }
+  size_t copied = 0;
+  uv_mutex_lock(&source->lock);
+  while (copied < size) {
+    int64_t position = offset + copied;
+    int64_t index = position / block_size;
+    struct cache_block_s* block = find_block(source, index, 1);
+    if (block && block->loading) {
+      uv_cond_wait(&source->loaded, &source->lock);
+      continue;
+    }
+    if (!block) {
+      if (fetch_blocks(source, index)) {
+        uv_mutex_unlock(&source->lock);
+        return copied ? (int64_t)copied : -1;
+      }
+      continue;
+    }
+    size_t block_offset = position - index * block_size;
+    size_t length = block->length - block_offset;
+    if (length > size - copied) {
+      length = size - copied;
+    }
+    memcpy((char*)buffer + copied, block->data + block_offset, length);
+    copied += length;
+  }
+  uv_mutex_unlock(&source->lock);
+  return copied;
+}
@@ -0,0 +1,51 @@
+//
+//  http_source.h
+//  barc
+//
+
+#ifndef http_source_h
+#define http_source_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Random access to a remote file through HTTP range requests, so an archive
+ * can be rendered without downloading it first. Reads go through a cache of
+ * fixed size blocks; misses that continue a sequential run fetch several
+ * blocks in one request. Safe to read from several threads: the cache is
+ * locked only while blocks are looked up or copied, never during a request,
+ * so readers of cached blocks don't wait on the network, and each request
+ * uses its own connection.
+ */
+struct http_source_s;
+
+/**
+ * Probe url with a one byte range request, unless size is already known
+ * (from http_source_probe) and positive.
+ * @return 0 if the server answers ranges and reports the file size
+ */
+int http_source_open(struct http_source_s** source_out, const char* url,
+                     int64_t size);
+void http_source_free(struct http_source_s* source);
+/**
+ * For callers choosing how to fetch url. Hand size to http_source_open (by
+ * way of zip_io_open_remote) to skip probing again.
+ * @return 0 if url can be opened
+ */
+int http_source_probe(const char* url, int64_t* size_out);
+
+int64_t http_source_get_size(const struct http_source_s* source);
+
+/**
+ * Copy up to size bytes at offset into buffer.
+ * @return bytes copied (0 at the end of the file), or -1 on a failed request
+ */
+int64_t http_source_read(struct http_source_s* source, int64_t offset,
+                         void* buffer, size_t size);
+
+/** Range requests made and bytes received so far, including the probe. */
+void http_source_get_stats(const struct http_source_s* source,
+                           size_t* requests_out, int64_t* bytes_out);
+
+#endif /* http_source_h */
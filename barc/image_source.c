@@ -12,6 +12,7 @@
 #include <MagickWand/MagickWand.h>
 #include <MagickWand/magick-image.h>
 #include "yuv_rgb.h"
+#include "zip_io.h"
 
 #define ThrowWandException(wand) \
 { \
@@ -27,12 +28,15 @@ description=(char *) MagickRelinquishMemory(description); \
 }
 
 struct image_source_s {
+  struct zip_io_s* zip;
   const char* sz_path;
   const char* sz_name;
   const char* sz_class;
   double start_offset;
   double stop_offset;
   AVFrame* frame;
+  // one long-lived wrapper, so conversions cached on it survive across ticks
+  struct smart_frame_t* smart_frame;
   struct media_stream_s* media_stream;
   struct source_s* container;
 };
@@ -49,12 +53,14 @@ double get_stop_offset(void* p);
 struct media_stream_s* get_media_stream(void* p);
 void free_f(void* p);
 
-int image_source_create(struct image_source_s** source_out, const char* path,
+int image_source_create(struct image_source_s** source_out,
+                        struct zip_io_s* zip, const char* path,
                         double start_offset, double stop_offset,
                         const char* stream_name,
                         const char* stream_class)
 {
   struct image_source_s* pthis = calloc(1, sizeof(struct image_source_s));
+  pthis->zip = zip;
   pthis->sz_path = path;
   pthis->start_offset = start_offset;
   pthis->stop_offset = stop_offset;
@@ -85,6 +91,8 @@ int image_source_create(struct image_source_s** source_out, const char* path,
     free(pthis);
     return ret;
   }
+  // the smart frame owns pthis->frame from here on
+  smart_frame_create(&pthis->smart_frame, pthis->frame);
 
   //set up media stream
   media_stream_set_name(pthis->media_stream, pthis->sz_name);
@@ -98,13 +106,25 @@ int image_source_create(struct image_source_s** source_out, const char* path,
 
 void image_source_free(struct image_source_s* pthis) {
   media_stream_free(pthis->media_stream);
-  av_frame_free(&pthis->frame);
+  smart_frame_release(pthis->smart_frame);
   free(pthis);
 }
 
 int read_image(struct image_source_s* pthis) {
   MagickWand* wand = NewMagickWand();
-  MagickBooleanType ret = MagickReadImage(wand, pthis->sz_path);
+  MagickBooleanType ret;
+  if (pthis->zip) {
+    void* data;
+    size_t size;
+    if (zip_io_read_entry(pthis->zip, pthis->sz_path, &data, &size)) {
+      DestroyMagickWand(wand);
+      return -1;
+    }
+    ret = MagickReadImageBlob(wand, data, size);
+    free(data);
+  } else {
+    ret = MagickReadImage(wand, pthis->sz_path);
+  }
   if (!ret) {
     printf("failed to read image at %s\n", pthis->sz_path);
     ThrowWandException(wand);
@@ -167,7 +187,7 @@ int video_callback(struct media_stream_s* stream,
                    double time_clock, void* p)
 {
   struct image_source_s* pthis = (struct image_source_s*)p;
-  smart_frame_create(frame_out, pthis->frame);
+  *frame_out = pthis->smart_frame;
   return 0;
 }
 
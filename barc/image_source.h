@@ -9,10 +9,13 @@
 #define image_source_h
 
 struct image_source_s;
+struct zip_io_s;
 
-/** Holds a single frame from an image file. */
+/** Holds a single frame from an image file. path names an entry of zip, or a
+ * file when zip is NULL. */
 
-int image_source_create(struct image_source_s** source_out, const char* path,
+int image_source_create(struct image_source_s** source_out,
+                        struct zip_io_s* zip, const char* path,
                         double start_offset, double stop_offset,
                         const char* stream_name,
                         const char* stream_class);
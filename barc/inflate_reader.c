@@ -0,0 +1,242 @@
+//
+//  inflate_reader.c
+//  barc
+//
+
+#include "inflate_reader.h"
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+// deflate back references reach at most this far
+#define INFLATE_WINDOW_SIZE 32768
+#define INFLATE_INPUT_SIZE (16 * 1024)
+
+struct access_point_s {
+  // output offset of the point
+  int64_t out;
+  // offset of the first compressed byte entirely after the point
+  int64_t in;
+  // bits of the byte before in that already belong to the next block
+  int bits;
+  // the output leading up to the point, oldest first
+  unsigned char window[INFLATE_WINDOW_SIZE];
+};
+
+struct inflate_reader_s {
+  z_stream stream;
+  inflate_reader_read_cb read_cb;
+  void* opaque;
+  int64_t compressed_size;
+  int64_t size;
+  // next compressed byte to fetch
+  int64_t in_offset;
+  // output offset of the next byte handed to the caller
+  int64_t position;
+  // total output inflated, i.e. the output offset at window_pos
+  int64_t out;
+  unsigned char input[INFLATE_INPUT_SIZE];
+  // circular: the newest output ends at window_pos. the last staged bytes
+  // before it are inflated but not yet read.
+  unsigned char window[INFLATE_WINDOW_SIZE];
+  size_t window_pos;
+  size_t staged;
+  char finished;
+  struct access_point_s* points;
+  size_t point_count;
+  size_t point_capacity;
+};
+
+static struct access_point_s* add_point(struct inflate_reader_s* reader) {
+  if (reader->point_count == reader->point_capacity) {
+    size_t capacity = reader->point_capacity ? reader->point_capacity * 2 : 8;
+    struct access_point_s* points = (struct access_point_s*)
+    realloc(reader->points, capacity * sizeof(struct access_point_s));
+    if (!points) {
+      return NULL;
+    }
+    reader->points = points;
+    reader->point_capacity = capacity;
+  }
+  struct access_point_s* point = &reader->points[reader->point_count++];
+  point->out = reader->out;
+  point->in = reader->in_offset - reader->stream.avail_in;
+  point->bits = reader->stream.data_type & 7;
+  size_t tail = INFLATE_WINDOW_SIZE - reader->window_pos;
+  memcpy(point->window, reader->window + reader->window_pos, tail);
+  memcpy(point->window + tail, reader->window, reader->window_pos);
+  return point;
+}
+
+int inflate_reader_alloc(struct inflate_reader_s** reader_out,
+                         inflate_reader_read_cb read_cb, void* opaque,
+                         int64_t compressed_size, int64_t size)
+{
+  struct inflate_reader_s* reader = (struct inflate_reader_s*)
+  calloc(1, sizeof(struct inflate_reader_s));
+  if (!reader) {
+    return -1;
+  }
+  // negative window bits: raw deflate, no zlib or gzip header
+  if (Z_OK != inflateInit2(&reader->stream, -15)) {
+    free(reader);
+    return -1;
+  }
+  reader->read_cb = read_cb;
+  reader->opaque = opaque;
+  reader->compressed_size = compressed_size;
+  reader->size = size;
+  // the top of the stream needs no dictionary
+  if (!add_point(reader)) {
+    inflate_reader_free(reader);
+    return -1;
+  }
+  *reader_out = reader;
+  return 0;
+}
+
+void inflate_reader_free(struct inflate_reader_s* reader) {
+  inflateEnd(&reader->stream);
+  free(reader->points);
+  free(reader);
+}
+
+size_t inflate_reader_get_point_count(struct inflate_reader_s* reader) {
+  return reader->point_count;
+}
+
+// inflate a little more into the window. staged output must be used up.
+static int produce(struct inflate_reader_s* reader) {
+  if (INFLATE_WINDOW_SIZE == reader->window_pos) {
+    reader->window_pos = 0;
+  }
+  z_stream* stream = &reader->stream;
+  if (!stream->avail_in) {
+    int64_t want = reader->compressed_size - reader->in_offset;
+    if (want <= 0) {
+      // the stream ended before its last block
+      return -1;
+    }
+    if (want > INFLATE_INPUT_SIZE) {
+      want = INFLATE_INPUT_SIZE;
+    }
+    int64_t len = reader->read_cb(reader->opaque, reader->in_offset,
+                                  reader->input, want);
+    if (len <= 0) {
+      return -1;
+    }
+    reader->in_offset += len;
+    stream->next_in = reader->input;
+    stream->avail_in = (uInt)len;
+  }
+  size_t space = INFLATE_WINDOW_SIZE - reader->window_pos;
+  stream->next_out = reader->window + reader->window_pos;
+  stream->avail_out = (uInt)space;
+  int ret = inflate(stream, Z_BLOCK);
+  if (Z_OK != ret && Z_STREAM_END != ret && Z_BUF_ERROR != ret) {
+    return -1;
+  }
+  size_t produced = space - stream->avail_out;
+  reader->window_pos += produced;
+  reader->staged += produced;
+  reader->out += produced;
+  if (Z_STREAM_END == ret) {
+    reader->finished = 1;
+    return 0;
+  }
+  // between two blocks, and past anything indexed so far
+  struct access_point_s* last = &reader->points[reader->point_count - 1];
+  if ((stream->data_type & 128) && !(stream->data_type & 64) &&
+      reader->out > last->out + INFLATE_READER_SPAN)
+  {
+    if (!add_point(reader)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int restore_point(struct inflate_reader_s* reader,
+                         const struct access_point_s* point)
+{
+  z_stream* stream = &reader->stream;
+  if (Z_OK != inflateReset(stream)) {
+    return -1;
+  }
+  stream->avail_in = 0;
+  reader->in_offset = point->in;
+  if (point->bits) {
+    unsigned char byte;
+    reader->in_offset--;
+    if (1 != reader->read_cb(reader->opaque, reader->in_offset, &byte, 1)) {
+      return -1;
+    }
+    reader->in_offset++;
+    inflatePrime(stream, point->bits, byte >> (8 - point->bits));
+  }
+  if (point->out) {
+    inflateSetDictionary(stream, point->window, INFLATE_WINDOW_SIZE);
+  }
+  // keep the history too, for access points added after this one
+  memcpy(reader->window, point->window, INFLATE_WINDOW_SIZE);
+  reader->window_pos = 0;
+  reader->staged = 0;
+  reader->out = point->out;
+  reader->position = point->out;
+  reader->finished = 0;
+  return 0;
+}
+
+int64_t inflate_reader_read(struct inflate_reader_s* reader,
+                            void* buf, size_t size)
+{
+  size_t done = 0;
+  while (done < size) {
+    if (reader->staged) {
+      size_t len = size - done < reader->staged ? size - done : reader->staged;
+      memcpy((unsigned char*)buf + done,
+             reader->window + reader->window_pos - reader->staged, len);
+      reader->staged -= len;
+      reader->position += len;
+      done += len;
+    } else if (reader->finished) {
+      break;
+    } else if (produce(reader)) {
+      return done ? (int64_t)done : -1;
+    }
+  }
+  return done;
+}
+
+int inflate_reader_seek(struct inflate_reader_s* reader, int64_t target) {
+  if (target < 0 || target > reader->size) {
+    return -1;
+  }
+  if (target < reader->position ||
+      target - reader->position > INFLATE_READER_SPAN)
+  {
+    size_t i = reader->point_count - 1;
+    while (i > 0 && reader->points[i].out > target) {
+      i--;
+    }
+    const struct access_point_s* point = &reader->points[i];
+    if ((point->out > reader->position || target < reader->position) &&
+        restore_point(reader, point))
+    {
+      return -1;
+    }
+  }
+  while (reader->position < target) {
+    if (reader->staged) {
+      int64_t len = target - reader->position;
+      if (len > (int64_t)reader->staged) {
+        len = reader->staged;
+      }
+      reader->staged -= len;
+      reader->position += len;
+    } else if (reader->finished || produce(reader)) {
+      return -1;
+    }
+  }
+  return 0;
+}
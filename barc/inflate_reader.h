@@ -0,0 +1,52 @@
+//
+//  inflate_reader.h
+//  barc
+//
+
+#ifndef inflate_reader_h
+#define inflate_reader_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Random access into a raw deflate stream, the way zlib's zran example does
+ * it. While inflating forward, the reader saves an access point (compressed
+ * offset, bit offset and the last 32 KiB of output) at a block boundary
+ * about every INFLATE_READER_SPAN bytes of output. A seek then restarts
+ * inflation at the nearest point before the target instead of at the top
+ * of the stream, so going back costs at most a span of inflating.
+ *
+ * Compressed bytes come from read_cb, at whatever offset the reader asks
+ * for. Not thread safe; each reader belongs to one demuxer.
+ */
+struct inflate_reader_s;
+
+#define INFLATE_READER_SPAN (1024 * 1024)
+
+/**
+ * Read up to size compressed bytes at offset into buf.
+ * @return bytes read, 0 at the end, or negative on error
+ */
+typedef int64_t (*inflate_reader_read_cb)(void* opaque, int64_t offset,
+                                          void* buf, size_t size);
+
+/**
+ * @param compressed_size length of the deflate stream
+ * @param size length of the output
+ */
+int inflate_reader_alloc(struct inflate_reader_s** reader_out,
+                         inflate_reader_read_cb read_cb, void* opaque,
+                         int64_t compressed_size, int64_t size);
+void inflate_reader_free(struct inflate_reader_s* reader);
+
+/** @return bytes read, 0 at the end of the output, or negative on error */
+int64_t inflate_reader_read(struct inflate_reader_s* reader,
+                            void* buf, size_t size);
+/** @return 0 once the next read starts at output offset target */
+int inflate_reader_seek(struct inflate_reader_s* reader, int64_t target);
+
+/** Access points saved so far. */
+size_t inflate_reader_get_point_count(struct inflate_reader_s* reader);
+
+#endif /* inflate_reader_h */
@@ -0,0 +1,78 @@
+//
+//  job_budget.c
+//  barc
+//
+
+#include "job_budget.h"
+
+// mirrors the defaults of each pipeline stage (see barc_pipeline_config_s)
+static const size_t default_decode_bytes = 16 * 1024 * 1024;
+static const int default_compose_jobs = 64;
+static const size_t default_encode_video_bytes = 32 * 1024 * 1024;
+// sources are not known until the manifest is read. most archives have few.
+static const int estimated_source_count = 4;
+// codecs, muxer, litehtml and MagickWand state
+static const size_t base_memory = 64 * 1024 * 1024;
+// one encode thread per track, and composition on the shared pool
+static const double cores_per_render = 2;
+
+void job_budget_estimate(const struct archive_config_s* config,
+                         struct job_cost_s* cost_out)
+{
+  const struct barc_pipeline_config_s* pipeline = &config->pipeline;
+  size_t decode_bytes = pipeline->decode_bytes ?
+  pipeline->decode_bytes : default_decode_bytes;
+  int compose_jobs = pipeline->compose_jobs > 0 ?
+  pipeline->compose_jobs : default_compose_jobs;
+  size_t encode_bytes = pipeline->encode_video_bytes ?
+  pipeline->encode_video_bytes : default_encode_video_bytes;
+  // composed frames are RGBA
+  size_t frame_bytes = config->width * config->height * 4;
+
+  size_t memory = base_memory + estimated_source_count * decode_bytes +
+  compose_jobs * frame_bytes + encode_bytes;
+  for (size_t i = 0; i < config->rendition_count; i++) {
+    const struct barc_rendition_s* rendition = &config->renditions[i];
+    memory += compose_jobs * rendition->out_width * rendition->out_height * 4 +
+    encode_bytes;
+  }
+  int renders = config->parallel_segments > 1 ? config->parallel_segments : 1;
+  cost_out->cpu = cores_per_render * renders;
+  cost_out->memory = memory * renders;
+}
+
+int job_budget_admits(const struct job_budget_s* budget,
+                      const struct job_cost_s* cost)
+{
+  if (!budget->running) {
+    return 1;
+  }
+  if (budget->cpu > 0 && budget->used.cpu + cost->cpu > budget->cpu) {
+    return 0;
+  }
+  if (budget->memory && budget->used.memory + cost->memory > budget->memory) {
+    return 0;
+  }
+  return 1;
+}
+
+void job_budget_acquire(struct job_budget_s* budget,
+                        const struct job_cost_s* cost)
+{
+  budget->used.cpu += cost->cpu;
+  budget->used.memory += cost->memory;
+  budget->running++;
+}
+
+void job_budget_release(struct job_budget_s* budget,
+                        const struct job_cost_s* cost)
+{
+  budget->used.cpu -= cost->cpu;
+  budget->used.memory -= cost->memory;
+  budget->running--;
+  if (!budget->running) {
+    // don't let rounding drift accumulate across jobs
+    budget->used.cpu = 0;
+    budget->used.memory = 0;
+  }
+}
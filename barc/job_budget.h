@@ -0,0 +1,49 @@
+//
+//  job_budget.h
+//  barc
+//
+
+#ifndef job_budget_h
+#define job_budget_h
+
+#include <stddef.h>
+#include "archive_package.h"
+
+/** What a render is expected to hold while it runs. */
+struct job_cost_s {
+  // cores kept busy
+  double cpu;
+  // peak resident bytes
+  size_t memory;
+};
+
+/** Resources shared by every job in the process. Zero means unlimited. */
+struct job_budget_s {
+  double cpu;
+  size_t memory;
+  // sum of the costs of admitted jobs
+  struct job_cost_s used;
+  int running;
+};
+
+/**
+ * Estimate from the output size and the pipeline queue limits. Every bounded
+ * queue is assumed full, which is where a render sits when its slowest stage
+ * is saturated.
+ */
+void job_budget_estimate(const struct archive_config_s* config,
+                         struct job_cost_s* cost_out);
+
+/**
+ * A job fits if it leaves the budget within its limits. The first job is
+ * always admitted, so a job bigger than the whole budget runs alone instead
+ * of never running.
+ */
+int job_budget_admits(const struct job_budget_s* budget,
+                      const struct job_cost_s* cost);
+void job_budget_acquire(struct job_budget_s* budget,
+                        const struct job_cost_s* cost);
+void job_budget_release(struct job_budget_s* budget,
+                        const struct job_cost_s* cost);
+
+#endif /* job_budget_h */
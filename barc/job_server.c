@@ -0,0 +1,488 @@
+//
+//  job_server.c
+//  barc
+//
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <jansson.h>
+#include <uv.h>
+
+#include "job_server.h"
+#include "job_budget.h"
+#include "batch_runner.h"
+#include "memory_governor.h"
+#include "perf_stats.h"
+
+static const uint64_t progress_interval_ms = 1000;
+// a job line longer than this is not a job
+static const size_t max_line_length = 1024 * 1024;
+
+struct job_server_s;
+
+struct server_client_s {
+  uv_pipe_t pipe;
+  struct job_server_s* server;
+  char* line;
+  size_t line_length;
+  size_t line_capacity;
+  struct server_client_s* next;
+};
+
+struct server_job_s {
+  struct batch_job_s* job;
+  struct job_cost_s cost;
+  // who to tell about this job. NULL once they hang up.
+  struct server_client_s* client;
+  struct job_server_s* server;
+  int finished;
+  uv_thread_t thread;
+  struct server_job_s* next;
+};
+
+struct job_server_s {
+  const struct job_server_config_s* config;
+  uv_loop_t* loop;
+  uv_pipe_t listener;
+  // render threads wake the loop through this when they finish
+  uv_async_t finished_async;
+  uv_timer_t progress_timer;
+  uv_signal_t sigint;
+  uv_signal_t sigterm;
+  struct job_budget_s budget;
+  struct server_job_s* queue_head;
+  struct server_job_s* queue_tail;
+  struct server_job_s* running;
+  struct server_client_s* clients;
+  char stopping;
+};
+
+struct server_write_s {
+  uv_write_t req;
+  char* data;
+};
+
+static void schedule_jobs(struct job_server_s* server);
+static void close_client(struct server_client_s* client);
+
+#pragma mark - Events
+
+static void after_write(uv_write_t* req, int status) {
+  struct server_write_s* write = (struct server_write_s*)req;
+  free(write->data);
+  free(write);
+}
+
+// takes the reference on event
+static void send_event(struct server_client_s* client, json_t* event) {
+  if (!event) {
+    return;
+  }
+  char* data = client ? json_dumps(event, JSON_COMPACT) : NULL;
+  json_decref(event);
+  if (!data) {
+    return;
+  }
+  size_t length = strlen(data);
+  data = (char*)realloc(data, length + 2);
+  data[length] = '\n';
+  data[length + 1] = '\0';
+  struct server_write_s* write = (struct server_write_s*)
+  calloc(1, sizeof(struct server_write_s));
+  write->data = data;
+  uv_buf_t buf = uv_buf_init(data, (unsigned int)length + 1);
+  int ret = uv_write(&write->req, (uv_stream_t*)&client->pipe, &buf, 1,
+                     after_write);
+  if (ret) {
+    printf("job server: write failed: %s\n", uv_strerror(ret));
+    free(data);
+    free(write);
+  }
+}
+
+static void send_job_event(struct server_job_s* server_job,
+                           const char* event_name)
+{
+  send_event(server_job->client,
+             json_pack("{s:s, s:s}", "event", event_name,
+                       "id", batch_job_get_id(server_job->job)));
+}
+
+static void send_job_result(struct server_job_s* server_job) {
+  int ret = batch_job_get_result(server_job->job);
+  time_t start_time = batch_job_get_start_time(server_job->job);
+  printf("job server: %s %s (ret %d)\n", batch_job_get_id(server_job->job),
+         ret ? "failed" : "done", ret);
+  send_event(server_job->client,
+             json_pack("{s:s, s:s, s:i, s:I}",
+                       "event", ret ? "failed" : "done",
+                       "id", batch_job_get_id(server_job->job),
+                       "ret", ret,
+                       "seconds", (json_int_t)(time(NULL) - start_time)));
+}
+
+static void send_status(struct job_server_s* server,
+                        struct server_client_s* client)
+{
+  int queued = 0;
+  for (struct server_job_s* job = server->queue_head; job; job = job->next) {
+    queued++;
+  }
+  send_event(client,
+             json_pack("{s:s, s:i, s:i, s:f, s:f, s:I, s:I, s:I, s:I}",
+                       "event", "status",
+                       "running", server->budget.running,
+                       "queued", queued,
+                       "cpu_used", server->budget.used.cpu,
+                       "cpu_budget", server->budget.cpu,
+                       "memory_used", (json_int_t)server->budget.used.memory,
+                       "memory_budget", (json_int_t)server->budget.memory,
+                       "memory_queued", (json_int_t)memory_governor_used(),
+                       "memory_limit",
+                       (json_int_t)memory_governor_get_limit()));
+}
+
+#pragma mark - Jobs
+
+static void server_job_free(struct server_job_s* server_job) {
+  batch_job_free(server_job->job);
+  free(server_job);
+}
+
+static void run_server_job(void* p) {
+  struct server_job_s* server_job = (struct server_job_s*)p;
+  struct job_server_s* server = server_job->server;
+  batch_job_execute(server_job->job);
+  __atomic_store_n(&server_job->finished, 1, __ATOMIC_RELEASE);
+  uv_async_send(&server->finished_async);
+}
+
+static void submit_job(struct server_client_s* client, const char* line) {
+  struct job_server_s* server = client->server;
+  struct batch_job_s* job = NULL;
+  if (server->stopping) {
+    send_event(client, json_pack("{s:s, s:s}", "event", "rejected",
+                                 "error", "shutting down"));
+    return;
+  }
+  if (batch_job_parse(line, &server->config->defaults, &job)) {
+    send_event(client, json_pack("{s:s, s:s}", "event", "rejected",
+                                 "error", "invalid job"));
+    return;
+  }
+  if (batch_job_check_output(job)) {
+    send_event(client, json_pack("{s:s, s:s, s:s}", "event", "rejected",
+                                 "id", batch_job_get_id(job),
+                                 "error", "output directory not writable"));
+    batch_job_free(job);
+    return;
+  }
+  struct server_job_s* server_job = (struct server_job_s*)
+  calloc(1, sizeof(struct server_job_s));
+  server_job->job = job;
+  server_job->client = client;
+  server_job->server = server;
+  job_budget_estimate(batch_job_get_config(job), &server_job->cost);
+  if (server->queue_tail) {
+    server->queue_tail->next = server_job;
+  } else {
+    server->queue_head = server_job;
+  }
+  server->queue_tail = server_job;
+  send_event(client, json_pack("{s:s, s:s, s:f, s:I}", "event", "queued",
+                               "id", batch_job_get_id(job),
+                               "cpu", server_job->cost.cpu,
+                               "memory",
+                               (json_int_t)server_job->cost.memory));
+  schedule_jobs(server);
+}
+
+// strictly in order: a big job at the head is not starved by small ones
+// slipping past it. estimates can be off, so nothing new starts while the
+// frames actually queued are close to --memory_limit either; the progress
+// timer tries again.
+static void schedule_jobs(struct job_server_s* server) {
+  while (!server->stopping && server->queue_head &&
+         job_budget_admits(&server->budget, &server->queue_head->cost) &&
+         (!server->running || !memory_governor_under_pressure()))
+  {
+    struct server_job_s* server_job = server->queue_head;
+    server->queue_head = server_job->next;
+    if (!server->queue_head) {
+      server->queue_tail = NULL;
+    }
+    job_budget_acquire(&server->budget, &server_job->cost);
+    // nothing else is decoding, so the per-source breakdown starts over
+    if (!server->running) {
+      perf_stats_reset_sources();
+    }
+    server_job->next = server->running;
+    server->running = server_job;
+    printf("job server: starting %s (%d running)\n",
+           batch_job_get_id(server_job->job), server->budget.running);
+    send_job_event(server_job, "started");
+    uv_thread_create(&server_job->thread, run_server_job, server_job);
+  }
+}
+
+static void close_handle(uv_handle_t* handle) {
+  if (!uv_is_closing(handle)) {
+    uv_close(handle, NULL);
+  }
+}
+
+// once nothing is rendering, let the loop run dry
+static void maybe_finish_stopping(struct job_server_s* server) {
+  if (!server->stopping || server->running) {
+    return;
+  }
+  close_handle((uv_handle_t*)&server->finished_async);
+  close_handle((uv_handle_t*)&server->progress_timer);
+  close_handle((uv_handle_t*)&server->sigint);
+  close_handle((uv_handle_t*)&server->sigterm);
+  struct server_client_s* client = server->clients;
+  while (client) {
+    struct server_client_s* next = client->next;
+    close_client(client);
+    client = next;
+  }
+}
+
+static void on_job_finished(uv_async_t* handle) {
+  struct job_server_s* server = (struct job_server_s*)handle->data;
+  struct server_job_s** link = &server->running;
+  while (*link) {
+    struct server_job_s* server_job = *link;
+    if (!__atomic_load_n(&server_job->finished, __ATOMIC_ACQUIRE)) {
+      link = &server_job->next;
+      continue;
+    }
+    uv_thread_join(&server_job->thread);
+    *link = server_job->next;
+    job_budget_release(&server->budget, &server_job->cost);
+    send_job_result(server_job);
+    server_job_free(server_job);
+  }
+  schedule_jobs(server);
+  maybe_finish_stopping(server);
+}
+
+static void on_progress_timer(uv_timer_t* handle) {
+  struct job_server_s* server = (struct job_server_s*)handle->data;
+  for (struct server_job_s* server_job = server->running; server_job;
+       server_job = server_job->next)
+  {
+    double complete, total;
+    if (!server_job->client) {
+      continue;
+    }
+    batch_job_get_progress(server_job->job, &complete, &total);
+    send_event(server_job->client,
+               json_pack("{s:s, s:s, s:{s:f, s:f}}",
+                         "event", "progress",
+                         "id", batch_job_get_id(server_job->job),
+                         "progress",
+                         "complete", complete * 1000,
+                         "total", total * 1000));
+  }
+  schedule_jobs(server);
+}
+
+#pragma mark - Connections
+
+static void forget_client(struct job_server_s* server,
+                          struct server_client_s* client)
+{
+  struct server_job_s* lists[] = { server->queue_head, server->running };
+  for (int i = 0; i < 2; i++) {
+    for (struct server_job_s* job = lists[i]; job; job = job->next) {
+      if (job->client == client) {
+        job->client = NULL;
+      }
+    }
+  }
+  struct server_client_s** link = &server->clients;
+  while (*link && *link != client) {
+    link = &(*link)->next;
+  }
+  if (*link) {
+    *link = client->next;
+  }
+}
+
+static void after_close_client(uv_handle_t* handle) {
+  struct server_client_s* client = (struct server_client_s*)handle->data;
+  free(client->line);
+  free(client);
+}
+
+static void close_client(struct server_client_s* client) {
+  forget_client(client->server, client);
+  if (!uv_is_closing((uv_handle_t*)&client->pipe)) {
+    uv_close((uv_handle_t*)&client->pipe, after_close_client);
+  }
+}
+
+static void handle_line(struct server_client_s* client, const char* line) {
+  json_error_t error;
+  json_t* json = json_loads(line, 0, &error);
+  const char* command = NULL;
+  if (json && !json_unpack(json, "{s:s}", "command", &command)) {
+    if (!strcmp(command, "status")) {
+      send_status(client->server, client);
+    } else {
+      send_event(client, json_pack("{s:s, s:s}", "event", "rejected",
+                                   "error", "unknown command"));
+    }
+    json_decref(json);
+    return;
+  }
+  json_decref(json);
+  submit_job(client, line);
+}
+
+static void alloc_read_buffer(uv_handle_t* handle, size_t suggested_size,
+                              uv_buf_t* buf)
+{
+  buf->base = (char*)malloc(suggested_size);
+  buf->len = buf->base ? suggested_size : 0;
+}
+
+static void on_client_read(uv_stream_t* stream, ssize_t nread,
+                           const uv_buf_t* buf)
+{
+  struct server_client_s* client = (struct server_client_s*)stream->data;
+  if (nread < 0) {
+    free(buf->base);
+    close_client(client);
+    return;
+  }
+  for (ssize_t i = 0; i < nread; i++) {
+    char c = buf->base[i];
+    if ('\n' == c) {
+      if (client->line_length) {
+        client->line[client->line_length] = '\0';
+        handle_line(client, client->line);
+      }
+      client->line_length = 0;
+      continue;
+    }
+    if (client->line_length + 1 >= client->line_capacity) {
+      if (client->line_capacity >= max_line_length) {
+        printf("job server: dropping client with an oversized line\n");
+        free(buf->base);
+        close_client(client);
+        return;
+      }
+      client->line_capacity = client->line_capacity ?
+      client->line_capacity * 2 : 4096;
+      client->line = (char*)realloc(client->line, client->line_capacity);
+    }
+    client->line[client->line_length++] = c;
+  }
+  free(buf->base);
+}
+
+static void on_connection(uv_stream_t* listener, int status) {
+  struct job_server_s* server = (struct job_server_s*)listener->data;
+  if (status < 0) {
+    printf("job server: connection error: %s\n", uv_strerror(status));
+    return;
+  }
+  struct server_client_s* client = (struct server_client_s*)
+  calloc(1, sizeof(struct server_client_s));
+  client->server = server;
+  uv_pipe_init(server->loop, &client->pipe, 0);
+  client->pipe.data = client;
+  if (uv_accept(listener, (uv_stream_t*)&client->pipe)) {
+    uv_close((uv_handle_t*)&client->pipe, after_close_client);
+    return;
+  }
+  client->next = server->clients;
+  server->clients = client;
+  uv_read_start((uv_stream_t*)&client->pipe, alloc_read_buffer,
+                on_client_read);
+}
+
+static void on_signal(uv_signal_t* handle, int signum) {
+  struct job_server_s* server = (struct job_server_s*)handle->data;
+  if (server->stopping) {
+    return;
+  }
+  printf("job server: caught signal %d. finishing %d running jobs\n",
+         signum, server->budget.running);
+  server->stopping = 1;
+  close_handle((uv_handle_t*)&server->listener);
+  while (server->queue_head) {
+    struct server_job_s* server_job = server->queue_head;
+    server->queue_head = server_job->next;
+    send_job_event(server_job, "cancelled");
+    server_job_free(server_job);
+  }
+  server->queue_tail = NULL;
+  maybe_finish_stopping(server);
+}
+
+#pragma mark - Public API
+
+int job_server_run(const struct job_server_config_s* config) {
+  struct job_server_s server;
+  memset(&server, 0, sizeof(server));
+  server.config = config;
+  server.budget.cpu = config->cpu_budget;
+  server.budget.memory = config->memory_budget;
+  if (server.budget.cpu <= 0) {
+    uv_cpu_info_t* cpu_info;
+    int cpu_count = 0;
+    if (!uv_cpu_info(&cpu_info, &cpu_count)) {
+      uv_free_cpu_info(cpu_info, cpu_count);
+    }
+    server.budget.cpu = cpu_count > 0 ? cpu_count : 1;
+  }
+
+  server.loop = (uv_loop_t*)malloc(sizeof(uv_loop_t));
+  uv_loop_init(server.loop);
+
+  // a socket left behind by a previous run would make bind fail
+  unlink(config->socket_path);
+  uv_pipe_init(server.loop, &server.listener, 0);
+  server.listener.data = &server;
+  int ret = uv_pipe_bind(&server.listener, config->socket_path);
+  if (!ret) {
+    ret = uv_listen((uv_stream_t*)&server.listener, 16, on_connection);
+  }
+  if (ret) {
+    printf("job server: unable to listen on %s: %s\n",
+           config->socket_path, uv_strerror(ret));
+    uv_close((uv_handle_t*)&server.listener, NULL);
+    uv_run(server.loop, UV_RUN_DEFAULT);
+    uv_loop_close(server.loop);
+    free(server.loop);
+    return ret;
+  }
+
+  uv_async_init(server.loop, &server.finished_async, on_job_finished);
+  server.finished_async.data = &server;
+  uv_timer_init(server.loop, &server.progress_timer);
+  server.progress_timer.data = &server;
+  uv_timer_start(&server.progress_timer, on_progress_timer,
+                 progress_interval_ms, progress_interval_ms);
+  uv_signal_init(server.loop, &server.sigint);
+  server.sigint.data = &server;
+  uv_signal_start(&server.sigint, on_signal, SIGINT);
+  uv_signal_init(server.loop, &server.sigterm);
+  server.sigterm.data = &server;
+  uv_signal_start(&server.sigterm, on_signal, SIGTERM);
+
+  printf("job server: listening on %s (cpu budget %.1f, memory budget %zu)\n",
+         config->socket_path, server.budget.cpu, server.budget.memory);
+  uv_run(server.loop, UV_RUN_DEFAULT);
+
+  unlink(config->socket_path);
+  uv_loop_close(server.loop);
+  free(server.loop);
+  return 0;
+}
@@ -0,0 +1,48 @@
+//
+//  job_server.h
+//  barc
+//
+
+#ifndef job_server_h
+#define job_server_h
+
+#include <stddef.h>
+#include "archive_package.h"
+
+/**
+ * A resident barc that takes render jobs over a Unix domain socket.
+ *
+ * Clients write one JSON job per line, with the fields --batch accepts (see
+ * batch_runner.h), including the web API names. Jobs are admitted in order
+ * as long as they fit the CPU and memory budget (see job_budget.h), and every
+ * job runs on its own thread in this process, sharing the compose pool.
+ *
+ * The server answers the submitting connection with one JSON event per line:
+ *   {"event": "queued", "id": "abc", "cpu": 2, "memory": 123456789}
+ *   {"event": "started", "id": "abc"}
+ *   {"event": "progress", "id": "abc",
+ *    "progress": {"complete": 1000, "total": 60000}}   (milliseconds)
+ *   {"event": "done", "id": "abc", "ret": 0, "seconds": 42}
+ *   {"event": "failed", "id": "abc", "ret": -1, "seconds": 3}
+ *   {"event": "rejected", "error": "..."}
+ * {"command": "status"} is answered with an event describing the budget.
+ * Jobs keep running if their connection goes away.
+ */
+struct job_server_config_s {
+  const char* socket_path;
+  // options applied to every job unless the job overrides them
+  struct archive_config_s defaults;
+  // cores to keep busy. zero uses every core.
+  double cpu_budget;
+  // bytes all running jobs may hold. zero is unlimited.
+  size_t memory_budget;
+};
+
+/**
+ * Serve until SIGINT or SIGTERM. Queued jobs are dropped on shutdown;
+ * running jobs are allowed to finish.
+ * @return 0 after a clean shutdown
+ */
+int job_server_run(const struct job_server_config_s* config);
+
+#endif /* job_server_h */
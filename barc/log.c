@@ -0,0 +1,167 @@
+//
+//  log.c
+//  barc
+//
+
+#include "log.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_LINE_MAX 1024
+
+static const char* level_names[] = {
+  "off", "error", "warn", "info", "debug"
+};
+
+static const char* module_names[log_module_count] = {
+  "barc", "mixer", "compose", "source", "writer", "archive"
+};
+
+unsigned char log_levels[log_module_count] = {
+  log_level_info, log_level_info, log_level_info,
+  log_level_info, log_level_info, log_level_info
+};
+
+// progress events no closer together than this, in nanoseconds
+static const uint64_t progress_interval = 1000000000;
+
+static FILE* progress_file;
+static uint64_t progress_start;
+static uint64_t progress_last;
+
+static int find_name(const char** names, int count, const char* name,
+                     size_t length)
+{
+  for (int i = 0; i < count; i++) {
+    if (strlen(names[i]) == length && !strncmp(names[i], name, length)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int log_configure(const char* spec) {
+  const char* entry = spec;
+  while (entry && *entry) {
+    size_t length = strcspn(entry, ",");
+    const char* equals = memchr(entry, '=', length);
+    const char* level_name = equals ? equals + 1 : entry;
+    int level = find_name(level_names, log_level_debug + 1, level_name,
+                          length - (level_name - entry));
+    if (level < 0) {
+      return -1;
+    }
+    if (equals) {
+      int module = find_name(module_names, log_module_count, entry,
+                             equals - entry);
+      if (module < 0) {
+        return -1;
+      }
+      log_levels[module] = level;
+    } else {
+      memset(log_levels, level, sizeof(log_levels));
+    }
+    entry += length;
+    if (',' == *entry) {
+      entry++;
+    }
+  }
+  return 0;
+}
+
+void log_write(enum log_module module, enum log_level level,
+               const char* format, ...)
+{
+  char line[LOG_LINE_MAX];
+  int length = snprintf(line, sizeof(line), "[%s] %s: ",
+                        level_names[level], module_names[module]);
+  va_list args;
+  va_start(args, format);
+  length += vsnprintf(line + length, sizeof(line) - length, format, args);
+  va_end(args);
+  if (length > LOG_LINE_MAX - 2) {
+    length = LOG_LINE_MAX - 2;
+  }
+  line[length++] = '\n';
+  // one write per line, so lines from different threads don't interleave
+  fwrite(line, 1, length, stdout);
+}
+
+// no locks: call sites that repeat per frame shouldn't serialize the threads
+// that hit them. a message racing a new window may count against either one.
+int log_rate_limit_take(struct log_rate_limit_s* limit, uint64_t now) {
+  uint64_t interval = (uint64_t)LOG_RATE_LIMIT_INTERVAL * 1000000000;
+  uint64_t start = __atomic_load_n(&limit->window_start, __ATOMIC_ACQUIRE);
+  if (!start || now >= start + interval) {
+    // whoever moves the window on starts the count over
+    if (__atomic_compare_exchange_n(&limit->window_start, &start, now, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      __atomic_store_n(&limit->count, 0, __ATOMIC_RELEASE);
+    }
+  }
+  // once the burst is used up, held back messages don't touch count at all
+  if (__atomic_load_n(&limit->count, __ATOMIC_ACQUIRE) < LOG_RATE_LIMIT_BURST &&
+      __atomic_add_fetch(&limit->count, 1, __ATOMIC_ACQ_REL) <=
+      LOG_RATE_LIMIT_BURST)
+  {
+    return __atomic_exchange_n(&limit->suppressed, 0, __ATOMIC_ACQ_REL);
+  }
+  __atomic_add_fetch(&limit->suppressed, 1, __ATOMIC_ACQ_REL);
+  return -1;
+}
+
+#pragma mark - Progress
+
+int log_progress_open(const char* target) {
+  char* end = NULL;
+  long fd = strtol(target, &end, 10);
+  if (end != target && !*end) {
+    progress_file = fdopen((int)fd, "w");
+  } else {
+    progress_file = fopen(target, "w");
+  }
+  if (!progress_file) {
+    fprintf(stderr, "unable to open progress output %s: %s\n", target,
+            strerror(errno));
+    return -1;
+  }
+  setvbuf(progress_file, NULL, _IOLBF, 0);
+  return 0;
+}
+
+void log_progress_close() {
+  if (progress_file) {
+    fclose(progress_file);
+    progress_file = NULL;
+  }
+}
+
+void log_progress(double complete, double total) {
+  uint64_t now = perf_stats_now();
+  if (!progress_start) {
+    progress_start = now;
+  } else if (complete < total && now - progress_last < progress_interval) {
+    return;
+  }
+  progress_last = now;
+  if (!progress_file) {
+    printf("{\"progress\": {\"complete\": %f, \"total\": %f }}\n",
+           complete * 1000, total * 1000);
+    return;
+  }
+  double elapsed = (now - progress_start) / 1e9;
+  fprintf(progress_file, "{\"progress\": {\"complete\": %.1f, "
+          "\"total\": %.1f, \"elapsed\": %.1f, \"eta\": ",
+          complete * 1000, total * 1000, elapsed);
+  if (complete > 0 && elapsed > 0) {
+    double eta = complete < total ?
+    elapsed * (total - complete) / complete : 0;
+    fprintf(progress_file, "%.1f}}\n", eta);
+  } else {
+    fprintf(progress_file, "null}}\n");
+  }
+}
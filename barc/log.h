@@ -0,0 +1,154 @@
+//
+//  log.h
+//  barc
+//
+
+#ifndef log_h
+#define log_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include "perf_stats.h"
+
+/**
+ * Leveled log messages, one line each on stdout:
+ *
+ *   [warn] mixer: audio clip detected at 12.340000
+ *
+ * Every module has its own threshold (see log_configure). A message above it
+ * costs one load and compare; its arguments are not evaluated. Builds with
+ * BARC_NO_DEBUG_LOGS defined (cmake -DBARC_DEBUG_LOGS=OFF) drop log_debug
+ * calls entirely.
+ *
+ * Messages that can repeat every frame or every sample belong in
+ * log_warn_limited, which prints at most LOG_RATE_LIMIT_BURST of them per
+ * call site every LOG_RATE_LIMIT_INTERVAL seconds and then says how many it
+ * held back.
+ */
+enum log_level {
+  log_level_off = 0,
+  log_level_error,
+  log_level_warn,
+  log_level_info,
+  log_level_debug
+};
+
+enum log_module {
+  // output clock and ticks
+  log_module_barc = 0,
+  // audio mixing and layout
+  log_module_mixer,
+  // frame builder and compose jobs
+  log_module_compose,
+  // demux, decode and lipsync of sources
+  log_module_source,
+  // encoders and muxer
+  log_module_writer,
+  // manifest, timeline and render orchestration
+  log_module_archive,
+  log_module_count
+};
+
+#define LOG_RATE_LIMIT_BURST 5
+#define LOG_RATE_LIMIT_INTERVAL 10
+
+// read without synchronization: only log_configure writes it
+extern unsigned char log_levels[log_module_count];
+
+static inline int log_enabled(enum log_module module, enum log_level level) {
+  return level <= log_levels[module];
+}
+
+/**
+ * Set thresholds from a comma separated list: a bare level applies to every
+ * module, module=level to one of them. "warn,source=debug" is quiet except
+ * for sources. Levels are off, error, warn, info (the default) and debug;
+ * modules are barc, mixer, compose, source, writer and archive.
+ * @return 0 on success, or -1 if spec has an unknown level or module. Modules
+ * before the bad entry keep their new level.
+ */
+int log_configure(const char* spec);
+
+void log_write(enum log_module module, enum log_level level,
+               const char* format, ...)
+__attribute__((format(printf, 3, 4)));
+
+/**
+ * Per call site state for log_warn_limited. Zero initialized, and only
+ * touched with atomics, so sites hit from many threads don't contend on a
+ * shared lock.
+ */
+struct log_rate_limit_s {
+  uint64_t window_start;
+  int count;
+  int suppressed;
+};
+
+/**
+ * @return -1 if a message at now (perf_stats_now) should be held back,
+ * otherwise the number held back since the last one that went out.
+ */
+int log_rate_limit_take(struct log_rate_limit_s* limit, uint64_t now);
+
+#define log_at(module, level, ...) do { \
+  if (log_enabled(module, level)) { \
+    log_write(module, level, __VA_ARGS__); \
+  } \
+} while (0)
+
+#define log_error(module, ...) log_at(module, log_level_error, __VA_ARGS__)
+#define log_warn(module, ...) log_at(module, log_level_warn, __VA_ARGS__)
+#define log_info(module, ...) log_at(module, log_level_info, __VA_ARGS__)
+#ifdef BARC_NO_DEBUG_LOGS
+// still type checked, but never evaluated
+#define log_debug(module, ...) do { \
+  if (0) { \
+    log_write(module, log_level_debug, __VA_ARGS__); \
+  } \
+} while (0)
+#else
+#define log_debug(module, ...) log_at(module, log_level_debug, __VA_ARGS__)
+#endif
+
+#define log_warn_limited(module, ...) do { \
+  static struct log_rate_limit_s log_limit_; \
+  if (log_enabled(module, log_level_warn)) { \
+    int log_held_back_ = log_rate_limit_take(&log_limit_, perf_stats_now()); \
+    if (log_held_back_ >= 0) { \
+      log_write(module, log_level_warn, __VA_ARGS__); \
+    } \
+    if (log_held_back_ > 0) { \
+      log_write(module, log_level_warn, \
+                "(%d similar messages held back before this one)", \
+                log_held_back_); \
+    } \
+  } \
+} while (0)
+
+#pragma mark - Progress
+
+/**
+ * Send progress somewhere other than stdout, so whoever runs barc doesn't
+ * have to pick it out of the log. target is a file descriptor number the
+ * parent left open (3) or a path. Each event is one line of JSON:
+ *
+ *   {"progress": {"complete": 12000.0, "total": 60000.0,
+ *                 "elapsed": 4.1, "eta": 16.4}}
+ *
+ * complete and total are milliseconds of output; elapsed and eta are wall
+ * clock seconds since the first event and until the last one. eta is null
+ * until there is something to extrapolate from.
+ * @return 0 on success
+ */
+int log_progress_open(const char* target);
+void log_progress_close();
+
+/**
+ * Report seconds of output done out of total. Events are spaced at least
+ * a second apart, except that the first one and the one that reaches total
+ * always go out. Without log_progress_open they go to stdout, as they always
+ * have.
+ */
+void log_progress(double complete, double total);
+
+#endif /* log_h */
@@ -6,9 +6,16 @@
 //
 
 #include "magic_frame.h"
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#include "perf_stats.h"
 #include "yuv_rgb.h"
 
 #define RGB_BYTES_PER_PIXEL 3
+// scaled tiles kept per source frame. a frame that outlives a few layout
+// changes (a frozen stream) would otherwise keep a tile for every size.
+#define MAGIC_FRAME_MAX_TILES 4
 
 #define ThrowWandException(wand) \
 { \
@@ -93,28 +100,119 @@ static void draw_border_radius(MagickWand* wand, int radius,
   DestroyMagickWand(border);
 }
 
-int magic_frame_add(MagickWand* output_wand,
-                    AVFrame* input_frame,
-                    size_t x_offset,
-                    size_t y_offset,
-                    struct border_s border,
-                    size_t output_width,
-                    size_t output_height,
-                    enum object_fit object_fit)
-{
-    uint8_t* rgb_buf_in = malloc(RGB_BYTES_PER_PIXEL *
-                                 input_frame->height * input_frame->width);
+#pragma mark - Cached source conversions
+
+// keys for attachments on the source smart_frame
+enum attachment_kind {
+    attachment_rgb = 1,
+    attachment_tile
+};
+
+struct rgb_key_s {
+    enum attachment_kind kind;
+};
+
+struct rgb_buffer_s {
+    uint8_t* pixels;
+};
+
+struct tile_cache_key_s {
+    enum attachment_kind kind;
+};
+
+// everything that changes the pixels of a scaled tile
+struct tile_key_s {
+    enum attachment_kind kind;
+    size_t width;
+    size_t height;
+    enum object_fit object_fit;
+    struct border_s border;
+};
+
+struct tile_s {
+    struct tile_key_s key;
+    MagickWand* wand;
+    // composite reads from the tile wand; one reader at a time
+    uv_mutex_t lock;
+    // compositions using the tile right now. guarded by the cache lock.
+    int refs;
+    uint64_t last_used;
+    // tiles built while every slot was in use are dropped after one use
+    char cached;
+};
+
+// the tiles of one source frame, least recently used evicted first
+struct tile_cache_s {
+    uv_mutex_t lock;
+    struct tile_s* tiles[MAGIC_FRAME_MAX_TILES];
+    uint64_t clock;
+};
+
+static void free_rgb_buffer(void* p) {
+    struct rgb_buffer_s* rgb = (struct rgb_buffer_s*)p;
+    free(rgb->pixels);
+    free(rgb);
+}
+
+static void free_tile(struct tile_s* tile) {
+    DestroyMagickWand(tile->wand);
+    uv_mutex_destroy(&tile->lock);
+    free(tile);
+}
+
+static void free_tile_cache(void* p) {
+    struct tile_cache_s* cache = (struct tile_cache_s*)p;
+    for (int i = 0; i < MAGIC_FRAME_MAX_TILES; i++) {
+        if (cache->tiles[i]) {
+            free_tile(cache->tiles[i]);
+        }
+    }
+    uv_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+// yuv -> rgb conversion happens once per source frame
+static uint8_t* get_rgb_pixels(struct smart_frame_t* smart_frame) {
+    struct rgb_key_s key;
+    memset(&key, 0, sizeof(key));
+    key.kind = attachment_rgb;
+    struct rgb_buffer_s* rgb = (struct rgb_buffer_s*)
+    smart_frame_get_attachment(smart_frame, &key, sizeof(key));
+    if (rgb) {
+        return rgb->pixels;
+    }
+
+    AVFrame* input_frame = smart_frame_get(smart_frame);
+    rgb = (struct rgb_buffer_s*) calloc(1, sizeof(struct rgb_buffer_s));
+    rgb->pixels = malloc(RGB_BYTES_PER_PIXEL *
+                         input_frame->height * input_frame->width);
 
     // Convert colorspace (AVFrame YUV -> pixelbuf RGB)
+    uint64_t start = perf_stats_start();
     yuv420_rgb24_std(input_frame->width, input_frame->height,
                      input_frame->data[0],
                      input_frame->data[1],
                      input_frame->data[2],
                      input_frame->linesize[0],
                      input_frame->linesize[1],
-                     rgb_buf_in,
+                     rgb->pixels,
                      input_frame->width * RGB_BYTES_PER_PIXEL,
                      YCBCR_709);
+    perf_stats_end(perf_color_convert, start);
+    rgb = (struct rgb_buffer_s*)
+    smart_frame_set_attachment(smart_frame, &key, sizeof(key),
+                               rgb, free_rgb_buffer);
+    return rgb->pixels;
+}
+
+static MagickWand* build_tile(struct smart_frame_t* smart_frame,
+                              struct border_s border,
+                              size_t output_width,
+                              size_t output_height,
+                              enum object_fit object_fit)
+{
+    AVFrame* input_frame = smart_frame_get(smart_frame);
+    uint8_t* rgb_buf_in = get_rgb_pixels(smart_frame);
 
     // background on image color for scale/crop debugging
     PixelWand* background = NewPixelWand();
@@ -189,13 +287,149 @@ int magic_frame_add(MagickWand* output_wand,
     if (status == MagickFalse)
         ThrowWandException(input_wand);
 
-    // compose source frames
-    MagickCompositeImage(output_wand, input_wand, OverCompositeOp,
-                         MagickTrue, x_offset, y_offset);
-    DestroyMagickWand(input_wand);
     DestroyPixelWand(background);
+    return input_wand;
+}
+
+static struct tile_cache_s* get_tile_cache(struct smart_frame_t* smart_frame)
+{
+    struct tile_cache_key_s key;
+    memset(&key, 0, sizeof(key));
+    key.kind = attachment_tile;
+    struct tile_cache_s* cache = (struct tile_cache_s*)
+    smart_frame_get_attachment(smart_frame, &key, sizeof(key));
+    if (cache) {
+        return cache;
+    }
+    cache = (struct tile_cache_s*) calloc(1, sizeof(struct tile_cache_s));
+    uv_mutex_init(&cache->lock);
+    return (struct tile_cache_s*)
+    smart_frame_set_attachment(smart_frame, &key, sizeof(key),
+                               cache, free_tile_cache);
+}
+
+// caller holds the cache lock
+static struct tile_s* find_tile(struct tile_cache_s* cache,
+                                const struct tile_key_s* key)
+{
+    for (int i = 0; i < MAGIC_FRAME_MAX_TILES; i++) {
+        struct tile_s* tile = cache->tiles[i];
+        if (tile && !memcmp(&tile->key, key, sizeof(*key))) {
+            tile->refs++;
+            tile->last_used = ++cache->clock;
+            return tile;
+        }
+    }
+    return NULL;
+}
+
+// take an empty slot, or the least recently used tile nobody is using
+static void insert_tile(struct tile_cache_s* cache, struct tile_s* tile) {
+    int slot = -1;
+    for (int i = 0; i < MAGIC_FRAME_MAX_TILES; i++) {
+        struct tile_s* other = cache->tiles[i];
+        if (!other) {
+            slot = i;
+            break;
+        }
+        if (!other->refs &&
+            (slot < 0 || other->last_used < cache->tiles[slot]->last_used))
+        {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        return;
+    }
+    if (cache->tiles[slot]) {
+        free_tile(cache->tiles[slot]);
+    }
+    cache->tiles[slot] = tile;
+    tile->cached = 1;
+}
 
-    free(rgb_buf_in);
+/* scaled tiles are shared by every composition that places this source
+ * frame at the same size: repeated ticks and renditions with matching tiles.
+ * the tile is held until put_tile, so eviction can't free it mid composite.
+ */
+static struct tile_s* get_tile(struct tile_cache_s* cache,
+                               struct smart_frame_t* smart_frame,
+                               struct border_s border,
+                               size_t output_width,
+                               size_t output_height,
+                               enum object_fit object_fit)
+{
+    struct tile_key_s key;
+    memset(&key, 0, sizeof(key));
+    key.kind = attachment_tile;
+    key.width = output_width;
+    key.height = output_height;
+    key.object_fit = object_fit;
+    key.border.radius = border.radius;
+    key.border.width = border.width;
+    key.border.red = border.red;
+    key.border.green = border.green;
+    key.border.blue = border.blue;
+    uv_mutex_lock(&cache->lock);
+    struct tile_s* tile = find_tile(cache, &key);
+    uv_mutex_unlock(&cache->lock);
+    if (tile) {
+        return tile;
+    }
+
+    // build outside the lock: other sizes of this frame needn't wait
+    tile = (struct tile_s*) calloc(1, sizeof(struct tile_s));
+    tile->key = key;
+    uv_mutex_init(&tile->lock);
+    tile->wand = build_tile(smart_frame, border, output_width, output_height,
+                            object_fit);
+    uv_mutex_lock(&cache->lock);
+    struct tile_s* existing = find_tile(cache, &key);
+    if (!existing) {
+        tile->refs = 1;
+        tile->last_used = ++cache->clock;
+        insert_tile(cache, tile);
+    }
+    uv_mutex_unlock(&cache->lock);
+    if (existing) {
+        // somebody beat us to it. theirs is just as good.
+        free_tile(tile);
+        return existing;
+    }
+    return tile;
+}
+
+static void put_tile(struct tile_cache_s* cache, struct tile_s* tile) {
+    uv_mutex_lock(&cache->lock);
+    tile->refs--;
+    char drop = !tile->cached;
+    uv_mutex_unlock(&cache->lock);
+    if (drop) {
+        free_tile(tile);
+    }
+}
+
+#pragma mark - Composition
+
+int magic_frame_add(MagickWand* output_wand,
+                    struct smart_frame_t* input_frame,
+                    size_t x_offset,
+                    size_t y_offset,
+                    struct border_s border,
+                    size_t output_width,
+                    size_t output_height,
+                    enum object_fit object_fit)
+{
+    struct tile_cache_s* cache = get_tile_cache(input_frame);
+    struct tile_s* tile = get_tile(cache, input_frame, border,
+                                   output_width, output_height, object_fit);
+
+    // compose source frames
+    uv_mutex_lock(&tile->lock);
+    MagickCompositeImage(output_wand, tile->wand, OverCompositeOp,
+                         MagickTrue, x_offset, y_offset);
+    uv_mutex_unlock(&tile->lock);
+    put_tile(cache, tile);
     return 0;
 }
 
@@ -219,6 +453,7 @@ int magic_frame_finish(MagickWand* output_wand, AVFrame* output_frame,
                             "RGB", CharPixel, rgb_buf_out);
 
     // send contrast_wand off to the frame buffer
+    uint64_t start = perf_stats_start();
     rgb24_yuv420_std(output_frame->width, output_frame->height,
                       rgb_buf_out, output_frame->width * RGB_BYTES_PER_PIXEL,
                       output_frame->data[0],
@@ -226,6 +461,7 @@ int magic_frame_finish(MagickWand* output_wand, AVFrame* output_frame,
                       output_frame->data[2],
                       output_frame->linesize[0],
                       output_frame->linesize[1], YCBCR_709);
+    perf_stats_end(perf_color_convert, start);
 
     free(rgb_buf_out);
     DestroyMagickWand(output_wand);
@@ -15,11 +15,15 @@
 #include <MagickWand/magick-image.h>
 #include "object_fit.h"
 #include "media_stream.h"
+#include "smart_avframe.h"
 
 int magic_frame_start(MagickWand** dest_wand,
                       size_t width, size_t height);
+/* Scale input_frame into a tile and composite it onto output_wand. Tiles and
+ * color conversions are cached on the smart frame, see smart_avframe.h; only
+ * the few most recently used tile sizes are kept. */
 int magic_frame_add(MagickWand* output_wand,
-                    AVFrame* input_frame,
+                    struct smart_frame_t* input_frame,
                     size_t x_offset,
                     size_t y_offset,
                     struct border_s border,
@@ -17,13 +17,53 @@
 
 #include "barc.h"
 #include "archive_package.h"
-#include "zipper.h"
 #include "curler.h"
+#include "archive_cache.h"
+#include "http_source.h"
+#include "zip_io.h"
+#include "segment_stitcher.h"
+#include "memory_governor.h"
+#include "perf_stats.h"
+#include "trace.h"
+#include "log.h"
+#include "file_writer.h"
+#include "batch_runner.h"
+#include "job_server.h"
+
+/* Join partial outputs written with --segment. Each input needs its
+ * .segment sidecar next to it. Inputs may be given in any order, but they
+ * must be every piece of one split.
+ */
+static int stitch_main(const char* output_path, char** paths, int count)
+{
+  if (count < 1) {
+    printf("usage: barc --stitch -o output segment [segment...]\n");
+    return -1;
+  }
+  struct segment_sidecar_s* sidecars = (struct segment_sidecar_s*)
+  calloc(count, sizeof(struct segment_sidecar_s));
+  struct stitch_segment_s* segments = (struct stitch_segment_s*)
+  calloc(count, sizeof(struct stitch_segment_s));
+  int ret = 0;
+  for (int i = 0; !ret && i < count; i++) {
+    ret = segment_sidecar_read(paths[i], &sidecars[i]);
+  }
+  if (!ret) {
+    int segment_count = segment_sidecar_order((const char**)paths, sidecars,
+                                              count, segments);
+    ret = segment_count < 0 ? -1 :
+    segment_stitcher_run(output_path, segments, segment_count);
+  }
+  free(segments);
+  free(sidecars);
+  return ret;
+}
 
 int main(int argc, char **argv)
 {
     char* input_path = NULL;
     char* output_path = NULL;
+    char stream_output_path[32];
     char* css_preset = NULL;
     char* css_custom = NULL;
     char* manifest_supplemental = NULL;
@@ -31,6 +71,30 @@ int main(int argc, char **argv)
     int out_height = 0;
     int64_t begin_offset = 0;
     int64_t end_offset = 0;
+    int parallel_segments = 0;
+    int segment_index = 0;
+    int segment_count = 0;
+    static int stitch_flag = 0;
+    static int vfr_flag = 0;
+    static int trim_gaps_flag = 0;
+    static int resume_flag = 0;
+    double checkpoint_interval = 0;
+    char* output_format = NULL;
+    double segment_duration = 0;
+    struct barc_rendition_s renditions[FILE_WRITER_MAX_AUDIO_FOLLOWERS];
+    size_t rendition_count = 0;
+    char* batch_path = NULL;
+    int batch_jobs = 1;
+    char* daemon_socket = NULL;
+    double cpu_budget = 0;
+    size_t memory_budget_mb = 0;
+    size_t memory_limit_mb = 0;
+    char* cache_dir = NULL;
+    char* perf_report_path = NULL;
+    char* trace_path = NULL;
+    char* sink = NULL;
+    char* progress_target = NULL;
+    size_t cache_size_mb = 10 * 1024;
     int c;
   char input_is_fd = 0;
   int input_fd = 0;
@@ -39,6 +103,10 @@ int main(int argc, char **argv)
     {
         /* These options set a flag. */
         //{"repairmode", no_argument, &repairmode_flag, 0},
+        {"stitch", no_argument, &stitch_flag, 1},
+        {"vfr", no_argument, &vfr_flag, 1},
+        {"trim_gaps", no_argument, &trim_gaps_flag, 1},
+        {"resume", no_argument, &resume_flag, 1},
         /* These options don’t set a flag.
          We distinguish them by their indices. */
         {"input", required_argument,        0, 'i'},
@@ -50,12 +118,31 @@ int main(int argc, char **argv)
         {"css_preset", optional_argument,   0, 'p'},
         {"begin_offset", optional_argument, 0, 'b'},
         {"end_offset", optional_argument,   0, 'e'},
+        {"parallel", required_argument,     0, 'j'},
+        {"segment", required_argument,      0, 's'},
+        {"format", required_argument,       0, 'f'},
+        {"segment_duration", required_argument, 0, 'd'},
+        {"rendition", required_argument,    0, 'r'},
+        {"batch", required_argument,        0, 'B'},
+        {"batch_jobs", required_argument,   0, 'J'},
+        {"daemon", required_argument,       0, 'D'},
+        {"cpu_budget", required_argument,   0, 'C'},
+        {"memory_budget", required_argument, 0, 'M'},
+        {"checkpoint", required_argument,   0, 'K'},
+        {"memory_limit", required_argument, 0, 'L'},
+        {"cache_dir", required_argument,    0, 'A'},
+        {"cache_size", required_argument,   0, 'Z'},
+        {"perf_report", required_argument,  0, 'R'},
+        {"trace", required_argument,        0, 'T'},
+        {"sink", required_argument,         0, 'S'},
+        {"log_level", required_argument,    0, 'v'},
+        {"progress", required_argument,     0, 'P'},
         {0, 0, 0, 0}
     };
     /* getopt_long stores the option index here. */
     int option_index = 0;
 
-    while ((c = getopt_long(argc, argv, "i:o:w:h:p:c:b:e:",
+    while ((c = getopt_long(argc, argv, "i:o:w:h:p:c:b:e:j:s:f:d:r:B:J:D:C:M:K:L:A:Z:R:T:S:v:P:",
                             long_options, &option_index)) != -1)
     {
         switch (c)
@@ -78,6 +165,97 @@ int main(int argc, char **argv)
             case 'e':
                 end_offset = atoi(optarg);
                 break;
+            case 0:
+                // long option set a flag
+                break;
+            case 's':
+                if (2 != sscanf(optarg, "%d/%d",
+                                &segment_index, &segment_count) ||
+                    segment_index < 0 || segment_count < 1 ||
+                    segment_index >= segment_count)
+                {
+                    fprintf(stderr, "Segment must look like i/N, "
+                            "with 0 <= i < N. Got %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'f':
+                output_format = optarg;
+                break;
+            case 'd':
+                segment_duration = atof(optarg);
+                break;
+            case 'r':
+            {
+                struct barc_rendition_s* rendition =
+                &renditions[rendition_count];
+                int path_start = 0;
+                if (rendition_count >= FILE_WRITER_MAX_AUDIO_FOLLOWERS) {
+                    fprintf(stderr, "At most %d renditions are supported\n",
+                            FILE_WRITER_MAX_AUDIO_FOLLOWERS);
+                    return 1;
+                }
+                if (2 != sscanf(optarg, "%zux%zu:%n", &rendition->out_width,
+                                &rendition->out_height, &path_start) ||
+                    !path_start || !optarg[path_start])
+                {
+                    fprintf(stderr, "Rendition must look like WxH:path. "
+                            "Got %s\n", optarg);
+                    return 1;
+                }
+                rendition->output_path = optarg + path_start;
+                rendition_count++;
+                break;
+            }
+            case 'j':
+                parallel_segments = atoi(optarg);
+                break;
+            case 'B':
+                batch_path = optarg;
+                break;
+            case 'J':
+                batch_jobs = atoi(optarg);
+                break;
+            case 'D':
+                daemon_socket = optarg;
+                break;
+            case 'C':
+                cpu_budget = atof(optarg);
+                break;
+            case 'M':
+                memory_budget_mb = strtoul(optarg, NULL, 10);
+                break;
+            case 'K':
+                checkpoint_interval = atof(optarg);
+                break;
+            case 'L':
+                memory_limit_mb = strtoul(optarg, NULL, 10);
+                break;
+            case 'A':
+                cache_dir = optarg;
+                break;
+            case 'Z':
+                cache_size_mb = strtoul(optarg, NULL, 10);
+                break;
+            case 'R':
+                perf_report_path = optarg;
+                break;
+            case 'T':
+                trace_path = optarg;
+                break;
+            case 'S':
+                sink = optarg;
+                break;
+            case 'v':
+                if (log_configure(optarg)) {
+                    fprintf(stderr, "Log level must look like "
+                            "level[,module=level...]. Got %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'P':
+                progress_target = optarg;
+                break;
             case 'p':
                 css_preset = optarg;
                 break;
@@ -107,10 +285,209 @@ int main(int argc, char **argv)
         out_height = 480;
     }
 
-  if (!strncmp(input_path, "http", 4)) {
+  enum file_writer_format format;
+  if (file_writer_parse_format(output_format, &format)) {
+    fprintf(stderr, "Unknown output format %s. "
+            "Expected one of mp4, fmp4, hls, dash.\n", output_format);
+    return 1;
+  }
+  enum file_writer_sink writer_sink;
+  if (file_writer_parse_sink(sink, &writer_sink)) {
+    fprintf(stderr, "Unknown sink %s. Expected one of encode, null, hash.\n",
+            sink);
+    return 1;
+  }
+  if (checkpoint_interval > 0 && (parallel_segments > 1 || segment_count)) {
+    fprintf(stderr, "--checkpoint can't be combined with --parallel "
+            "or --segment\n");
+    return 1;
+  }
+  if (resume_flag && checkpoint_interval <= 0) {
+    fprintf(stderr, "--resume needs the --checkpoint interval of the render "
+            "being resumed\n");
+    return 1;
+  }
+  // checkpointed chunks are stitched the same way segments are
+  char segmented = parallel_segments > 1 || segment_count ||
+  checkpoint_interval > 0;
+  if (file_writer_sink_encode != writer_sink && (segmented || stitch_flag)) {
+    fprintf(stderr, "--sink %s writes no output, so there is nothing to "
+            "stitch. It can't be combined with -j, --segment, --checkpoint "
+            "or --stitch\n", sink);
+    return 1;
+  }
+  if (rendition_count && segmented) {
+    printf("segmented renders only produce the main output. "
+           "ignoring %zu renditions\n", rendition_count);
+    rendition_count = 0;
+  }
+  if (output_format && segmented) {
+    printf("segmented renders always produce progressive mp4. "
+           "ignoring --format %s\n", output_format);
+    output_format = NULL;
+    format = file_writer_format_auto;
+  }
+
+  if (trim_gaps_flag && segmented) {
+    printf("segmented renders keep the full timeline. ignoring --trim_gaps\n");
+    trim_gaps_flag = 0;
+  }
+
+  if (vfr_flag && format != file_writer_format_auto) {
+    // fragments are cut every gop_size frames, which stops lining up with
+    // --segment_duration once frames go missing
+    printf("--vfr only applies to mp4 output. ignoring it for --format %s\n",
+           output_format);
+    vfr_flag = 0;
+  }
+
+  if ((batch_path || daemon_socket) && (stitch_flag || segment_count)) {
+    fprintf(stderr, "--batch and --daemon can't be combined with --stitch "
+            "or --segment\n");
+    return 1;
+  }
+
+  if (file_writer_is_stream_output(output_path) &&
+      !batch_path && !daemon_socket)
+  {
+    if (stitch_flag || segmented) {
+      fprintf(stderr, "Segmented renders and --stitch need a seekable "
+              "output file. Got %s\n", output_path);
+      return 1;
+    }
+    if (file_writer_format_hls == format || file_writer_format_dash == format)
+    {
+      fprintf(stderr, "--format %s writes a playlist and segment files, "
+              "so it can't stream to %s. Use mp4 or fmp4\n", output_format,
+              output_path);
+      return 1;
+    }
+    if (!strcmp(output_path, "-")) {
+      // media owns stdout now. everything we would have printed goes to
+      // stderr, one line at a time so progress stays readable.
+      int media_fd = dup(STDOUT_FILENO);
+      dup2(STDERR_FILENO, STDOUT_FILENO);
+      setvbuf(stdout, NULL, _IOLBF, 0);
+      snprintf(stream_output_path, sizeof(stream_output_path),
+               "pipe:%d", media_fd);
+      output_path = stream_output_path;
+    }
+  }
+
+  if (stitch_flag) {
+    int ret = stitch_main(output_path, argv + optind, argc - optind);
+    if (ret) {
+      printf("stitch failed (ret %d)\n", ret);
+    }
+    return ret ? 1 : 0;
+  }
+
+  // shared by every render in the process, batch and daemon jobs included
+  memory_governor_set_limit(memory_limit_mb * 1024 * 1024);
+  if (perf_report_path) {
+    perf_stats_enable();
+  }
+  if (trace_path) {
+    trace_enable();
+    trace_set_thread_name("main");
+  }
+  if (progress_target && log_progress_open(progress_target)) {
+    return 1;
+  }
+  if (archive_cache_configure(cache_dir,
+                              (int64_t)cache_size_mb * 1024 * 1024))
+  {
+    return 1;
+  }
+
+  struct archive_config_s archive_config = { 0 };
+  archive_config.begin_offset = begin_offset;
+  archive_config.end_offset = end_offset;
+  archive_config.css_custom = css_custom;
+  archive_config.css_preset = css_preset;
+  archive_config.height = out_height;
+  archive_config.width = out_width;
+  archive_config.output_path = output_path;
+  archive_config.parallel_segments = parallel_segments;
+  archive_config.segment_index = segment_index;
+  archive_config.segment_count = segment_count;
+  archive_config.output_format = output_format;
+  archive_config.segment_duration = segment_duration;
+  archive_config.sink = sink;
+  archive_config.renditions = renditions;
+  archive_config.rendition_count = rendition_count;
+  archive_config.variable_frame_rate = vfr_flag;
+  archive_config.trim_gaps = trim_gaps_flag;
+  archive_config.checkpoint_interval = checkpoint_interval;
+  archive_config.resume = resume_flag;
+
+  if (daemon_socket) {
+    barc_bootstrap();
+    struct job_server_config_s server_config = { 0 };
+    server_config.socket_path = daemon_socket;
+    server_config.defaults = archive_config;
+    server_config.cpu_budget = cpu_budget;
+    server_config.memory_budget = memory_budget_mb * 1024 * 1024;
+    int ret = job_server_run(&server_config);
+    if (perf_report_path) {
+      perf_stats_write_report(perf_report_path);
+    }
+    if (trace_path) {
+      trace_write(trace_path);
+    }
+    MagickWandTerminus();
+    return ret ? 1 : 0;
+  }
+
+  if (batch_path) {
+    FILE* jobs = strcmp(batch_path, "-") ? fopen(batch_path, "r") : stdin;
+    if (!jobs) {
+      perror(batch_path);
+      return 1;
+    }
+    barc_bootstrap();
+    struct batch_config_s batch_config = { 0 };
+    batch_config.defaults = archive_config;
+    batch_config.max_jobs = batch_jobs;
+    int failed = batch_run(jobs, &batch_config);
+    if (jobs != stdin) {
+      fclose(jobs);
+    }
+    printf("batch finished. %d jobs failed\n", failed);
+    if (perf_report_path) {
+      perf_stats_write_report(perf_report_path);
+    }
+    if (trace_path) {
+      trace_write(trace_path);
+    }
+    MagickWandTerminus();
+    return failed ? 1 : 0;
+  }
+
+  if (!input_path) {
+    fprintf(stderr, "usage: barc -i input [-o output] [options]\n");
+    return 1;
+  }
+
+  // zips served with range support are read in place, like local ones,
+  // unless there is a cache to keep them in for next time
+  char remote = 0;
+  if (archive_cache_enabled() && zip_io_is_remote(input_path)) {
+    input_path = archive_cache_fetch(input_path);
+    if (!input_path) {
+      return 1;
+    }
+  } else {
+    remote = zip_io_is_remote(input_path) &&
+    !http_source_probe(input_path, &archive_config.remote_size);
+  }
+  if (!remote && !strncmp(input_path, "http", 4)) {
     printf("Input parameter looks like a URL. Attempting to download %s\n",
            input_path);
     input_path = get_http(input_path);
+    if (!input_path) {
+      return 1;
+    }
   }
 
   barc_bootstrap();
@@ -123,11 +500,13 @@ int main(int argc, char **argv)
     struct stat file_stat;
     stat(input_path, &file_stat);
 
-    if (S_ISDIR(file_stat.st_mode)) {
+    if (remote) {
+        printf("using remote zip %s\n", input_path);
+    } else if (S_ISDIR(file_stat.st_mode)) {
         printf("using directory %s\n", input_path);
     } else if (S_ISREG(file_stat.st_mode)) {
-        printf("attempt to unzip regular file %s\n", input_path);
-        input_path = unzip_archive(input_path);
+        // media is read straight out of the zip
+        printf("using zip %s\n", input_path);
     } else {
         printf("Unknown file type %s\n", input_path);
         exit(-1);
@@ -140,30 +519,32 @@ int main(int argc, char **argv)
 
   struct archive_s* archive;
   archive_alloc(&archive);
-  struct archive_config_s archive_config = { 0 };
-  archive_config.begin_offset = begin_offset;
-  archive_config.end_offset = end_offset;
-  archive_config.css_custom = css_custom;
-  archive_config.css_preset = css_preset;
-  archive_config.height = out_height;
-  archive_config.width = out_width;
   archive_config.source_path = input_path;
-  archive_config.output_path = output_path;
   archive_load_configuration(archive, &archive_config);
   ret = archive_main(archive);
   if (ret) {
-    printf("archive main returned %d", ret);
+    printf("archive main returned %d\n", ret);
   }
   archive_free(archive);
 
   time_t finish_time = time(NULL);
   printf("Composition took %ld seconds\n", finish_time - start_time);
+  printf("Peak queued frame memory %zu MB\n",
+         memory_governor_peak() / (1024 * 1024));
+  if (perf_report_path) {
+    perf_stats_write_report(perf_report_path);
+  }
+  if (trace_path) {
+    trace_write(trace_path);
+  }
+  log_progress_close();
 
   char cwd[1024];
   printf("%s\n", getcwd(cwd, sizeof(cwd)));
 
   MagickWandTerminus();
 
-  return(0);
+  // whoever ran us needs to know the output is no good
+  return ret ? 1 : 0;
 
 }
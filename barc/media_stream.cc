@@ -7,6 +7,7 @@
 
 extern "C" {
 #include "media_stream.h"
+#include "log.h"
 #include <libavutil/audio_fifo.h>
 #include <assert.h>
 }
@@ -86,8 +87,8 @@ int archive_stream_get_video_for_time(struct media_stream_s* stream,
   int ret = stream->video_read_cb(stream, smart_frame, clock_time,
                                   stream->video_read_arg);
   if (ret) {
-    printf("failed to get video frame for stream %s t=%f\n",
-           stream->sz_name, clock_time);
+    log_warn_limited(log_module_source, "failed to get video frame for "
+                     "stream %s t=%f", stream->sz_name, clock_time);
   }
   return ret;
 }
@@ -118,8 +119,8 @@ int archive_stream_get_audio_samples(struct media_stream_s* stream,
   ret = stream->audio_read_cb(stream, frame, clock_time,
                               stream->audio_read_arg);
   if (ret != num_samples) {
-    printf("failed to get audio frame for stream %s t=%f\n",
-           stream->sz_name, clock_time);
+    log_warn_limited(log_module_source, "failed to get audio frame for "
+                     "stream %s t=%f", stream->sz_name, clock_time);
     return ret;
   }
   assert(frame->channels == num_channels);
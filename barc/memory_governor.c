@@ -0,0 +1,61 @@
+//
+//  memory_governor.c
+//  barc
+//
+
+#include "memory_governor.h"
+
+static size_t limit_bytes;
+static size_t used_bytes;
+static size_t peak_bytes;
+
+void memory_governor_set_limit(size_t bytes) {
+  __atomic_store_n(&limit_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+size_t memory_governor_get_limit() {
+  return __atomic_load_n(&limit_bytes, __ATOMIC_RELAXED);
+}
+
+void memory_governor_charge(size_t bytes) {
+  size_t used = __atomic_add_fetch(&used_bytes, bytes, __ATOMIC_RELAXED);
+  size_t peak = __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED);
+  while (used > peak &&
+         !__atomic_compare_exchange_n(&peak_bytes, &peak, used, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+  {
+    // peak was reloaded by the failed exchange
+  }
+}
+
+void memory_governor_discharge(size_t bytes) {
+  __atomic_sub_fetch(&used_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+size_t memory_governor_used() {
+  return __atomic_load_n(&used_bytes, __ATOMIC_RELAXED);
+}
+
+size_t memory_governor_peak() {
+  return __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED);
+}
+
+size_t memory_governor_scale(size_t depth, size_t minimum) {
+  size_t limit = memory_governor_get_limit();
+  size_t used = memory_governor_used();
+  if (!limit || used <= limit / 2) {
+    return depth;
+  }
+  if (used >= limit) {
+    return minimum;
+  }
+  // headroom left in the upper half of the limit, as a share of that half
+  double share = (double)(limit - used) / (limit - limit / 2);
+  size_t scaled = (size_t)(depth * share);
+  return scaled > minimum ? scaled : minimum;
+}
+
+int memory_governor_under_pressure() {
+  size_t limit = memory_governor_get_limit();
+  return limit && memory_governor_used() > limit / 4 * 3;
+}
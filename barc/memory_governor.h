@@ -0,0 +1,44 @@
+//
+//  memory_governor.h
+//  barc
+//
+
+#ifndef memory_governor_h
+#define memory_governor_h
+
+#include <stddef.h>
+
+/**
+ * Process-wide account of the bytes held by frames sitting in pipeline
+ * queues: decoded video ahead of the mixer, output frames being composed and
+ * raw frames waiting for the encoders, across every render in the process.
+ *
+ * Queues never block on the governor directly, since a stage waiting for
+ * bytes held by another render could wait forever. Instead each bounded queue
+ * asks memory_governor_scale for its current depth, which shrinks as the
+ * account approaches the limit. A queue is always allowed one item, so every
+ * render keeps moving, just with less slack.
+ */
+
+/** Set the limit in bytes. 0 (the default) tracks usage without a limit. */
+void memory_governor_set_limit(size_t bytes);
+size_t memory_governor_get_limit();
+
+void memory_governor_charge(size_t bytes);
+void memory_governor_discharge(size_t bytes);
+
+/** Bytes charged right now, and the most ever charged at once. */
+size_t memory_governor_used();
+size_t memory_governor_peak();
+
+/**
+ * Depth a queue should use now, given its configured depth. Queues get their
+ * full depth until half the limit is in use, then shrink linearly towards
+ * minimum as usage reaches the limit.
+ */
+size_t memory_governor_scale(size_t depth, size_t minimum);
+
+/** @return nonzero once usage passes three quarters of the limit. */
+int memory_governor_under_pressure();
+
+#endif /* memory_governor_h */
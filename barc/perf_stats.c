@@ -0,0 +1,269 @@
+//
+//  perf_stats.c
+//  barc
+//
+
+#include "perf_stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <jansson.h>
+#include <uv.h>
+
+/* Buckets are log-linear: values under 8 get one bucket each, and every
+ * power of two above that is split into 8, so a bucket is never more than
+ * 12.5% wide. 2^48 ns is over three days.
+ */
+#define PERF_HISTOGRAM_BUCKETS (46 * 8)
+
+static const int sub_bucket_bits = 3;
+
+struct histogram_s {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[PERF_HISTOGRAM_BUCKETS];
+};
+
+struct source_stats_s {
+  char name[128];
+  struct histogram_s decode;
+};
+
+char perf_stats_enabled;
+
+static struct histogram_s metrics[perf_metric_count];
+static struct source_stats_s sources[PERF_STATS_MAX_SOURCES];
+static int source_count;
+// adding sources is rare, so the lookup by name simply takes a lock
+static uv_once_t sources_once = UV_ONCE_INIT;
+static uv_mutex_t sources_lock;
+static uint64_t enabled_time;
+// in microseconds, so it can be added to atomically
+static uint64_t media_time_us;
+
+static const char* metric_names[perf_metric_count] = {
+  "demux",
+  "decode",
+  "layout",
+  "compose_subframe",
+  "compose_frame",
+  "color_convert",
+  "encode",
+  "mux",
+  "queue_push_wait",
+  "queue_pop_wait",
+  "frame_latency",
+  "queue_fill",
+};
+
+void perf_stats_enable() {
+  enabled_time = perf_stats_now();
+  perf_stats_enabled = 1;
+}
+
+void perf_stats_reset() {
+  memset(metrics, 0, sizeof(metrics));
+  perf_stats_reset_sources();
+  media_time_us = 0;
+  enabled_time = perf_stats_now();
+}
+
+static void init_sources_lock() {
+  uv_mutex_init(&sources_lock);
+}
+
+void perf_stats_reset_sources() {
+  uv_once(&sources_once, init_sources_lock);
+  uv_mutex_lock(&sources_lock);
+  memset(sources, 0, sizeof(sources));
+  __atomic_store_n(&source_count, 0, __ATOMIC_RELEASE);
+  uv_mutex_unlock(&sources_lock);
+}
+
+static int bucket_index(uint64_t value) {
+  if (value < (1 << sub_bucket_bits)) {
+    return (int)value;
+  }
+  int exponent = 63 - __builtin_clzll(value);
+  int sub = (int)(value >> (exponent - sub_bucket_bits)) &
+  ((1 << sub_bucket_bits) - 1);
+  int index = (exponent - sub_bucket_bits + 1) * (1 << sub_bucket_bits) + sub;
+  return index < PERF_HISTOGRAM_BUCKETS ? index : PERF_HISTOGRAM_BUCKETS - 1;
+}
+
+// smallest value that lands in bucket index
+static uint64_t bucket_floor(int index) {
+  if (index < (1 << sub_bucket_bits)) {
+    return index;
+  }
+  int exponent = index / (1 << sub_bucket_bits) + sub_bucket_bits - 1;
+  uint64_t sub = index % (1 << sub_bucket_bits);
+  return ((1 << sub_bucket_bits) + sub) << (exponent - sub_bucket_bits);
+}
+
+static void histogram_add(struct histogram_s* histogram, uint64_t value) {
+  __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&histogram->sum, value, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&histogram->buckets[bucket_index(value)], 1,
+                     __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+  while (value > max &&
+         !__atomic_compare_exchange_n(&histogram->max, &max, value, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+  {
+    // max was reloaded by the failed exchange
+  }
+}
+
+// middle of the bucket holding the value at quantile, capped at the max
+static double histogram_quantile(const struct histogram_s* histogram,
+                                 double quantile)
+{
+  uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+  if (!count) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(quantile * (count - 1)) + 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < PERF_HISTOGRAM_BUCKETS; i++) {
+    seen += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+    if (seen >= rank) {
+      double floor = bucket_floor(i);
+      double middle = i + 1 < PERF_HISTOGRAM_BUCKETS ?
+      (floor + bucket_floor(i + 1) - 1) / 2 : floor;
+      return middle < max ? middle : max;
+    }
+  }
+  return max;
+}
+
+static uint64_t histogram_summary(const struct histogram_s* histogram,
+                                  double* mean_out, double* p50_out,
+                                  double* p99_out, double* max_out)
+{
+  uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+  uint64_t sum = __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+  *mean_out = count ? (double)sum / count : 0;
+  *p50_out = histogram_quantile(histogram, 0.5);
+  *p99_out = histogram_quantile(histogram, 0.99);
+  *max_out = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+  return count;
+}
+
+void perf_stats_record(enum perf_metric metric, uint64_t value) {
+  histogram_add(&metrics[metric], value);
+}
+
+int perf_stats_add_source(const char* name) {
+  if (!perf_stats_enabled) {
+    return -1;
+  }
+  uv_once(&sources_once, init_sources_lock);
+  uv_mutex_lock(&sources_lock);
+  int source = 0;
+  while (source < source_count &&
+         strncmp(sources[source].name, name, sizeof(sources[source].name) - 1))
+  {
+    source++;
+  }
+  if (source == source_count && source < PERF_STATS_MAX_SOURCES) {
+    snprintf(sources[source].name, sizeof(sources[source].name), "%s", name);
+    // the report reads the count without the lock
+    __atomic_store_n(&source_count, source + 1, __ATOMIC_RELEASE);
+  }
+  uv_mutex_unlock(&sources_lock);
+  return source < PERF_STATS_MAX_SOURCES ? source : -1;
+}
+
+void perf_stats_end_source(int source, uint64_t start) {
+  if (!start) {
+    return;
+  }
+  uint64_t elapsed = perf_stats_now() - start;
+  histogram_add(&metrics[perf_decode], elapsed);
+  if (source >= 0) {
+    histogram_add(&sources[source].decode, elapsed);
+  }
+}
+
+void perf_stats_add_media_time(double seconds) {
+  __atomic_add_fetch(&media_time_us, (uint64_t)(seconds * 1000000),
+                     __ATOMIC_RELAXED);
+}
+
+uint64_t perf_stats_summary(enum perf_metric metric, double* mean_out,
+                            double* p50_out, double* p99_out,
+                            double* max_out)
+{
+  return histogram_summary(&metrics[metric], mean_out, p50_out, p99_out,
+                           max_out);
+}
+
+#pragma mark - Report
+
+static json_t* summary_json(const struct histogram_s* histogram,
+                            double scale)
+{
+  double mean, p50, p99, max;
+  uint64_t count = histogram_summary(histogram, &mean, &p50, &p99, &max);
+  return json_pack("{s:I, s:f, s:f, s:f, s:f, s:f}",
+                   "count", (json_int_t)count,
+                   "total", (double)histogram->sum * scale,
+                   "mean", mean * scale,
+                   "p50", p50 * scale,
+                   "p99", p99 * scale,
+                   "max", max * scale);
+}
+
+double perf_stats_peak_rss_mb() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage)) {
+    return 0;
+  }
+#ifdef __APPLE__
+  // bytes on darwin, kilobytes everywhere else
+  return usage.ru_maxrss / (1024.0 * 1024);
+#else
+  return usage.ru_maxrss / 1024.0;
+#endif
+}
+
+int perf_stats_write_report(const char* path) {
+  double wall_seconds = (perf_stats_now() - enabled_time) / 1e9;
+  double media_seconds =
+  __atomic_load_n(&media_time_us, __ATOMIC_RELAXED) / 1e6;
+  uint64_t frames = __atomic_load_n(&metrics[perf_frame_latency].count,
+                                    __ATOMIC_RELAXED);
+  json_t* stages = json_object();
+  for (int i = 0; i < perf_metric_count; i++) {
+    // timers are reported in milliseconds, fill in percent
+    double scale = perf_queue_fill == i ? 1 : 1e-6;
+    json_object_set_new(stages, metric_names[i],
+                        summary_json(&metrics[i], scale));
+  }
+  json_t* decode = json_object();
+  int count = __atomic_load_n(&source_count, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < count; i++) {
+    json_object_set_new(decode, sources[i].name,
+                        summary_json(&sources[i].decode, 1e-6));
+  }
+  json_t* report = json_pack("{s:f, s:f, s:f, s:I, s:f, s:f, s:o, s:o}",
+                             "wall_seconds", wall_seconds,
+                             "media_seconds", media_seconds,
+                             "realtime_factor", wall_seconds > 0 ?
+                             media_seconds / wall_seconds : 0,
+                             "frames", (json_int_t)frames,
+                             "frames_per_second", wall_seconds > 0 ?
+                             frames / wall_seconds : 0,
+                             "peak_rss_mb", perf_stats_peak_rss_mb(),
+                             "stages", stages,
+                             "decode_sources", decode);
+  int ret = report ? json_dump_file(report, path, JSON_INDENT(2)) : -1;
+  if (ret) {
+    printf("unable to write performance report %s\n", path);
+  }
+  json_decref(report);
+  return ret;
+}
@@ -0,0 +1,119 @@
+//
+//  perf_stats.h
+//  barc
+//
+
+#ifndef perf_stats_h
+#define perf_stats_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Process wide timers for the stages of the render pipeline, kept as
+ * histograms and written out as a JSON report when the process is done.
+ * Until perf_stats_enable is called, perf_stats_start returns 0 without
+ * reading the clock and perf_stats_end does nothing, so the hot paths pay
+ * one predictable branch each.
+ *
+ *   uint64_t start = perf_stats_start();
+ *   avcodec_encode_video2(...);
+ *   perf_stats_end(perf_encode, start);
+ *
+ * Recording is lock free and safe from any thread.
+ */
+enum perf_metric {
+  // av_read_frame, for video and audio
+  perf_demux = 0,
+  // video and audio decoding, also broken out per source
+  perf_decode,
+  // placing streams in the css layout for one output frame
+  perf_layout,
+  // one source frame scaled and drawn onto the output
+  perf_compose_subframe,
+  // a whole output frame, subframes and color conversion included
+  perf_compose_frame,
+  // yuv to rgb for sources, and rgb to yuv for the output
+  perf_color_convert,
+  // video and audio encoding
+  perf_encode,
+  // writing one packet to the container
+  perf_mux,
+  // time pipeline stages spend blocked on full or empty queues
+  perf_queue_push_wait,
+  perf_queue_pop_wait,
+  // from the start of an output frame to its hand off to the encoder
+  perf_frame_latency,
+  // how full a queue is when something is pushed, in percent. not a timer.
+  perf_queue_fill,
+  perf_metric_count
+};
+
+#define PERF_STATS_MAX_SOURCES 256
+
+/** Turn recording on. The report's wall clock starts here. */
+void perf_stats_enable();
+void perf_stats_reset();
+
+// read without synchronization: it is only ever set before rendering starts
+extern char perf_stats_enabled;
+
+static inline uint64_t perf_stats_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/** @return a start time for perf_stats_end, or 0 when disabled. */
+static inline uint64_t perf_stats_start() {
+  return perf_stats_enabled ? perf_stats_now() : 0;
+}
+
+void perf_stats_record(enum perf_metric metric, uint64_t value);
+
+static inline void perf_stats_end(enum perf_metric metric, uint64_t start) {
+  if (start) {
+    perf_stats_record(metric, perf_stats_now() - start);
+  }
+}
+
+/**
+ * Name a source so its decode time is reported separately. Sources opened
+ * again under the same name (by every chunk of a checkpointed render, say)
+ * share one entry.
+ * @return id for perf_stats_end_source, or -1 when disabled or out of room
+ */
+int perf_stats_add_source(const char* name);
+/**
+ * Forget every named source, so a long batch or daemon run doesn't run out
+ * of room. Only while no source is decoding: ids handed out before are no
+ * longer valid.
+ */
+void perf_stats_reset_sources();
+/** Record decode time for source (as perf_decode too). */
+void perf_stats_end_source(int source, uint64_t start);
+
+/** Count seconds of output rendered, for the realtime factor. */
+void perf_stats_add_media_time(double seconds);
+
+/**
+ * Count, mean and percentiles of a metric, in its own units (nanoseconds or
+ * percent).
+ * @return number of values recorded
+ */
+uint64_t perf_stats_summary(enum perf_metric metric, double* mean_out,
+                            double* p50_out, double* p99_out,
+                            double* max_out);
+
+/** Most memory the process has had resident so far. */
+double perf_stats_peak_rss_mb();
+
+/**
+ * Write everything recorded so far to path as JSON: wall and media time,
+ * realtime factor, frames per second, peak resident memory, and count, mean,
+ * p50, p99 and max per metric (milliseconds for timers).
+ */
+int perf_stats_write_report(const char* path);
+
+#endif /* perf_stats_h */
@@ -0,0 +1,63 @@
+//
+//  segment_plan.c
+//  barc
+//
+
+#include "segment_plan.h"
+#include <math.h>
+#include <stdint.h>
+
+static int64_t gcd(int64_t a, int64_t b) {
+  while (b) {
+    int64_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+double segment_plan_grid(double video_framerate,
+                         int audio_frame_size, int audio_sample_rate)
+{
+  // video frame: 1 / fps, audio frame: frame_size / sample_rate.
+  // lcm(a/b, c/d) == lcm(a*d, c*b) / (b*d)
+  int64_t fps = (int64_t) llround(video_framerate);
+  if (fps <= 0 || audio_frame_size <= 0 || audio_sample_rate <= 0) {
+    return 0;
+  }
+  int64_t video_num = audio_sample_rate;
+  int64_t audio_num = (int64_t)audio_frame_size * fps;
+  int64_t lcm = video_num / gcd(video_num, audio_num) * audio_num;
+  return (double)lcm / (double)(fps * audio_sample_rate);
+}
+
+int segment_plan_split(double duration, int max_segments, double grid,
+                       struct segment_s* segments_out)
+{
+  if (duration <= 0 || max_segments < 1) {
+    return 0;
+  }
+  int count = 0;
+  double begin = 0;
+  for (int i = 1; i <= max_segments; i++) {
+    double end = duration;
+    if (i < max_segments && grid > 0) {
+      end = round((duration * i / max_segments) / grid) * grid;
+    }
+    // short timelines collapse into fewer segments
+    if (end <= begin) {
+      continue;
+    }
+    if (end > duration) {
+      end = duration;
+    }
+    segments_out[count].begin = begin;
+    segments_out[count].end = end;
+    count++;
+    begin = end;
+    if (begin >= duration) {
+      break;
+    }
+  }
+  return count;
+}
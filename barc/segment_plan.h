@@ -0,0 +1,33 @@
+//
+//  segment_plan.h
+//  barc
+//
+
+#ifndef segment_plan_h
+#define segment_plan_h
+
+#include <stddef.h>
+
+/** A slice of the output timeline, in seconds. [begin, end) */
+struct segment_s {
+  double begin;
+  double end;
+};
+
+/**
+ * Smallest interval that is a whole number of video frames and a whole
+ * number of audio frames at the same time. Splitting the timeline on
+ * multiples of this keeps both tracks contiguous when segments are joined.
+ */
+double segment_plan_grid(double video_framerate,
+                         int audio_frame_size, int audio_sample_rate);
+
+/**
+ * Split [0, duration) into at most max_segments pieces of roughly equal
+ * length whose boundaries land on multiples of grid.
+ * @return the number of segments written to segments_out
+ */
+int segment_plan_split(double duration, int max_segments, double grid,
+                       struct segment_s* segments_out);
+
+#endif /* segment_plan_h */
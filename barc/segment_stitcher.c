@@ -0,0 +1,352 @@
+//
+//  segment_stitcher.c
+//  barc
+//
+
+#include "segment_stitcher.h"
+#include <jansson.h>
+#include <libavformat/avformat.h>
+#include <libavutil/mathematics.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char* sidecar_extension = ".segment";
+// pts in the sidecar use the same millisecond base as the output container
+static const int64_t sidecar_time_base = 1000;
+
+static int open_segment(AVFormatContext** ctx_out, const char* path) {
+  int ret = avformat_open_input(ctx_out, path, NULL, NULL);
+  if (ret < 0) {
+    printf("stitcher: unable to open segment %s: %s\n",
+           path, av_err2str(ret));
+    return ret;
+  }
+  ret = avformat_find_stream_info(*ctx_out, NULL);
+  if (ret < 0) {
+    printf("stitcher: no stream info for %s: %s\n", path, av_err2str(ret));
+    avformat_close_input(ctx_out);
+  }
+  return ret;
+}
+
+// segments are encoded starting from zero, but the muxer may have shifted
+// timestamps slightly. anchor everything on the first video packet.
+static int find_first_video_time(const char* path, double* time_out) {
+  AVFormatContext* ctx = NULL;
+  AVPacket packet = { 0 };
+  int ret = open_segment(&ctx, path);
+  if (ret < 0) {
+    return ret;
+  }
+  *time_out = 0;
+  while (av_read_frame(ctx, &packet) >= 0) {
+    AVStream* stream = ctx->streams[packet.stream_index];
+    if (AVMEDIA_TYPE_VIDEO == stream->codecpar->codec_type &&
+        AV_NOPTS_VALUE != packet.pts)
+    {
+      *time_out = packet.pts * av_q2d(stream->time_base);
+      av_packet_unref(&packet);
+      break;
+    }
+    av_packet_unref(&packet);
+  }
+  avformat_close_input(&ctx);
+  return 0;
+}
+
+static int open_output(AVFormatContext** ctx_out, const char* path,
+                       AVFormatContext* template_ctx)
+{
+  int ret = avformat_alloc_output_context2(ctx_out, NULL, NULL, path);
+  if (!*ctx_out) {
+    printf("stitcher: could not create output context for %s\n", path);
+    return ret < 0 ? ret : -1;
+  }
+  AVFormatContext* ctx = *ctx_out;
+  for (int i = 0; i < template_ctx->nb_streams; i++) {
+    AVStream* in_stream = template_ctx->streams[i];
+    AVStream* out_stream = avformat_new_stream(ctx, NULL);
+    if (!out_stream) {
+      return AVERROR(ENOMEM);
+    }
+    ret = avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar);
+    if (ret < 0) {
+      return ret;
+    }
+    out_stream->codecpar->codec_tag = 0;
+    out_stream->time_base = in_stream->time_base;
+  }
+  if (!(ctx->oformat->flags & AVFMT_NOFILE)) {
+    ret = avio_open(&ctx->pb, path, AVIO_FLAG_WRITE);
+    if (ret < 0) {
+      printf("stitcher: could not open %s: %s\n", path, av_err2str(ret));
+      return ret;
+    }
+  }
+  ret = avformat_write_header(ctx, NULL);
+  if (ret < 0) {
+    printf("stitcher: could not write header: %s\n", av_err2str(ret));
+  }
+  return ret;
+}
+
+/* Each segment is shifted by a single offset per stream, applied to pts and
+ * dts alike so reordered frames keep their display times. Every segment
+ * starts a new encoder on an IDR frame, and the reorder delay puts its first
+ * dts a frame or two ahead of its first pts. When that would land at or
+ * behind the previous segment's last dts, the whole stream is pushed back
+ * just far enough. */
+static int copy_segment(AVFormatContext* out_ctx, AVFormatContext* in_ctx,
+                        const struct stitch_segment_s* segment,
+                        double time_shift, char is_last,
+                        int64_t* last_dts)
+{
+  int ret = 0;
+  AVPacket packet = { 0 };
+  int64_t* shifts = (int64_t*) malloc(out_ctx->nb_streams * sizeof(int64_t));
+  for (int i = 0; i < out_ctx->nb_streams; i++) {
+    shifts[i] = AV_NOPTS_VALUE;
+  }
+  while (!ret && av_read_frame(in_ctx, &packet) >= 0) {
+    int index = packet.stream_index;
+    if (index >= out_ctx->nb_streams) {
+      av_packet_unref(&packet);
+      continue;
+    }
+    AVStream* in_stream = in_ctx->streams[index];
+    AVStream* out_stream = out_ctx->streams[index];
+    int64_t ts = AV_NOPTS_VALUE != packet.pts ? packet.pts : packet.dts;
+    double packet_time = ts * av_q2d(in_stream->time_base) + time_shift;
+    char is_audio = AVMEDIA_TYPE_AUDIO == in_stream->codecpar->codec_type;
+
+    // audio packets stand alone, so the overlap with the neighbouring
+    // segments can be cut out. video is never cut: segment renders stop
+    // their encoder at the segment end, and a dropped frame could be a
+    // reference for the ones after it.
+    if (is_audio && segment->drop_leading_audio &&
+        packet_time < segment->begin - 0.0001)
+    {
+      av_packet_unref(&packet);
+      continue;
+    }
+    if (is_audio && !is_last && packet_time >= segment->end - 0.0001) {
+      av_packet_unref(&packet);
+      continue;
+    }
+
+    av_packet_rescale_ts(&packet, in_stream->time_base,
+                         out_stream->time_base);
+    if (AV_NOPTS_VALUE == shifts[index]) {
+      shifts[index] = llround(time_shift / av_q2d(out_stream->time_base));
+      int64_t first_dts = AV_NOPTS_VALUE != packet.dts ?
+      packet.dts : packet.pts;
+      if (AV_NOPTS_VALUE != last_dts[index] && AV_NOPTS_VALUE != first_dts &&
+          first_dts + shifts[index] <= last_dts[index])
+      {
+        shifts[index] = last_dts[index] + 1 - first_dts;
+      }
+    }
+    if (AV_NOPTS_VALUE != packet.pts) {
+      packet.pts += shifts[index];
+    }
+    if (AV_NOPTS_VALUE != packet.dts) {
+      packet.dts += shifts[index];
+      last_dts[index] = packet.dts;
+    }
+    packet.pos = -1;
+    ret = av_interleaved_write_frame(out_ctx, &packet);
+    if (ret < 0) {
+      printf("stitcher: failed to write packet: %s\n", av_err2str(ret));
+    }
+    av_packet_unref(&packet);
+  }
+  free(shifts);
+  return ret < 0 ? ret : 0;
+}
+
+int segment_stitcher_run(const char* output_path,
+                         const struct stitch_segment_s* segments,
+                         size_t segment_count)
+{
+  AVFormatContext* out_ctx = NULL;
+  int64_t* last_dts = NULL;
+  int ret = 0;
+
+  for (size_t i = 0; !ret && i < segment_count; i++) {
+    const struct stitch_segment_s* segment = &segments[i];
+    double first_video_time = 0;
+    ret = find_first_video_time(segment->path, &first_video_time);
+    if (ret < 0) {
+      break;
+    }
+
+    AVFormatContext* in_ctx = NULL;
+    ret = open_segment(&in_ctx, segment->path);
+    if (ret < 0) {
+      break;
+    }
+
+    if (!out_ctx) {
+      ret = open_output(&out_ctx, output_path, in_ctx);
+      if (ret < 0) {
+        avformat_close_input(&in_ctx);
+        break;
+      }
+      last_dts = (int64_t*) malloc(out_ctx->nb_streams * sizeof(int64_t));
+      for (int j = 0; j < out_ctx->nb_streams; j++) {
+        last_dts[j] = AV_NOPTS_VALUE;
+      }
+    }
+
+    printf("stitcher: appending %s at %f\n", segment->path, segment->begin);
+    ret = copy_segment(out_ctx, in_ctx, segment,
+                       segment->begin - first_video_time,
+                       i == segment_count - 1, last_dts);
+    avformat_close_input(&in_ctx);
+  }
+
+  if (out_ctx) {
+    int tret = av_write_trailer(out_ctx);
+    if (!ret) {
+      ret = tret;
+    }
+    if (!(out_ctx->oformat->flags & AVFMT_NOFILE)) {
+      avio_closep(&out_ctx->pb);
+    }
+    avformat_free_context(out_ctx);
+  }
+  free(last_dts);
+  return ret;
+}
+
+#pragma mark - Sidecar
+
+static char* sidecar_path(const char* media_path) {
+  size_t len = strlen(media_path) + strlen(sidecar_extension) + 1;
+  char* path = (char*) malloc(len);
+  snprintf(path, len, "%s%s", media_path, sidecar_extension);
+  return path;
+}
+
+int segment_sidecar_write(const char* media_path,
+                          const struct segment_sidecar_s* sidecar)
+{
+  json_t* json = json_pack("{s:i, s:i, s:f, s:f, s:I, s:I, s:i, s:f, s:b}",
+                           "index", sidecar->index,
+                           "count", sidecar->count,
+                           "begin", sidecar->begin,
+                           "end", sidecar->end,
+                           "pts_begin", (json_int_t)
+                           llround(sidecar->begin * sidecar_time_base),
+                           "pts_end", (json_int_t)
+                           llround(sidecar->end * sidecar_time_base),
+                           "audio_preroll_frames",
+                           sidecar->audio_preroll_frames,
+                           "audio_preroll", sidecar->audio_preroll,
+                           "empty", sidecar->empty);
+  if (!json) {
+    printf("unable to build segment sidecar\n");
+    return -1;
+  }
+  char* path = sidecar_path(media_path);
+  int ret = json_dump_file(json, path, JSON_INDENT(2));
+  if (ret) {
+    printf("unable to write segment sidecar %s\n", path);
+  }
+  free(path);
+  json_decref(json);
+  return ret;
+}
+
+int segment_sidecar_read(const char* media_path,
+                         struct segment_sidecar_s* sidecar_out)
+{
+  json_error_t error;
+  char* path = sidecar_path(media_path);
+  json_t* json = json_load_file(path, 0, &error);
+  if (!json) {
+    printf("unable to read segment sidecar %s: %s\n", path, error.text);
+    free(path);
+    return -1;
+  }
+  int empty = 0;
+  memset(sidecar_out, 0, sizeof(struct segment_sidecar_s));
+  int ret = json_unpack(json, "{s:i, s:i, s:F, s:F, s?i, s?F, s?b}",
+                        "index", &sidecar_out->index,
+                        "count", &sidecar_out->count,
+                        "begin", &sidecar_out->begin,
+                        "end", &sidecar_out->end,
+                        "audio_preroll_frames",
+                        &sidecar_out->audio_preroll_frames,
+                        "audio_preroll", &sidecar_out->audio_preroll,
+                        "empty", &empty);
+  if (ret) {
+    printf("malformed segment sidecar %s\n", path);
+  }
+  sidecar_out->empty = empty;
+  free(path);
+  json_decref(json);
+  return ret;
+}
+
+int segment_sidecar_order(const char** paths,
+                          const struct segment_sidecar_s* sidecars,
+                          int count, struct stitch_segment_s* segments_out)
+{
+  int segment_count = count > 0 ? sidecars[0].count : 0;
+  for (int i = 0; i < count; i++) {
+    if (sidecars[i].count != segment_count) {
+      printf("%s belongs to a different split (%d segments, expected %d)\n",
+             paths[i], sidecars[i].count, segment_count);
+      return -1;
+    }
+  }
+  if (segment_count < 1 || segment_count > count) {
+    printf("expected %d segments to stitch, got %d pieces\n",
+           segment_count, count);
+    return -1;
+  }
+  // slot i holds the piece with index i
+  const struct segment_sidecar_s** slots = (const struct segment_sidecar_s**)
+  calloc(segment_count, sizeof(struct segment_sidecar_s*));
+  const char** slot_paths = (const char**)
+  calloc(segment_count, sizeof(const char*));
+  int ret = 0;
+  for (int i = 0; !ret && i < count; i++) {
+    const struct segment_sidecar_s* sidecar = &sidecars[i];
+    if (sidecar->empty) {
+      continue;
+    }
+    if (sidecar->index < 0 || sidecar->index >= segment_count) {
+      printf("%s is segment %d of a split into %d\n", paths[i],
+             sidecar->index, segment_count);
+      ret = -1;
+    } else if (slots[sidecar->index]) {
+      printf("%s and %s are both segment %d\n", slot_paths[sidecar->index],
+             paths[i], sidecar->index);
+      ret = -1;
+    } else {
+      slots[sidecar->index] = sidecar;
+      slot_paths[sidecar->index] = paths[i];
+    }
+  }
+  for (int i = 0; !ret && i < segment_count; i++) {
+    if (!slots[i]) {
+      printf("segment %d of %d is missing\n", i, segment_count);
+      ret = -1;
+    } else if (i > 0 && fabs(slots[i - 1]->end - slots[i]->begin) > 1e-6) {
+      printf("%s ends at %f but %s begins at %f\n", slot_paths[i - 1],
+             slots[i - 1]->end, slot_paths[i], slots[i]->begin);
+      ret = -1;
+    } else {
+      segments_out[i].path = slot_paths[i];
+      segments_out[i].begin = slots[i]->begin;
+      segments_out[i].end = slots[i]->end;
+      segments_out[i].drop_leading_audio = slots[i]->audio_preroll_frames > 0;
+    }
+  }
+  free(slot_paths);
+  free(slots);
+  return ret ? -1 : segment_count;
+}
@@ -0,0 +1,70 @@
+//
+//  segment_stitcher.h
+//  barc
+//
+
+#ifndef segment_stitcher_h
+#define segment_stitcher_h
+
+#include <stddef.h>
+
+/** One independently rendered piece of the final output. */
+struct stitch_segment_s {
+  const char* path;
+  // where this segment sits on the output timeline, in seconds
+  double begin;
+  double end;
+  // segment was rendered with audio pre-roll ahead of its first video frame.
+  // those packets overlap the previous segment and are discarded.
+  char drop_leading_audio;
+};
+
+/**
+ * Remux a list of segments into a single container without re-encoding.
+ * Every segment must have been written with the same encoder settings,
+ * start on an IDR frame and hold no video past its end (file_writer and the
+ * segment renders make sure of both). Segments must be given in timeline
+ * order.
+ * @return 0 on success
+ */
+int segment_stitcher_run(const char* output_path,
+                         const struct stitch_segment_s* segments,
+                         size_t segment_count);
+
+/**
+ * Describes one partial output rendered with --segment. Written next to the
+ * media as <media path>.segment (JSON), and read back by --stitch.
+ * Timestamps inside the partial output start at zero; begin/end place it on
+ * the final timeline.
+ */
+struct segment_sidecar_s {
+  int index;
+  int count;
+  double begin;
+  double end;
+  // audio frames encoded ahead of begin, and their total length in seconds
+  int audio_preroll_frames;
+  double audio_preroll;
+  // the timeline had fewer pieces than requested; no media was written
+  char empty;
+};
+
+int segment_sidecar_write(const char* media_path,
+                          const struct segment_sidecar_s* sidecar);
+int segment_sidecar_read(const char* media_path,
+                         struct segment_sidecar_s* sidecar_out);
+
+/**
+ * Check that the sidecars of count pieces describe exactly one whole split,
+ * and list the pieces in segments_out in timeline order, ready for
+ * segment_stitcher_run. Every piece must be from a split into the same
+ * number of segments, every index below that number must appear exactly
+ * once, and each piece must end where the next one begins. Empty pieces are
+ * accepted and left out.
+ * @return number of segments in segments_out (room for count), or -1
+ */
+int segment_sidecar_order(const char** paths,
+                          const struct segment_sidecar_s* sidecars,
+                          int count, struct stitch_segment_s* segments_out);
+
+#endif /* segment_stitcher_h */
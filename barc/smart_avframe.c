@@ -6,12 +6,23 @@
 //
 
 #include "smart_avframe.h"
+#include <stdlib.h>
+#include <string.h>
 #include <uv.h>
 
+struct attachment_s {
+    void* key;
+    size_t key_size;
+    void* data;
+    smart_frame_attachment_free_f free_f;
+    struct attachment_s* next;
+};
+
 struct smart_frame_t {
     AVFrame* frame;
     int ref;
     uv_mutex_t lock;
+    struct attachment_s* attachments;
 };
 
 void smart_frame_create(struct smart_frame_t** smart_frame, AVFrame* frame) {
@@ -38,6 +49,14 @@ void smart_frame_release(struct smart_frame_t* frame) {
     }
     uv_mutex_unlock(&frame->lock);
     if (do_free) {
+        struct attachment_s* attachment = frame->attachments;
+        while (attachment) {
+            struct attachment_s* next = attachment->next;
+            attachment->free_f(attachment->data);
+            free(attachment->key);
+            free(attachment);
+            attachment = next;
+        }
         av_frame_free(&frame->frame);
         uv_mutex_destroy(&frame->lock);
         free(frame);
@@ -47,3 +66,63 @@ void smart_frame_release(struct smart_frame_t* frame) {
 AVFrame* smart_frame_get(struct smart_frame_t* frame) {
     return frame->frame;
 }
+
+// caller must hold the frame lock
+static struct attachment_s* find_attachment(struct smart_frame_t* frame,
+                                            const void* key, size_t key_size)
+{
+    struct attachment_s* attachment = frame->attachments;
+    while (attachment) {
+        if (attachment->key_size == key_size &&
+            !memcmp(attachment->key, key, key_size))
+        {
+            return attachment;
+        }
+        attachment = attachment->next;
+    }
+    return NULL;
+}
+
+void* smart_frame_get_attachment(struct smart_frame_t* frame,
+                                 const void* key, size_t key_size)
+{
+    uv_mutex_lock(&frame->lock);
+    struct attachment_s* attachment = find_attachment(frame, key, key_size);
+    void* data = attachment ? attachment->data : NULL;
+    uv_mutex_unlock(&frame->lock);
+    return data;
+}
+
+void* smart_frame_set_attachment(struct smart_frame_t* frame,
+                                 const void* key, size_t key_size,
+                                 void* data,
+                                 smart_frame_attachment_free_f free_f)
+{
+    uv_mutex_lock(&frame->lock);
+    struct attachment_s* existing = find_attachment(frame, key, key_size);
+    if (existing) {
+        uv_mutex_unlock(&frame->lock);
+        // somebody beat us to it. theirs is just as good.
+        free_f(data);
+        return existing->data;
+    }
+    struct attachment_s* attachment = (struct attachment_s*)
+    calloc(1, sizeof(struct attachment_s));
+    attachment->key = malloc(key_size);
+    memcpy(attachment->key, key, key_size);
+    attachment->key_size = key_size;
+    attachment->data = data;
+    attachment->free_f = free_f;
+    attachment->next = frame->attachments;
+    frame->attachments = attachment;
+    uv_mutex_unlock(&frame->lock);
+    return data;
+}
+
+size_t frame_buffer_bytes(const AVFrame* frame) {
+    size_t bytes = 0;
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++) {
+        bytes += frame->buf[i]->size;
+    }
+    return bytes;
+}
@@ -27,4 +27,29 @@ void smart_frame_release(struct smart_frame_t* frame);
 
 AVFrame* smart_frame_get(struct smart_frame_t* frame);
 
+/* Derived data (color conversions, scaled copies) can be attached to a frame
+ * so it is only computed once, no matter how many output frames or
+ * renditions use the source frame. Attachments are looked up by an opaque
+ * key and destroyed with free_f along with the frame.
+ */
+typedef void (*smart_frame_attachment_free_f)(void* data);
+
+/* @return the attachment stored under key, or NULL. */
+void* smart_frame_get_attachment(struct smart_frame_t* frame,
+                                 const void* key, size_t key_size);
+/* Attach data under key. If another thread attached something under the same
+ * key first, data is released with free_f and the existing attachment is
+ * returned instead.
+ * @return the attachment now stored under key.
+ */
+void* smart_frame_set_attachment(struct smart_frame_t* frame,
+                                 const void* key, size_t key_size,
+                                 void* data,
+                                 smart_frame_attachment_free_f free_f);
+
+/* Size of the buffers behind frame's data, for queue and memory accounting.
+ * Buffers shared with other frames are counted in full.
+ */
+size_t frame_buffer_bytes(const AVFrame* frame);
+
 #endif /* smart_avframe_h */
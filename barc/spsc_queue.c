@@ -0,0 +1,175 @@
+//
+//  spsc_queue.c
+//  barc
+//
+
+#include "spsc_queue.h"
+#include "memory_governor.h"
+#include "perf_stats.h"
+#include <stdlib.h>
+#include <uv.h>
+
+struct spsc_queue_s {
+  void** items;
+  // size of each queued item, as given to spsc_queue_push_sized
+  size_t* item_bytes;
+  size_t capacity;
+  // head is only written by the producer, tail only by the consumer
+  size_t head;
+  size_t tail;
+  // counting semaphores let either side sleep instead of spinning
+  uv_sem_t free_slots;
+  uv_sem_t used_slots;
+  // optional byte bound. the producer sleeps on byte_freed while over it.
+  size_t max_bytes;
+  size_t queued_bytes;
+  uv_mutex_t byte_lock;
+  uv_cond_t byte_freed;
+};
+
+int spsc_queue_alloc(struct spsc_queue_s** queue_out, size_t capacity) {
+  struct spsc_queue_s* queue = (struct spsc_queue_s*)
+  calloc(1, sizeof(struct spsc_queue_s));
+  if (!queue) {
+    return -1;
+  }
+  queue->items = (void**) calloc(capacity, sizeof(void*));
+  queue->item_bytes = (size_t*) calloc(capacity, sizeof(size_t));
+  if (!queue->items || !queue->item_bytes) {
+    free(queue->items);
+    free(queue->item_bytes);
+    free(queue);
+    return -1;
+  }
+  queue->capacity = capacity;
+  uv_sem_init(&queue->free_slots, (unsigned int) capacity);
+  uv_sem_init(&queue->used_slots, 0);
+  uv_mutex_init(&queue->byte_lock);
+  uv_cond_init(&queue->byte_freed);
+  *queue_out = queue;
+  return 0;
+}
+
+void spsc_queue_free(struct spsc_queue_s* queue) {
+  uv_sem_destroy(&queue->free_slots);
+  uv_sem_destroy(&queue->used_slots);
+  uv_mutex_destroy(&queue->byte_lock);
+  uv_cond_destroy(&queue->byte_freed);
+  free(queue->items);
+  free(queue->item_bytes);
+  free(queue);
+}
+
+void spsc_queue_set_max_bytes(struct spsc_queue_s* queue, size_t max_bytes)
+{
+  queue->max_bytes = max_bytes;
+}
+
+static void enqueue(struct spsc_queue_s* queue, void* item, size_t bytes) {
+  size_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+  queue->items[head % queue->capacity] = item;
+  queue->item_bytes[head % queue->capacity] = bytes;
+  // publish the item before the consumer can observe the new head
+  __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+  uv_sem_post(&queue->used_slots);
+  if (perf_stats_enabled) {
+    size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    perf_stats_record(perf_queue_fill,
+                      100 * (head + 1 - tail) / queue->capacity);
+  }
+}
+
+// only the time spent asleep counts as waiting
+static void wait_slot(uv_sem_t* slots, enum perf_metric metric) {
+  if (!uv_sem_trywait(slots)) {
+    return;
+  }
+  uint64_t start = perf_stats_start();
+  uv_sem_wait(slots);
+  perf_stats_end(metric, start);
+}
+
+static void* dequeue(struct spsc_queue_s* queue) {
+  size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+  // pairs with the release store in enqueue
+  __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+  void* item = queue->items[tail % queue->capacity];
+  size_t bytes = queue->item_bytes[tail % queue->capacity];
+  __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+  uv_sem_post(&queue->free_slots);
+  if (bytes) {
+    memory_governor_discharge(bytes);
+    uv_mutex_lock(&queue->byte_lock);
+    queue->queued_bytes -= bytes;
+    uv_cond_signal(&queue->byte_freed);
+    uv_mutex_unlock(&queue->byte_lock);
+  }
+  return item;
+}
+
+void spsc_queue_push(struct spsc_queue_s* queue, void* item) {
+  wait_slot(&queue->free_slots, perf_queue_push_wait);
+  enqueue(queue, item, 0);
+}
+
+void spsc_queue_push_sized(struct spsc_queue_s* queue, void* item,
+                           size_t bytes)
+{
+  uv_mutex_lock(&queue->byte_lock);
+  // the bound tightens while the process is short on memory. re-read on
+  // every wakeup, since other queues may have drained in the meantime.
+  uint64_t start = 0;
+  while (queue->max_bytes && queue->queued_bytes > 0 &&
+         queue->queued_bytes + bytes >
+         memory_governor_scale(queue->max_bytes, 0))
+  {
+    if (!start) {
+      start = perf_stats_start();
+    }
+    uv_cond_wait(&queue->byte_freed, &queue->byte_lock);
+  }
+  queue->queued_bytes += bytes;
+  uv_mutex_unlock(&queue->byte_lock);
+  perf_stats_end(perf_queue_push_wait, start);
+  memory_governor_charge(bytes);
+  wait_slot(&queue->free_slots, perf_queue_push_wait);
+  enqueue(queue, item, bytes);
+}
+
+int spsc_queue_try_push(struct spsc_queue_s* queue, void* item) {
+  if (uv_sem_trywait(&queue->free_slots)) {
+    return 1;
+  }
+  enqueue(queue, item, 0);
+  return 0;
+}
+
+void* spsc_queue_pop(struct spsc_queue_s* queue) {
+  wait_slot(&queue->used_slots, perf_queue_pop_wait);
+  return dequeue(queue);
+}
+
+int spsc_queue_try_pop(struct spsc_queue_s* queue, void** item_out) {
+  if (uv_sem_trywait(&queue->used_slots)) {
+    return 1;
+  }
+  *item_out = dequeue(queue);
+  return 0;
+}
+
+size_t spsc_queue_size(struct spsc_queue_s* queue) {
+  size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+  size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+  return head - tail;
+}
+
+size_t spsc_queue_capacity(struct spsc_queue_s* queue) {
+  return queue->capacity;
+}
+
+size_t spsc_queue_bytes(struct spsc_queue_s* queue) {
+  uv_mutex_lock(&queue->byte_lock);
+  size_t bytes = queue->queued_bytes;
+  uv_mutex_unlock(&queue->byte_lock);
+  return bytes;
+}
@@ -0,0 +1,49 @@
+//
+//  spsc_queue.h
+//  barc
+//
+
+#ifndef spsc_queue_h
+#define spsc_queue_h
+
+#include <stddef.h>
+
+struct spsc_queue_s;
+
+/* Bounded single-producer, single-consumer queue of pointers.
+ * Exactly one thread may push and exactly one (other) thread may pop. Items
+ * are handed off without locks; the blocking variants only sleep when the
+ * queue is full (push) or empty (pop).
+ */
+int spsc_queue_alloc(struct spsc_queue_s** queue_out, size_t capacity);
+void spsc_queue_free(struct spsc_queue_s* queue);
+
+/* Also bound the queue by the total size of what it holds. Items pushed with
+ * spsc_queue_push_sized count against the limit; a single item larger than
+ * the limit is still let through once the queue is empty. 0 means no byte
+ * limit (the default). Set before either side starts using the queue. */
+void spsc_queue_set_max_bytes(struct spsc_queue_s* queue, size_t max_bytes);
+
+/* Block until there is room in the queue, then enqueue item. */
+void spsc_queue_push(struct spsc_queue_s* queue, void* item);
+/* Like spsc_queue_push, but also waits for bytes of room under the byte
+ * limit. The bytes are given back when the item is popped. They also count
+ * towards the memory governor, which shrinks the byte limit while the process
+ * is close to its memory limit (see memory_governor.h). */
+void spsc_queue_push_sized(struct spsc_queue_s* queue, void* item,
+                           size_t bytes);
+/* @return 0 if item was enqueued, 1 if the queue is full. */
+int spsc_queue_try_push(struct spsc_queue_s* queue, void* item);
+
+/* Block until an item is available, then dequeue it. */
+void* spsc_queue_pop(struct spsc_queue_s* queue);
+/* @return 0 if an item was dequeued into item_out, 1 if the queue is empty. */
+int spsc_queue_try_pop(struct spsc_queue_s* queue, void** item_out);
+
+/* Approximate number of queued items. Exact when called from either end. */
+size_t spsc_queue_size(struct spsc_queue_s* queue);
+size_t spsc_queue_capacity(struct spsc_queue_s* queue);
+/* Bytes currently accounted to queued items. */
+size_t spsc_queue_bytes(struct spsc_queue_s* queue);
+
+#endif /* spsc_queue_h */
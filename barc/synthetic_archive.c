@@ -0,0 +1,405 @@
+//
+//  synthetic_archive.c
+//  barc
+//
+
+#include "synthetic_archive.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <jansson.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/opt.h>
+
+#define SYNTHETIC_PATH_MAX 1024
+#define SYNTHETIC_ID_MAX 64
+
+static const int sample_rate = 48000;
+static const int audio_bit_rate = 32000;
+// what libopus asks for when it doesn't say
+static const int default_audio_frame_size = 960;
+// manifest times are milliseconds; any fixed start keeps output repeatable
+static const json_int_t created_at = 1500000000000;
+static const char* layout_presets[] = {
+  "horizontalPresentation", "verticalPresentation", "pip", "bestFit"
+};
+
+struct synthetic_file_s {
+  // which stream of the archive, for its pattern and tone
+  int stream_index;
+  AVFormatContext* format_ctx;
+  AVStream* video_stream;
+  AVStream* audio_stream;
+  AVCodecContext* video_ctx;
+  AVCodecContext* audio_ctx;
+  AVFrame* video_frame;
+  AVFrame* audio_frame;
+  int64_t video_frames;
+  int64_t audio_samples;
+};
+
+void synthetic_archive_config_default(struct synthetic_archive_config_s* config)
+{
+  memset(config, 0, sizeof(struct synthetic_archive_config_s));
+  config->stream_count = 4;
+  config->width = 640;
+  config->height = 480;
+  config->fps = 15;
+  config->duration = 60;
+  config->start_stagger = 1;
+  config->stop_stagger = 1;
+  config->reconnects = 1;
+  config->gap_duration = 2;
+  config->layout_interval = 10;
+  config->video_bit_rate = 500000;
+}
+
+static void stream_id_for_index(int index, char id_out[SYNTHETIC_ID_MAX]) {
+  // shaped like the uuids real archives use
+  snprintf(id_out, SYNTHETIC_ID_MAX, "00000000-0000-4000-8000-%012d", index);
+}
+
+#pragma mark - Media
+
+static int open_video(struct synthetic_file_s* file,
+                      const struct synthetic_archive_config_s* config)
+{
+  AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_VP8);
+  if (!codec) {
+    printf("No VP8 encoder. Build FFmpeg with --enable-libvpx\n");
+    return AVERROR_ENCODER_NOT_FOUND;
+  }
+  file->video_stream = avformat_new_stream(file->format_ctx, codec);
+  if (!file->video_stream) {
+    return AVERROR(ENOMEM);
+  }
+  AVCodecContext* ctx = file->video_stream->codec;
+  ctx->width = config->width;
+  ctx->height = config->height;
+  ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  ctx->time_base = (AVRational){ 1, config->fps };
+  ctx->gop_size = config->fps * 2;
+  ctx->bit_rate = config->video_bit_rate;
+  file->video_stream->time_base = ctx->time_base;
+  // encode like a publisher does, which also keeps generating quick
+  av_opt_set(ctx->priv_data, "deadline", "realtime", 0);
+  av_opt_set(ctx->priv_data, "cpu-used", "8", 0);
+  if (file->format_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+    ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
+  }
+  int ret = avcodec_open2(ctx, codec, NULL);
+  if (ret < 0) {
+    printf("Could not open video codec: %s\n", av_err2str(ret));
+    return ret;
+  }
+  file->video_ctx = ctx;
+
+  file->video_frame = av_frame_alloc();
+  file->video_frame->format = ctx->pix_fmt;
+  file->video_frame->width = ctx->width;
+  file->video_frame->height = ctx->height;
+  return av_frame_get_buffer(file->video_frame, 32);
+}
+
+static int open_audio(struct synthetic_file_s* file) {
+  AVCodec* codec = avcodec_find_encoder_by_name("libopus");
+  if (!codec) {
+    codec = avcodec_find_encoder(AV_CODEC_ID_OPUS);
+  }
+  if (!codec) {
+    printf("No Opus encoder. Build FFmpeg with --enable-libopus\n");
+    return AVERROR_ENCODER_NOT_FOUND;
+  }
+  file->audio_stream = avformat_new_stream(file->format_ctx, codec);
+  if (!file->audio_stream) {
+    return AVERROR(ENOMEM);
+  }
+  AVCodecContext* ctx = file->audio_stream->codec;
+  ctx->sample_fmt = codec->sample_fmts ?
+  codec->sample_fmts[0] : AV_SAMPLE_FMT_S16;
+  ctx->sample_rate = sample_rate;
+  ctx->channels = 1;
+  ctx->channel_layout = AV_CH_LAYOUT_MONO;
+  ctx->bit_rate = audio_bit_rate;
+  ctx->time_base = (AVRational){ 1, sample_rate };
+  // the built in opus encoder is still marked experimental
+  ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+  file->audio_stream->time_base = ctx->time_base;
+  if (file->format_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+    ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
+  }
+  int ret = avcodec_open2(ctx, codec, NULL);
+  if (ret < 0) {
+    printf("Could not open audio codec: %s\n", av_err2str(ret));
+    return ret;
+  }
+  file->audio_ctx = ctx;
+
+  file->audio_frame = av_frame_alloc();
+  file->audio_frame->format = ctx->sample_fmt;
+  file->audio_frame->channel_layout = ctx->channel_layout;
+  file->audio_frame->sample_rate = ctx->sample_rate;
+  file->audio_frame->nb_samples = ctx->frame_size ?
+  ctx->frame_size : default_audio_frame_size;
+  return av_frame_get_buffer(file->audio_frame, 0);
+}
+
+// a bright bar sweeps across a background shaded differently per stream
+static void fill_pattern(struct synthetic_file_s* file) {
+  AVFrame* frame = file->video_frame;
+  av_frame_make_writable(frame);
+  int bar_width = frame->width / 16;
+  int bar_x = (int)((file->video_frames * 8) % frame->width);
+  uint8_t background = 40 + 30 * (file->stream_index % 6);
+  for (int y = 0; y < frame->height; y++) {
+    uint8_t* row = frame->data[0] + y * frame->linesize[0];
+    memset(row, background, frame->width);
+    for (int x = 0; x < bar_width; x++) {
+      row[(bar_x + x) % frame->width] = 235;
+    }
+  }
+  for (int y = 0; y < frame->height / 2; y++) {
+    memset(frame->data[1] + y * frame->linesize[1],
+           64 + 37 * (file->stream_index % 5), frame->width / 2);
+    memset(frame->data[2] + y * frame->linesize[2],
+           192 - 29 * (file->stream_index % 5), frame->width / 2);
+  }
+  frame->pts = file->video_frames;
+}
+
+// each stream plays its own pitch, quietly enough to mix without clipping
+static void fill_tone(struct synthetic_file_s* file) {
+  AVFrame* frame = file->audio_frame;
+  av_frame_make_writable(frame);
+  double frequency = 220 * (file->stream_index + 1);
+  for (int i = 0; i < frame->nb_samples; i++) {
+    double value = 0.2 * sin(2 * M_PI * frequency *
+                             (file->audio_samples + i) / sample_rate);
+    // mono, so planar and packed formats are laid out the same
+    if (AV_SAMPLE_FMT_S16 == frame->format ||
+        AV_SAMPLE_FMT_S16P == frame->format)
+    {
+      ((int16_t*)frame->data[0])[i] = (int16_t)(value * INT16_MAX);
+    } else {
+      ((float*)frame->data[0])[i] = (float)value;
+    }
+  }
+  frame->pts = file->audio_samples;
+}
+
+/**
+ * Encode frame (NULL to drain the encoder) and mux what comes out.
+ * @return 0, AVERROR_EOF once drained, or an error
+ */
+static int write_frame(struct synthetic_file_s* file, AVCodecContext* ctx,
+                       AVStream* stream, AVFrame* frame)
+{
+  AVPacket packet = { 0 };
+  av_init_packet(&packet);
+  int got_packet = 0;
+  int ret = AVMEDIA_TYPE_VIDEO == ctx->codec_type ?
+  avcodec_encode_video2(ctx, &packet, frame, &got_packet) :
+  avcodec_encode_audio2(ctx, &packet, frame, &got_packet);
+  if (ret < 0) {
+    printf("Error encoding synthetic media: %s\n", av_err2str(ret));
+    return ret;
+  }
+  if (!got_packet) {
+    return frame ? 0 : AVERROR_EOF;
+  }
+  av_packet_rescale_ts(&packet, ctx->time_base, stream->time_base);
+  packet.stream_index = stream->index;
+  return av_interleaved_write_frame(file->format_ctx, &packet);
+}
+
+static int drain_encoder(struct synthetic_file_s* file, AVCodecContext* ctx,
+                         AVStream* stream)
+{
+  int ret;
+  while (0 == (ret = write_frame(file, ctx, stream, NULL)));
+  return AVERROR_EOF == ret ? 0 : ret;
+}
+
+static int write_webm(const struct synthetic_archive_config_s* config,
+                      int stream_index, const char* path, double duration)
+{
+  struct synthetic_file_s file = { 0 };
+  file.stream_index = stream_index;
+  char header_written = 0;
+  int ret = avformat_alloc_output_context2(&file.format_ctx, NULL, "webm",
+                                           path);
+  if (ret < 0) {
+    printf("Could not allocate webm output: %s\n", av_err2str(ret));
+    return ret;
+  }
+  if ((ret = open_video(&file, config)) < 0 ||
+      (ret = open_audio(&file)) < 0)
+  {
+    goto end;
+  }
+  if ((ret = avio_open(&file.format_ctx->pb, path, AVIO_FLAG_WRITE)) < 0) {
+    printf("Could not open '%s': %s\n", path, av_err2str(ret));
+    goto end;
+  }
+  if ((ret = avformat_write_header(file.format_ctx, NULL)) < 0) {
+    printf("Could not write webm header: %s\n", av_err2str(ret));
+    goto end;
+  }
+  header_written = 1;
+
+  // feed both encoders in timestamp order so the muxer interleaves cheaply
+  int64_t video_count = llround(duration * config->fps);
+  int64_t audio_count = llround(duration * sample_rate);
+  while (0 == ret && (file.video_frames < video_count ||
+                      file.audio_samples < audio_count))
+  {
+    double video_time = (double)file.video_frames / config->fps;
+    double audio_time = (double)file.audio_samples / sample_rate;
+    if (file.video_frames < video_count &&
+        (file.audio_samples >= audio_count || video_time <= audio_time))
+    {
+      fill_pattern(&file);
+      ret = write_frame(&file, file.video_ctx, file.video_stream,
+                        file.video_frame);
+      file.video_frames++;
+    } else {
+      fill_tone(&file);
+      ret = write_frame(&file, file.audio_ctx, file.audio_stream,
+                        file.audio_frame);
+      file.audio_samples += file.audio_frame->nb_samples;
+    }
+  }
+  if (0 == ret) {
+    ret = drain_encoder(&file, file.video_ctx, file.video_stream);
+  }
+  if (0 == ret) {
+    ret = drain_encoder(&file, file.audio_ctx, file.audio_stream);
+  }
+
+end:
+  if (header_written) {
+    av_write_trailer(file.format_ctx);
+  }
+  if (file.video_ctx) {
+    avcodec_close(file.video_ctx);
+  }
+  if (file.audio_ctx) {
+    avcodec_close(file.audio_ctx);
+  }
+  av_frame_free(&file.video_frame);
+  av_frame_free(&file.audio_frame);
+  avio_closep(&file.format_ctx->pb);
+  avformat_free_context(file.format_ctx);
+  return ret;
+}
+
+#pragma mark - Manifest
+
+static json_t* layout_events(const struct synthetic_archive_config_s* config)
+{
+  json_t* events = json_array();
+  if (config->layout_interval <= 0) {
+    return events;
+  }
+  char stream_id[SYNTHETIC_ID_MAX];
+  int preset_count = sizeof(layout_presets) / sizeof(layout_presets[0]);
+  for (int i = 1; i * config->layout_interval < config->duration; i++) {
+    json_int_t at = created_at + llround(i * config->layout_interval * 1000);
+    // focus moves on to the next stream, off the one that had it
+    if (i > 1) {
+      stream_id_for_index((i - 2) % config->stream_count, stream_id);
+      json_array_append_new(events, json_pack
+                            ("{s:I, s:s, s:{s:s, s:s, s:[s]}}",
+                             "createdAt", at, "action", "streamChanged",
+                             "stream", "id", stream_id,
+                             "videoType", "camera",
+                             "layoutClassList", "camera"));
+    }
+    stream_id_for_index((i - 1) % config->stream_count, stream_id);
+    json_array_append_new(events, json_pack
+                          ("{s:I, s:s, s:{s:s, s:s, s:[s]}}",
+                           "createdAt", at, "action", "streamChanged",
+                           "stream", "id", stream_id,
+                           "videoType", "camera",
+                           "layoutClassList", "focus"));
+    json_array_append_new(events, json_pack
+                          ("{s:I, s:s, s:{s:s}}",
+                           "createdAt", at, "action", "layoutChanged",
+                           "layout", "type",
+                           layout_presets[(i - 1) % preset_count]));
+  }
+  return events;
+}
+
+int synthetic_archive_write(const struct synthetic_archive_config_s* config,
+                            const char* dir)
+{
+  if (config->stream_count < 1 || config->fps < 1 ||
+      config->width < 2 || config->height < 2)
+  {
+    printf("synthetic archive needs at least one stream, a frame rate and "
+           "a size\n");
+    return AVERROR(EINVAL);
+  }
+  json_t* files = json_array();
+  char stream_id[SYNTHETIC_ID_MAX];
+  char filename[SYNTHETIC_PATH_MAX];
+  char path[SYNTHETIC_PATH_MAX];
+  int ret = 0;
+  int parts = config->reconnects + 1;
+  for (int i = 0; i < config->stream_count && 0 == ret; i++) {
+    stream_id_for_index(i, stream_id);
+    double start = i * config->start_stagger;
+    double stop = config->duration - i * config->stop_stagger;
+    double part_duration =
+    (stop - start - config->reconnects * config->gap_duration) / parts;
+    if (part_duration <= 0) {
+      printf("synthetic stream %d has no time left between its gaps\n", i);
+      ret = AVERROR(EINVAL);
+      break;
+    }
+    for (int part = 0; part < parts && 0 == ret; part++) {
+      double part_start = start + part * (part_duration +
+                                          config->gap_duration);
+      snprintf(filename, sizeof(filename), "%s_%d.webm", stream_id, part);
+      snprintf(path, sizeof(path), "%s/%s", dir, filename);
+      printf("Writing synthetic stream %s (%.1fs to %.1fs)\n", filename,
+             part_start, part_start + part_duration);
+      ret = write_webm(config, i, path, part_duration);
+      struct stat file_stat = { 0 };
+      stat(path, &file_stat);
+      json_array_append_new(files, json_pack
+                            ("{s:s, s:s, s:I, s:I, s:I, s:s}",
+                             "connectionData", "",
+                             "filename", filename,
+                             "size", (json_int_t)file_stat.st_size,
+                             "startTimeOffset",
+                             (json_int_t)llround(part_start * 1000),
+                             "stopTimeOffset",
+                             (json_int_t)llround((part_start + part_duration)
+                                                 * 1000),
+                             "streamId", stream_id));
+    }
+  }
+  if (0 == ret) {
+    json_t* manifest = json_pack("{s:I, s:o, s:o, s:s, s:s, s:s}",
+                                 "createdAt", created_at,
+                                 "files", files,
+                                 "layoutEvents", layout_events(config),
+                                 "id", "synthetic-archive",
+                                 "name", "synthetic archive",
+                                 "sessionId", "synthetic-session");
+    files = NULL;
+    snprintf(path, sizeof(path), "%s/manifest.json", dir);
+    if (!manifest || json_dump_file(manifest, path, JSON_INDENT(2))) {
+      printf("Could not write %s\n", path);
+      ret = AVERROR(EIO);
+    }
+    json_decref(manifest);
+  }
+  json_decref(files);
+  return ret;
+}
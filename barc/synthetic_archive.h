@@ -0,0 +1,49 @@
+//
+//  synthetic_archive.h
+//  barc
+//
+
+#ifndef synthetic_archive_h
+#define synthetic_archive_h
+
+/**
+ * Writes an individual stream archive made up entirely of test media, for
+ * benchmarks and tests that can't use real (private) archives: one VP8/Opus
+ * webm per stream connection, showing a moving test pattern and playing a
+ * tone of its own, plus a manifest.json that places them on the archive
+ * timeline and changes the layout as it goes.
+ *
+ * Streams join start_stagger seconds apart and leave stop_stagger seconds
+ * apart, so sources come and go. With reconnects, each stream is split into
+ * that many more files with the same stream id and gap_duration seconds of
+ * nothing between them, the way a dropped publisher shows up in a real
+ * archive.
+ */
+struct synthetic_archive_config_s {
+  int stream_count;
+  int width;
+  int height;
+  int fps;
+  // seconds, from the first stream joining to the last one leaving
+  double duration;
+  double start_stagger;
+  double stop_stagger;
+  int reconnects;
+  double gap_duration;
+  // move focus to the next stream and switch presets this often. 0 for a
+  // single bestFit layout throughout.
+  double layout_interval;
+  int video_bit_rate;
+};
+
+void synthetic_archive_config_default(struct synthetic_archive_config_s* config);
+
+/**
+ * Write the archive into dir, which must exist. Needs av_register_all first.
+ * @return 0 on success, AVERROR_ENCODER_NOT_FOUND if FFmpeg was built
+ * without VP8 or Opus encoders, or another negative error.
+ */
+int synthetic_archive_write(const struct synthetic_archive_config_s* config,
+                            const char* dir);
+
+#endif /* synthetic_archive_h */
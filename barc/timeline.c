@@ -0,0 +1,156 @@
+//
+//  timeline.c
+//  barc
+//
+
+#include <stdlib.h>
+#include "timeline.h"
+
+struct timeline_entry_s {
+  double time;
+  enum timeline_edge edge;
+  // insertion order, so sorting is stable
+  size_t sequence;
+  void* item;
+};
+
+struct timeline_s {
+  struct timeline_entry_s* entries;
+  size_t count;
+  size_t capacity;
+  size_t cursor;
+  size_t sequence;
+  char inclusive;
+  // entries were added since the unfired tail was last sorted
+  char dirty;
+};
+
+static int compare_entries(const void* a, const void* b) {
+  const struct timeline_entry_s* lhs = (const struct timeline_entry_s*)a;
+  const struct timeline_entry_s* rhs = (const struct timeline_entry_s*)b;
+  if (lhs->time != rhs->time) {
+    return lhs->time < rhs->time ? -1 : 1;
+  }
+  if (lhs->edge != rhs->edge) {
+    return lhs->edge < rhs->edge ? -1 : 1;
+  }
+  return (lhs->sequence > rhs->sequence) - (lhs->sequence < rhs->sequence);
+}
+
+static void add_entry(struct timeline_s* timeline, double time,
+                      enum timeline_edge edge, void* item)
+{
+  if (timeline->count == timeline->capacity) {
+    timeline->capacity = timeline->capacity ? timeline->capacity * 2 : 64;
+    timeline->entries = (struct timeline_entry_s*)
+    realloc(timeline->entries,
+            timeline->capacity * sizeof(struct timeline_entry_s));
+  }
+  struct timeline_entry_s* entry = &timeline->entries[timeline->count++];
+  entry->time = time;
+  entry->edge = edge;
+  entry->sequence = timeline->sequence++;
+  entry->item = item;
+  timeline->dirty = 1;
+}
+
+void timeline_alloc(struct timeline_s** timeline_out, char inclusive) {
+  struct timeline_s* timeline = (struct timeline_s*)
+  calloc(1, sizeof(struct timeline_s));
+  timeline->inclusive = inclusive;
+  *timeline_out = timeline;
+}
+
+void timeline_free(struct timeline_s* timeline) {
+  if (!timeline) {
+    return;
+  }
+  free(timeline->entries);
+  free(timeline);
+}
+
+void timeline_add_span(struct timeline_s* timeline, double begin, double end,
+                       void* item)
+{
+  add_entry(timeline, begin, timeline_enter, item);
+  add_entry(timeline, end, timeline_leave, item);
+}
+
+void timeline_add_point(struct timeline_s* timeline, double time, void* item)
+{
+  add_entry(timeline, time, timeline_enter, item);
+}
+
+static void sort_pending(struct timeline_s* timeline) {
+  if (timeline->dirty) {
+    // fired entries stay where they are; only the tail needs ordering
+    qsort(timeline->entries + timeline->cursor,
+          timeline->count - timeline->cursor,
+          sizeof(struct timeline_entry_s), compare_entries);
+    timeline->dirty = 0;
+  }
+}
+
+int timeline_advance(struct timeline_s* timeline, double time,
+                     timeline_edge_cb* callback, void* p)
+{
+  sort_pending(timeline);
+  int fired = 0;
+  while (timeline->cursor < timeline->count) {
+    struct timeline_entry_s* entry = &timeline->entries[timeline->cursor];
+    if (timeline->inclusive ? entry->time > time : entry->time >= time) {
+      break;
+    }
+    timeline->cursor++;
+    callback(p, entry->item, entry->edge);
+    fired++;
+  }
+  return fired;
+}
+
+size_t timeline_remaining(const struct timeline_s* timeline) {
+  return timeline->count - timeline->cursor;
+}
+
+static void append_gap(struct timeline_gap_s** gaps, size_t* count,
+                       size_t* capacity, double begin, double end)
+{
+  if (*count == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 16;
+    *gaps = (struct timeline_gap_s*)
+    realloc(*gaps, *capacity * sizeof(struct timeline_gap_s));
+  }
+  (*gaps)[*count].begin = begin;
+  (*gaps)[*count].end = end;
+  (*count)++;
+}
+
+size_t timeline_find_gaps(struct timeline_s* timeline, double from,
+                          double min_length,
+                          struct timeline_gap_s** gaps_out)
+{
+  struct timeline_gap_s* gaps = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  int active = 0;
+  double idle_since = from;
+  sort_pending(timeline);
+  for (size_t i = timeline->cursor; i < timeline->count; i++) {
+    const struct timeline_entry_s* entry = &timeline->entries[i];
+    if (timeline_enter == entry->edge) {
+      if (!active && entry->time - idle_since >= min_length &&
+          entry->time > from)
+      {
+        append_gap(&gaps, &count, &capacity, idle_since, entry->time);
+      }
+      active++;
+    } else {
+      active--;
+      if (!active) {
+        idle_since = entry->time > from ? entry->time : from;
+      }
+    }
+  }
+  *gaps_out = gaps;
+  return count;
+}
@@ -0,0 +1,66 @@
+//
+//  timeline.h
+//  barc
+//
+
+#ifndef timeline_h
+#define timeline_h
+
+#include <stddef.h>
+
+/**
+ * Things that switch on and off along the archive clock, sorted once and
+ * walked with a cursor. The clock only moves forward, so each tick costs
+ * the number of changes since the last tick rather than the number of items.
+ */
+struct timeline_s;
+
+enum timeline_edge {
+  timeline_enter = 0,
+  timeline_leave = 1
+};
+
+typedef void (timeline_edge_cb)(void* p, void* item, enum timeline_edge edge);
+
+/**
+ * @param inclusive fire edges at exactly the advanced-to time. spans are
+ * half open, [begin, end), so an inclusive timeline has an item active at
+ * begin and gone at end.
+ */
+void timeline_alloc(struct timeline_s** timeline_out, char inclusive);
+void timeline_free(struct timeline_s* timeline);
+
+/** item enters at begin and leaves at end */
+void timeline_add_span(struct timeline_s* timeline, double begin, double end,
+                       void* item);
+/** item fires once, as an enter edge */
+void timeline_add_point(struct timeline_s* timeline, double time, void* item);
+
+/**
+ * Fire every edge up to time, in time order. Edges at the same time fire
+ * enters first, then in the order they were added.
+ * @return the number of edges fired
+ */
+int timeline_advance(struct timeline_s* timeline, double time,
+                     timeline_edge_cb* callback, void* p);
+
+/** @return edges not yet fired */
+size_t timeline_remaining(const struct timeline_s* timeline);
+
+/** A stretch of time with no span active. [begin, end) */
+struct timeline_gap_s {
+  double begin;
+  double end;
+};
+
+/**
+ * Find the stretches between from and the last edge where no span is active,
+ * ignoring any shorter than min_length. Only meaningful on a timeline of
+ * spans. Call before advancing.
+ * @return the number of gaps in gaps_out. free it with free().
+ */
+size_t timeline_find_gaps(struct timeline_s* timeline, double from,
+                          double min_length,
+                          struct timeline_gap_s** gaps_out);
+
+#endif /* timeline_h */
@@ -0,0 +1,212 @@
+//
+//  trace.c
+//  barc
+//
+
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+enum trace_event_type {
+  trace_event_span = 0,
+  trace_event_counter
+};
+
+struct trace_event_s {
+  const char* name;
+  const char* arg_name;
+  int64_t arg;
+  uint64_t start;
+  uint64_t duration;
+  enum trace_event_type type;
+};
+
+/** Events of one thread. Only that thread appends to it. */
+struct trace_buffer_s {
+  char name[128];
+  int tid;
+  struct trace_event_s* events;
+  size_t count;
+  size_t capacity;
+  struct trace_buffer_s* next;
+};
+
+char trace_enabled;
+
+static uint64_t epoch;
+static size_t total_events;
+static size_t dropped_events;
+static uv_once_t buffers_once = UV_ONCE_INIT;
+static uv_mutex_t buffers_lock;
+static struct trace_buffer_s* buffers;
+static int thread_count;
+static __thread struct trace_buffer_s* thread_buffer;
+
+static void init_buffers_lock() {
+  uv_mutex_init(&buffers_lock);
+  epoch = perf_stats_now();
+}
+
+void trace_enable() {
+  // enabling again keeps the events and timeline recorded so far
+  uv_once(&buffers_once, init_buffers_lock);
+  trace_enabled = 1;
+}
+
+static struct trace_buffer_s* get_thread_buffer() {
+  if (thread_buffer) {
+    return thread_buffer;
+  }
+  struct trace_buffer_s* buffer = (struct trace_buffer_s*)
+  calloc(1, sizeof(struct trace_buffer_s));
+  uv_mutex_lock(&buffers_lock);
+  buffer->tid = ++thread_count;
+  buffer->next = buffers;
+  buffers = buffer;
+  uv_mutex_unlock(&buffers_lock);
+  snprintf(buffer->name, sizeof(buffer->name), "thread %d", buffer->tid);
+  thread_buffer = buffer;
+  return buffer;
+}
+
+static struct trace_event_s* append_event() {
+  if (__atomic_add_fetch(&total_events, 1, __ATOMIC_RELAXED) >
+      TRACE_MAX_EVENTS)
+  {
+    __atomic_add_fetch(&dropped_events, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  struct trace_buffer_s* buffer = get_thread_buffer();
+  if (buffer->count == buffer->capacity) {
+    size_t capacity = buffer->capacity ? buffer->capacity * 2 : 1024;
+    struct trace_event_s* events = (struct trace_event_s*)
+    realloc(buffer->events, capacity * sizeof(struct trace_event_s));
+    if (!events) {
+      return NULL;
+    }
+    buffer->events = events;
+    buffer->capacity = capacity;
+  }
+  return &buffer->events[buffer->count++];
+}
+
+void trace_end(const char* name, uint64_t start, const char* arg_name,
+               int64_t arg)
+{
+  if (!start) {
+    return;
+  }
+  uint64_t now = perf_stats_now();
+  struct trace_event_s* event = append_event();
+  if (!event) {
+    return;
+  }
+  event->type = trace_event_span;
+  event->name = name;
+  event->arg_name = arg_name;
+  event->arg = arg;
+  event->start = start;
+  event->duration = now - start;
+}
+
+void trace_counter(const char* name, int64_t value) {
+  if (!trace_enabled) {
+    return;
+  }
+  uint64_t now = perf_stats_now();
+  struct trace_event_s* event = append_event();
+  if (!event) {
+    return;
+  }
+  event->type = trace_event_counter;
+  event->name = name;
+  event->arg_name = NULL;
+  event->arg = value;
+  event->start = now;
+  event->duration = 0;
+}
+
+void trace_set_thread_name(const char* name) {
+  if (!trace_enabled) {
+    return;
+  }
+  struct trace_buffer_s* buffer = get_thread_buffer();
+  snprintf(buffer->name, sizeof(buffer->name), "%s", name);
+}
+
+#pragma mark - Output
+
+// names are file names at worst, so only quotes, backslashes and control
+// characters need care
+static void write_string(FILE* file, const char* string) {
+  fputc('"', file);
+  for (const char* c = string; *c; c++) {
+    if ('"' == *c || '\\' == *c) {
+      fprintf(file, "\\%c", *c);
+    } else if ((unsigned char)*c < 0x20) {
+      fprintf(file, "\\u%04x", *c);
+    } else {
+      fputc(*c, file);
+    }
+  }
+  fputc('"', file);
+}
+
+// timestamps are microseconds from trace_enable
+static double micros(uint64_t ns) {
+  return ns / 1000.0;
+}
+
+int trace_write(const char* path) {
+  FILE* file = fopen(path, "w");
+  if (!file) {
+    perror(path);
+    return -1;
+  }
+  fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  fprintf(file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+          "\"args\": {\"name\": \"barc\"}}");
+  uv_mutex_lock(&buffers_lock);
+  for (struct trace_buffer_s* buffer = buffers; buffer;
+       buffer = buffer->next)
+  {
+    fprintf(file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+            "\"pid\": 1, \"tid\": %d, \"args\": {\"name\": ", buffer->tid);
+    write_string(file, buffer->name);
+    fprintf(file, "}}");
+    for (size_t i = 0; i < buffer->count; i++) {
+      struct trace_event_s* event = &buffer->events[i];
+      fprintf(file, ",\n{\"name\": ");
+      write_string(file, event->name);
+      if (trace_event_counter == event->type) {
+        fprintf(file, ", \"ph\": \"C\", \"pid\": 1, \"tid\": %d, "
+                "\"ts\": %.3f, \"args\": {\"value\": %lld}}", buffer->tid,
+                micros(event->start - epoch), (long long)event->arg);
+        continue;
+      }
+      fprintf(file, ", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+              "\"ts\": %.3f, \"dur\": %.3f", buffer->tid,
+              micros(event->start - epoch), micros(event->duration));
+      if (event->arg_name) {
+        fprintf(file, ", \"args\": {");
+        write_string(file, event->arg_name);
+        fprintf(file, ": %lld}", (long long)event->arg);
+      }
+      fputc('}', file);
+    }
+  }
+  uv_mutex_unlock(&buffers_lock);
+  fprintf(file, "\n]}\n");
+  size_t dropped = __atomic_load_n(&dropped_events, __ATOMIC_RELAXED);
+  if (dropped) {
+    printf("trace: dropped %zu events past the first %d\n", dropped,
+           TRACE_MAX_EVENTS);
+  }
+  int ret = fclose(file);
+  if (ret) {
+    perror(path);
+  }
+  return ret;
+}
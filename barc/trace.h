@@ -0,0 +1,55 @@
+//
+//  trace.h
+//  barc
+//
+
+#ifndef trace_h
+#define trace_h
+
+#include <stdint.h>
+#include "perf_stats.h"
+
+/**
+ * Timeline of what every pipeline thread was doing, written in the Chrome
+ * trace event format (load it in chrome://tracing or ui.perfetto.dev).
+ * Spans are recorded as complete ("X") events on the thread that ran them,
+ * and queue depths as counters, so stalls between the frame builder, its
+ * compose workers and the encoders show up as gaps.
+ *
+ *   uint64_t start = trace_begin();
+ *   crunch(...);
+ *   trace_end("compose", start, "serial", serial_number);
+ *
+ * Each thread appends to a buffer of its own, so recording takes no locks.
+ * Names must be string literals (or otherwise outlive the trace). Disabled,
+ * trace_begin returns 0 without reading the clock and trace_end returns
+ * right away.
+ */
+
+// stop recording after this many events, about 200 MB of them
+#define TRACE_MAX_EVENTS (4 * 1024 * 1024)
+
+/** Start recording. Calling it again keeps what is already recorded. */
+void trace_enable();
+// only ever set before rendering starts
+extern char trace_enabled;
+
+static inline uint64_t trace_begin() {
+  return trace_enabled ? perf_stats_now() : 0;
+}
+
+/** Record a span from start until now. arg_name may be NULL. */
+void trace_end(const char* name, uint64_t start, const char* arg_name,
+               int64_t arg);
+/** Record the current value of a counter track, e.g. a queue depth. */
+void trace_counter(const char* name, int64_t value);
+/** Label the calling thread in the trace. Copies name. */
+void trace_set_thread_name(const char* name);
+
+/**
+ * Write every event recorded so far. Call once the threads being traced
+ * are done or idle.
+ */
+int trace_write(const char* path);
+
+#endif /* trace_h */
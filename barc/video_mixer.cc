@@ -9,6 +9,7 @@ extern "C" {
 #include "video_mixer.h"
 #include "file_writer.h"
 #include "frame_builder.h"
+#include "perf_stats.h"
 }
 
 #include <vector>
@@ -22,6 +23,19 @@ struct video_mixer_s {
   char auto_layout;
   size_t out_width;
   size_t out_height;
+
+  // last frame handed to the writer, and the most recent frame dropped after
+  // it. touched from frame builder callbacks, read after the builder drains.
+  AVFrame* last_frame;
+  struct file_writer_t* last_writer;
+  int64_t omitted_pts;
+  char has_omitted;
+  char variable_frame_rate;
+
+  // what an empty layout composes to, built once and handed out by reference
+  // while nothing is on screen
+  AVFrame* blank_frame;
+  char showing_blank;
 };
 
 /* this runs backwards from a normal sort comparator
@@ -118,23 +132,66 @@ void video_mixer_free(struct video_mixer_s* mixer) {
   // instance does not hold ownership of it's streams, so we can just drop refs
   // TODO refcount media_stream_s
   mixer->streams.clear();
+  av_frame_free(&mixer->last_frame);
+  av_frame_free(&mixer->blank_frame);
   delete mixer->layout;
   free(mixer);
 }
 
+void video_mixer_set_max_compose_jobs(struct video_mixer_s* mixer,
+                                      int max_jobs)
+{
+  frame_builder_set_max_jobs(mixer->frame_builder, max_jobs);
+}
+
+void video_mixer_set_variable_frame_rate(struct video_mixer_s* mixer,
+                                         char enabled, int max_omitted)
+{
+  mixer->variable_frame_rate = enabled;
+  frame_builder_set_repeat_mode(mixer->frame_builder,
+                                enabled ?
+                                frame_builder_repeat_omit :
+                                frame_builder_repeat_reference,
+                                max_omitted);
+}
+
 int video_mixer_flush(struct video_mixer_s* mixer) {
-  return frame_builder_wait(mixer->frame_builder, 0);
+  int ret = frame_builder_wait(mixer->frame_builder, 0);
+  // the last written frame would otherwise end where the omitted run began
+  if (mixer->has_omitted && mixer->last_frame) {
+    AVFrame* frame = av_frame_clone(mixer->last_frame);
+    frame->pts = mixer->omitted_pts;
+    if (file_writer_push_video_frame(mixer->last_writer, frame)) {
+      printf("Unable to push video frame %lld\n", frame->pts);
+    }
+    av_frame_free(&frame);
+    mixer->has_omitted = 0;
+  }
+  return ret;
 }
 
 struct frame_builder_callback_data_t {
   int64_t pts;
   struct file_writer_t* file_writer;
+  struct video_mixer_s* mixer;
 };
 
 static void frame_builder_cb(AVFrame* frame, void *p) {
   struct frame_builder_callback_data_t* data =
   ((struct frame_builder_callback_data_t*)p);
+  struct video_mixer_s* mixer = data->mixer;
+  if (!frame) {
+    // unchanged since the last frame; leave a gap in the timeline
+    mixer->omitted_pts = data->pts;
+    mixer->has_omitted = 1;
+    free(p);
+    return;
+  }
   frame->pts = data->pts;
+  av_frame_free(&mixer->last_frame);
+  mixer->last_frame = av_frame_clone(frame);
+  mixer->last_writer = data->file_writer;
+  mixer->has_omitted = 0;
   int ret = file_writer_push_video_frame(data->file_writer, frame);
   if (ret) {
     printf("Unable to push video frame %lld\n", frame->pts);
@@ -158,15 +215,77 @@ void video_mixer_clear_streams(struct video_mixer_s* mixer) {
   mixer->streams.clear();
 }
 
+static AVFrame* alloc_blank_frame(int width, int height) {
+  AVFrame* frame = av_frame_alloc();
+  frame->format = AV_PIX_FMT_YUV420P;
+  frame->width = width;
+  frame->height = height;
+  if (av_frame_get_buffer(frame, 32)) {
+    av_frame_free(&frame);
+    return NULL;
+  }
+  // black, as the compositor's background comes out of swscale
+  memset(frame->data[0], 16, frame->linesize[0] * height);
+  memset(frame->data[1], 128, frame->linesize[1] * ((height + 1) / 2));
+  memset(frame->data[2], 128, frame->linesize[2] * ((height + 1) / 2));
+  return frame;
+}
+
+int video_mixer_push_blank_frame(struct video_mixer_s* pthis,
+                                 struct file_writer_t* file_writer,
+                                 int64_t pts)
+{
+  if (!pthis->showing_blank) {
+    // frames still being composed have earlier timestamps
+    frame_builder_wait(pthis->frame_builder, 0);
+    // the next composed frame has to replace the black one, even if it looks
+    // like the last frame before the gap
+    frame_builder_forget_previous(pthis->frame_builder);
+  } else if (pthis->variable_frame_rate) {
+    // the first blank frame lasts until something changes
+    pthis->omitted_pts = pts;
+    pthis->has_omitted = 1;
+    return 0;
+  }
+  if (!pthis->blank_frame ||
+      pthis->blank_frame->width != file_writer->out_width ||
+      pthis->blank_frame->height != file_writer->out_height)
+  {
+    av_frame_free(&pthis->blank_frame);
+    pthis->blank_frame = alloc_blank_frame((int)file_writer->out_width,
+                                           (int)file_writer->out_height);
+    if (!pthis->blank_frame) {
+      printf("Unable to allocate blank video frame\n");
+      return -1;
+    }
+  }
+  pthis->showing_blank = 1;
+  AVFrame* frame = av_frame_clone(pthis->blank_frame);
+  frame->pts = pts;
+  av_frame_free(&pthis->last_frame);
+  pthis->last_frame = av_frame_clone(frame);
+  pthis->last_writer = file_writer;
+  pthis->has_omitted = 0;
+  int ret = file_writer_push_video_frame(file_writer, frame);
+  if (ret) {
+    printf("Unable to push video frame %lld\n", frame->pts);
+  }
+  av_frame_free(&frame);
+  return ret;
+}
+
 int video_mixer_async_push_frame(struct video_mixer_s* pthis,
                                  struct file_writer_t* file_writer,
                                  double time_clock, int64_t pts)
 {
   int ret = -1;
+  pthis->showing_blank = 0;
 
+  uint64_t start = perf_stats_start();
   populate_stream_coords(pthis);
   // z sort only after layout manager has run
   std::sort(pthis->streams.begin(), pthis->streams.end(), z_index_sort);
+  perf_stats_end(perf_layout, start);
   //std::reverse(pthis->streams.begin(), pthis->streams.end());
 
   struct frame_builder_callback_data_t* callback_data =
@@ -174,6 +293,7 @@ int video_mixer_async_push_frame(struct video_mixer_s* pthis,
   malloc(sizeof(struct frame_builder_callback_data_t));
   callback_data->pts = pts;
   callback_data->file_writer = file_writer;
+  callback_data->mixer = pthis;
   frame_builder_begin_frame(pthis->frame_builder,
                             file_writer->out_width,
                             file_writer->out_height,
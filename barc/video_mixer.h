@@ -23,6 +23,12 @@ void video_mixer_clear_streams(struct video_mixer_s* mixer);
 int video_mixer_async_push_frame(struct video_mixer_s* mixer,
                                  struct file_writer_t* file_writer,
                                  double time_clock, int64_t pts);
+/** Output a black frame without running layout or compose, for stretches
+ * with no sources. In variable frame rate mode only the first frame of such
+ * a stretch is written; it lasts until the next change. */
+int video_mixer_push_blank_frame(struct video_mixer_s* mixer,
+                                 struct file_writer_t* file_writer,
+                                 int64_t pts);
 
 void video_mixer_set_width(struct video_mixer_s* mixer, size_t width);
 void video_mixer_set_height(struct video_mixer_s* mixer, size_t height);
@@ -32,6 +38,17 @@ void video_mixer_set_css_preset(struct video_mixer_s* mixer,
 void video_mixer_set_css_custom(struct video_mixer_s* mixer,
                                 const char* css);
 
+/** Most output frames being composed at once. Pushing another frame blocks
+ * until the oldest one reaches the file writer. */
+void video_mixer_set_max_compose_jobs(struct video_mixer_s* mixer,
+                                      int max_jobs);
+
+/** Drop frames whose inputs did not change instead of repeating them, so the
+ * output has variable frame timing. At least one frame is still written every
+ * max_omitted frames. */
+void video_mixer_set_variable_frame_rate(struct video_mixer_s* mixer,
+                                         char enabled, int max_omitted);
+
 int video_mixer_flush(struct video_mixer_s* mixer);
 
 #endif /* video_mixer_h */
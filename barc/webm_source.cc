@@ -10,13 +10,20 @@ extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/opt.h>
+#include <uv.h>
 #include "file_audio_source.h"
 #include "webm_source.h"
+#include "log.h"
+#include "perf_stats.h"
 #include "source_container.h"
+#include "spsc_queue.h"
+#include "trace.h"
+#include "zip_io.h"
 }
 
 #include <deque>
 #include <queue>
+#include <cmath>
 
 // Workaround C++ issue with ffmpeg macro
 #ifndef __clang__
@@ -28,6 +35,11 @@ AV_ERROR_MAX_STRING_SIZE, errnum)
 
 // we know this to be true from documentation, it's not discoverable :-(
 static const AVRational archive_manifest_timebase = { 1, 1000 };
+// how far ahead of a seek point to start reading audio
+static const double audio_seek_margin = 0.1;
+// decoded video buffered ahead of the mixer, per source
+static const size_t default_prefetch_frames = 8;
+static const size_t default_prefetch_bytes = 16 * 1024 * 1024;
 
 static void setup_media_stream(struct webm_source_s* pthis);
 int video_read_callback(struct media_stream_s* stream,
@@ -65,6 +77,19 @@ struct webm_source_s {
 
   std::queue<struct smart_frame_t*> video_fifo;
 
+  /* decode stage. decode_thread is the only reader of video_format_context
+   * while it runs; it hands frames over through decode_queue and marks the
+   * end of the file with NULL. */
+  struct spsc_queue_s* decode_queue;
+  uv_thread_t decode_thread;
+  size_t prefetch_frames;
+  size_t prefetch_bytes;
+  char decoding;
+  char decode_stop;
+  char decode_eof;
+  // id of this source's decode timer (see perf_stats.h)
+  int perf_source;
+
   struct media_stream_s* media_stream;
   struct source_s* container;
 };
@@ -75,6 +100,8 @@ int webm_source_alloc(struct webm_source_s** media_source_out)
   calloc(1, sizeof(struct webm_source_s));
   media_stream_alloc(&pthis->media_stream);
   pthis->video_fifo = std::queue<struct smart_frame_t*>();
+  pthis->prefetch_frames = default_prefetch_frames;
+  pthis->prefetch_bytes = default_prefetch_bytes;
   file_audio_source_alloc(&pthis->audio_source);
   source_create(&pthis->container, is_active, get_stop_offset,
                 get_media_stream, free_f, pthis);
@@ -82,13 +109,19 @@ int webm_source_alloc(struct webm_source_s** media_source_out)
   return 0;
 }
 
+static void stop_decoder(struct webm_source_s* pthis);
+
 void webm_source_free(struct webm_source_s* pthis) {
+  stop_decoder(pthis);
   while (!pthis->video_fifo.empty()) {
     smart_frame_release(pthis->video_fifo.front());
     pthis->video_fifo.pop();
   }
   avcodec_close(pthis->video_context);
-  avformat_close_input(&pthis->video_format_context);
+  zip_io_close_input(&pthis->video_format_context);
+  if (pthis->decode_queue) {
+    spsc_queue_free(pthis->decode_queue);
+  }
   media_stream_free(pthis->media_stream);
   file_audio_source_free(pthis->audio_source);
   free(pthis);
@@ -97,12 +130,40 @@ void webm_source_free(struct webm_source_s* pthis) {
 int webm_source_seek(struct webm_source_s* pthis,
                            double to_time)
 {
-  // seek audio source
-  file_audio_source_seek(pthis->audio_source, to_time);
-  // seek video source
-  // TODO: video processing should be in a separate class
+  // callers give us archive time. the file itself starts at start_offset.
   pthis->global_seek_offset = to_time;
-  return 0;
+  double local_time = to_time - pthis->start_offset;
+  // the decoder reads the same format context we are about to move
+  stop_decoder(pthis);
+  if (local_time <= 0) {
+    // source has not started yet at the seek point; read from the top.
+    return 0;
+  }
+  // seek audio source. land a little early so the lipsync logic in
+  // audio_read_callback can drop exactly the samples we don't need.
+  file_audio_source_seek(pthis->audio_source,
+                         fmax(0, local_time - audio_seek_margin));
+  // seek video source to the keyframe before the seek point. everything
+  // from there on needs to be decoded, even frames we will never show.
+  // TODO: video processing should be in a separate class
+  AVStream* video_stream =
+  pthis->video_format_context->streams[pthis->video_stream_index];
+  int64_t seek_pts = local_time / av_q2d(video_stream->time_base);
+  int ret = av_seek_frame(pthis->video_format_context,
+                          pthis->video_stream_index, seek_pts,
+                          AVSEEK_FLAG_BACKWARD);
+  if (ret < 0) {
+    printf("video seek failed (%s). decoding from the beginning\n",
+           av_err2str(ret));
+    ret = av_seek_frame(pthis->video_format_context,
+                        pthis->video_stream_index, 0, AVSEEK_FLAG_BACKWARD);
+  }
+  avcodec_flush_buffers(pthis->video_context);
+  while (!pthis->video_fifo.empty()) {
+    smart_frame_release(pthis->video_fifo.front());
+    pthis->video_fifo.pop();
+  }
+  return ret < 0 ? ret : 0;
 }
 
 #pragma mark - Container setup
@@ -155,29 +216,31 @@ static inline int64_t samples_per_pts(int sample_rate, int64_t pts,
  * extra data in a fifo. Sometimes this causes memory to run away, so instead
  * we just read the same input file twice.
  */
-static int read_video_frame(struct webm_source_s* pthis)
+static int read_video_frame(struct webm_source_s* pthis,
+                            struct smart_frame_t** frame_out)
 {
   int ret, got_frame = 0;
   AVPacket packet = { 0 };
 
-  /* pump packet reader until fifo is populated, or file ends */
-  while (pthis->video_fifo.empty()) {
+  /* pump packet reader until a frame comes out, or file ends */
+  while (!got_frame) {
+    uint64_t start = perf_stats_start();
     ret = av_read_frame(pthis->video_format_context, &packet);
+    perf_stats_end(perf_demux, start);
     if (ret < 0) {
       return ret;
     }
-    double packet_time = (double)packet.pts /
-    pthis->video_format_context->streams[pthis->video_stream_index]->
-    time_base.den;
-
     AVFrame* frame = av_frame_alloc();
     got_frame = 0;
-    if (packet.stream_index == pthis->video_stream_index &&
-        // don't bother decoding frame if it will never be used
-        pthis->global_seek_offset < packet_time)
-    {
+    // every packet after a seek must be decoded, even if we will never show
+    // it: later frames reference it.
+    if (packet.stream_index == pthis->video_stream_index) {
+      start = perf_stats_start();
+      uint64_t trace_start = trace_begin();
       ret = avcodec_decode_video2(pthis->video_context, frame,
                                   &got_frame, &packet);
+      perf_stats_end_source(pthis->perf_source, start);
+      trace_end("decode video", trace_start, "pts", packet.pts);
       if (ret < 0) {
         av_log(NULL, AV_LOG_ERROR, "Error decoding video: %s\n",
                av_err2str(ret));
@@ -185,9 +248,9 @@ static int read_video_frame(struct webm_source_s* pthis)
 
       if (got_frame) {
         frame->pts = av_frame_get_best_effort_timestamp(frame);
-        smart_frame_t* smart_frame;
-        smart_frame_create(&smart_frame, frame);
-        pthis->video_fifo.push(smart_frame);
+        smart_frame_create(frame_out, frame);
+      } else {
+        av_frame_free(&frame);
       }
     } else {
       av_frame_free(&frame);
@@ -199,7 +262,66 @@ static int read_video_frame(struct webm_source_s* pthis)
   return !got_frame;
 }
 
+#pragma mark - Decode stage
+
+static void decode_worker(void* p) {
+  struct webm_source_s* pthis = (struct webm_source_s*)p;
+  struct smart_frame_t* smart_frame;
+  trace_set_thread_name("decode");
+  while (!__atomic_load_n(&pthis->decode_stop, __ATOMIC_ACQUIRE) &&
+         !read_video_frame(pthis, &smart_frame))
+  {
+    // blocks here once the mixer falls far enough behind
+    uint64_t trace_start = trace_begin();
+    spsc_queue_push_sized(pthis->decode_queue, smart_frame,
+                          frame_buffer_bytes(smart_frame_get(smart_frame)));
+    trace_end("push decoded frame", trace_start, NULL, 0);
+  }
+  spsc_queue_push(pthis->decode_queue, NULL);
+}
+
+static void start_decoder(struct webm_source_s* pthis) {
+  if (!pthis->decode_queue) {
+    spsc_queue_alloc(&pthis->decode_queue, pthis->prefetch_frames);
+    spsc_queue_set_max_bytes(pthis->decode_queue, pthis->prefetch_bytes);
+  }
+  pthis->decode_stop = 0;
+  pthis->decode_eof = 0;
+  pthis->decoding = 1;
+  uv_thread_create(&pthis->decode_thread, decode_worker, pthis);
+}
+
+static void stop_decoder(struct webm_source_s* pthis) {
+  if (!pthis->decoding) {
+    return;
+  }
+  __atomic_store_n(&pthis->decode_stop, 1, __ATOMIC_RELEASE);
+  // make room so the worker can see the flag, then drain up to its marker
+  struct smart_frame_t* smart_frame;
+  while (!pthis->decode_eof &&
+         (smart_frame = (struct smart_frame_t*)
+          spsc_queue_pop(pthis->decode_queue)))
+  {
+    smart_frame_release(smart_frame);
+  }
+  uv_thread_join(&pthis->decode_thread);
+  pthis->decoding = 0;
+  pthis->decode_eof = 0;
+}
+
+void webm_source_set_prefetch(struct webm_source_s* pthis,
+                              size_t max_frames, size_t max_bytes)
+{
+  if (max_frames) {
+    pthis->prefetch_frames = max_frames;
+  }
+  if (max_bytes) {
+    pthis->prefetch_bytes = max_bytes;
+  }
+}
+
 int webm_source_open(struct webm_source_s** source_out,
+                           struct zip_io_s* zip,
                            const char *filename,
                            double start_offset, double stop_offset,
                            const char* stream_name,
@@ -214,9 +336,11 @@ int webm_source_open(struct webm_source_s** source_out,
   pthis->start_offset = start_offset;
   pthis->stop_offset = stop_offset;
   pthis->filename = filename;
+  pthis->perf_source = perf_stats_add_source(filename);
 
   struct file_audio_config_s audio_config;
   audio_config.file_path = filename;
+  audio_config.zip = zip;
   ret = file_audio_source_load_config(pthis->audio_source, &audio_config);
   if (ret) {
     printf("unable to open audio source for reading\n");
@@ -224,8 +348,7 @@ int webm_source_open(struct webm_source_s** source_out,
     return ret;
   }
 
-  ret = avformat_open_input(&pthis->video_format_context, filename,
-                            NULL, NULL);
+  ret = zip_io_open_input(zip, filename, &pthis->video_format_context);
   if (ret < 0)
   {
     av_log(NULL, AV_LOG_ERROR, "Cannot open input file\n");
@@ -267,11 +390,23 @@ struct media_stream_s* webm_source_get_stream
 #pragma mark - Internal utils
 static int ensure_video_frame(struct webm_source_s* stream)
 {
-  int ret = 0;
-  if (stream->video_fifo.empty()) {
-    ret = read_video_frame(stream);
+  if (!stream->video_fifo.empty()) {
+    return 0;
   }
-  return ret;
+  if (!stream->decoding) {
+    start_decoder(stream);
+  }
+  if (stream->decode_eof) {
+    return -1;
+  }
+  struct smart_frame_t* smart_frame = (struct smart_frame_t*)
+  spsc_queue_pop(stream->decode_queue);
+  if (!smart_frame) {
+    stream->decode_eof = 1;
+    return -1;
+  }
+  stream->video_fifo.push(smart_frame);
+  return 0;
 }
 
 static void setup_media_stream(struct webm_source_s* pthis) {
@@ -338,21 +473,22 @@ int audio_read_callback(struct media_stream_s* stream,
 {
   struct webm_source_s* pthis = (struct webm_source_s*)p;
   int ret = 0;
+  clock_time += pthis->global_seek_offset;
 
   double audio_time =
   file_audio_source_get_pos(pthis->audio_source) + pthis->start_offset;
   double sample_rate = file_audio_source_get_sample_rate(pthis->audio_source);
   int num_desync_samples = (clock_time - audio_time) * sample_rate;
   if (audio_time < clock_time && num_desync_samples > 0) {
-    printf("lipsync: dropping %d audio samples to catch up with clock\n",
-           num_desync_samples);
+    log_debug(log_module_source, "lipsync: dropping %d audio samples to "
+              "catch up with clock", num_desync_samples);
     int16_t* drop_samples = (int16_t*)calloc(num_desync_samples, sizeof(int16_t));
     file_audio_source_get_next(pthis->audio_source, num_desync_samples, drop_samples);
     // is there an easy way to do this without the malloc cycle?
     free(drop_samples);
   } else if (audio_time - clock_time > 0.1) {
-    printf("lipsync: audio source ahead of global clock by %.02f\n",
-           audio_time - clock_time);
+    log_warn_limited(log_module_source, "lipsync: audio source ahead of "
+                     "global clock by %.02f", audio_time - clock_time);
   }
 
   assert(frame->format == AV_SAMPLE_FMT_S16);
@@ -11,8 +11,11 @@
 #include "media_stream.h"
 
 struct webm_source_s;
+struct zip_io_s;
 
+/* filename names an entry of zip, or a file when zip is NULL. */
 int webm_source_open(struct webm_source_s** source_out,
+                           struct zip_io_s* zip,
                            const char *filename,
                            double start_offset, double stop_offset,
                            const char* stream_name,
@@ -20,6 +23,11 @@ int webm_source_open(struct webm_source_s** source_out,
 void webm_source_free(struct webm_source_s*);
 int webm_source_seek(struct webm_source_s* media_source,
                            double to_time);
+/* Video is demuxed and decoded on a thread of its own, at most max_frames
+ * (and max_bytes of frame data) ahead of the mixer. Zero keeps the default.
+ * Call before the first frame is read. */
+void webm_source_set_prefetch(struct webm_source_s* media_source,
+                              size_t max_frames, size_t max_bytes);
 int file_stream_is_active_at_time(struct webm_source_s* media_source,
                                   double clock_time);
 double file_stream_get_stop_offset(struct webm_source_s* media_source);
@@ -0,0 +1,479 @@
+//
+//  zip_io.c
+//  barc
+//
+
+#include "zip_io.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zip.h>
+#include <uv.h>
+#include "http_source.h"
+#include "inflate_reader.h"
+
+// big enough that the demuxers rarely come back to libzip for small reads
+static const int io_buffer_size = 64 * 1024;
+
+struct zip_io_s {
+  char* path;
+  // for the manifest and lookups. inputs open archives of their own.
+  zip_t* archive;
+  // guards archive
+  uv_mutex_t lock;
+  // set when the zip is read over http. every archive opened from the zip
+  // reads through it, sharing its cache.
+  struct http_source_s* remote;
+};
+
+/** libzip source reading a remote zip through range requests. */
+struct remote_zip_s {
+  struct http_source_s* http;
+  int64_t offset;
+  zip_error_t error;
+};
+
+/** Opaque state of one AVIOContext reading a single entry. */
+struct zip_entry_reader_s {
+  // this reader's own handle on the zip, so it needs no lock
+  zip_t* archive;
+  zip_uint64_t index;
+  zip_file_t* file;
+  int64_t size;
+  int64_t position;
+  char stored;
+  // deflated entries: file reads the raw stream, and inflate turns it into
+  // media with random access. NULL for other entries.
+  struct inflate_reader_s* inflate;
+  int64_t compressed_position;
+};
+
+#pragma mark - Remote zips
+
+static zip_int64_t remote_zip_callback(void* userdata, void* data,
+                                       zip_uint64_t len, zip_source_cmd_t cmd)
+{
+  struct remote_zip_s* remote = (struct remote_zip_s*)userdata;
+  int64_t size = http_source_get_size(remote->http);
+  switch (cmd) {
+    case ZIP_SOURCE_OPEN:
+      remote->offset = 0;
+      return 0;
+    case ZIP_SOURCE_READ: {
+      int64_t ret = http_source_read(remote->http, remote->offset, data, len);
+      if (ret < 0) {
+        zip_error_set(&remote->error, ZIP_ER_READ, EIO);
+        return -1;
+      }
+      remote->offset += ret;
+      return ret;
+    }
+    case ZIP_SOURCE_CLOSE:
+      return 0;
+    case ZIP_SOURCE_STAT: {
+      zip_stat_t* stat = ZIP_SOURCE_GET_ARGS(zip_stat_t, data, len,
+                                             &remote->error);
+      if (!stat) {
+        return -1;
+      }
+      zip_stat_init(stat);
+      stat->size = size;
+      stat->valid |= ZIP_STAT_SIZE;
+      return sizeof(zip_stat_t);
+    }
+    case ZIP_SOURCE_ERROR:
+      return zip_error_to_data(&remote->error, data, len);
+    case ZIP_SOURCE_FREE:
+      zip_error_fini(&remote->error);
+      free(remote);
+      return 0;
+    case ZIP_SOURCE_SEEK: {
+      zip_int64_t offset =
+      zip_source_seek_compute_offset(remote->offset, size, data, len,
+                                     &remote->error);
+      if (offset < 0) {
+        return -1;
+      }
+      remote->offset = offset;
+      return 0;
+    }
+    case ZIP_SOURCE_TELL:
+      return remote->offset;
+    case ZIP_SOURCE_SUPPORTS:
+      return zip_source_make_command_bitmap(ZIP_SOURCE_OPEN, ZIP_SOURCE_READ,
+                                            ZIP_SOURCE_CLOSE, ZIP_SOURCE_STAT,
+                                            ZIP_SOURCE_ERROR, ZIP_SOURCE_FREE,
+                                            ZIP_SOURCE_SEEK, ZIP_SOURCE_TELL,
+                                            ZIP_SOURCE_SUPPORTS, -1);
+    default:
+      zip_error_set(&remote->error, ZIP_ER_OPNOTSUPP, 0);
+      return -1;
+  }
+}
+
+// only the central directory and the entries actually read are fetched
+static zip_t* open_remote_zip(const char* url, struct http_source_s* http) {
+  struct remote_zip_s* remote = (struct remote_zip_s*)
+  calloc(1, sizeof(struct remote_zip_s));
+  remote->http = http;
+  zip_error_init(&remote->error);
+  zip_error_t error;
+  zip_error_init(&error);
+  zip_source_t* source = zip_source_function_create(remote_zip_callback,
+                                                    remote, &error);
+  zip_t* archive = NULL;
+  if (!source) {
+    remote_zip_callback(remote, NULL, 0, ZIP_SOURCE_FREE);
+  } else if (!(archive = zip_open_from_source(source, ZIP_RDONLY, &error))) {
+    // frees remote too
+    zip_source_free(source);
+  }
+  if (!archive) {
+    printf("unable to open zip %s: %s\n", url, zip_error_strerror(&error));
+  }
+  zip_error_fini(&error);
+  return archive;
+}
+
+int zip_io_is_remote(const char* path) {
+  return !strncmp(path, "http://", 7) || !strncmp(path, "https://", 8);
+}
+
+#pragma mark - Archives
+
+// another handle on the zip. for a remote zip, the central directory comes
+// out of the cache, so this makes no requests.
+static zip_t* open_archive(struct zip_io_s* zip) {
+  if (zip->remote) {
+    return open_remote_zip(zip->path, zip->remote);
+  }
+  int error_code;
+  zip_t* archive = zip_open(zip->path, ZIP_RDONLY, &error_code);
+  if (!archive) {
+    zip_error_t error;
+    zip_error_init_with_code(&error, error_code);
+    printf("unable to open zip %s: %s\n", zip->path,
+           zip_error_strerror(&error));
+    zip_error_fini(&error);
+  }
+  return archive;
+}
+
+int zip_io_open_remote(struct zip_io_s** zip_out, const char* path,
+                       int64_t size)
+{
+  struct zip_io_s* zip = (struct zip_io_s*)calloc(1, sizeof(struct zip_io_s));
+  zip->path = strdup(path);
+  if (zip_io_is_remote(path) && http_source_open(&zip->remote, path, size)) {
+    free(zip->path);
+    free(zip);
+    return -1;
+  }
+  zip->archive = open_archive(zip);
+  if (!zip->archive) {
+    if (zip->remote) {
+      http_source_free(zip->remote);
+    }
+    free(zip->path);
+    free(zip);
+    return -1;
+  }
+  uv_mutex_init(&zip->lock);
+  *zip_out = zip;
+  return 0;
+}
+
+int zip_io_open(struct zip_io_s** zip_out, const char* path) {
+  return zip_io_open_remote(zip_out, path, 0);
+}
+
+void zip_io_close(struct zip_io_s* zip) {
+  zip_discard(zip->archive);
+  if (zip->remote) {
+    size_t requests;
+    int64_t bytes;
+    http_source_get_stats(zip->remote, &requests, &bytes);
+    printf("fetched %lld bytes of %lld in %zu range requests\n",
+           (long long)bytes, (long long)http_source_get_size(zip->remote),
+           requests);
+    http_source_free(zip->remote);
+  }
+  uv_mutex_destroy(&zip->lock);
+  free(zip->path);
+  free(zip);
+}
+
+const char* zip_io_find(struct zip_io_s* zip, const char* suffix) {
+  const char* result = NULL;
+  size_t suffix_len = strlen(suffix);
+  uv_mutex_lock(&zip->lock);
+  zip_int64_t count = zip_get_num_entries(zip->archive, 0);
+  for (zip_int64_t i = 0; !result && i < count; i++) {
+    const char* name = zip_get_name(zip->archive, i, 0);
+    size_t len = name ? strlen(name) : 0;
+    if (len >= suffix_len && !strchr(name, '/') &&
+        !strcmp(name + len - suffix_len, suffix))
+    {
+      result = name;
+    }
+  }
+  uv_mutex_unlock(&zip->lock);
+  return result;
+}
+
+int zip_io_read_entry(struct zip_io_s* zip, const char* name,
+                      void** data_out, size_t* size_out)
+{
+  zip_stat_t stat;
+  int ret = 0;
+  char* data = NULL;
+  uv_mutex_lock(&zip->lock);
+  zip_file_t* file = NULL;
+  if (zip_stat(zip->archive, name, 0, &stat) ||
+      !(file = zip_fopen(zip->archive, name, 0)))
+  {
+    printf("unable to open %s in zip: %s\n", name,
+           zip_strerror(zip->archive));
+    ret = -1;
+  } else {
+    // terminated, so text entries can be handed to parsers as they are
+    data = (char*)malloc(stat.size + 1);
+    zip_uint64_t sum = 0;
+    while (!ret && sum < stat.size) {
+      zip_int64_t len = zip_fread(file, data + sum, stat.size - sum);
+      if (len <= 0) {
+        printf("short read of %s in zip\n", name);
+        ret = -1;
+      } else {
+        sum += len;
+      }
+    }
+    data[stat.size] = '\0';
+    zip_fclose(file);
+  }
+  uv_mutex_unlock(&zip->lock);
+  if (ret) {
+    free(data);
+    return ret;
+  }
+  *data_out = data;
+  *size_out = stat.size;
+  return 0;
+}
+
+#pragma mark - AVIOContext callbacks
+
+// for libzip versions that can't seek in raw entry data: reading it again
+// is cheap, it's inflating that costs.
+static int reopen_compressed_at(struct zip_entry_reader_s* reader,
+                                int64_t offset)
+{
+  zip_fclose(reader->file);
+  reader->file = zip_fopen_index(reader->archive, reader->index,
+                                 ZIP_FL_COMPRESSED);
+  if (!reader->file) {
+    return -1;
+  }
+  char scratch[16 * 1024];
+  while (offset > 0) {
+    zip_int64_t len = zip_fread(reader->file, scratch,
+                                offset < (int64_t)sizeof(scratch) ? offset :
+                                sizeof(scratch));
+    if (len <= 0) {
+      return -1;
+    }
+    offset -= len;
+  }
+  return 0;
+}
+
+// inflate_reader callback
+static int64_t read_compressed(void* opaque, int64_t offset, void* buf,
+                               size_t size)
+{
+  struct zip_entry_reader_s* reader = (struct zip_entry_reader_s*)opaque;
+  zip_int64_t len = -1;
+  if (offset == reader->compressed_position ||
+      !zip_fseek(reader->file, offset, SEEK_SET) ||
+      !reopen_compressed_at(reader, offset))
+  {
+    len = zip_fread(reader->file, buf, size);
+  }
+  reader->compressed_position = len > 0 ? offset + len : -1;
+  return len;
+}
+
+static int read_entry(void* opaque, uint8_t* buf, int buf_size) {
+  struct zip_entry_reader_s* reader = (struct zip_entry_reader_s*)opaque;
+  if (reader->inflate) {
+    int64_t len = inflate_reader_read(reader->inflate, buf, buf_size);
+    if (len > 0) {
+      reader->position += len;
+    }
+    return len < 0 ? AVERROR(EIO) : len ? (int)len : AVERROR_EOF;
+  }
+  zip_int64_t len = zip_fread(reader->file, buf, buf_size);
+  if (len < 0) {
+    return AVERROR(EIO);
+  }
+  if (!len) {
+    return AVERROR_EOF;
+  }
+  reader->position += len;
+  return (int)len;
+}
+
+static int reposition(struct zip_entry_reader_s* reader, int64_t target) {
+  if (reader->stored) {
+    if (zip_fseek(reader->file, target, SEEK_SET)) {
+      return -1;
+    }
+    reader->position = target;
+    return 0;
+  }
+  // other compression methods only go forward. start over to go back.
+  if (target < reader->position) {
+    zip_fclose(reader->file);
+    reader->file = zip_fopen_index(reader->archive, reader->index, 0);
+    reader->position = 0;
+    if (!reader->file) {
+      return -1;
+    }
+  }
+  char scratch[16 * 1024];
+  while (reader->position < target) {
+    int64_t want = target - reader->position;
+    zip_int64_t len = zip_fread(reader->file, scratch,
+                                want < (int64_t)sizeof(scratch) ? want :
+                                sizeof(scratch));
+    if (len <= 0) {
+      return -1;
+    }
+    reader->position += len;
+  }
+  return 0;
+}
+
+static int64_t seek_entry(void* opaque, int64_t offset, int whence) {
+  struct zip_entry_reader_s* reader = (struct zip_entry_reader_s*)opaque;
+  if (whence & AVSEEK_SIZE) {
+    return reader->size;
+  }
+  int64_t target;
+  switch (whence & ~AVSEEK_FORCE) {
+    case SEEK_SET:
+      target = offset;
+      break;
+    case SEEK_CUR:
+      target = reader->position + offset;
+      break;
+    case SEEK_END:
+      target = reader->size + offset;
+      break;
+    default:
+      return AVERROR(EINVAL);
+  }
+  if (target < 0 || target > reader->size) {
+    return AVERROR(EINVAL);
+  }
+  if (reader->inflate) {
+    if (inflate_reader_seek(reader->inflate, target)) {
+      return AVERROR(EIO);
+    }
+    reader->position = target;
+    return target;
+  }
+  return reposition(reader, target) ? AVERROR(EIO) : target;
+}
+
+#pragma mark - Inputs
+
+static void free_entry_reader(struct zip_entry_reader_s* reader) {
+  if (reader->file) {
+    zip_fclose(reader->file);
+  }
+  if (reader->inflate) {
+    inflate_reader_free(reader->inflate);
+  }
+  if (reader->archive) {
+    zip_discard(reader->archive);
+  }
+  free(reader);
+}
+
+static void free_entry_io(AVIOContext* io) {
+  free_entry_reader((struct zip_entry_reader_s*)io->opaque);
+  av_freep(&io->buffer);
+  av_freep(&io);
+}
+
+int zip_io_open_input(struct zip_io_s* zip, const char* name,
+                      AVFormatContext** context_out)
+{
+  if (!zip) {
+    return avformat_open_input(context_out, name, NULL, NULL);
+  }
+  struct zip_entry_reader_s* reader = (struct zip_entry_reader_s*)
+  calloc(1, sizeof(struct zip_entry_reader_s));
+  reader->archive = open_archive(zip);
+  zip_stat_t stat;
+  zip_int64_t index = -1;
+  if (reader->archive) {
+    index = zip_name_locate(reader->archive, name, 0);
+  }
+  if (index >= 0 && !zip_stat_index(reader->archive, index, 0, &stat)) {
+    reader->index = index;
+    reader->size = stat.size;
+    reader->stored = ZIP_CM_STORE == stat.comp_method;
+    if (ZIP_CM_DEFLATE == stat.comp_method) {
+      reader->file = zip_fopen_index(reader->archive, index,
+                                     ZIP_FL_COMPRESSED);
+    } else {
+      reader->file = zip_fopen_index(reader->archive, index, 0);
+    }
+  }
+  if (!reader->file) {
+    printf("unable to open %s in zip\n", name);
+    free_entry_reader(reader);
+    return AVERROR(ENOENT);
+  }
+  if (ZIP_CM_DEFLATE == stat.comp_method &&
+      inflate_reader_alloc(&reader->inflate, read_compressed, reader,
+                           stat.comp_size, stat.size))
+  {
+    printf("unable to inflate %s in zip\n", name);
+    free_entry_reader(reader);
+    return AVERROR(ENOMEM);
+  }
+
+  unsigned char* buffer = (unsigned char*)av_malloc(io_buffer_size);
+  AVIOContext* io = avio_alloc_context(buffer, io_buffer_size, 0, reader,
+                                       read_entry, NULL, seek_entry);
+  AVFormatContext* context = avformat_alloc_context();
+  context->pb = io;
+  context->flags |= AVFMT_FLAG_CUSTOM_IO;
+  // the name is only used for probing and logs
+  int ret = avformat_open_input(&context, name, NULL, NULL);
+  if (ret < 0) {
+    // avformat_open_input freed the context, but never a custom pb
+    free_entry_io(io);
+    return ret;
+  }
+  *context_out = context;
+  return ret;
+}
+
+void zip_io_close_input(AVFormatContext** context) {
+  if (!*context) {
+    return;
+  }
+  AVIOContext* io = NULL;
+  if ((*context)->flags & AVFMT_FLAG_CUSTOM_IO) {
+    io = (*context)->pb;
+  }
+  avformat_close_input(context);
+  if (io) {
+    free_entry_io(io);
+  }
+}
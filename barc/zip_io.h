@@ -0,0 +1,56 @@
+//
+//  zip_io.h
+//  barc
+//
+
+#ifndef zip_io_h
+#define zip_io_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <libavformat/avformat.h>
+
+/**
+ * Archive media read straight out of the zip, without extracting it.
+ * Entries are streamed through libzip: stored entries seek directly.
+ * Deflated ones are read raw and inflated here (inflate_reader), which
+ * saves an access point every megabyte or so, so seeking back only
+ * re-inflates from the nearest one. Every input opens the zip again for
+ * itself, so inputs read and seek without waiting on one another.
+ *
+ * An http(s) url is opened in place: libzip reads the central directory and
+ * then only the entries that are used, through range requests (http_source).
+ * All the inputs of a remote zip share one block cache, and fetch what they
+ * miss concurrently.
+ */
+struct zip_io_s;
+
+/** @return nonzero if path is an http(s) url rather than a local file. */
+int zip_io_is_remote(const char* path);
+
+/** @return 0 if path is a readable zip, or a url serving one with ranges. */
+int zip_io_open(struct zip_io_s** zip_out, const char* path);
+/**
+ * zip_io_open, without probing a url again when the caller already has its
+ * size from http_source_probe. Same as zip_io_open when size is 0.
+ */
+int zip_io_open_remote(struct zip_io_s** zip_out, const char* path,
+                       int64_t size);
+/** Close only once every input opened from it has been closed. */
+void zip_io_close(struct zip_io_s* zip);
+
+/** @return name of the first top level entry ending in suffix, or NULL. */
+const char* zip_io_find(struct zip_io_s* zip, const char* suffix);
+/** Read a whole entry into memory (free with free()). */
+int zip_io_read_entry(struct zip_io_s* zip, const char* name,
+                      void** data_out, size_t* size_out);
+
+/**
+ * avformat_open_input on an entry of zip, or on the file name when zip is
+ * NULL. Close with zip_io_close_input either way.
+ */
+int zip_io_open_input(struct zip_io_s* zip, const char* name,
+                      AVFormatContext** context_out);
+void zip_io_close_input(AVFormatContext** context);
+
+#endif /* zip_io_h */
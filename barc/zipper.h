@@ -8,6 +8,6 @@
 #ifndef zipper_h
 #define zipper_h
 
-char* unzip_archive(const char* path);
+int rmrf(const char *path);
 
 #endif /* zipper_h */
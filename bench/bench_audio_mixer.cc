@@ -0,0 +1,64 @@
+//
+//  bench_audio_mixer.cc
+//  barc
+//
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+#include <libavutil/frame.h>
+#include <string.h>
+#include "audio_mixer.h"
+#include "media_stream.h"
+}
+
+#include <benchmark/benchmark.h>
+#include <vector>
+
+// what the aac encoder asks for per frame
+static const int output_frame_size = 1024;
+static const int output_sample_rate = 48000;
+
+// quiet enough that 64 streams mixed together don't clip
+static int read_tone(struct media_stream_s* stream, AVFrame* frame,
+                     double clock_time, void* p)
+{
+  int16_t* samples = (int16_t*)frame->data[0];
+  for (int i = 0; i < frame->nb_samples; i++) {
+    samples[i] = (i % 96) * 4 - 192;
+  }
+  return frame->nb_samples;
+}
+
+static void bench_audio_mixer(benchmark::State& state) {
+  std::vector<struct media_stream_s*> streams;
+  for (int i = 0; i < state.range(0); i++) {
+    struct media_stream_s* stream;
+    media_stream_alloc(&stream);
+    media_stream_set_audio_read(stream, read_tone, NULL);
+    streams.push_back(stream);
+  }
+  AVFrame* output_frame = av_frame_alloc();
+  output_frame->format = AV_SAMPLE_FMT_FLTP;
+  output_frame->channel_layout = AV_CH_LAYOUT_MONO;
+  output_frame->nb_samples = output_frame_size;
+  output_frame->sample_rate = output_sample_rate;
+  av_frame_get_buffer(output_frame, 1);
+  double clock_time = 0;
+  for (auto _ : state) {
+    memset(output_frame->data[0], 0, output_frame_size * sizeof(float));
+    audio_mixer_get_samples_for_streams(streams.data(), streams.size(),
+                                        clock_time, output_frame);
+    clock_time += (double)output_frame_size / output_sample_rate;
+  }
+  state.SetItemsProcessed(state.iterations() * output_frame_size *
+                          streams.size());
+  av_frame_free(&output_frame);
+  for (struct media_stream_s* stream : streams) {
+    media_stream_free(stream);
+  }
+}
+
+BENCHMARK(bench_audio_mixer)
+->Name("audio_mixer_get_samples_for_streams")
+->ArgName("streams")
+->RangeMultiplier(2)->Range(1, 64);
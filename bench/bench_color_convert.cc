@@ -0,0 +1,123 @@
+//
+//  bench_color_convert.cc
+//  barc
+//
+
+extern "C" {
+#include <stdlib.h>
+#include <string.h>
+#include "yuv_rgb.h"
+}
+
+#include <benchmark/benchmark.h>
+
+#define RGB_BYTES_PER_PIXEL 3
+
+// planes are padded to a multiple of 32 so every variant, aligned sse
+// included, can use the same buffers
+struct color_buffers_s {
+  uint32_t width;
+  uint32_t height;
+  uint32_t y_stride;
+  uint32_t uv_stride;
+  uint32_t rgb_stride;
+  uint8_t* y;
+  uint8_t* u;
+  uint8_t* v;
+  uint8_t* rgb;
+};
+
+static uint32_t align_32(uint32_t value) {
+  return (value + 31) & ~31u;
+}
+
+static void color_buffers_alloc(struct color_buffers_s* buffers,
+                                uint32_t width, uint32_t height)
+{
+  buffers->width = width;
+  buffers->height = height;
+  buffers->y_stride = align_32(width);
+  buffers->uv_stride = align_32(width / 2);
+  buffers->rgb_stride = align_32(width * RGB_BYTES_PER_PIXEL);
+  buffers->y = (uint8_t*)aligned_alloc(32, buffers->y_stride * height);
+  buffers->u = (uint8_t*)aligned_alloc(32, buffers->uv_stride * height / 2);
+  buffers->v = (uint8_t*)aligned_alloc(32, buffers->uv_stride * height / 2);
+  buffers->rgb = (uint8_t*)aligned_alloc(32, buffers->rgb_stride * height);
+  // a gradient, so nothing is trivially constant
+  for (uint32_t i = 0; i < buffers->y_stride * height; i++) {
+    buffers->y[i] = i & 0xff;
+  }
+  memset(buffers->u, 96, buffers->uv_stride * height / 2);
+  memset(buffers->v, 160, buffers->uv_stride * height / 2);
+  for (uint32_t i = 0; i < buffers->rgb_stride * height; i++) {
+    buffers->rgb[i] = (i * 7) & 0xff;
+  }
+}
+
+static void color_buffers_free(struct color_buffers_s* buffers) {
+  free(buffers->y);
+  free(buffers->u);
+  free(buffers->v);
+  free(buffers->rgb);
+}
+
+typedef void (*yuv_to_rgb_f)(uint32_t, uint32_t, const uint8_t*,
+                             const uint8_t*, const uint8_t*, uint32_t,
+                             uint32_t, uint8_t*, uint32_t, YCbCrType);
+typedef void (*rgb_to_yuv_f)(uint32_t, uint32_t, const uint8_t*, uint32_t,
+                             uint8_t*, uint8_t*, uint8_t*, uint32_t, uint32_t,
+                             YCbCrType);
+
+static void yuv_to_rgb(benchmark::State& state, yuv_to_rgb_f convert) {
+  struct color_buffers_s buffers;
+  color_buffers_alloc(&buffers, (uint32_t)state.range(0),
+                      (uint32_t)state.range(1));
+  for (auto _ : state) {
+    convert(buffers.width, buffers.height, buffers.y, buffers.u, buffers.v,
+            buffers.y_stride, buffers.uv_stride, buffers.rgb,
+            buffers.rgb_stride, YCBCR_601);
+    benchmark::DoNotOptimize(buffers.rgb);
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * buffers.width * buffers.height);
+  color_buffers_free(&buffers);
+}
+
+static void rgb_to_yuv(benchmark::State& state, rgb_to_yuv_f convert) {
+  struct color_buffers_s buffers;
+  color_buffers_alloc(&buffers, (uint32_t)state.range(0),
+                      (uint32_t)state.range(1));
+  for (auto _ : state) {
+    convert(buffers.width, buffers.height, buffers.rgb, buffers.rgb_stride,
+            buffers.y, buffers.u, buffers.v, buffers.y_stride,
+            buffers.uv_stride, YCBCR_601);
+    benchmark::DoNotOptimize(buffers.y);
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * buffers.width * buffers.height);
+  color_buffers_free(&buffers);
+}
+
+// common source and output sizes
+static void resolutions(benchmark::internal::Benchmark* bench) {
+  bench->ArgNames({"width", "height"});
+  bench->Args({320, 240});
+  bench->Args({640, 480});
+  bench->Args({1280, 720});
+  bench->Args({1920, 1080});
+}
+
+BENCHMARK_CAPTURE(yuv_to_rgb, yuv420_rgb24_std, yuv420_rgb24_std)
+->Apply(resolutions);
+BENCHMARK_CAPTURE(rgb_to_yuv, rgb24_yuv420_std, rgb24_yuv420_std)
+->Apply(resolutions);
+#ifdef __SSE2__
+BENCHMARK_CAPTURE(yuv_to_rgb, yuv420_rgb24_sse, yuv420_rgb24_sse)
+->Apply(resolutions);
+BENCHMARK_CAPTURE(yuv_to_rgb, yuv420_rgb24_sseu, yuv420_rgb24_sseu)
+->Apply(resolutions);
+BENCHMARK_CAPTURE(rgb_to_yuv, rgb24_yuv420_sse, rgb24_yuv420_sse)
+->Apply(resolutions);
+BENCHMARK_CAPTURE(rgb_to_yuv, rgb24_yuv420_sseu, rgb24_yuv420_sseu)
+->Apply(resolutions);
+#endif
@@ -0,0 +1,48 @@
+//
+//  bench_layout.cc
+//  barc
+//
+
+#include <benchmark/benchmark.h>
+#include <string>
+#include <vector>
+#include "Geometry.h"
+
+struct layout_preset_s {
+  const char* name;
+  const std::string* css;
+  // presentation layouts put one stream in the focus role
+  bool has_focus;
+};
+
+static const struct layout_preset_s presets[] = {
+  { "bestFit", &Layout::kBestfitCss, false },
+  { "pip", &Layout::kPip, true },
+  { "verticalPresentation", &Layout::kVerticalPresentation, true },
+  { "horizontalPresentation", &Layout::kHorizontalPresentation, true },
+  { "circleTopPresentation", &Layout::kCircleTopPresentation, true },
+};
+
+static void bench_layout_render(benchmark::State& state) {
+  const struct layout_preset_s& preset = presets[state.range(0)];
+  state.SetLabel(preset.name);
+  std::vector<ArchiveStreamInfo> streams;
+  for (int i = 0; i < state.range(1); i++) {
+    std::string layout_class = preset.has_focus && 0 == i ? "focus" : "";
+    streams.push_back(ArchiveStreamInfo("stream" + std::to_string(i),
+                                        layout_class, true));
+  }
+  CssLayoutEngine engine(1280, 720);
+  for (auto _ : state) {
+    StreamPositionMap positions = engine.render(streams, *preset.css);
+    benchmark::DoNotOptimize(positions);
+  }
+}
+
+BENCHMARK(bench_layout_render)
+->Name("CssLayoutEngine_render")
+->ArgNames({"preset", "streams"})
+->ArgsProduct({benchmark::CreateDenseRange(0, sizeof(presets) /
+                                              sizeof(presets[0]) - 1, 1),
+               {1, 2, 4, 9, 16}})
+->Unit(benchmark::kMicrosecond);
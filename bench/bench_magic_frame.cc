@@ -0,0 +1,115 @@
+//
+//  bench_magic_frame.cc
+//  barc
+//
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <string.h>
+#include "magic_frame.h"
+}
+
+#include <benchmark/benchmark.h>
+
+static const int source_width = 640;
+static const int source_height = 480;
+static const int output_width = 1280;
+static const int output_height = 720;
+
+enum border_mode {
+  border_mode_none = 0,
+  border_mode_square,
+  border_mode_rounded
+};
+
+static const char* object_fit_names[] = {
+  "contain", "cover", "fill", "none", "scale_down"
+};
+static const char* border_mode_names[] = {
+  "none", "square", "rounded"
+};
+
+static AVFrame* make_source_frame() {
+  AVFrame* frame = av_frame_alloc();
+  frame->format = AV_PIX_FMT_YUV420P;
+  frame->width = source_width;
+  frame->height = source_height;
+  av_frame_get_buffer(frame, 32);
+  for (int y = 0; y < source_height; y++) {
+    memset(frame->data[0] + y * frame->linesize[0], y & 0xff, source_width);
+  }
+  for (int y = 0; y < source_height / 2; y++) {
+    memset(frame->data[1] + y * frame->linesize[1], 96, source_width / 2);
+    memset(frame->data[2] + y * frame->linesize[2], 160, source_width / 2);
+  }
+  return frame;
+}
+
+static struct border_s make_border(enum border_mode mode) {
+  struct border_s border = { 0 };
+  if (border_mode_none != mode) {
+    border.width = 4;
+    border.red = 255;
+  }
+  if (border_mode_rounded == mode) {
+    border.radius = 48;
+  }
+  return border;
+}
+
+/* One source frame tiled into half of a 720p output, the way a two person
+ * bestFit layout draws it. Each iteration gets a fresh smart frame, so the
+ * color conversion and scaled tile cached on it are computed every time, as
+ * they are for each new decoded frame.
+ */
+static void bench_magic_frame_add(benchmark::State& state) {
+  enum object_fit fit = (enum object_fit)state.range(0);
+  struct border_s border = make_border((enum border_mode)state.range(1));
+  state.SetLabel(std::string(object_fit_names[fit]) + "/" +
+                 border_mode_names[state.range(1)]);
+  AVFrame* source = make_source_frame();
+  MagickWand* output_wand;
+  magic_frame_start(&output_wand, output_width, output_height);
+  for (auto _ : state) {
+    state.PauseTiming();
+    struct smart_frame_t* smart_frame;
+    smart_frame_create(&smart_frame, av_frame_clone(source));
+    state.ResumeTiming();
+    magic_frame_add(output_wand, smart_frame, 0, 0, border,
+                    output_width / 2, output_height, fit);
+    state.PauseTiming();
+    smart_frame_release(smart_frame);
+    state.ResumeTiming();
+  }
+  DestroyMagickWand(output_wand);
+  av_frame_free(&source);
+}
+
+BENCHMARK(bench_magic_frame_add)
+->Name("magic_frame_add")
+->ArgNames({"fit", "border"})
+->ArgsProduct({{object_fit_contain, object_fit_cover, object_fit_fill,
+                object_fit_none, object_fit_scale_down},
+               {border_mode_none, border_mode_square, border_mode_rounded}})
+->Unit(benchmark::kMicrosecond);
+
+/* The same tile added to a second output, as renditions do: everything
+ * cached on the smart frame is reused.
+ */
+static void bench_magic_frame_add_cached(benchmark::State& state) {
+  struct border_s border = make_border(border_mode_none);
+  struct smart_frame_t* smart_frame;
+  smart_frame_create(&smart_frame, make_source_frame());
+  MagickWand* output_wand;
+  magic_frame_start(&output_wand, output_width, output_height);
+  for (auto _ : state) {
+    magic_frame_add(output_wand, smart_frame, 0, 0, border,
+                    output_width / 2, output_height, object_fit_contain);
+  }
+  DestroyMagickWand(output_wand);
+  smart_frame_release(smart_frame);
+}
+
+BENCHMARK(bench_magic_frame_add_cached)
+->Name("magic_frame_add_cached")
+->Unit(benchmark::kMicrosecond);
@@ -0,0 +1,22 @@
+//
+//  bench_main.cc
+//  barc
+//
+
+extern "C" {
+#include "barc.h"
+}
+
+#include <benchmark/benchmark.h>
+
+// MagickWand and FFmpeg need the same setup as a render before any
+// benchmark runs, so this replaces benchmark_main.
+int main(int argc, char** argv) {
+  barc_bootstrap();
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -0,0 +1,49 @@
+//
+//  bench_smart_frame.cc
+//  barc
+//
+
+extern "C" {
+#include "smart_avframe.h"
+}
+
+#include <benchmark/benchmark.h>
+
+/* Every output frame retains each source frame it composes and releases it
+ * once composed, from as many compose workers as are running, so one popular
+ * source frame is retained and released from several threads at once.
+ */
+static struct smart_frame_t* shared_frame() {
+  // function statics are initialized once, however many threads ask
+  static struct smart_frame_t* frame = [] {
+    struct smart_frame_t* result;
+    smart_frame_create(&result, av_frame_alloc());
+    return result;
+  }();
+  return frame;
+}
+
+static void bench_smart_frame_retain_release(benchmark::State& state) {
+  struct smart_frame_t* frame = shared_frame();
+  for (auto _ : state) {
+    smart_frame_retain(frame);
+    smart_frame_release(frame);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(bench_smart_frame_retain_release)
+->Name("smart_frame_retain_release")
+->ThreadRange(1, 8)
+->UseRealTime();
+
+static void bench_smart_frame_create_release(benchmark::State& state) {
+  for (auto _ : state) {
+    struct smart_frame_t* frame;
+    smart_frame_create(&frame, av_frame_alloc());
+    smart_frame_release(frame);
+  }
+}
+
+BENCHMARK(bench_smart_frame_create_release)
+->Name("smart_frame_create_release");
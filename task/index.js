@@ -9,6 +9,7 @@
 
 const child_process = require('child_process');
 const fs = require('fs');
+const net = require('net');
 const zlib = require('zlib');
 const path = require('path');
 
@@ -26,7 +27,10 @@ const uploader = s3.createClient({
   s3Options: {
     accessKeyId: process.env.S3_TOKEN,
     secretAccessKey: process.env.S3_SECRET,
-    region: process.env.S3_REGION
+    region: process.env.S3_REGION,
+    // point at a local S3 lookalike for testing
+    endpoint: process.env.S3_ENDPOINT,
+    s3ForcePathStyle: !!process.env.S3_ENDPOINT
   },
 });
 
@@ -53,16 +57,39 @@ function bashEscape(arg) {
   });
 }
 
-var processArchive = function(archiveLocalPath, requestArgs, cb) {
+/**
+ * Render an archive with barc. When segment ({index, count}) is given, only
+ * that slice of the timeline is rendered, from its own working directory so
+ * several workers can share a host. onProgress receives a percentage and
+ * barc's estimate of the seconds left, which may be null.
+ * With STREAM_UPLOAD set, barc writes fragmented mp4 to stdout and it goes
+ * straight to S3 while encoding continues; cb then gets the S3 key.
+ */
+var processArchive = function(archiveLocalPath, requestArgs, cb, segment,
+                              onProgress) {
   debug(`begin processing task ${taskId}`)
   var barc = process.env.BARC_PATH || 'barc';
   var cwd = process.cwd();
+  var name = taskId;
+  if (segment) {
+    name = `${taskId}.seg${segment.index}`;
+    cwd = `${cwd}/${name}`;
+    if (!fs.existsSync(cwd)) {
+      fs.mkdirSync(cwd);
+    }
+  }
   debug("Working from " + cwd);
   debug(`job args: ` + JSON.stringify(requestArgs));
-  var archiveOutput = `${cwd}/${taskId}.mp4`;
+  var streamed = streamUpload && !segment;
+  var archiveOutput = `${cwd}/${name}.mp4`;
   var args = [];
-  args.push(`-i${archiveLocalPath}`);
-  args.push(`-o${archiveOutput}`);
+  args.push(`-i${path.resolve(archiveLocalPath)}`);
+  args.push(streamed ? '-o-' : `-o${archiveOutput}`);
+  // progress comes back on its own pipe, see below
+  args.push('--progress=3');
+  if (segment) {
+    args.push(`--segment=${segment.index}/${segment.count}`);
+  }
 
   for (let k in requestArgs) {
     if ('_' === k) {
@@ -79,52 +106,76 @@ var processArchive = function(archiveLocalPath, requestArgs, cb) {
   // kill your process without saying much and leave you well confused.
   const child = child_process.spawn(barc, args, {
     detached: false,
-    cwd: cwd
+    cwd: cwd,
+    stdio: ['pipe', 'pipe', 'pipe', 'pipe']
   });
   debug(`Spawned child pid ${child.pid}`)
-  tryPostback({status: 'processing'});
-  var logpath = `${cwd}/${taskId}.log`;
+  if (!onProgress) {
+    tryPostback({status: 'processing'});
+    onProgress = function(percentage, eta) {
+      tryPostback({progress: percentage, eta: eta});
+    };
+  }
+  var logpath = `${cwd}/${name}.log`;
   var logfd = fs.openSync(logpath, "w+");
   var last_progress = 0;
-  child.stdout.on('data', function(data) {
+  // when streaming, the render is the only thing on stdout and the log
+  // (progress included) moves to stderr. wait for both before finishing.
+  var pending = streamed ? 2 : 1;
+  var exitCode = null;
+  var uploadError = null;
+  var finish = function() {
+    if (--pending > 0) {
+      return;
+    }
+    if (0 == exitCode && !uploadError) {
+      cb(streamed ? uploadKey(name) : archiveOutput);
+    } else {
+      cb(null, uploadError || `error - unknown return code ${exitCode}`)
+    }
+  };
+  if (streamed) {
+    uploadArchiveStream(child.stdout, uploadKey(name), function(error) {
+      uploadError = error;
+      finish();
+    });
+  }
+  var onOutput = function(data) {
     fs.write(logfd, data.toString(), function(err, written, string) {
-
+      if (err) {
+        debug("Error writing to log: ", err);
+      }
     });
-    var lines = data.toString().split("\n");
+  };
+  if (!streamed) {
+    child.stdout.on('data', onOutput);
+  }
+  child.stderr.on('data', onOutput);
+  // one {"progress": {complete, total, elapsed, eta}} object per line, about
+  // once a second. see log.h
+  var bufferedProgress = '';
+  child.stdio[3].on('data', function(data) {
+    var lines = (bufferedProgress + data.toString()).split("\n");
+    bufferedProgress = lines.pop();
     lines.forEach(function(line) {
       try {
         var parsed = JSON.parse(line);
-        if (parsed.progress) {
-          var percentage =
-          (100 * parsed.progress.complete / parsed.progress.total).toFixed(2);
-          if (percentage - last_progress > 5) {
-            debug(`Task progress ${percentage}%`);
-            last_progress = percentage;
-            tryPostback({progress: percentage});
-          }
+        var percentage =
+        (100 * parsed.progress.complete / parsed.progress.total).toFixed(2);
+        if (percentage - last_progress > 5) {
+          debug(`Task progress ${percentage}%, ${parsed.progress.eta}s left`);
+          last_progress = percentage;
+          onProgress(percentage, parsed.progress.eta);
         }
       } catch (e) {
-        // just a line we can't parse. no biggie.
-      }
-    });
-  });
-  child.stderr.on('data', function(data) {
-    fs.write(logfd, data.toString(), function(err, written, string) {
-      // nothing to do here, really.
-      if (err) {
-        debug("Error writing to log: ", err);
+        debug(`unexpected progress line from barc: ${line}`);
       }
     });
-    //console.log(`stderr`);
-    //console.log(data.toString());
   });
   child.on('exit', (code) => {
     debug(`Child exited with code ${code}`);
-    if (0 == code) {
-      cb(archiveOutput);
-    } else {
-      cb(null, `error - unknown return code ${code}`)
-    }
+    exitCode = code;
+    finish();
     // finally, compress the log file and call it a day.
     var gzip = zlib.createGzip();
     const inp = fs.createReadStream(logpath);
@@ -136,7 +187,7 @@ var processArchive = function(archiveLocalPath, requestArgs, cb) {
     });
     // clean up the mess we made during normal use
     fs.unlinkSync(logpath);
-    if (process.env.CLEAN_ARTIFACTS) {
+    if (process.env.CLEAN_ARTIFACTS && !segment) {
       // probably also good to clean up source archive if we're not debugging
       fs.unlinkSync(archiveLocalPath);
     }
@@ -147,6 +198,172 @@ var processArchive = function(archiveLocalPath, requestArgs, cb) {
   });
 }
 
+/**
+ * Hand the archive to a resident `barc --daemon` listening on BARC_SOCKET
+ * instead of spawning a process. The daemon decides when the job fits its
+ * CPU and memory budget, and reports progress and the result as JSON lines
+ * on the same connection. Rendering logs stay with the daemon.
+ */
+var submitToDaemon = function(archiveLocalPath, requestArgs, cb) {
+  var archiveOutput = `${process.cwd()}/${taskId}.mp4`;
+  var job = {
+    id: taskId,
+    input: path.resolve(archiveLocalPath),
+    output: archiveOutput
+  };
+  for (let k in requestArgs) {
+    if ('_' === k) {
+      continue;
+    }
+    job[k] = requestArgs[k];
+  }
+  tryPostback({status: 'processing'});
+  var lastProgress = 0;
+  var finished = false;
+  var buffered = '';
+  var socket = net.createConnection(barcSocket, function() {
+    debug(`submit ${taskId} to barc daemon at ${barcSocket}`);
+    socket.write(JSON.stringify(job) + '\n');
+  });
+  var finish = function(outputPath, error) {
+    if (finished) {
+      return;
+    }
+    finished = true;
+    socket.end();
+    if (process.env.CLEAN_ARTIFACTS) {
+      fs.unlinkSync(archiveLocalPath);
+    }
+    cb(outputPath, error);
+  };
+  var onEvent = function(event) {
+    if (event.id && event.id !== taskId) {
+      return;
+    }
+    switch (event.event) {
+      case 'queued':
+      case 'started':
+        debug(`barc daemon: ${taskId} ${event.event}`);
+        break;
+      case 'progress':
+        var percentage =
+        (100 * event.progress.complete / event.progress.total).toFixed(2);
+        if (event.progress.total > 0 && percentage - lastProgress > 5) {
+          debug(`Task progress ${percentage}%`);
+          lastProgress = percentage;
+          tryPostback({progress: percentage});
+        }
+        break;
+      case 'done':
+        finish(archiveOutput);
+        break;
+      default:
+        finish(null, `error - barc daemon reported ${event.event} ` +
+          `${event.error || event.ret || ''}`);
+    }
+  };
+  socket.on('data', function(data) {
+    var lines = (buffered + data.toString()).split('\n');
+    buffered = lines.pop();
+    lines.forEach(function(line) {
+      try {
+        onEvent(JSON.parse(line));
+      } catch (e) {
+        debug(`unexpected line from barc daemon: ${line}`);
+      }
+    });
+  });
+  socket.on('error', function(err) {
+    finish(null, err);
+  });
+  socket.on('close', function() {
+    finish(null, 'error - barc daemon hung up');
+  });
+}
+
+/**
+ * Fan the archive out into SEGMENT_COUNT slices, render each one with its
+ * own barc process, then join the slices with `barc --stitch`. Each slice
+ * only needs the archive and its index, so the local processes here can be
+ * swapped for remote workers without changing the stitch step.
+ */
+var processArchiveSegmented = function(archiveLocalPath, requestArgs,
+                                       segmentCount, cb) {
+  tryPostback({status: 'processing'});
+  var outputs = new Array(segmentCount);
+  var segmentProgress = new Array(segmentCount).fill(0);
+  var lastProgress = 0;
+  var remaining = segmentCount;
+  var failure = null;
+  var onSegmentDone = function(index, outputPath, error) {
+    if (error) {
+      failure = failure || error;
+    } else {
+      outputs[index] = outputPath;
+    }
+    if (--remaining > 0) {
+      return;
+    }
+    if (failure) {
+      cb(null, failure);
+      return;
+    }
+    stitchSegments(outputs, function(outputPath, error) {
+      outputs.forEach(function(segmentPath) {
+        cleanupSegment(segmentPath);
+      });
+      if (process.env.CLEAN_ARTIFACTS) {
+        fs.unlinkSync(archiveLocalPath);
+      }
+      cb(outputPath, error);
+    });
+  };
+  for (let i = 0; i < segmentCount; i++) {
+    let segment = {index: i, count: segmentCount};
+    processArchive(archiveLocalPath, requestArgs, function(outputPath, error) {
+      onSegmentDone(i, outputPath, error);
+    }, segment, function(percentage) {
+      segmentProgress[i] = Number(percentage);
+      var total = segmentProgress.reduce((a, b) => a + b, 0) / segmentCount;
+      if (total - lastProgress > 5) {
+        lastProgress = total;
+        tryPostback({progress: total.toFixed(2)});
+      }
+    });
+  }
+}
+
+var stitchSegments = function(segmentPaths, cb) {
+  var barc = process.env.BARC_PATH || 'barc';
+  var archiveOutput = `${process.cwd()}/${taskId}.mp4`;
+  var args = ['--stitch', `-o${archiveOutput}`].concat(segmentPaths);
+  debug(`stitch ${segmentPaths.length} segments into ${archiveOutput}`);
+  const child = child_process.spawn(barc, args, {detached: false});
+  child.stdout.on('data', function(data) {
+    debug(data.toString());
+  });
+  child.on('exit', (code) => {
+    debug(`Stitch exited with code ${code}`);
+    if (0 == code) {
+      cb(archiveOutput);
+    } else {
+      cb(null, `error - stitch returned code ${code}`);
+    }
+  });
+  child.on('error', function(err) {
+    console.log("Spawn error " + err);
+    cb(null, err);
+  });
+}
+
+var cleanupSegment = function(segmentPath) {
+  [segmentPath, `${segmentPath}.segment`].forEach(function(file) {
+    if (fs.existsSync(file)) {
+      fs.unlinkSync(file);
+    }
+  });
+}
+
 var uploadLogs = function(logpath) {
   if (!process.env.S3_PREFIX || !process.env.S3_BUCKET) {
     debug("Missing S3 configuration vars");
@@ -184,6 +401,41 @@ var uploadLogs = function(logpath) {
   });
 };
 
+var uploadKey = function(name) {
+  return `${process.env.S3_PREFIX}/${taskId}/${name}.mp4`;
+}
+
+/**
+ * Multipart upload from a stream, so parts leave as soon as barc writes
+ * them. cb gets an error, or nothing on success.
+ */
+var uploadArchiveStream = function(stream, key, cb) {
+  tryPostback({
+    output_key: key,
+    output_bucket: process.env.S3_BUCKET
+  });
+  debug(`Begin streamed upload to ${key} at ${process.env.S3_BUCKET}`);
+  var params = {
+    Bucket: process.env.S3_BUCKET,
+    Key: key,
+    ACL: 'private',
+    Body: stream
+  };
+  var options = {
+    partSize: 15728640,
+    queueSize: 4
+  };
+  uploader.s3.upload(params, options, function(err, data) {
+    if (err) {
+      debug("unable to upload:", err.stack);
+      cb(err);
+      return;
+    }
+    debug("done uploading archive");
+    cb();
+  });
+}
+
 var uploadArchiveOutput = function(archiveOutput, cb) {
   if (!process.env.S3_PREFIX || !process.env.S3_BUCKET) {
     debug("Missing S3 configuration vars");
@@ -283,6 +535,17 @@ const archiveURL = process.env.ARCHIVE_URL;
 debug(`Using archive URL ${archiveURL}`);
 const callbackURL = process.env.CALLBACK_URL;
 debug(`Using callback URL ${callbackURL}`);
+const segmentCount = parseInt(process.env.SEGMENT_COUNT, 10) || 1;
+debug(`Using ${segmentCount} segments`);
+// segmented renders are stitched from local files, so they can't stream
+const streamUpload = !!process.env.STREAM_UPLOAD && segmentCount <= 1 &&
+  !!process.env.S3_PREFIX && !!process.env.S3_BUCKET;
+debug(`Streaming upload: ${streamUpload}`);
+// render through a resident barc instead of spawning one. segmented and
+// streamed renders still need their own process.
+const barcSocket = segmentCount <= 1 && !streamUpload ?
+  process.env.BARC_SOCKET : null;
+debug(`Using barc daemon: ${barcSocket}`);
 
 tryPostback({lastMessage: 'GOLIATH ONLINE', status: 'launched'});
 
@@ -306,7 +569,11 @@ downloadArchive(archiveURL, function(inputPath, error) {
     });
     return;
   }
-  processArchive(inputPath, argv, function(outputPath, error) {
+  var render = segmentCount > 1 ?
+    function(inputPath, argv, cb) {
+      processArchiveSegmented(inputPath, argv, segmentCount, cb);
+    } : barcSocket ? submitToDaemon : processArchive;
+  render(inputPath, argv, function(outputPath, error) {
     if (error) {
       debug(`Processing failed with error ${error}`);
       tryPostback({
@@ -316,6 +583,12 @@ downloadArchive(archiveURL, function(inputPath, error) {
       });
       return;
     }
+    if (streamUpload) {
+      // already uploaded while rendering
+      debug(`task ${taskId} completed successfully.`);
+      tryPostback({status: 'complete', progress: 100});
+      return;
+    }
     tryPostback({status: 'uploading'});
     uploadArchiveOutput(outputPath, function(result, error) {
       if (error) {
@@ -0,0 +1,184 @@
+//
+//  local_http_server.h
+//  barc
+//
+
+#ifndef local_http_server_h
+#define local_http_server_h
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Stand-in for the archive host: serves one buffer on a loopback port and
+ * answers "Range: bytes=a-b" with a 206, unless told to ignore ranges. The
+ * first drop_count ranged responses of more than one byte are cut off
+ * halfway, like a connection that died. Any path serves the same body.
+ * Every connection is served on a thread of its own, so clients that make
+ * requests in parallel get them answered in parallel.
+ */
+class LocalHttpServer {
+public:
+  LocalHttpServer(const std::vector<char>& body, bool ignore_ranges,
+                  int drop_count = 0)
+  : body_(body), ignore_ranges_(ignore_ranges), drop_count_(drop_count),
+  requests_(0), active_(0), max_active_(0), delay_ms_(0), stopping_(false)
+  {
+    listener_ = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(listener_, (struct sockaddr*)&addr, sizeof(addr));
+    socklen_t len = sizeof(addr);
+    getsockname(listener_, (struct sockaddr*)&addr, &len);
+    port_ = ntohs(addr.sin_port);
+    listen(listener_, 32);
+    thread_ = std::thread(&LocalHttpServer::Serve, this);
+  }
+
+  ~LocalHttpServer() {
+    stopping_ = true;
+    // wake the accept() with a connection of our own
+    int wake = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port_);
+    connect(wake, (struct sockaddr*)&addr, sizeof(addr));
+    close(wake);
+    thread_.join();
+    for (std::thread& worker : workers_) {
+      worker.join();
+    }
+    close(listener_);
+  }
+
+  std::string Url(const std::string& path = "/archive.zip") {
+    return "http://127.0.0.1:" + std::to_string(port_) + path;
+  }
+
+  int Requests() {
+    return requests_;
+  }
+
+  // most requests that were being answered at the same time
+  int MaxConcurrentRequests() {
+    return max_active_;
+  }
+
+  // hold every response this long before sending it, so requests that are
+  // made in parallel overlap
+  void SetResponseDelay(int delay_ms) {
+    delay_ms_ = delay_ms;
+  }
+
+private:
+  void Serve() {
+    while (!stopping_) {
+      int client = accept(listener_, NULL, NULL);
+      if (client < 0) {
+        continue;
+      }
+      if (stopping_) {
+        close(client);
+        continue;
+      }
+      requests_++;
+      workers_.push_back(std::thread(&LocalHttpServer::Handle, this, client));
+    }
+  }
+
+  void Handle(int client) {
+    int active = ++active_;
+    int max_active = max_active_;
+    while (active > max_active &&
+           !max_active_.compare_exchange_weak(max_active, active))
+    {
+    }
+    if (delay_ms_) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms_));
+    }
+    Respond(client);
+    active_--;
+    close(client);
+  }
+
+  void Respond(int client) {
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos) {
+      ssize_t len = recv(client, buffer, sizeof(buffer), 0);
+      if (len <= 0) {
+        return;
+      }
+      request.append(buffer, len);
+    }
+    long long begin = 0;
+    long long end = body_.size() - 1;
+    bool ranged = false;
+    const char* range = strcasestr(request.c_str(), "\r\nRange: bytes=");
+    if (range && !ignore_ranges_ &&
+        2 == sscanf(range, "\r\nRange: bytes=%lld-%lld", &begin, &end))
+    {
+      ranged = true;
+    }
+    char header[512];
+    if (ranged) {
+      snprintf(header, sizeof(header),
+               "HTTP/1.1 206 Partial Content\r\n"
+               "Content-Range: bytes %lld-%lld/%zu\r\n"
+               "ETag: \"barc-test\"\r\n"
+               "Content-Length: %lld\r\nConnection: close\r\n\r\n",
+               begin, end, body_.size(), end - begin + 1);
+    } else {
+      snprintf(header, sizeof(header),
+               "HTTP/1.1 200 OK\r\n"
+               "ETag: \"barc-test\"\r\n"
+               "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+               body_.size());
+    }
+    long long length = end - begin + 1;
+    if (ranged && length > 1 && drop_count_-- > 0) {
+      length /= 2;
+    }
+    send(client, header, strlen(header), MSG_NOSIGNAL);
+    send(client, body_.data() + begin, length, MSG_NOSIGNAL);
+  }
+
+  std::vector<char> body_;
+  bool ignore_ranges_;
+  std::atomic<int> drop_count_;
+  std::atomic<int> requests_;
+  std::atomic<int> active_;
+  std::atomic<int> max_active_;
+  std::atomic<int> delay_ms_;
+  volatile bool stopping_;
+  int listener_;
+  int port_;
+  std::thread thread_;
+  // one per connection, joined on the way out
+  std::vector<std::thread> workers_;
+};
+
+static inline std::vector<char> make_test_body(size_t size) {
+  std::vector<char> body(size);
+  for (size_t i = 0; i < size; i++) {
+    body[i] = (char)(i * 7 + i / 251);
+  }
+  return body;
+}
+
+#endif /* local_http_server_h */
@@ -0,0 +1,123 @@
+//
+//  test_archive_cache.cc
+//  barc
+//
+
+extern "C" {
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "archive_cache.h"
+}
+
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+#include "local_http_server.h"
+
+TEST(ArchiveCache, KeyIgnoresQueryOnlyWithEtag) {
+  char a[17];
+  char b[17];
+  archive_cache_key("https://s3/a.zip?sig=1", "\"x\"", 10, a);
+  archive_cache_key("https://s3/a.zip?sig=2", "\"x\"", 10, b);
+  EXPECT_STREQ(a, b);
+  archive_cache_key("https://s3/a.zip?sig=2", "\"y\"", 10, b);
+  EXPECT_STRNE(a, b);
+  archive_cache_key("https://s3/a.zip?sig=1", "", 10, a);
+  archive_cache_key("https://s3/a.zip?sig=2", "", 10, b);
+  EXPECT_STRNE(a, b);
+}
+
+class ArchiveCacheTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    char dir[] = "/tmp/test_archive_cache.XXXXXX";
+    ASSERT_TRUE(mkdtemp(dir) != NULL);
+    dir_ = dir;
+  }
+
+  void TearDown() override {
+    archive_cache_configure(NULL, 0);
+    std::string command = "rm -rf " + dir_;
+    EXPECT_EQ(0, system(command.c_str()));
+  }
+
+  std::string dir_;
+};
+
+TEST_F(ArchiveCacheTest, RepeatFetchIsAHit) {
+  std::vector<char> body = make_test_body(5 * 1024 * 1024);
+  LocalHttpServer server(body, false);
+  ASSERT_EQ(0, archive_cache_configure(dir_.c_str(), 64 * 1024 * 1024));
+  char* first = archive_cache_fetch(server.Url("/a.zip?sig=1").c_str());
+  ASSERT_TRUE(first != NULL);
+  int requests = server.Requests();
+  char* second = archive_cache_fetch(server.Url("/a.zip?sig=2").c_str());
+  ASSERT_TRUE(second != NULL);
+  EXPECT_STREQ(first, second);
+  // just the probe
+  EXPECT_EQ(requests + 1, server.Requests());
+  struct stat file_stat;
+  ASSERT_EQ(0, stat(second, &file_stat));
+  EXPECT_EQ((off_t)body.size(), file_stat.st_size);
+  archive_cache_release(first);
+  archive_cache_release(second);
+  free(first);
+  free(second);
+}
+
+TEST_F(ArchiveCacheTest, EvictsLeastRecentlyUsed) {
+  std::vector<char> body = make_test_body(1024 * 1024);
+  LocalHttpServer server(body, false);
+  // room for two archives
+  ASSERT_EQ(0, archive_cache_configure(dir_.c_str(), 2 * 1024 * 1024));
+  char* a = archive_cache_fetch(server.Url("/a.zip").c_str());
+  char* b = archive_cache_fetch(server.Url("/b.zip").c_str());
+  ASSERT_TRUE(a && b);
+  archive_cache_release(a);
+  archive_cache_release(b);
+  // make a the recent one
+  struct timeval old_times[2] = { { 1000, 0 }, { 1000, 0 } };
+  utimes(b, old_times);
+  char* again = archive_cache_fetch(server.Url("/a.zip").c_str());
+  ASSERT_TRUE(again != NULL);
+  archive_cache_release(again);
+  free(again);
+  char* c = archive_cache_fetch(server.Url("/c.zip").c_str());
+  ASSERT_TRUE(c != NULL);
+  struct stat file_stat;
+  EXPECT_EQ(0, stat(a, &file_stat));
+  EXPECT_NE(0, stat(b, &file_stat));
+  EXPECT_EQ(0, stat(c, &file_stat));
+  free(a);
+  free(b);
+  free(c);
+}
+
+TEST_F(ArchiveCacheTest, HeldArchiveIsNotEvicted) {
+  std::vector<char> body = make_test_body(1024 * 1024);
+  LocalHttpServer server(body, false);
+  // room for one archive
+  ASSERT_EQ(0, archive_cache_configure(dir_.c_str(), 1024 * 1024));
+  char* a = archive_cache_fetch(server.Url("/a.zip").c_str());
+  ASSERT_TRUE(a != NULL);
+  // a is still being rendered: b goes over budget instead
+  char* b = archive_cache_fetch(server.Url("/b.zip").c_str());
+  ASSERT_TRUE(b != NULL);
+  struct stat file_stat;
+  EXPECT_EQ(0, stat(a, &file_stat));
+  EXPECT_EQ(0, stat(b, &file_stat));
+  archive_cache_release(a);
+  archive_cache_release(b);
+  char* c = archive_cache_fetch(server.Url("/c.zip").c_str());
+  ASSERT_TRUE(c != NULL);
+  EXPECT_NE(0, stat(a, &file_stat));
+  EXPECT_NE(0, stat(b, &file_stat));
+  EXPECT_EQ(0, stat(c, &file_stat));
+  archive_cache_release(c);
+  free(a);
+  free(b);
+  free(c);
+}
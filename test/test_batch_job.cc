@@ -0,0 +1,95 @@
+//
+//  test_batch_job.cc
+//  barc
+//
+
+extern "C" {
+#include "batch_runner.h"
+}
+
+#include "gtest/gtest.h"
+
+static struct archive_config_s test_defaults() {
+  struct archive_config_s defaults = { 0 };
+  defaults.width = 640;
+  defaults.height = 480;
+  defaults.css_preset = "bestFit";
+  return defaults;
+}
+
+TEST(BatchJob, AppliesDefaults) {
+  struct archive_config_s defaults = test_defaults();
+  struct batch_job_s* job = NULL;
+  ASSERT_EQ(0, batch_job_parse("{\"input\": \"a.zip\", \"output\": \"a.mp4\"}",
+                               &defaults, &job));
+  const struct archive_config_s* config = batch_job_get_config(job);
+  EXPECT_STREQ("a.zip", batch_job_get_input(job));
+  // the input doubles as the id when none is given
+  EXPECT_STREQ("a.zip", batch_job_get_id(job));
+  EXPECT_STREQ("a.mp4", config->output_path);
+  EXPECT_EQ(640, config->width);
+  EXPECT_EQ(480, config->height);
+  EXPECT_STREQ("bestFit", config->css_preset);
+  batch_job_free(job);
+}
+
+TEST(BatchJob, OverridesDefaults) {
+  struct archive_config_s defaults = test_defaults();
+  struct batch_job_s* job = NULL;
+  ASSERT_EQ(0, batch_job_parse("{\"id\": \"j1\", \"input\": \"/in/b\", "
+                               "\"output\": \"/out/b.mp4\", \"width\": 1280, "
+                               "\"height\": 720, \"css_preset\": \"custom\", "
+                               "\"begin_offset\": 5, \"end_offset\": 7.5, "
+                               "\"vfr\": true}",
+                               &defaults, &job));
+  const struct archive_config_s* config = batch_job_get_config(job);
+  EXPECT_STREQ("j1", batch_job_get_id(job));
+  EXPECT_EQ(1280, config->width);
+  EXPECT_EQ(720, config->height);
+  EXPECT_STREQ("custom", config->css_preset);
+  EXPECT_DOUBLE_EQ(5, config->begin_offset);
+  EXPECT_DOUBLE_EQ(7.5, config->end_offset);
+  EXPECT_TRUE(config->variable_frame_rate);
+  batch_job_free(job);
+}
+
+TEST(BatchJob, DropsSharedOutputs) {
+  struct archive_config_s defaults = test_defaults();
+  struct barc_rendition_s rendition = { 320, 240, "small.mp4" };
+  defaults.renditions = &rendition;
+  defaults.rendition_count = 1;
+  defaults.segment_count = 4;
+  struct batch_job_s* job = NULL;
+  ASSERT_EQ(0, batch_job_parse("{\"input\": \"a\", \"output\": \"a.mp4\"}",
+                               &defaults, &job));
+  EXPECT_EQ(0, batch_job_get_config(job)->rendition_count);
+  EXPECT_EQ(0, batch_job_get_config(job)->segment_count);
+  batch_job_free(job);
+}
+
+TEST(BatchJob, RejectsBadLines) {
+  struct archive_config_s defaults = test_defaults();
+  struct batch_job_s* job = NULL;
+  EXPECT_NE(0, batch_job_parse("not json", &defaults, &job));
+  EXPECT_NE(0, batch_job_parse("{\"output\": \"a.mp4\"}", &defaults, &job));
+  EXPECT_NE(0, batch_job_parse("{\"input\": \"a\"}", &defaults, &job));
+  EXPECT_NE(0, batch_job_parse("{\"input\": \"a\", \"output\": \"-\"}",
+                               &defaults, &job));
+  EXPECT_NE(0, batch_job_parse("{\"input\": \"a\", \"output\": \"a.mp4\", "
+                               "\"width\": 0}", &defaults, &job));
+  EXPECT_TRUE(NULL == job);
+}
+
+TEST(BatchJob, ChecksOutputDirectory) {
+  struct archive_config_s defaults = test_defaults();
+  struct batch_job_s* job = NULL;
+  ASSERT_EQ(0, batch_job_parse("{\"input\": \"a\", \"output\": \"/tmp/a.mp4\"}",
+                               &defaults, &job));
+  EXPECT_EQ(0, batch_job_check_output(job));
+  batch_job_free(job);
+  ASSERT_EQ(0, batch_job_parse("{\"input\": \"a\", "
+                               "\"output\": \"/nonexistent/barc/a.mp4\"}",
+                               &defaults, &job));
+  EXPECT_NE(0, batch_job_check_output(job));
+  batch_job_free(job);
+}
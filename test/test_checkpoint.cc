@@ -0,0 +1,131 @@
+//
+//  test_checkpoint.cc
+//  barc
+//
+
+extern "C" {
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "checkpoint.h"
+}
+
+#include <string>
+#include "gtest/gtest.h"
+
+class CheckpointTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    char dir[] = "/tmp/test_checkpoint.XXXXXX";
+    ASSERT_TRUE(mkdtemp(dir) != NULL);
+    dir_ = dir;
+    output_path_ = dir_ + "/render.mp4";
+  }
+
+  void TearDown() override {
+    std::string command = "rm -rf " + dir_;
+    EXPECT_EQ(0, system(command.c_str()));
+  }
+
+  // a checkpoint for 5 chunks over 150 seconds with completed done
+  struct checkpoint_s Plan(int completed) {
+    struct checkpoint_s checkpoint;
+    memset(&checkpoint, 0, sizeof(checkpoint));
+    checkpoint.end_time = 150;
+    checkpoint.chunk_count = 5;
+    checkpoint.completed = completed;
+    checkpoint_fingerprint("input a.zip\nsize 640x480", checkpoint.fingerprint);
+    return checkpoint;
+  }
+
+  void WriteChunk(int index) {
+    char path[PATH_MAX];
+    checkpoint_chunk_path(output_path_.c_str(), index, path, sizeof(path));
+    FILE* file = fopen(path, "w");
+    ASSERT_TRUE(file != NULL);
+    fclose(file);
+  }
+
+  std::string dir_;
+  std::string output_path_;
+};
+
+TEST_F(CheckpointTest, RoundTrip) {
+  struct checkpoint_s checkpoint = Plan(0);
+  checkpoint.end_time = 10800.5;
+  checkpoint.chunk_count = 36;
+  checkpoint.completed = 32;
+  checkpoint.resume_time = 9600;
+  const char* path = output_path_.c_str();
+  EXPECT_EQ(0, checkpoint_write(path, &checkpoint));
+
+  struct checkpoint_s parsed;
+  EXPECT_EQ(0, checkpoint_read(path, &parsed));
+  EXPECT_DOUBLE_EQ(checkpoint.end_time, parsed.end_time);
+  EXPECT_EQ(checkpoint.chunk_count, parsed.chunk_count);
+  EXPECT_STREQ(checkpoint.fingerprint, parsed.fingerprint);
+  EXPECT_EQ(checkpoint.completed, parsed.completed);
+  EXPECT_DOUBLE_EQ(checkpoint.resume_time, parsed.resume_time);
+
+  checkpoint_remove(path);
+  EXPECT_NE(0, checkpoint_read(path, &parsed));
+}
+
+TEST_F(CheckpointTest, RejectsImpossibleProgress) {
+  struct checkpoint_s checkpoint = Plan(0);
+  checkpoint.chunk_count = 2;
+  checkpoint.completed = 3;
+  EXPECT_EQ(0, checkpoint_write(output_path_.c_str(), &checkpoint));
+
+  struct checkpoint_s parsed;
+  EXPECT_NE(0, checkpoint_read(output_path_.c_str(), &parsed));
+}
+
+TEST_F(CheckpointTest, ResumesAfterCompletedChunks) {
+  struct checkpoint_s checkpoint = Plan(3);
+  ASSERT_EQ(0, checkpoint_write(output_path_.c_str(), &checkpoint));
+  for (int i = 0; i < 3; i++) {
+    WriteChunk(i);
+  }
+  EXPECT_EQ(3, checkpoint_find_resume(output_path_.c_str(), &checkpoint));
+}
+
+TEST_F(CheckpointTest, ResumesAtMissingChunk) {
+  struct checkpoint_s checkpoint = Plan(3);
+  ASSERT_EQ(0, checkpoint_write(output_path_.c_str(), &checkpoint));
+  WriteChunk(0);
+  WriteChunk(2);
+  EXPECT_EQ(1, checkpoint_find_resume(output_path_.c_str(), &checkpoint));
+}
+
+TEST_F(CheckpointTest, DifferentPlanStartsOver) {
+  struct checkpoint_s written = Plan(3);
+  ASSERT_EQ(0, checkpoint_write(output_path_.c_str(), &written));
+  for (int i = 0; i < 3; i++) {
+    WriteChunk(i);
+  }
+  const char* path = output_path_.c_str();
+
+  struct checkpoint_s plan = Plan(0);
+  plan.chunk_count = 6;
+  EXPECT_EQ(0, checkpoint_find_resume(path, &plan));
+  plan = Plan(0);
+  plan.end_time = 151;
+  EXPECT_EQ(0, checkpoint_find_resume(path, &plan));
+  // same timeline, rendered at another size
+  plan = Plan(0);
+  checkpoint_fingerprint("input a.zip\nsize 1280x720", plan.fingerprint);
+  EXPECT_EQ(0, checkpoint_find_resume(path, &plan));
+}
+
+TEST_F(CheckpointTest, NoCheckpointStartsOver) {
+  struct checkpoint_s plan = Plan(0);
+  EXPECT_EQ(0, checkpoint_find_resume(output_path_.c_str(), &plan));
+}
+
+TEST(Checkpoint, ChunkPath) {
+  char path[64];
+  checkpoint_chunk_path("/out/render.mp4", 12, path, sizeof(path));
+  EXPECT_STREQ("/out/render.mp4.chunk12.mp4", path);
+}
@@ -0,0 +1,96 @@
+//
+//  test_curler.cc
+//  barc
+//
+
+extern "C" {
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "curler.h"
+}
+
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+#include "local_http_server.h"
+
+static std::vector<char> read_file(const char* path) {
+  std::ifstream file(path, std::ios::binary);
+  return std::vector<char>(std::istreambuf_iterator<char>(file),
+                           std::istreambuf_iterator<char>());
+}
+
+class CurlerTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    char dir[] = "/tmp/test_curler.XXXXXX";
+    ASSERT_TRUE(mkdtemp(dir) != NULL);
+    dir_ = dir;
+    path_ = dir_ + "/download";
+  }
+
+  void TearDown() override {
+    std::string command = "rm -rf " + dir_;
+    EXPECT_EQ(0, system(command.c_str()));
+  }
+
+  std::string dir_;
+  std::string path_;
+};
+
+TEST_F(CurlerTest, DownloadsRangesInParallel) {
+  // a few chunks, the last one short
+  std::vector<char> body = make_test_body(10 * 1024 * 1024 + 3);
+  LocalHttpServer server(body, false);
+  // long enough that chunks requested together are answered together
+  server.SetResponseDelay(200);
+  struct download_s* download;
+  ASSERT_EQ(0, download_start(&download, server.Url().c_str(),
+                              path_.c_str(), 3));
+  EXPECT_EQ(0, download_wait(download));
+  download_free(download);
+  EXPECT_TRUE(body == read_file(path_.c_str()));
+  // the probe, then the three chunks at once
+  EXPECT_EQ(4, server.Requests());
+  EXPECT_EQ(3, server.MaxConcurrentRequests());
+}
+
+TEST_F(CurlerTest, ResumesDroppedChunks) {
+  std::vector<char> body = make_test_body(9 * 1024 * 1024);
+  LocalHttpServer server(body, false, 3);
+  struct download_s* download;
+  ASSERT_EQ(0, download_start(&download, server.Url().c_str(),
+                              path_.c_str(), 2));
+  EXPECT_EQ(0, download_wait(download));
+  download_free(download);
+  EXPECT_TRUE(body == read_file(path_.c_str()));
+}
+
+TEST(Curler, DownloadsWithoutRanges) {
+  std::vector<char> body = make_test_body(1024 * 1024);
+  LocalHttpServer server(body, true);
+  char* path = get_http(server.Url().c_str());
+  ASSERT_TRUE(path != NULL);
+  EXPECT_TRUE(body == read_file(path));
+  unlink(path);
+  free(path);
+}
+
+static int64_t parse(const char* header) {
+  return parse_content_range_total(header, strlen(header));
+}
+
+TEST(Curler, ParsesContentRangeTotal) {
+  EXPECT_EQ(1234, parse("Content-Range: bytes 0-0/1234\r\n"));
+  EXPECT_EQ(5000000000LL, parse("content-range: bytes 0-99/5000000000\r\n"));
+  // what a 416 carries
+  EXPECT_EQ(1234, parse("Content-Range: bytes */1234\r\n"));
+  EXPECT_EQ(-1, parse("Content-Range: bytes 0-0/*\r\n"));
+  EXPECT_EQ(-1, parse("Content-Length: 1234\r\n"));
+  EXPECT_EQ(-1, parse("X-Path: /1234\r\n"));
+  // only part of the buffer is the header
+  EXPECT_EQ(12, parse_content_range_total("Content-Range: bytes 0-0/123", 27));
+}
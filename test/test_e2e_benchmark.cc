@@ -0,0 +1,91 @@
+//
+//  test_e2e_benchmark.cc
+//  barc
+//
+
+extern "C" {
+#include <jansson.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <libavformat/avformat.h>
+#include "synthetic_archive.h"
+}
+
+#include <string>
+#include "gtest/gtest.h"
+
+// set by CMake, see BARC_E2E_* cache variables there
+static double env_threshold(const char* name) {
+  const char* value = getenv(name);
+  return value && *value ? atof(value) : 0;
+}
+
+/* Renders a synthetic archive end to end with the barc binary: four
+ * staggered 640x480 streams that each drop out once, with the layout changing
+ * every five seconds. Realtime factor and peak memory are printed and
+ * recorded as test properties (see --gtest_output=xml). They only fail the
+ * test when BARC_E2E_MIN_REALTIME_FACTOR or BARC_E2E_MAX_RSS_MB are set.
+ */
+class EndToEnd : public ::testing::Test {
+protected:
+  void SetUp() override {
+    char dir[] = "/tmp/test_e2e_benchmark.XXXXXX";
+    ASSERT_TRUE(mkdtemp(dir) != NULL);
+    dir_ = dir;
+  }
+
+  void TearDown() override {
+    std::string command = "rm -rf " + dir_;
+    EXPECT_EQ(0, system(command.c_str()));
+  }
+
+  std::string dir_;
+};
+
+TEST_F(EndToEnd, RenderSyntheticArchive) {
+  av_register_all();
+  struct synthetic_archive_config_s config;
+  synthetic_archive_config_default(&config);
+  config.duration = 20;
+  config.layout_interval = 5;
+  std::string archive = dir_ + "/archive";
+  std::string output = dir_ + "/render.mp4";
+  std::string report_path = dir_ + "/report.json";
+  ASSERT_EQ(0, mkdir(archive.c_str(), 0755));
+  int ret = synthetic_archive_write(&config, archive.c_str());
+  if (AVERROR_ENCODER_NOT_FOUND == ret) {
+    printf("Skipping: FFmpeg has no VP8 or Opus encoder\n");
+    return;
+  }
+  ASSERT_EQ(0, ret);
+
+  std::string command = std::string(BARC_BINARY) + " -i " + archive +
+  " -o " + output + " -w 1280 -h 720 --perf_report " + report_path +
+  " > /dev/null";
+  ASSERT_EQ(0, system(command.c_str()));
+
+  json_error_t error;
+  json_t* report = json_load_file(report_path.c_str(), 0, &error);
+  ASSERT_TRUE(NULL != report);
+  double realtime_factor =
+  json_number_value(json_object_get(report, "realtime_factor"));
+  double peak_rss_mb =
+  json_number_value(json_object_get(report, "peak_rss_mb"));
+  double media_seconds =
+  json_number_value(json_object_get(report, "media_seconds"));
+  json_decref(report);
+  printf("e2e: %.1fs rendered, realtime factor %.2f, peak rss %.0f MB\n",
+         media_seconds, realtime_factor, peak_rss_mb);
+  RecordProperty("realtime_factor_x100", (int)(realtime_factor * 100));
+  RecordProperty("peak_rss_mb", (int)peak_rss_mb);
+  EXPECT_NEAR(config.duration, media_seconds, 1);
+
+  double min_realtime_factor = env_threshold("BARC_E2E_MIN_REALTIME_FACTOR");
+  if (min_realtime_factor > 0) {
+    EXPECT_GE(realtime_factor, min_realtime_factor);
+  }
+  double max_rss_mb = env_threshold("BARC_E2E_MAX_RSS_MB");
+  if (max_rss_mb > 0) {
+    EXPECT_LE(peak_rss_mb, max_rss_mb);
+  }
+}
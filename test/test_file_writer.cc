@@ -10,6 +10,7 @@ extern "C" {
 #include "file_writer.h"
 }
 
+#include <string>
 #include "gtest/gtest.h"
 
 TEST(FileWriter, AllocFileWriter) {
@@ -19,6 +20,44 @@ TEST(FileWriter, AllocFileWriter) {
   file_writer_free(file_writer);
 }
 
+TEST(FileWriter, ParseOutputFormat) {
+  enum file_writer_format format = file_writer_format_hls;
+  EXPECT_EQ(0, file_writer_parse_format(NULL, &format));
+  EXPECT_EQ(file_writer_format_auto, format);
+  EXPECT_EQ(0, file_writer_parse_format("mp4", &format));
+  EXPECT_EQ(file_writer_format_auto, format);
+  EXPECT_EQ(0, file_writer_parse_format("fmp4", &format));
+  EXPECT_EQ(file_writer_format_fmp4, format);
+  EXPECT_EQ(0, file_writer_parse_format("hls", &format));
+  EXPECT_EQ(file_writer_format_hls, format);
+  EXPECT_EQ(0, file_writer_parse_format("dash", &format));
+  EXPECT_EQ(file_writer_format_dash, format);
+  EXPECT_NE(0, file_writer_parse_format("avi", &format));
+}
+
+TEST(FileWriter, DefaultSegmentDuration) {
+  struct file_writer_t* file_writer = NULL;
+  file_writer_alloc(&file_writer);
+  EXPECT_GT(file_writer->segment_duration, 0);
+  file_writer_set_output_format(file_writer, file_writer_format_hls, 6);
+  EXPECT_EQ(file_writer_format_hls, file_writer->output_format);
+  EXPECT_DOUBLE_EQ(6, file_writer->segment_duration);
+  file_writer_set_output_format(file_writer, file_writer_format_fmp4, 0);
+  EXPECT_GT(file_writer->segment_duration, 0);
+  file_writer_free(file_writer);
+}
+
+TEST(FileWriter, StreamRefusesPlaylistFormats) {
+  av_register_all();
+  struct file_writer_t* file_writer = NULL;
+  file_writer_alloc(&file_writer);
+  file_writer_set_output_format(file_writer, file_writer_format_hls, 0);
+  EXPECT_NE(0, file_writer_open(file_writer, "pipe:1", 320, 240));
+  // nothing started, so nothing to wait for
+  EXPECT_EQ(0, file_writer_close(file_writer));
+  file_writer_free(file_writer);
+}
+
 AVFrame* empty_audio_frame() {
   AVFrame* frame = av_frame_alloc();
   // TODO: Dig the format out of the file writer context for better flexibility
@@ -67,3 +106,135 @@ TEST(FileWriter, WriteFrame) {
   unlink(outfile);
 }
 */
+
+TEST(FileWriter, StreamOutputNames) {
+  EXPECT_TRUE(file_writer_is_stream_output("-"));
+  EXPECT_TRUE(file_writer_is_stream_output("pipe:1"));
+  EXPECT_TRUE(file_writer_is_stream_output("pipe:4"));
+  EXPECT_FALSE(file_writer_is_stream_output("output.mp4"));
+  EXPECT_FALSE(file_writer_is_stream_output("-output.mp4"));
+  EXPECT_FALSE(file_writer_is_stream_output(NULL));
+}
+
+// stands in for an upload endpoint: collects everything the muxer sends
+struct fake_upload_s {
+  std::string bytes;
+  int writes;
+};
+
+static int fake_upload_write(void* opaque, uint8_t* buf, int size) {
+  struct fake_upload_s* upload = (struct fake_upload_s*)opaque;
+  upload->bytes.append((const char*)buf, size);
+  upload->writes++;
+  return size;
+}
+
+TEST(FileWriter, CallbackSinkStreamsFragments) {
+  av_register_all();
+  avfilter_register_all();
+  struct fake_upload_s upload = { std::string(), 0 };
+  struct file_writer_t* file_writer = NULL;
+  file_writer_alloc(&file_writer);
+  file_writer_set_output_callback(file_writer, fake_upload_write, &upload);
+  file_writer_set_output_format(file_writer, file_writer_format_auto, 1);
+  ASSERT_EQ(0, file_writer_open(file_writer, NULL, 320, 240));
+  // callback sinks can't seek, so progressive mp4 turns into fragmented
+  EXPECT_EQ(file_writer_format_fmp4, file_writer->output_format);
+
+  // two seconds of black video and silence
+  for (int i = 0; i < 60; i++) {
+    AVFrame* frame = av_frame_alloc();
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = 320;
+    frame->height = 240;
+    ASSERT_EQ(0, av_frame_get_buffer(frame, 0));
+    memset(frame->data[0], 16, frame->linesize[0] * frame->height);
+    memset(frame->data[1], 128, frame->linesize[1] * frame->height / 2);
+    memset(frame->data[2], 128, frame->linesize[2] * frame->height / 2);
+    frame->pts = i * 1000 / 30;
+    EXPECT_EQ(0, file_writer_push_video_frame(file_writer, frame));
+    av_frame_free(&frame);
+  }
+  for (int i = 0; i < 94; i++) {
+    AVFrame* frame = empty_audio_frame();
+    memset(frame->data[0], 0, frame->linesize[0]);
+    frame->pts = i * 1024;
+    EXPECT_EQ(0, file_writer_push_audio_frame(file_writer, frame));
+    av_frame_free(&frame);
+  }
+  EXPECT_EQ(0, file_writer_close(file_writer));
+  file_writer_free(file_writer);
+
+  ASSERT_GT(upload.bytes.size(), 8);
+  EXPECT_EQ("ftyp", upload.bytes.substr(4, 4));
+  EXPECT_NE(std::string::npos, upload.bytes.find("moof"));
+  EXPECT_GT(upload.writes, 1);
+}
+
+static void write_hashed(struct file_writer_t* file_writer, const char* path,
+                         uint8_t luma)
+{
+  file_writer_set_sink(file_writer, file_writer_sink_hash);
+  ASSERT_EQ(0, file_writer_open(file_writer, path, 320, 240));
+  for (int i = 0; i < 30; i++) {
+    AVFrame* frame = av_frame_alloc();
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = 320;
+    frame->height = 240;
+    ASSERT_EQ(0, av_frame_get_buffer(frame, 0));
+    memset(frame->data[0], luma, frame->linesize[0] * frame->height);
+    memset(frame->data[1], 128, frame->linesize[1] * frame->height / 2);
+    memset(frame->data[2], 128, frame->linesize[2] * frame->height / 2);
+    frame->pts = i * 1000 / 30;
+    EXPECT_EQ(0, file_writer_push_video_frame(file_writer, frame));
+    av_frame_free(&frame);
+  }
+  for (int i = 0; i < 47; i++) {
+    AVFrame* frame = empty_audio_frame();
+    memset(frame->data[0], 0, frame->linesize[0]);
+    frame->pts = i * 1024;
+    EXPECT_EQ(0, file_writer_push_audio_frame(file_writer, frame));
+    av_frame_free(&frame);
+  }
+  EXPECT_EQ(0, file_writer_close(file_writer));
+}
+
+TEST(FileWriter, HashSinkIsDeterministic) {
+  av_register_all();
+  avfilter_register_all();
+  const char* outfile = "/tmp/barc_hash_sink.mp4";
+  unlink(outfile);
+  struct file_writer_t* first = NULL;
+  struct file_writer_t* second = NULL;
+  struct file_writer_t* other = NULL;
+  file_writer_alloc(&first);
+  file_writer_alloc(&second);
+  file_writer_alloc(&other);
+  write_hashed(first, outfile, 16);
+  write_hashed(second, outfile, 16);
+  write_hashed(other, outfile, 17);
+  // every frame is seen, but nothing is written
+  EXPECT_EQ(30, first->video_frame_ct);
+  EXPECT_EQ(47, first->audio_frame_ct);
+  EXPECT_NE(0, access(outfile, F_OK));
+  EXPECT_EQ(first->video_hash, second->video_hash);
+  EXPECT_EQ(first->audio_hash, second->audio_hash);
+  EXPECT_NE(first->video_hash, other->video_hash);
+  EXPECT_EQ(first->audio_hash, other->audio_hash);
+  file_writer_free(first);
+  file_writer_free(second);
+  file_writer_free(other);
+}
+
+TEST(FileWriter, ParseSink) {
+  enum file_writer_sink sink = file_writer_sink_hash;
+  EXPECT_EQ(0, file_writer_parse_sink(NULL, &sink));
+  EXPECT_EQ(file_writer_sink_encode, sink);
+  EXPECT_EQ(0, file_writer_parse_sink("null", &sink));
+  EXPECT_EQ(file_writer_sink_null, sink);
+  EXPECT_EQ(0, file_writer_parse_sink("hash", &sink));
+  EXPECT_EQ(file_writer_sink_hash, sink);
+  EXPECT_EQ(0, file_writer_parse_sink("encode", &sink));
+  EXPECT_EQ(file_writer_sink_encode, sink);
+  EXPECT_NE(0, file_writer_parse_sink("x264", &sink));
+}
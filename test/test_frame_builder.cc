@@ -0,0 +1,133 @@
+//
+//  test_frame_builder.cc
+//  barc
+//
+
+extern "C" {
+#include <string.h>
+#include <MagickWand/MagickWand.h>
+#include "frame_builder.h"
+}
+
+#include <vector>
+#include "gtest/gtest.h"
+
+#define TEST_FRAME_WIDTH 64
+#define TEST_FRAME_HEIGHT 48
+
+// what each callback got: the output's pixels, or NULL when omitted. output
+// handed out again shares the buffer of the frame it repeats.
+static std::vector<uint8_t*> delivered;
+
+static void record_frame(AVFrame* frame, void* p) {
+  delivered.push_back(frame ? frame->data[0] : NULL);
+}
+
+class FrameBuilderTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    MagickWandGenesis();
+    delivered.clear();
+    frame_builder_alloc(&builder_);
+    gray_ = SourceFrame(64);
+    white_ = SourceFrame(235);
+  }
+
+  void TearDown() override {
+    frame_builder_free(builder_);
+    smart_frame_release(gray_);
+    smart_frame_release(white_);
+  }
+
+  static struct smart_frame_t* SourceFrame(uint8_t luma) {
+    AVFrame* frame = av_frame_alloc();
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = TEST_FRAME_WIDTH;
+    frame->height = TEST_FRAME_HEIGHT;
+    av_frame_get_buffer(frame, 1);
+    memset(frame->data[0], luma, frame->linesize[0] * frame->height);
+    memset(frame->data[1], 128, frame->linesize[1] * frame->height / 2);
+    memset(frame->data[2], 128, frame->linesize[2] * frame->height / 2);
+    struct smart_frame_t* smart_frame;
+    smart_frame_create(&smart_frame, frame);
+    return smart_frame;
+  }
+
+  // one output frame with source placed at x
+  void Build(struct smart_frame_t* source, int x) {
+    frame_builder_begin_frame(builder_, TEST_FRAME_WIDTH * 2,
+                              TEST_FRAME_HEIGHT, AV_PIX_FMT_YUV420P, NULL);
+    struct frame_builder_subframe_t subframe;
+    memset(&subframe, 0, sizeof(subframe));
+    subframe.smart_frame = source;
+    subframe.x_offset = x;
+    subframe.render_width = TEST_FRAME_WIDTH;
+    subframe.render_height = TEST_FRAME_HEIGHT;
+    subframe.object_fit = object_fit_contain;
+    frame_builder_add_subframe(builder_, &subframe);
+    frame_builder_finish_frame(builder_, record_frame);
+  }
+
+  struct frame_builder_t* builder_;
+  struct smart_frame_t* gray_;
+  struct smart_frame_t* white_;
+};
+
+TEST_F(FrameBuilderTest, UnchangedFrameReusesOutput) {
+  Build(gray_, 0);
+  Build(gray_, 0);
+  Build(white_, 0);
+  // the same source somewhere else is a different frame too
+  Build(white_, TEST_FRAME_WIDTH);
+  frame_builder_wait(builder_, 0);
+  ASSERT_EQ(4u, delivered.size());
+  EXPECT_TRUE(NULL != delivered[0]);
+  EXPECT_EQ(delivered[0], delivered[1]);
+  EXPECT_TRUE(NULL != delivered[2]);
+  EXPECT_NE(delivered[1], delivered[2]);
+  EXPECT_TRUE(NULL != delivered[3]);
+  EXPECT_NE(delivered[2], delivered[3]);
+}
+
+TEST_F(FrameBuilderTest, OmitsUnchangedFramesUpToMax) {
+  frame_builder_set_repeat_mode(builder_, frame_builder_repeat_omit, 2);
+  for (int i = 0; i < 4; i++) {
+    Build(gray_, 0);
+  }
+  Build(white_, 0);
+  frame_builder_wait(builder_, 0);
+  ASSERT_EQ(5u, delivered.size());
+  EXPECT_TRUE(NULL != delivered[0]);
+  EXPECT_TRUE(NULL == delivered[1]);
+  EXPECT_TRUE(NULL == delivered[2]);
+  // too many in a row: the previous output goes out again
+  EXPECT_EQ(delivered[0], delivered[3]);
+  // a change is composed right away
+  EXPECT_TRUE(NULL != delivered[4]);
+  EXPECT_NE(delivered[0], delivered[4]);
+}
+
+TEST_F(FrameBuilderTest, ComposeModeComposesEveryFrame) {
+  frame_builder_set_repeat_mode(builder_, frame_builder_repeat_compose, 0);
+  Build(gray_, 0);
+  Build(gray_, 0);
+  frame_builder_wait(builder_, 0);
+  ASSERT_EQ(2u, delivered.size());
+  EXPECT_TRUE(NULL != delivered[0]);
+  EXPECT_TRUE(NULL != delivered[1]);
+  EXPECT_NE(delivered[0], delivered[1]);
+}
+
+TEST_F(FrameBuilderTest, ForgottenFrameIsComposed) {
+  frame_builder_set_repeat_mode(builder_, frame_builder_repeat_omit, 2);
+  Build(gray_, 0);
+  // the caller put out a blank frame in between
+  frame_builder_wait(builder_, 0);
+  frame_builder_forget_previous(builder_);
+  Build(gray_, 0);
+  frame_builder_wait(builder_, 0);
+  ASSERT_EQ(2u, delivered.size());
+  EXPECT_TRUE(NULL != delivered[0]);
+  EXPECT_TRUE(NULL != delivered[1]);
+  EXPECT_NE(delivered[0], delivered[1]);
+}
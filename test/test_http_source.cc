@@ -0,0 +1,142 @@
+//
+//  test_http_source.cc
+//  barc
+//
+
+extern "C" {
+#include <string.h>
+#include <uv.h>
+#include "http_source.h"
+}
+
+#include <vector>
+#include "gtest/gtest.h"
+#include "local_http_server.h"
+
+TEST(HttpSource, ReadsRandomRanges) {
+  std::vector<char> body = make_test_body(3 * 1024 * 1024 + 17);
+  LocalHttpServer server(body, false);
+  struct http_source_s* source;
+  ASSERT_EQ(0, http_source_open(&source, server.Url().c_str(), 0));
+  EXPECT_EQ((int64_t)body.size(), http_source_get_size(source));
+
+  // the tail first, the way libzip looks for the central directory
+  std::vector<char> buffer(600 * 1024);
+  int64_t tail = body.size() - 100;
+  EXPECT_EQ(100, http_source_read(source, tail, buffer.data(), 1000));
+  EXPECT_EQ(0, memcmp(body.data() + tail, buffer.data(), 100));
+  // spans several cache blocks
+  EXPECT_EQ((int64_t)buffer.size(),
+            http_source_read(source, 12345, buffer.data(), buffer.size()));
+  EXPECT_EQ(0, memcmp(body.data() + 12345, buffer.data(), buffer.size()));
+  EXPECT_EQ(0, http_source_read(source, body.size(), buffer.data(), 1));
+  http_source_free(source);
+}
+
+TEST(HttpSource, CachedReadsMakeNoRequests) {
+  std::vector<char> body = make_test_body(1024 * 1024);
+  LocalHttpServer server(body, false);
+  struct http_source_s* source;
+  ASSERT_EQ(0, http_source_open(&source, server.Url().c_str(), 0));
+  char buffer[4096];
+  ASSERT_EQ(4096, http_source_read(source, 1000, buffer, sizeof(buffer)));
+  size_t requests;
+  int64_t bytes;
+  http_source_get_stats(source, &requests, &bytes);
+  ASSERT_EQ(4096, http_source_read(source, 500, buffer, sizeof(buffer)));
+  size_t requests_after;
+  http_source_get_stats(source, &requests_after, &bytes);
+  EXPECT_EQ(requests, requests_after);
+  EXPECT_EQ(0, memcmp(body.data() + 500, buffer, sizeof(buffer)));
+  http_source_free(source);
+}
+
+TEST(HttpSource, ReadsAheadSequentially) {
+  std::vector<char> body = make_test_body(8 * 1024 * 1024);
+  LocalHttpServer server(body, false);
+  struct http_source_s* source;
+  ASSERT_EQ(0, http_source_open(&source, server.Url().c_str(), 0));
+  std::vector<char> buffer(64 * 1024);
+  for (size_t offset = 0; offset < body.size(); offset += buffer.size()) {
+    ASSERT_EQ((int64_t)buffer.size(),
+              http_source_read(source, offset, buffer.data(), buffer.size()));
+    ASSERT_EQ(0, memcmp(body.data() + offset, buffer.data(), buffer.size()));
+  }
+  size_t requests;
+  int64_t bytes;
+  http_source_get_stats(source, &requests, &bytes);
+  // one request per 256 KB block would be 32 plus the probe
+  EXPECT_LT(requests, 10u);
+  EXPECT_EQ((int64_t)body.size() + 1, bytes);
+  http_source_free(source);
+}
+
+TEST(HttpSource, RejectsServerWithoutRanges) {
+  std::vector<char> body = make_test_body(64 * 1024);
+  LocalHttpServer server(body, true);
+  struct http_source_s* source;
+  EXPECT_NE(0, http_source_open(&source, server.Url().c_str(), 0));
+  int64_t size;
+  EXPECT_NE(0, http_source_probe(server.Url().c_str(), &size));
+}
+
+TEST(HttpSource, KnownSizeSkipsProbe) {
+  std::vector<char> body = make_test_body(64 * 1024);
+  LocalHttpServer server(body, false);
+  int64_t size = 0;
+  ASSERT_EQ(0, http_source_probe(server.Url().c_str(), &size));
+  EXPECT_EQ((int64_t)body.size(), size);
+  int probes = server.Requests();
+  struct http_source_s* source;
+  ASSERT_EQ(0, http_source_open(&source, server.Url().c_str(), size));
+  EXPECT_EQ(probes, server.Requests());
+  EXPECT_EQ(size, http_source_get_size(source));
+  http_source_free(source);
+}
+
+struct concurrent_reader_s {
+  struct http_source_s* source;
+  const std::vector<char>* body;
+  int mismatches;
+};
+
+static void read_stripe(void* p) {
+  struct concurrent_reader_s* reader = (struct concurrent_reader_s*)p;
+  char buffer[10000];
+  for (size_t offset = 0; offset < reader->body->size();
+       offset += sizeof(buffer))
+  {
+    int64_t len = http_source_read(reader->source, offset, buffer,
+                                   sizeof(buffer));
+    if (len <= 0 ||
+        memcmp(reader->body->data() + offset, buffer, (size_t)len))
+    {
+      reader->mismatches++;
+    }
+  }
+}
+
+TEST(HttpSource, ConcurrentReadersShareCache) {
+  std::vector<char> body = make_test_body(8 * 1024 * 1024);
+  LocalHttpServer server(body, false);
+  struct http_source_s* source;
+  ASSERT_EQ(0, http_source_open(&source, server.Url().c_str(), 0));
+  // all reading the same blocks, so most wait on a block another one is
+  // fetching
+  struct concurrent_reader_s readers[4];
+  uv_thread_t threads[4];
+  for (int i = 0; i < 4; i++) {
+    readers[i] = { source, &body, 0 };
+    uv_thread_create(&threads[i], read_stripe, &readers[i]);
+  }
+  for (int i = 0; i < 4; i++) {
+    uv_thread_join(&threads[i]);
+    EXPECT_EQ(0, readers[i].mismatches);
+  }
+  size_t requests;
+  int64_t bytes;
+  http_source_get_stats(source, &requests, &bytes);
+  // every block fetched once, plus the probe
+  EXPECT_EQ((int64_t)body.size() + 1, bytes);
+  http_source_free(source);
+}
@@ -0,0 +1,101 @@
+//
+//  test_inflate_reader.cc
+//  barc
+//
+
+extern "C" {
+#include <zlib.h>
+#include "inflate_reader.h"
+}
+
+#include <string.h>
+#include <vector>
+#include "gtest/gtest.h"
+
+struct compressed_s {
+  std::vector<unsigned char> bytes;
+  int64_t bytes_read;
+};
+
+static int64_t read_compressed(void* opaque, int64_t offset, void* buf,
+                               size_t size)
+{
+  struct compressed_s* compressed = (struct compressed_s*)opaque;
+  int64_t left = compressed->bytes.size() - offset;
+  int64_t len = left < (int64_t)size ? left : size;
+  memcpy(buf, compressed->bytes.data() + offset, len);
+  compressed->bytes_read += len;
+  return len;
+}
+
+class InflateReader : public ::testing::Test {
+protected:
+  void SetUp() override {
+    // compressible, but never repeating: text-like runs of a counter
+    for (int i = 0; plain.size() < 6 * INFLATE_READER_SPAN; i++) {
+      char line[64];
+      int len = snprintf(line, sizeof(line), "frame %d pts %d\n", i, i * 33);
+      plain.insert(plain.end(), line, line + len);
+    }
+    z_stream stream = { 0 };
+    ASSERT_EQ(Z_OK, deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                                 -15, 8, Z_DEFAULT_STRATEGY));
+    compressed.bytes.resize(deflateBound(&stream, plain.size()));
+    stream.next_in = plain.data();
+    stream.avail_in = plain.size();
+    stream.next_out = compressed.bytes.data();
+    stream.avail_out = compressed.bytes.size();
+    ASSERT_EQ(Z_STREAM_END, deflate(&stream, Z_FINISH));
+    compressed.bytes.resize(stream.total_out);
+    deflateEnd(&stream);
+    compressed.bytes_read = 0;
+    ASSERT_EQ(0, inflate_reader_alloc(&reader, read_compressed, &compressed,
+                                      compressed.bytes.size(), plain.size()));
+  }
+
+  void TearDown() override {
+    inflate_reader_free(reader);
+  }
+
+  void expect_read_at(int64_t offset, size_t size) {
+    std::vector<unsigned char> buf(size);
+    ASSERT_EQ(0, inflate_reader_seek(reader, offset));
+    ASSERT_EQ((int64_t)size, inflate_reader_read(reader, buf.data(), size));
+    EXPECT_EQ(0, memcmp(plain.data() + offset, buf.data(), size))
+    << "at " << offset;
+  }
+
+  std::vector<unsigned char> plain;
+  struct compressed_s compressed;
+  struct inflate_reader_s* reader;
+};
+
+TEST_F(InflateReader, ReadsWholeStream) {
+  std::vector<unsigned char> buf(plain.size() + 100);
+  int64_t total = 0;
+  int64_t len;
+  while ((len = inflate_reader_read(reader, buf.data() + total, 4000)) > 0) {
+    total += len;
+  }
+  ASSERT_EQ((int64_t)plain.size(), total);
+  EXPECT_EQ(0, memcmp(plain.data(), buf.data(), plain.size()));
+  // about one access point per span
+  EXPECT_GE(inflate_reader_get_point_count(reader), 5u);
+}
+
+TEST_F(InflateReader, SeeksBackFromNearestPoint) {
+  // like a demuxer reading the index at the end, then going back
+  expect_read_at(plain.size() - 1000, 1000);
+  int64_t read_to_end = compressed.bytes_read;
+  compressed.bytes_read = 0;
+  expect_read_at(plain.size() - 2 * INFLATE_READER_SPAN, 5000);
+  EXPECT_LT(compressed.bytes_read, read_to_end / 2);
+  expect_read_at(0, 5000);
+  expect_read_at(3 * INFLATE_READER_SPAN + 17, 70000);
+  expect_read_at(INFLATE_READER_SPAN / 2, 100);
+}
+
+TEST_F(InflateReader, RejectsSeekPastEnd) {
+  EXPECT_NE(0, inflate_reader_seek(reader, plain.size() + 1));
+  expect_read_at(plain.size(), 0);
+}
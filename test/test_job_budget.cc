@@ -0,0 +1,70 @@
+//
+//  test_job_budget.cc
+//  barc
+//
+
+extern "C" {
+#include "job_budget.h"
+}
+
+#include "gtest/gtest.h"
+
+TEST(JobBudget, BiggerOutputsCostMore) {
+  struct archive_config_s config = { 0 };
+  struct job_cost_s small, large;
+  config.width = 640;
+  config.height = 480;
+  job_budget_estimate(&config, &small);
+  config.width = 1920;
+  config.height = 1080;
+  job_budget_estimate(&config, &large);
+  EXPECT_GT(large.memory, small.memory);
+  EXPECT_EQ(small.cpu, large.cpu);
+}
+
+TEST(JobBudget, ParallelSegmentsMultiplyCost) {
+  struct archive_config_s config = { 0 };
+  struct job_cost_s serial, parallel;
+  config.width = 640;
+  config.height = 480;
+  job_budget_estimate(&config, &serial);
+  config.parallel_segments = 4;
+  job_budget_estimate(&config, &parallel);
+  EXPECT_DOUBLE_EQ(serial.cpu * 4, parallel.cpu);
+  EXPECT_EQ(serial.memory * 4, parallel.memory);
+}
+
+TEST(JobBudget, AdmitsUntilFull) {
+  struct job_budget_s budget = { 0 };
+  budget.cpu = 4;
+  budget.memory = 1000;
+  struct job_cost_s cost = { 2, 400 };
+  ASSERT_TRUE(job_budget_admits(&budget, &cost));
+  job_budget_acquire(&budget, &cost);
+  ASSERT_TRUE(job_budget_admits(&budget, &cost));
+  job_budget_acquire(&budget, &cost);
+  EXPECT_FALSE(job_budget_admits(&budget, &cost));
+  job_budget_release(&budget, &cost);
+  EXPECT_TRUE(job_budget_admits(&budget, &cost));
+  EXPECT_EQ(1, budget.running);
+}
+
+TEST(JobBudget, MemoryLimitsIndependently) {
+  struct job_budget_s budget = { 0 };
+  budget.memory = 1000;
+  struct job_cost_s cost = { 1, 600 };
+  job_budget_acquire(&budget, &cost);
+  // no cpu limit, but memory is short
+  EXPECT_FALSE(job_budget_admits(&budget, &cost));
+}
+
+TEST(JobBudget, OversizedJobRunsAlone) {
+  struct job_budget_s budget = { 0 };
+  budget.cpu = 1;
+  budget.memory = 100;
+  struct job_cost_s cost = { 8, 1000 };
+  EXPECT_TRUE(job_budget_admits(&budget, &cost));
+  job_budget_acquire(&budget, &cost);
+  struct job_cost_s small = { 0.1, 1 };
+  EXPECT_FALSE(job_budget_admits(&budget, &small));
+}
@@ -0,0 +1,113 @@
+//
+//  test_log.cc
+//  barc
+//
+
+extern "C" {
+#include <jansson.h>
+#include <uv.h>
+#include "log.h"
+}
+
+#include "gtest/gtest.h"
+
+#define TEST_PROGRESS_PATH "/tmp/test_progress.json"
+
+TEST(Log, ConfigureLevels) {
+  EXPECT_TRUE(log_enabled(log_module_writer, log_level_info));
+  EXPECT_FALSE(log_enabled(log_module_writer, log_level_debug));
+  ASSERT_EQ(0, log_configure("warn,source=debug"));
+  EXPECT_FALSE(log_enabled(log_module_writer, log_level_info));
+  EXPECT_TRUE(log_enabled(log_module_writer, log_level_warn));
+  EXPECT_TRUE(log_enabled(log_module_source, log_level_debug));
+  ASSERT_EQ(0, log_configure("off"));
+  EXPECT_FALSE(log_enabled(log_module_barc, log_level_error));
+  EXPECT_NE(0, log_configure("loud"));
+  EXPECT_NE(0, log_configure("encoder=debug"));
+  ASSERT_EQ(0, log_configure("info"));
+}
+
+TEST(Log, RateLimitHoldsBackBursts) {
+  struct log_rate_limit_s limit = { 0 };
+  uint64_t second = 1000000000;
+  uint64_t now = 100 * second;
+  for (int i = 0; i < LOG_RATE_LIMIT_BURST; i++) {
+    EXPECT_EQ(0, log_rate_limit_take(&limit, now));
+  }
+  EXPECT_EQ(-1, log_rate_limit_take(&limit, now));
+  EXPECT_EQ(-1, log_rate_limit_take(&limit, now + second));
+  // the first message of the next window says what was missed
+  now += LOG_RATE_LIMIT_INTERVAL * second;
+  EXPECT_EQ(2, log_rate_limit_take(&limit, now));
+  EXPECT_EQ(0, log_rate_limit_take(&limit, now));
+}
+
+#define TEST_RATE_LIMIT_THREADS 8
+#define TEST_RATE_LIMIT_TAKES 10000
+
+struct rate_limit_worker_s {
+  struct log_rate_limit_s* limit;
+  uint64_t now;
+  int sent;
+};
+
+static void take_rate_limit(void* p) {
+  struct rate_limit_worker_s* worker = (struct rate_limit_worker_s*)p;
+  for (int i = 0; i < TEST_RATE_LIMIT_TAKES; i++) {
+    if (log_rate_limit_take(worker->limit, worker->now) >= 0) {
+      worker->sent++;
+    }
+  }
+}
+
+TEST(Log, RateLimitSharedByThreads) {
+  struct log_rate_limit_s limit = { 0 };
+  uint64_t second = 1000000000;
+  struct rate_limit_worker_s workers[TEST_RATE_LIMIT_THREADS];
+  uv_thread_t threads[TEST_RATE_LIMIT_THREADS];
+  for (int i = 0; i < TEST_RATE_LIMIT_THREADS; i++) {
+    workers[i] = { &limit, 100 * second, 0 };
+    uv_thread_create(&threads[i], take_rate_limit, &workers[i]);
+  }
+  int sent = 0;
+  for (int i = 0; i < TEST_RATE_LIMIT_THREADS; i++) {
+    uv_thread_join(&threads[i]);
+    sent += workers[i].sent;
+  }
+  EXPECT_EQ(LOG_RATE_LIMIT_BURST, sent);
+  // nothing held back goes uncounted
+  uint64_t later = (100 + LOG_RATE_LIMIT_INTERVAL) * second;
+  EXPECT_EQ(TEST_RATE_LIMIT_THREADS * TEST_RATE_LIMIT_TAKES -
+            LOG_RATE_LIMIT_BURST, log_rate_limit_take(&limit, later));
+}
+
+TEST(Log, ProgressGoesToItsOwnFile) {
+  ASSERT_EQ(0, log_progress_open(TEST_PROGRESS_PATH));
+  log_progress(0, 60);
+  // too soon after the first one
+  log_progress(1, 60);
+  log_progress(60, 60);
+  log_progress_close();
+
+  FILE* file = fopen(TEST_PROGRESS_PATH, "r");
+  ASSERT_TRUE(NULL != file);
+  char line[256];
+  int count = 0;
+  json_t* last = NULL;
+  while (fgets(line, sizeof(line), file)) {
+    json_error_t error;
+    json_decref(last);
+    last = json_loads(line, 0, &error);
+    ASSERT_TRUE(NULL != last) << line;
+    count++;
+  }
+  fclose(file);
+  EXPECT_EQ(2, count);
+  json_t* progress = json_object_get(last, "progress");
+  EXPECT_DOUBLE_EQ(60000, json_number_value(json_object_get(progress,
+                                                            "complete")));
+  EXPECT_DOUBLE_EQ(60000, json_number_value(json_object_get(progress,
+                                                            "total")));
+  EXPECT_TRUE(json_is_number(json_object_get(progress, "elapsed")));
+  json_decref(last);
+}
@@ -79,3 +79,21 @@ TEST(ManifestParser, LoadManifestInvalidPath) {
   EXPECT_TRUE(ret != 0);
   archive_manifest_free(manifest);
 }
+
+TEST(ManifestParser, LoadManifestFromBuffer) {
+  FILE* file = fopen("/tmp/test_manifest.json", "r");
+  ASSERT_TRUE(file != NULL);
+  char buffer[64 * 1024];
+  size_t size = fread(buffer, 1, sizeof(buffer), file);
+  fclose(file);
+  ASSERT_GT(size, 0);
+
+  struct archive_manifest_s* manifest = NULL;
+  archive_manifest_alloc(&manifest);
+  int ret = archive_manifest_parse_buffer(manifest, buffer, size);
+  EXPECT_TRUE(0 == ret);
+  EXPECT_FALSE(strcmp(TEST_ARCHIVE_ID, archive_manifest_get_id(manifest)));
+  ret = archive_manifest_files_walk(manifest, files_walk, manifest);
+  EXPECT_TRUE(NUM_TEST_FILES == ret);
+  archive_manifest_free(manifest);
+}
@@ -0,0 +1,65 @@
+//
+//  test_memory_governor.cc
+//  barc
+//
+
+extern "C" {
+#include "memory_governor.h"
+}
+
+#include "gtest/gtest.h"
+
+// the governor is process wide: whatever a test charges or limits, even when
+// it fails halfway, is undone before the next one
+class MemoryGovernor : public ::testing::Test {
+protected:
+  void SetUp() override {
+    limit_ = memory_governor_get_limit();
+    used_ = memory_governor_used();
+  }
+
+  void TearDown() override {
+    size_t used = memory_governor_used();
+    if (used > used_) {
+      memory_governor_discharge(used - used_);
+    } else if (used < used_) {
+      memory_governor_charge(used_ - used);
+    }
+    memory_governor_set_limit(limit_);
+  }
+
+  size_t limit_;
+  size_t used_;
+};
+
+TEST_F(MemoryGovernor, UnlimitedKeepsDepth) {
+  memory_governor_set_limit(0);
+  memory_governor_charge(1 << 30);
+  EXPECT_EQ(64, memory_governor_scale(64, 1));
+  EXPECT_FALSE(memory_governor_under_pressure());
+  memory_governor_discharge(1 << 30);
+  EXPECT_EQ(0, memory_governor_used());
+}
+
+TEST_F(MemoryGovernor, ShrinksTowardsLimit) {
+  memory_governor_set_limit(1000);
+  memory_governor_charge(400);
+  EXPECT_EQ(64, memory_governor_scale(64, 1));
+  memory_governor_charge(350);
+  // a quarter of the limit left: half of the upper half
+  EXPECT_EQ(32, memory_governor_scale(64, 1));
+  EXPECT_FALSE(memory_governor_under_pressure());
+  memory_governor_charge(250);
+  EXPECT_EQ(1, memory_governor_scale(64, 1));
+  EXPECT_TRUE(memory_governor_under_pressure());
+  memory_governor_discharge(1000);
+  EXPECT_EQ(64, memory_governor_scale(64, 1));
+}
+
+TEST_F(MemoryGovernor, TracksPeak) {
+  size_t base = memory_governor_peak();
+  memory_governor_charge(base + 5000);
+  memory_governor_discharge(base + 5000);
+  EXPECT_EQ(base + 5000, memory_governor_peak());
+  EXPECT_EQ(0, memory_governor_used());
+}
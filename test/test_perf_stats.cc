@@ -0,0 +1,100 @@
+//
+//  test_perf_stats.cc
+//  barc
+//
+
+extern "C" {
+#include <jansson.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "perf_stats.h"
+}
+
+#include <string>
+#include "gtest/gtest.h"
+
+// stats are process wide: every test starts enabled with nothing recorded,
+// and leaves them disabled again
+class PerfStats : public ::testing::Test {
+protected:
+  void SetUp() override {
+    perf_stats_enable();
+    perf_stats_reset();
+  }
+
+  void TearDown() override {
+    perf_stats_enabled = 0;
+  }
+};
+
+TEST_F(PerfStats, DisabledReadsNoClock) {
+  perf_stats_enabled = 0;
+  EXPECT_EQ(0u, perf_stats_start());
+  perf_stats_end(perf_encode, perf_stats_start());
+  double mean, p50, p99, max;
+  EXPECT_EQ(0u, perf_stats_summary(perf_encode, &mean, &p50, &p99, &max));
+  EXPECT_EQ(-1, perf_stats_add_source("a.webm"));
+}
+
+TEST_F(PerfStats, PercentilesWithinABucket) {
+  // 1..1000 microseconds
+  for (uint64_t i = 1; i <= 1000; i++) {
+    perf_stats_record(perf_compose_frame, i * 1000);
+  }
+  double mean, p50, p99, max;
+  EXPECT_EQ(1000u, perf_stats_summary(perf_compose_frame,
+                                      &mean, &p50, &p99, &max));
+  EXPECT_NEAR(500500, mean, 1);
+  EXPECT_NEAR(500000, p50, 500000 * 0.125);
+  EXPECT_NEAR(990000, p99, 990000 * 0.125);
+  EXPECT_EQ(1000000, max);
+}
+
+TEST_F(PerfStats, SourcesSharedByName) {
+  int source = perf_stats_add_source("a.webm");
+  EXPECT_EQ(0, source);
+  EXPECT_EQ(1, perf_stats_add_source("b.webm"));
+  EXPECT_EQ(source, perf_stats_add_source("a.webm"));
+  // reopened far more often than there is room for
+  for (int i = 0; i < PERF_STATS_MAX_SOURCES * 2; i++) {
+    EXPECT_EQ(1, perf_stats_add_source("b.webm"));
+  }
+  perf_stats_reset_sources();
+  EXPECT_EQ(0, perf_stats_add_source("b.webm"));
+}
+
+TEST_F(PerfStats, WritesReport) {
+  char dir[] = "/tmp/test_perf_stats.XXXXXX";
+  ASSERT_TRUE(mkdtemp(dir) != NULL);
+  std::string path = std::string(dir) + "/report.json";
+  int source = perf_stats_add_source("a.webm");
+  EXPECT_EQ(0, source);
+  perf_stats_end_source(source, perf_stats_start());
+  for (int i = 0; i < 30; i++) {
+    perf_stats_record(perf_frame_latency, 5000000);
+  }
+  perf_stats_record(perf_queue_fill, 50);
+  perf_stats_add_media_time(1);
+  ASSERT_EQ(0, perf_stats_write_report(path.c_str()));
+
+  json_error_t error;
+  json_t* report = json_load_file(path.c_str(), 0, &error);
+  unlink(path.c_str());
+  rmdir(dir);
+  ASSERT_TRUE(report != NULL);
+  EXPECT_EQ(30, json_integer_value(json_object_get(report, "frames")));
+  EXPECT_DOUBLE_EQ(1, json_real_value(json_object_get(report,
+                                                      "media_seconds")));
+  EXPECT_GT(json_real_value(json_object_get(report, "peak_rss_mb")), 0);
+  json_t* stages = json_object_get(report, "stages");
+  json_t* latency = json_object_get(stages, "frame_latency");
+  EXPECT_NEAR(5, json_real_value(json_object_get(latency, "p50")), 0.5);
+  json_t* fill = json_object_get(stages, "queue_fill");
+  EXPECT_NEAR(50, json_real_value(json_object_get(fill, "max")), 0.01);
+  json_t* decode = json_object_get(json_object_get(report, "decode_sources"),
+                                   "a.webm");
+  EXPECT_EQ(1, json_integer_value(json_object_get(decode, "count")));
+  EXPECT_EQ(1, json_integer_value(json_object_get(
+      json_object_get(stages, "decode"), "count")));
+  json_decref(report);
+}
@@ -0,0 +1,48 @@
+//
+//  test_segment_plan.cc
+//  barc
+//
+
+extern "C" {
+#include <math.h>
+#include "segment_plan.h"
+}
+
+#include "gtest/gtest.h"
+
+// 30fps video against 1024-sample AAC frames at 48kHz lines up every 8/15 s
+TEST(SegmentPlan, GridAlignsAudioAndVideo) {
+  double grid = segment_plan_grid(30, 1024, 48000);
+  EXPECT_NEAR(8.0 / 15.0, grid, 1e-9);
+  double video_frames = grid * 30;
+  double audio_frames = grid * 48000 / 1024;
+  EXPECT_NEAR(round(video_frames), video_frames, 1e-9);
+  EXPECT_NEAR(round(audio_frames), audio_frames, 1e-9);
+}
+
+TEST(SegmentPlan, SplitCoversTimelineOnGrid) {
+  struct segment_s segments[4];
+  double grid = segment_plan_grid(30, 1024, 48000);
+  int count = segment_plan_split(100, 4, grid, segments);
+  EXPECT_EQ(4, count);
+  EXPECT_EQ(0, segments[0].begin);
+  EXPECT_EQ(100, segments[count - 1].end);
+  for (int i = 1; i < count; i++) {
+    EXPECT_EQ(segments[i - 1].end, segments[i].begin);
+    double steps = segments[i].begin / grid;
+    EXPECT_NEAR(round(steps), steps, 1e-6);
+  }
+}
+
+TEST(SegmentPlan, ShortTimelineUsesFewerSegments) {
+  struct segment_s segments[8];
+  int count = segment_plan_split(1, 8, 8.0 / 15.0, segments);
+  EXPECT_GT(count, 0);
+  EXPECT_LT(count, 8);
+  EXPECT_EQ(1, segments[count - 1].end);
+}
+
+TEST(SegmentPlan, EmptyTimeline) {
+  struct segment_s segments[2];
+  EXPECT_EQ(0, segment_plan_split(0, 2, 1, segments));
+}
@@ -0,0 +1,91 @@
+//
+//  test_segment_render.cc
+//  barc
+//
+
+extern "C" {
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <libavformat/avformat.h>
+#include "synthetic_archive.h"
+}
+
+#include <string>
+#include <vector>
+#include "gtest/gtest.h"
+
+class SegmentRender : public ::testing::Test {
+protected:
+  void SetUp() override {
+    char dir[] = "/tmp/test_segment_render.XXXXXX";
+    ASSERT_TRUE(mkdtemp(dir) != NULL);
+    dir_ = dir;
+  }
+
+  void TearDown() override {
+    std::string command = "rm -rf " + dir_;
+    EXPECT_EQ(0, system(command.c_str()));
+  }
+
+  int Barc(const std::string& args) {
+    std::string command = std::string(BARC_BINARY) + " " + args +
+    " > /dev/null";
+    return system(command.c_str());
+  }
+
+  std::string dir_;
+};
+
+/* Renders each piece of a split with its own barc --segment i/N process, the
+ * way a job queue would, then joins them with --stitch. The result must be
+ * as long as the timeline, with timestamps that only go forward.
+ */
+TEST_F(SegmentRender, StitchesSeparateSegmentRuns) {
+  av_register_all();
+  struct synthetic_archive_config_s config;
+  synthetic_archive_config_default(&config);
+  config.stream_count = 2;
+  config.duration = 6;
+  config.layout_interval = 0;
+  std::string archive = dir_ + "/archive";
+  ASSERT_EQ(0, mkdir(archive.c_str(), 0755));
+  int ret = synthetic_archive_write(&config, archive.c_str());
+  if (AVERROR_ENCODER_NOT_FOUND == ret) {
+    printf("Skipping: FFmpeg has no VP8 or Opus encoder\n");
+    return;
+  }
+  ASSERT_EQ(0, ret);
+
+  const int count = 3;
+  std::string pieces;
+  for (int i = count - 1; i >= 0; i--) {
+    std::string piece = dir_ + "/piece" + std::to_string(i) + ".mp4";
+    ASSERT_EQ(0, Barc("-i " + archive + " -o " + piece + " -w 320 -h 240 " +
+                      "--segment " + std::to_string(i) + "/" +
+                      std::to_string(count)));
+    pieces += " " + piece;
+  }
+  std::string output = dir_ + "/stitched.mp4";
+  // all but the first piece is not enough
+  EXPECT_NE(0, Barc("--stitch -o " + output + " " + dir_ + "/piece1.mp4 " +
+                    dir_ + "/piece2.mp4"));
+  ASSERT_EQ(0, Barc("--stitch -o " + output + pieces));
+
+  AVFormatContext* context = NULL;
+  ASSERT_EQ(0, avformat_open_input(&context, output.c_str(), NULL, NULL));
+  ASSERT_LE(0, avformat_find_stream_info(context, NULL));
+  EXPECT_NEAR(config.duration, (double)context->duration / AV_TIME_BASE, 0.5);
+  std::vector<int64_t> last_dts(context->nb_streams, AV_NOPTS_VALUE);
+  AVPacket packet;
+  int backwards = 0;
+  while (!av_read_frame(context, &packet)) {
+    int64_t& last = last_dts[packet.stream_index];
+    if (AV_NOPTS_VALUE != last && packet.dts <= last) {
+      backwards++;
+    }
+    last = packet.dts;
+    av_packet_unref(&packet);
+  }
+  EXPECT_EQ(0, backwards);
+  avformat_close_input(&context);
+}
@@ -0,0 +1,117 @@
+//
+//  test_segment_sidecar.cc
+//  barc
+//
+
+extern "C" {
+#include <stdio.h>
+#include <string.h>
+#include "segment_stitcher.h"
+}
+
+#include "gtest/gtest.h"
+
+#define TEST_MEDIA_PATH "/tmp/test_segment_sidecar.mp4"
+
+TEST(SegmentSidecar, RoundTrip) {
+  struct segment_sidecar_s sidecar = { 0 };
+  sidecar.index = 2;
+  sidecar.count = 4;
+  sidecar.begin = 50.133333333;
+  sidecar.end = 75.2;
+  sidecar.audio_preroll_frames = 1;
+  sidecar.audio_preroll = 1024.0 / 48000;
+  EXPECT_EQ(0, segment_sidecar_write(TEST_MEDIA_PATH, &sidecar));
+
+  struct segment_sidecar_s parsed;
+  EXPECT_EQ(0, segment_sidecar_read(TEST_MEDIA_PATH, &parsed));
+  EXPECT_EQ(sidecar.index, parsed.index);
+  EXPECT_EQ(sidecar.count, parsed.count);
+  EXPECT_DOUBLE_EQ(sidecar.begin, parsed.begin);
+  EXPECT_DOUBLE_EQ(sidecar.end, parsed.end);
+  EXPECT_EQ(sidecar.audio_preroll_frames, parsed.audio_preroll_frames);
+  EXPECT_DOUBLE_EQ(sidecar.audio_preroll, parsed.audio_preroll);
+  EXPECT_EQ(0, parsed.empty);
+  remove(TEST_MEDIA_PATH ".segment");
+}
+
+TEST(SegmentSidecar, EmptySegment) {
+  struct segment_sidecar_s sidecar = { 0 };
+  sidecar.index = 3;
+  sidecar.count = 2;
+  sidecar.empty = 1;
+  EXPECT_EQ(0, segment_sidecar_write(TEST_MEDIA_PATH, &sidecar));
+
+  struct segment_sidecar_s parsed;
+  EXPECT_EQ(0, segment_sidecar_read(TEST_MEDIA_PATH, &parsed));
+  EXPECT_EQ(1, parsed.empty);
+  remove(TEST_MEDIA_PATH ".segment");
+}
+
+TEST(SegmentSidecar, MissingSidecar) {
+  struct segment_sidecar_s parsed;
+  EXPECT_NE(0, segment_sidecar_read("/tmp/no_such_segment.mp4", &parsed));
+}
+
+class SegmentSidecarOrder : public ::testing::Test {
+protected:
+  // a split of [0, 30) into three pieces, given out of order
+  void SetUp() override {
+    const double bounds[][2] = { { 20, 30 }, { 0, 10 }, { 10, 20 } };
+    for (int i = 0; i < 3; i++) {
+      memset(&sidecars_[i], 0, sizeof(sidecars_[i]));
+      sidecars_[i].index = (i + 2) % 3;
+      sidecars_[i].count = 3;
+      sidecars_[i].begin = bounds[i][0];
+      sidecars_[i].end = bounds[i][1];
+      sidecars_[i].audio_preroll_frames = sidecars_[i].index > 0;
+    }
+  }
+
+  int Order(int count) {
+    return segment_sidecar_order(paths_, sidecars_, count, segments_);
+  }
+
+  const char* paths_[4] = { "c.mp4", "a.mp4", "b.mp4", "d.mp4" };
+  struct segment_sidecar_s sidecars_[4];
+  struct stitch_segment_s segments_[4];
+};
+
+TEST_F(SegmentSidecarOrder, OrdersByIndex) {
+  ASSERT_EQ(3, Order(3));
+  EXPECT_STREQ("a.mp4", segments_[0].path);
+  EXPECT_STREQ("b.mp4", segments_[1].path);
+  EXPECT_STREQ("c.mp4", segments_[2].path);
+  EXPECT_DOUBLE_EQ(10, segments_[1].begin);
+  EXPECT_EQ(0, segments_[0].drop_leading_audio);
+  EXPECT_EQ(1, segments_[2].drop_leading_audio);
+}
+
+TEST_F(SegmentSidecarOrder, SkipsEmptyPieces) {
+  memset(&sidecars_[3], 0, sizeof(sidecars_[3]));
+  sidecars_[3].index = 3;
+  sidecars_[3].count = 3;
+  sidecars_[3].begin = 30;
+  sidecars_[3].end = 30;
+  sidecars_[3].empty = 1;
+  EXPECT_EQ(3, Order(4));
+}
+
+TEST_F(SegmentSidecarOrder, RejectsMissingSegment) {
+  EXPECT_EQ(-1, Order(2));
+}
+
+TEST_F(SegmentSidecarOrder, RejectsDuplicateSegment) {
+  sidecars_[3] = sidecars_[1];
+  EXPECT_EQ(-1, Order(4));
+}
+
+TEST_F(SegmentSidecarOrder, RejectsGap) {
+  sidecars_[2].end = 19.5;
+  EXPECT_EQ(-1, Order(3));
+}
+
+TEST_F(SegmentSidecarOrder, RejectsOtherSplit) {
+  sidecars_[1].count = 4;
+  EXPECT_EQ(-1, Order(3));
+}
@@ -6,6 +6,7 @@
 //
 
 extern "C" {
+#include <stdlib.h>
 #include "smart_avframe.h"
 }
 
@@ -22,3 +23,46 @@ TEST(SmartFrame, AllocSmartFrame) {
     EXPECT_TRUE(another_frame == frame);
     smart_frame_release(smart_frame);
 }
+
+static int freed_attachments = 0;
+static void count_free(void* data) {
+    freed_attachments++;
+    free(data);
+}
+
+TEST(SmartFrame, Attachments) {
+    freed_attachments = 0;
+    struct smart_frame_t* smart_frame;
+    smart_frame_create(&smart_frame, av_frame_alloc());
+    int key = 1;
+    EXPECT_TRUE(NULL == smart_frame_get_attachment(smart_frame,
+                                                   &key, sizeof(key)));
+    void* data = malloc(16);
+    EXPECT_EQ(data, smart_frame_set_attachment(smart_frame, &key, sizeof(key),
+                                               data, count_free));
+    EXPECT_EQ(data, smart_frame_get_attachment(smart_frame,
+                                               &key, sizeof(key)));
+    int other_key = 2;
+    EXPECT_TRUE(NULL == smart_frame_get_attachment(smart_frame, &other_key,
+                                                   sizeof(other_key)));
+    smart_frame_release(smart_frame);
+    EXPECT_EQ(1, freed_attachments);
+}
+
+TEST(SmartFrame, DuplicateAttachmentKeepsFirst) {
+    freed_attachments = 0;
+    struct smart_frame_t* smart_frame;
+    smart_frame_create(&smart_frame, av_frame_alloc());
+    int key = 1;
+    void* first = malloc(16);
+    void* second = malloc(16);
+    smart_frame_set_attachment(smart_frame, &key, sizeof(key),
+                               first, count_free);
+    EXPECT_EQ(first, smart_frame_set_attachment(smart_frame, &key,
+                                                sizeof(key), second,
+                                                count_free));
+    // the loser is released right away
+    EXPECT_EQ(1, freed_attachments);
+    smart_frame_release(smart_frame);
+    EXPECT_EQ(2, freed_attachments);
+}
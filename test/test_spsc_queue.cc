@@ -0,0 +1,119 @@
+//
+//  test_spsc_queue.cc
+//  barc
+//
+
+extern "C" {
+#include <uv.h>
+#include "spsc_queue.h"
+}
+
+#include "gtest/gtest.h"
+
+TEST(SpscQueue, AllocQueue) {
+  struct spsc_queue_s* queue = NULL;
+  int ret = spsc_queue_alloc(&queue, 4);
+  EXPECT_TRUE(0 == ret);
+  EXPECT_TRUE(NULL != queue);
+  EXPECT_TRUE(0 == spsc_queue_size(queue));
+  EXPECT_TRUE(4 == spsc_queue_capacity(queue));
+  spsc_queue_free(queue);
+}
+
+TEST(SpscQueue, TryPushFullTryPopEmpty) {
+  struct spsc_queue_s* queue = NULL;
+  spsc_queue_alloc(&queue, 2);
+  int a = 1, b = 2, c = 3;
+  EXPECT_TRUE(0 == spsc_queue_try_push(queue, &a));
+  EXPECT_TRUE(0 == spsc_queue_try_push(queue, &b));
+  EXPECT_TRUE(1 == spsc_queue_try_push(queue, &c));
+  EXPECT_TRUE(2 == spsc_queue_size(queue));
+  void* item = NULL;
+  EXPECT_TRUE(0 == spsc_queue_try_pop(queue, &item));
+  EXPECT_TRUE(&a == item);
+  EXPECT_TRUE(0 == spsc_queue_try_pop(queue, &item));
+  EXPECT_TRUE(&b == item);
+  EXPECT_TRUE(1 == spsc_queue_try_pop(queue, &item));
+  spsc_queue_free(queue);
+}
+
+#define NUM_HANDOFF_ITEMS 100000
+
+static void producer(void* p) {
+  struct spsc_queue_s* queue = (struct spsc_queue_s*)p;
+  for (intptr_t i = 1; i <= NUM_HANDOFF_ITEMS; i++) {
+    spsc_queue_push(queue, (void*)i);
+  }
+}
+
+// items must arrive in order, and none may be lost across the wraparound
+TEST(SpscQueue, ThreadedHandoffPreservesOrder) {
+  struct spsc_queue_s* queue = NULL;
+  spsc_queue_alloc(&queue, 8);
+  uv_thread_t thread;
+  uv_thread_create(&thread, producer, queue);
+  intptr_t expected = 1;
+  char in_order = 1;
+  while (expected <= NUM_HANDOFF_ITEMS) {
+    intptr_t item = (intptr_t)spsc_queue_pop(queue);
+    if (item != expected) {
+      in_order = 0;
+    }
+    expected++;
+  }
+  uv_thread_join(&thread);
+  EXPECT_TRUE(in_order);
+  EXPECT_TRUE(0 == spsc_queue_size(queue));
+  spsc_queue_free(queue);
+}
+
+struct sized_producer_s {
+  struct spsc_queue_s* queue;
+  size_t max_seen;
+};
+
+static void sized_producer(void* p) {
+  struct sized_producer_s* producer = (struct sized_producer_s*)p;
+  for (intptr_t i = 1; i <= 1000; i++) {
+    spsc_queue_push_sized(producer->queue, (void*)i, 300);
+    size_t bytes = spsc_queue_bytes(producer->queue);
+    if (bytes > producer->max_seen) {
+      producer->max_seen = bytes;
+    }
+  }
+}
+
+// the producer must stall on bytes long before it runs out of slots
+TEST(SpscQueue, ByteLimitAppliesBackpressure) {
+  struct sized_producer_s producer = { NULL, 0 };
+  spsc_queue_alloc(&producer.queue, 64);
+  spsc_queue_set_max_bytes(producer.queue, 1000);
+  uv_thread_t thread;
+  uv_thread_create(&thread, sized_producer, &producer);
+  intptr_t expected = 1;
+  char in_order = 1;
+  while (expected <= 1000) {
+    if ((intptr_t)spsc_queue_pop(producer.queue) != expected) {
+      in_order = 0;
+    }
+    expected++;
+  }
+  uv_thread_join(&thread);
+  EXPECT_TRUE(in_order);
+  EXPECT_LE(producer.max_seen, 1000);
+  EXPECT_EQ(0, spsc_queue_bytes(producer.queue));
+  spsc_queue_free(producer.queue);
+}
+
+// one oversized item may not wedge the queue forever
+TEST(SpscQueue, OversizedItemPassesWhenEmpty) {
+  struct spsc_queue_s* queue = NULL;
+  spsc_queue_alloc(&queue, 4);
+  spsc_queue_set_max_bytes(queue, 10);
+  int a = 1;
+  spsc_queue_push_sized(queue, &a, 100);
+  EXPECT_EQ(100, spsc_queue_bytes(queue));
+  EXPECT_TRUE(&a == spsc_queue_pop(queue));
+  EXPECT_EQ(0, spsc_queue_bytes(queue));
+  spsc_queue_free(queue);
+}
@@ -0,0 +1,132 @@
+//
+//  test_timeline.cc
+//  barc
+//
+
+extern "C" {
+#include <stdlib.h>
+#include "timeline.h"
+}
+
+#include <set>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+struct edge_log_s {
+  std::vector<std::pair<long, enum timeline_edge>> edges;
+  std::set<long> active;
+};
+
+static void record_edge(void* p, void* item, enum timeline_edge edge) {
+  struct edge_log_s* log = (struct edge_log_s*)p;
+  long id = (long)item;
+  log->edges.push_back(std::make_pair(id, edge));
+  if (timeline_enter == edge) {
+    log->active.insert(id);
+  } else {
+    log->active.erase(id);
+  }
+}
+
+TEST(Timeline, SpansAreHalfOpen) {
+  struct timeline_s* timeline;
+  struct edge_log_s log;
+  timeline_alloc(&timeline, 1);
+  timeline_add_span(timeline, 1, 2, (void*)1);
+  EXPECT_EQ(0, timeline_advance(timeline, 0.5, record_edge, &log));
+  EXPECT_EQ(1, timeline_advance(timeline, 1, record_edge, &log));
+  EXPECT_EQ(1u, log.active.count(1));
+  EXPECT_EQ(0, timeline_advance(timeline, 1.99, record_edge, &log));
+  EXPECT_EQ(1, timeline_advance(timeline, 2, record_edge, &log));
+  EXPECT_TRUE(log.active.empty());
+  EXPECT_EQ(0u, timeline_remaining(timeline));
+  timeline_free(timeline);
+}
+
+TEST(Timeline, FiresInTimeOrderRegardlessOfInsertion) {
+  struct timeline_s* timeline;
+  struct edge_log_s log;
+  timeline_alloc(&timeline, 1);
+  timeline_add_span(timeline, 5, 9, (void*)2);
+  timeline_add_span(timeline, 0, 3, (void*)1);
+  timeline_add_span(timeline, 3, 4, (void*)3);
+  EXPECT_EQ(6, timeline_advance(timeline, 10, record_edge, &log));
+  ASSERT_EQ(6u, log.edges.size());
+  EXPECT_EQ(1, log.edges[0].first);
+  // enters at a time go before leaves at that time
+  EXPECT_EQ(3, log.edges[1].first);
+  EXPECT_EQ(timeline_enter, log.edges[1].second);
+  EXPECT_EQ(1, log.edges[2].first);
+  EXPECT_EQ(timeline_leave, log.edges[2].second);
+  EXPECT_EQ(2, log.edges[5].first);
+  timeline_free(timeline);
+}
+
+TEST(Timeline, ShortSpanInsideOneStepEndsInactive) {
+  struct timeline_s* timeline;
+  struct edge_log_s log;
+  timeline_alloc(&timeline, 1);
+  timeline_add_span(timeline, 1.01, 1.02, (void*)1);
+  timeline_add_span(timeline, 1.5, 1.5, (void*)2);
+  timeline_advance(timeline, 2, record_edge, &log);
+  EXPECT_EQ(4u, log.edges.size());
+  EXPECT_TRUE(log.active.empty());
+  timeline_free(timeline);
+}
+
+TEST(Timeline, ExclusivePointsWaitForTimeToPass) {
+  struct timeline_s* timeline;
+  struct edge_log_s log;
+  timeline_alloc(&timeline, 0);
+  timeline_add_point(timeline, -4, (void*)1);
+  timeline_add_point(timeline, 2, (void*)2);
+  // points before the start fire on the first step
+  EXPECT_EQ(1, timeline_advance(timeline, 0, record_edge, &log));
+  EXPECT_EQ(0, timeline_advance(timeline, 2, record_edge, &log));
+  EXPECT_EQ(1, timeline_advance(timeline, 2.001, record_edge, &log));
+  timeline_free(timeline);
+}
+
+TEST(Timeline, AcceptsEntriesAfterAdvancing) {
+  struct timeline_s* timeline;
+  struct edge_log_s log;
+  timeline_alloc(&timeline, 1);
+  timeline_add_span(timeline, 0, 10, (void*)1);
+  timeline_advance(timeline, 1, record_edge, &log);
+  timeline_add_span(timeline, 2, 3, (void*)2);
+  timeline_add_point(timeline, 0.5, (void*)3);
+  // already in the past, so it fires on the next step
+  EXPECT_EQ(1, timeline_advance(timeline, 1.5, record_edge, &log));
+  EXPECT_EQ(3, log.edges.back().first);
+  EXPECT_EQ(2, timeline_advance(timeline, 3, record_edge, &log));
+  EXPECT_EQ(1u, timeline_remaining(timeline));
+  timeline_free(timeline);
+}
+
+TEST(Timeline, FindsGapsBetweenSpans) {
+  struct timeline_s* timeline;
+  struct timeline_gap_s* gaps;
+  timeline_alloc(&timeline, 1);
+  timeline_add_span(timeline, 10, 20, (void*)1);
+  timeline_add_span(timeline, 15, 30, (void*)2);
+  timeline_add_span(timeline, 30, 40, (void*)3);
+  timeline_add_span(timeline, 40.5, 50, (void*)4);
+  timeline_add_span(timeline, 60, 70, (void*)5);
+  size_t count = timeline_find_gaps(timeline, 0, 1, &gaps);
+  ASSERT_EQ(2u, count);
+  // the lead-in before anyone joined
+  EXPECT_EQ(0, gaps[0].begin);
+  EXPECT_EQ(10, gaps[0].end);
+  // touching and overlapping spans leave no gap; 40-40.5 is too short
+  EXPECT_EQ(50, gaps[1].begin);
+  EXPECT_EQ(60, gaps[1].end);
+  free(gaps);
+
+  // starting part way through a gap only reports what is left of it
+  count = timeline_find_gaps(timeline, 55, 1, &gaps);
+  ASSERT_EQ(1u, count);
+  EXPECT_EQ(55, gaps[0].begin);
+  free(gaps);
+  timeline_free(timeline);
+}
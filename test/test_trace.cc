@@ -0,0 +1,127 @@
+//
+//  test_trace.cc
+//  barc
+//
+
+extern "C" {
+#include <jansson.h>
+#include <stdlib.h>
+#include <uv.h>
+#include "trace.h"
+}
+
+#include <string.h>
+#include <set>
+#include <string>
+#include "gtest/gtest.h"
+
+// events from earlier tests (or --gtest_repeat runs) stay recorded, so each
+// test only looks at what it added itself
+class Trace : public ::testing::Test {
+protected:
+  void SetUp() override {
+    char dir[] = "/tmp/test_trace.XXXXXX";
+    ASSERT_TRUE(mkdtemp(dir) != NULL);
+    dir_ = dir;
+    trace_enable();
+  }
+
+  void TearDown() override {
+    trace_enabled = 0;
+    std::string command = "rm -rf " + dir_;
+    EXPECT_EQ(0, system(command.c_str()));
+  }
+
+  json_t* Write() {
+    std::string path = dir_ + "/trace.json";
+    if (trace_write(path.c_str())) {
+      return NULL;
+    }
+    json_error_t error;
+    json_t* trace = json_load_file(path.c_str(), 0, &error);
+    EXPECT_TRUE(trace) << error.text;
+    return trace;
+  }
+
+  std::string dir_;
+};
+
+static void compose_worker(void* p) {
+  trace_set_thread_name("compose");
+  uint64_t start = trace_begin();
+  trace_end("compose", start, "serial", *(int*)p);
+}
+
+TEST_F(Trace, DisabledRecordsNothing) {
+  json_t* before = Write();
+  ASSERT_TRUE(before);
+  trace_enabled = 0;
+  EXPECT_EQ(0u, trace_begin());
+  trace_end("tick", trace_begin(), NULL, 0);
+  trace_counter("frame_builder pending", 3);
+  json_t* after = Write();
+  ASSERT_TRUE(after);
+  EXPECT_EQ(json_array_size(json_object_get(before, "traceEvents")),
+            json_array_size(json_object_get(after, "traceEvents")));
+  json_decref(before);
+  json_decref(after);
+}
+
+TEST_F(Trace, WritesEventsPerThread) {
+  // tells this run's events apart from those of earlier ones
+  static int run;
+  int value = ++run;
+  trace_set_thread_name("main");
+  uint64_t start = trace_begin();
+  EXPECT_NE(0u, start);
+  trace_counter("frame_builder pending", value);
+  uv_thread_t thread;
+  uv_thread_create(&thread, compose_worker, &value);
+  uv_thread_join(&thread);
+  trace_end("tick", start, "clock_ms", value);
+
+  json_t* trace = Write();
+  ASSERT_TRUE(trace);
+  json_t* events = json_object_get(trace, "traceEvents");
+  ASSERT_TRUE(json_is_array(events));
+  json_int_t main_tid = -1;
+  std::set<json_int_t> compose_tids;
+  int found = 0;
+  size_t i;
+  json_t* event;
+  json_array_foreach(events, i, event) {
+    const char* name = json_string_value(json_object_get(event, "name"));
+    const char* ph = json_string_value(json_object_get(event, "ph"));
+    json_int_t tid = json_integer_value(json_object_get(event, "tid"));
+    json_t* args = json_object_get(event, "args");
+    if (!strcmp("thread_name", name)) {
+      const char* thread = json_string_value(json_object_get(args, "name"));
+      if (!strcmp("main", thread)) {
+        main_tid = tid;
+      } else if (!strcmp("compose", thread)) {
+        compose_tids.insert(tid);
+      }
+    } else if (!strcmp("tick", name) &&
+               value == json_integer_value(json_object_get(args, "clock_ms")))
+    {
+      EXPECT_STREQ("X", ph);
+      EXPECT_GE(json_real_value(json_object_get(event, "dur")), 0);
+      EXPECT_EQ(main_tid, tid);
+      found++;
+    } else if (!strcmp("compose", name) &&
+               value == json_integer_value(json_object_get(args, "serial")))
+    {
+      EXPECT_STREQ("X", ph);
+      EXPECT_EQ(1u, compose_tids.count(tid));
+      EXPECT_NE(main_tid, tid);
+      found++;
+    } else if (!strcmp("frame_builder pending", name) &&
+               value == json_integer_value(json_object_get(args, "value")))
+    {
+      EXPECT_STREQ("C", ph);
+      found++;
+    }
+  }
+  EXPECT_EQ(3, found);
+  json_decref(trace);
+}
@@ -0,0 +1,114 @@
+//
+//  barc_synth.c
+//  barc
+//
+//  Writes a synthetic individual stream archive for benchmarking barc
+//  without real recordings. See synthetic_archive.h.
+//
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include <libavformat/avformat.h>
+
+#include "synthetic_archive.h"
+
+static void usage() {
+  printf("usage: barc_synth -o dir [--streams N] [--width W] [--height H]\n"
+         "         [--fps N] [--duration seconds] [--start_stagger seconds]\n"
+         "         [--stop_stagger seconds] [--reconnects N] [--gap seconds]\n"
+         "         [--layout_interval seconds] [--bit_rate bps]\n");
+}
+
+int main(int argc, char** argv) {
+  struct synthetic_archive_config_s config;
+  synthetic_archive_config_default(&config);
+  const char* output_dir = NULL;
+  int c;
+
+  static struct option long_options[] =
+  {
+    {"output", required_argument,          0, 'o'},
+    {"streams", required_argument,         0, 'n'},
+    {"width", required_argument,           0, 'w'},
+    {"height", required_argument,          0, 'h'},
+    {"fps", required_argument,             0, 'f'},
+    {"duration", required_argument,        0, 'd'},
+    {"start_stagger", required_argument,   0, 's'},
+    {"stop_stagger", required_argument,    0, 'S'},
+    {"reconnects", required_argument,      0, 'r'},
+    {"gap", required_argument,             0, 'g'},
+    {"layout_interval", required_argument, 0, 'l'},
+    {"bit_rate", required_argument,        0, 'b'},
+    {0, 0, 0, 0}
+  };
+  int option_index = 0;
+
+  while ((c = getopt_long(argc, argv, "o:n:w:h:f:d:s:S:r:g:l:b:",
+                          long_options, &option_index)) != -1)
+  {
+    switch (c)
+    {
+      case 'o':
+        output_dir = optarg;
+        break;
+      case 'n':
+        config.stream_count = atoi(optarg);
+        break;
+      case 'w':
+        config.width = atoi(optarg);
+        break;
+      case 'h':
+        config.height = atoi(optarg);
+        break;
+      case 'f':
+        config.fps = atoi(optarg);
+        break;
+      case 'd':
+        config.duration = atof(optarg);
+        break;
+      case 's':
+        config.start_stagger = atof(optarg);
+        break;
+      case 'S':
+        config.stop_stagger = atof(optarg);
+        break;
+      case 'r':
+        config.reconnects = atoi(optarg);
+        break;
+      case 'g':
+        config.gap_duration = atof(optarg);
+        break;
+      case 'l':
+        config.layout_interval = atof(optarg);
+        break;
+      case 'b':
+        config.video_bit_rate = atoi(optarg);
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  if (!output_dir) {
+    usage();
+    return 1;
+  }
+  if (mkdir(output_dir, 0755) && EEXIST != errno) {
+    perror(output_dir);
+    return 1;
+  }
+  av_register_all();
+  int ret = synthetic_archive_write(&config, output_dir);
+  if (ret) {
+    printf("Unable to write synthetic archive: %s\n", av_err2str(ret));
+    return 1;
+  }
+  printf("Wrote %d streams, %.1f seconds, to %s\n", config.stream_count,
+         config.duration, output_dir);
+  return 0;
+}